@@ -0,0 +1,187 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <cstring>
+#include <unistd.h>
+
+#include "access_log.hh"
+#include "ep.hh"
+
+static const char ACCESS_LOG_MAGIC[8] = { 'E', 'P', 'A', 'C', 'C', 'L', 'O', 'G' };
+static const uint32_t ACCESS_LOG_VERSION = 1;
+
+// Size of the stdio buffers used to read and write the file.
+static const size_t ACCESS_LOG_IO_BUFFER = 1024 * 1024;
+
+struct access_log_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+template <typename T>
+static void put(std::vector<char> &buf, T v) {
+    const char *p = reinterpret_cast<const char*>(&v);
+    buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+/**
+ * Writes the keys of the resident items of every vbucket visited that
+ * are at the given temperature.
+ *
+ * The hash table locks are held while items are visited, so a
+ * vbucket's keys are gathered in memory and only written once the
+ * next one is reached (or the visit is done).
+ */
+class AccessLogWriter : public VBucketVisitor {
+public:
+
+    AccessLogWriter(FILE *f) : fp(f), temperature(0), count(0), failed(false) {}
+
+    void setTemperature(uint8_t t) {
+        temperature = t;
+    }
+
+    bool visitBucket(RCPtr<VBucket> vb) {
+        flush();
+        if (failed || vb->getState() == dead) {
+            return false;
+        }
+        currentBucket = vb;
+        return true;
+    }
+
+    void visit(StoredValue *v) {
+        if (v->isDeleted() || !v->isResident()
+            || v->getTemperature() != temperature) {
+            return;
+        }
+
+        const std::string &key(v->getKey());
+        put<uint16_t>(buf, currentBucket->getId());
+        put<uint8_t>(buf, static_cast<uint8_t>(key.length()));
+        buf.insert(buf.end(), key.begin(), key.end());
+        ++count;
+    }
+
+    /**
+     * Write out the keys gathered so far.
+     *
+     * @return false if any write failed
+     */
+    bool flush() {
+        if (!failed && !buf.empty()) {
+            failed = fwrite(&buf[0], buf.size(), 1, fp) != 1;
+        }
+        buf.clear();
+        return !failed;
+    }
+
+    size_t getCount() {
+        return count;
+    }
+
+private:
+    FILE              *fp;
+    std::vector<char>  buf;
+    uint8_t            temperature;
+    size_t             count;
+    bool               failed;
+};
+
+bool AccessLog::write(EventuallyPersistentStore &store, size_t &keys) {
+    keys = 0;
+    access_log_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, ACCESS_LOG_MAGIC, sizeof(h.magic));
+    h.version = ACCESS_LOG_VERSION;
+
+    std::string tmp(path + ".tmp");
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, ACCESS_LOG_IO_BUFFER);
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    AccessLogWriter writer(fp);
+    // One pass per temperature, hottest first.  An item warming up or
+    // cooling down in between may be written twice or not at all.
+    for (int t = MAX_TEMPERATURE; ok && t >= 0; --t) {
+        writer.setTemperature(static_cast<uint8_t>(t));
+        store.visit(writer);
+        ok = writer.flush();
+    }
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+        keys = writer.getCount();
+        return true;
+    }
+    unlink(tmp.c_str());
+    return false;
+}
+
+bool AccessLogReader::open() {
+    close();
+    fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, ACCESS_LOG_IO_BUFFER);
+
+    access_log_header h;
+    if (fread(&h, sizeof(h), 1, fp) != 1
+        || std::memcmp(h.magic, ACCESS_LOG_MAGIC, sizeof(h.magic)) != 0
+        || h.version != ACCESS_LOG_VERSION) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool AccessLogReader::next(size_t n,
+                           std::vector<std::pair<uint16_t, std::string> > &keys) {
+    if (fp == NULL) {
+        return false;
+    }
+    char key[256];
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t vbid;
+        uint8_t nkey;
+        if (fread(&vbid, sizeof(vbid), 1, fp) != 1
+            || fread(&nkey, sizeof(nkey), 1, fp) != 1
+            || nkey == 0 || fread(key, nkey, 1, fp) != 1) {
+            close();
+            return false;
+        }
+        keys.push_back(std::make_pair(vbid, std::string(key, nkey)));
+    }
+    return true;
+}
+
+void AccessLogReader::close() {
+    if (fp != NULL) {
+        fclose(fp);
+        fp = NULL;
+    }
+}
+
+bool AccessScanner::callback(Dispatcher &d, TaskId t) {
+    if (stats.warmValuesComplete.get()) {
+        hrtime_t start = gethrtime();
+        size_t keys(0);
+        if (store->writeAccessLog(keys)) {
+            stats.alogKeys.set(keys);
+            stats.alogTime.set((gethrtime() - start) / 1000);
+            ++stats.alogRuns;
+        } else {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to write the access log.\n");
+        }
+    }
+    d.snooze(t, sleepTime);
+    return true;
+}
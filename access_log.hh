@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef ACCESS_LOG_HH
+#define ACCESS_LOG_HH 1
+
+#include <cstdio>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "dispatcher.hh"
+#include "stats.hh"
+
+class EventuallyPersistentStore;
+
+/**
+ * A file listing the keys of the items resident in memory, the most
+ * recently used first, so the next warmup can page in the values of
+ * the working set before all others.
+ *
+ * How recently an item was used is taken from the temperature the
+ * item pager keeps: the keys of the hottest items are written first,
+ * and those of the items about to be ejected last.  The file only
+ * orders the loading of values, so it doesn't matter much if it's out
+ * of date.  It's written next to its place, synced and renamed over
+ * it, so even after a crash a reader never sees half of one.  Keys are
+ * written outside the hash table locks.
+ */
+class AccessLog {
+public:
+
+    /**
+     * @param p the path of the access log
+     */
+    AccessLog(const std::string &p) : path(p) {}
+
+    /**
+     * Write the keys of the resident items of all vbuckets of a store.
+     *
+     * @param store the store
+     * @param keys set to the number of keys written
+     * @return true if the log was written
+     */
+    bool write(EventuallyPersistentStore &store, size_t &keys);
+
+    const std::string &getPath() const {
+        return path;
+    }
+
+private:
+
+    const std::string path;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLog);
+};
+
+/**
+ * Reads the keys back from an access log, in the order they were
+ * written.
+ */
+class AccessLogReader {
+public:
+
+    AccessLogReader(const std::string &p) : path(p), fp(NULL) {}
+
+    ~AccessLogReader() {
+        close();
+    }
+
+    /**
+     * Open the log.
+     *
+     * @return false if there's no log, or it isn't one
+     */
+    bool open();
+
+    /**
+     * Read the next keys.
+     *
+     * @param n the most keys to read
+     * @param keys the vbuckets and keys read are appended here
+     * @return false once the end of the log is reached
+     */
+    bool next(size_t n, std::vector<std::pair<uint16_t, std::string> > &keys);
+
+    void close();
+
+private:
+
+    const std::string  path;
+    FILE              *fp;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogReader);
+};
+
+/**
+ * Dispatcher job writing the access log now and then.
+ *
+ * Nothing is written while values are still being paged in after
+ * warmup, as the hash tables don't hold the working set yet.
+ */
+class AccessScanner : public DispatcherCallback {
+public:
+
+    /**
+     * Construct an AccessScanner.
+     *
+     * @param s the store (where we'll visit)
+     * @param st the stats
+     * @param stime number of seconds to wait between runs
+     */
+    AccessScanner(EventuallyPersistentStore *s, EPStats &st, size_t stime) :
+        store(s), stats(st), sleepTime(static_cast<double>(stime)) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() { return std::string("Writing the access log."); }
+
+private:
+    EventuallyPersistentStore *store;
+    EPStats                   &stats;
+    double                     sleepTime;
+};
+
+#endif /* ACCESS_LOG_HH */
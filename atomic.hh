@@ -291,7 +291,59 @@ private:
     bool locked;
 };
 
+/**
+ * A Mutex that also acts as the write side of a sequence lock.
+ *
+ * The sequence number is odd while the mutex is held and changes on
+ * every acquire and release, so a reader that doesn't take the lock
+ * can tell whether anything protected by it may have changed while
+ * it was looking:
+ *
+ *     uint32_t seq = m.readBegin();
+ *     ... copy out what's needed ...
+ *     if (!(seq & 1) && !m.readRetry(seq)) { ... the copy is good ... }
+ */
+class SeqMutex : public AdaptiveMutex {
+public:
+    SeqMutex() : seq(0) {}
+
+    /**
+     * Get the sequence number before an unlocked read.
+     */
+    uint32_t readBegin() const {
+        uint32_t rv = seq;
+        ep_sync_synchronize();
+        return rv;
+    }
+
+    /**
+     * True if a read started at the given sequence number may have
+     * raced with a holder of the mutex.
+     */
+    bool readRetry(uint32_t start) const {
+        ep_sync_synchronize();
+        return (start & 1) || seq != start;
+    }
+
+protected:
+    void acquire() {
+        AdaptiveMutex::acquire();
+        ++seq;
+        ep_sync_synchronize();
+    }
+
+    void release() {
+        ep_sync_synchronize();
+        ++seq;
+        AdaptiveMutex::release();
+    }
+
+private:
+    volatile uint32_t seq;
+};
+
 template <class T> class RCPtr;
+template <class T> class SingleThreadedRCPtr;
 
 class RCValue {
 public:
@@ -300,6 +352,7 @@ public:
     ~RCValue() {}
 private:
     template <class TT> friend class RCPtr;
+    template <class TT> friend class SingleThreadedRCPtr;
     int _rc_incref() const {
         return ++_rc_refcount;
     }
@@ -404,6 +457,81 @@ private:
     mutable SpinLock lock; // exists solely for the purpose of implementing reset() safely
 };
 
+/**
+ * Single pointer reference counted handle.
+ *
+ * The reference count itself lives in the (RCValue derived) object
+ * and is atomic, so distinct handles to the same object may be used
+ * from different threads.  Unlike RCPtr, a single handle instance
+ * must not be modified while another thread reads it.
+ */
+template <class C>
+class SingleThreadedRCPtr {
+public:
+    SingleThreadedRCPtr(C *init = NULL) : value(init) {
+        if (init != NULL) {
+            static_cast<const RCValue*>(value)->_rc_incref();
+        }
+    }
+
+    SingleThreadedRCPtr(const SingleThreadedRCPtr<C> &other) : value(other.value) {
+        if (value != NULL) {
+            static_cast<const RCValue*>(value)->_rc_incref();
+        }
+    }
+
+    ~SingleThreadedRCPtr() {
+        release(value);
+    }
+
+    void reset(C *newValue = NULL) {
+        if (newValue != NULL) {
+            static_cast<const RCValue*>(newValue)->_rc_incref();
+        }
+        C *tmp = value;
+        value = newValue;
+        release(tmp);
+    }
+
+    void reset(const SingleThreadedRCPtr<C> &other) {
+        reset(other.value);
+    }
+
+    SingleThreadedRCPtr<C> &operator =(const SingleThreadedRCPtr<C> &other) {
+        reset(other.value);
+        return *this;
+    }
+
+    C *get() const {
+        return value;
+    }
+
+    C &operator *() const {
+        return *value;
+    }
+
+    C *operator ->() const {
+        return value;
+    }
+
+    bool operator! () const {
+        return !value;
+    }
+
+    operator bool () const {
+        return value != NULL;
+    }
+
+private:
+    static void release(C *v) {
+        if (v != NULL && static_cast<const RCValue*>(v)->_rc_decref() == 0) {
+            delete v;
+        }
+    }
+
+    C *value;
+};
+
 /**
  * Efficient approximate-FIFO queue optimize for concurrent writers.
  */
@@ -0,0 +1,269 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef BLOOM_HH
+#define BLOOM_HH 1
+
+#include <cmath>
+#include <cstring>
+#include <string>
+
+#include "common.hh"
+#include "atomic.hh"
+#include "hash.hh"
+
+//! False positive probability Bloom filters are sized for.
+#define BFILTER_FALSE_POSITIVE_PROB 0.01
+//! Upper bound on the number of hash functions of a Bloom filter.
+#define BFILTER_MAX_HASHES 16
+//! Share of the keys of a Bloom filter gone before it wants a rebuild.
+#define BFILTER_STALE_RATIO 0.25
+
+/**
+ * A Bloom filter over keys.
+ *
+ * Tells whether a key may have been added (with a small chance of a
+ * false positive) or certainly was not.  Keys can't be removed, but
+ * the filter counts those gone stale and can be rebuilt from the keys
+ * still wanted: the keys given to addRebuilt and those added meanwhile
+ * replace all others at once, without a lookup of any of them failing.
+ *
+ * Adds are serialized, lookups don't lock.  A lookup racing with the
+ * add of the same key may miss it, so anything that depends on
+ * finding a key has to add it before making that visible by other
+ * means (such as removing it from a locked hash table).
+ */
+class BloomFilter {
+public:
+
+    /**
+     * Create a Bloom filter.
+     *
+     * @param keys the number of keys to size the filter for; 0
+     *        creates a disabled filter
+     * @param fpp the false positive probability at that many keys
+     */
+    BloomFilter(size_t keys = 0, double fpp = BFILTER_FALSE_POSITIVE_PROB) :
+        numBits(0), numHashes(0), bits(NULL), numKeys(0), numStale(0),
+        rebuilt(NULL), rebuiltKeys(0), staleAtRebuild(0) {
+        if (keys > 0) {
+            double ln2 = std::log(2.0);
+            double m = -static_cast<double>(keys) * std::log(fpp) / (ln2 * ln2);
+            numBits = std::max(static_cast<size_t>(m), static_cast<size_t>(64));
+            numBits = (numBits + 7) & ~static_cast<size_t>(7);
+            numHashes = static_cast<size_t>(m / static_cast<double>(keys) * ln2 + 0.5);
+            numHashes = std::max(static_cast<size_t>(1),
+                                 std::min(numHashes,
+                                          static_cast<size_t>(BFILTER_MAX_HASHES)));
+            bits = new uint8_t[numBits / 8];
+            std::memset(bits, 0, numBits / 8);
+        }
+    }
+
+    ~BloomFilter() {
+        delete []bits;
+        delete []rebuilt;
+    }
+
+    /**
+     * True if this filter tracks anything at all.
+     */
+    bool enabled() const {
+        return numBits > 0;
+    }
+
+    /**
+     * Remember the given key.
+     */
+    void add(const std::string &key) {
+        if (!enabled()) {
+            return;
+        }
+        uint32_t h1, h2;
+        hashes(key, h1, h2);
+        SpinLockHolder lh(&lock);
+        set(bits, h1, h2);
+        ++numKeys;
+        if (rebuilt != NULL) {
+            set(rebuilt, h1, h2);
+            ++rebuiltKeys;
+        }
+    }
+
+    /**
+     * Note that one of the keys added is gone.
+     */
+    void forget() {
+        if (enabled()) {
+            ++numStale;
+        }
+    }
+
+    /**
+     * True if enough of the keys added are gone for a rebuild to be
+     * worth it.
+     */
+    bool wantsRebuild() const {
+        size_t stale = numStale.get();
+        return stale > 0 && static_cast<double>(stale)
+            >= static_cast<double>(numKeys.get()) * BFILTER_STALE_RATIO;
+    }
+
+    /**
+     * Start a rebuild.  From now on every key added also goes to the
+     * rebuilt filter.
+     *
+     * @return false if the filter is disabled or already rebuilding
+     */
+    bool beginRebuild() {
+        if (!enabled()) {
+            return false;
+        }
+        uint8_t *b = new uint8_t[numBits / 8];
+        std::memset(b, 0, numBits / 8);
+        SpinLockHolder lh(&lock);
+        if (rebuilt != NULL) {
+            lh.unlock();
+            delete []b;
+            return false;
+        }
+        rebuilt = b;
+        rebuiltKeys = 0;
+        staleAtRebuild = numStale.get();
+        return true;
+    }
+
+    /**
+     * Give a key still wanted to the filter being rebuilt.
+     */
+    void addRebuilt(const std::string &key) {
+        uint32_t h1, h2;
+        hashes(key, h1, h2);
+        SpinLockHolder lh(&lock);
+        if (rebuilt != NULL) {
+            set(rebuilt, h1, h2);
+            ++rebuiltKeys;
+        }
+    }
+
+    /**
+     * Replace the filter with the one rebuilt (if a rebuild is still
+     * going on).
+     */
+    void endRebuild() {
+        SpinLockHolder lh(&lock);
+        if (rebuilt == NULL) {
+            return;
+        }
+        // Every byte goes straight from its old to its new value, so
+        // the bits of a key in both stay set.
+        std::memcpy(bits, rebuilt, numBits / 8);
+        numKeys.set(rebuiltKeys);
+        numStale.decr(staleAtRebuild);
+        uint8_t *b = rebuilt;
+        rebuilt = NULL;
+        lh.unlock();
+        delete []b;
+    }
+
+    /**
+     * Check whether the given key may have been added.
+     *
+     * A disabled filter can't rule anything out.
+     *
+     * @return false if the key was certainly never added
+     */
+    bool maybeContains(const std::string &key) const {
+        if (!enabled()) {
+            return true;
+        }
+        uint32_t h1, h2;
+        hashes(key, h1, h2);
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t b = (h1 + i * h2) % numBits;
+            if ((bits[b >> 3] & (1 << (b & 7))) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Forget all keys, dropping any rebuild going on.
+     */
+    void clear() {
+        if (enabled()) {
+            SpinLockHolder lh(&lock);
+            std::memset(bits, 0, numBits / 8);
+            numKeys.set(0);
+            numStale.set(0);
+            uint8_t *b = rebuilt;
+            rebuilt = NULL;
+            lh.unlock();
+            delete []b;
+        }
+    }
+
+    /**
+     * Get the number of adds since creation (or the last clear).
+     */
+    size_t getNumKeys() const {
+        return numKeys.get();
+    }
+
+    /**
+     * Get the number of keys added that are gone.
+     */
+    size_t getNumStale() const {
+        return numStale.get();
+    }
+
+    /**
+     * Get the number of bits in the filter.
+     */
+    size_t getNumBits() const {
+        return numBits;
+    }
+
+    /**
+     * Get the number of hash functions applied to each key.
+     */
+    size_t getNumHashes() const {
+        return numHashes;
+    }
+
+    /**
+     * Get the amount of memory used by the filter's bits.
+     */
+    size_t memorySize() const {
+        return numBits / 8;
+    }
+
+private:
+
+    // Double hashing: the i-th probe is h1 + i * h2.
+    void hashes(const std::string &key, uint32_t &h1, uint32_t &h2) const {
+        h1 = murmur_hash(key.data(), key.length());
+        h2 = djb_hash(key.data(), key.length()) | 1;
+    }
+
+    void set(uint8_t *b, uint32_t h1, uint32_t h2) {
+        for (size_t i = 0; i < numHashes; ++i) {
+            size_t n = (h1 + i * h2) % numBits;
+            b[n >> 3] |= static_cast<uint8_t>(1 << (n & 7));
+        }
+    }
+
+    size_t          numBits;
+    size_t          numHashes;
+    uint8_t        *bits;
+    Atomic<size_t>  numKeys;
+    Atomic<size_t>  numStale;
+    //! The filter being rebuilt, if any, and the keys given to it.
+    uint8_t        *rebuilt;
+    size_t          rebuiltKeys;
+    size_t          staleAtRebuild;
+    SpinLock        lock;
+
+    DISALLOW_COPY_AND_ASSIGN(BloomFilter);
+};
+
+#endif /* BLOOM_HH */
@@ -163,7 +163,7 @@ void Dispatcher::wake(TaskId task, TaskId *outtid) {
     TaskId oldTask(task);
     TaskId newTask(new Task(*oldTask));
     if (outtid) {
-        *outtid = TaskId(task);
+        *outtid = TaskId(newTask);
     }
     futureQueue.push(newTask);
     mutex.notify();
@@ -70,11 +70,11 @@ private:
         snooze(sleeptime);
     }
 
-    Task(const Task &task) {
-        priority = task.priority;
-        state = task_running;
-        callback = task.callback;
-        isDaemonTask = task.isDaemonTask;
+    Task(const Task &task) : name(task.name), callback(task.callback),
+                             priority(task.priority), state(task_running),
+                             isDaemonTask(task.isDaemonTask) {
+        // A copy is made to run right away.
+        snooze(0);
     }
 
     void snooze(const double secs) {
@@ -26,7 +26,7 @@
 #include "flusher.hh"
 #include "locks.hh"
 #include "dispatcher.hh"
-#include "sqlite-kvstore.hh"
+#include "kvstore.hh"
 #include "ep_engine.h"
 #include "item_pager.hh"
 
@@ -306,14 +306,24 @@ private:
 };
 
 EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine &theEngine,
-                                                     StrategicSqlite3 *t,
+                                                     KVStore *t,
                                                      bool startVb0) :
-    engine(theEngine), stats(engine.getEpStats()), tctx(stats, t), bgFetchDelay(0)
+    engine(theEngine), stats(engine.getEpStats()), bgFetchDelay(0),
+    fullEviction(engine.isFullEviction()),
+    bloomFilterKeys(fullEviction ? engine.getBfilterKeyCount() : 0),
+    metadataWarmup(engine.isMetadataWarmup()),
+    visitorPool(engine.getVisitorThreads()), htSnapshot(NULL),
+    snapshotResult(snapshot_off), accessLog(NULL)
 {
     doPersistence = getenv("EP_NO_PERSISTENCE") == NULL;
     dispatcher = new Dispatcher();
     nonIODispatcher = new Dispatcher();
-    flusher = new Flusher(this, dispatcher);
+    for (size_t i = 0; i < t->getNumShards(); ++i) {
+        DBShard *shard = new DBShard(stats, t, i);
+        shard->dispatcher = t->getNumShards() == 1 ? dispatcher : new Dispatcher();
+        shard->flusher = new Flusher(this, shard);
+        shards.push_back(shard);
+    }
 
     stats.memOverhead = sizeof(EventuallyPersistentStore);
 
@@ -321,8 +331,21 @@ EventuallyPersistentStore::EventuallyPersistentStore(EventuallyPersistentEngine
 
     underlying = t;
 
+    if (engine.getSnapshotFile() != NULL) {
+        htSnapshot = new HashTableSnapshot(engine.getSnapshotFile(),
+                                           engine.getDbFiles());
+    }
+
+    if (engine.getAccessLogPath() != NULL) {
+        accessLog = new AccessLog(engine.getAccessLogPath());
+    }
+
+    for (size_t i = 0; i < t->getNumDumpShards(); ++i) {
+        warmupShards.push_back(new WarmupShard());
+    }
+
     if (startVb0) {
-        RCPtr<VBucket> vb(new VBucket(0, active, stats));
+        RCPtr<VBucket> vb(new VBucket(0, active, stats, bloomFilterKeys));
         vbuckets.addBucket(vb);
         vbuckets.setBucketVersion(0, 0);
     }
@@ -348,9 +371,472 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
     dispatcher->stop();
     nonIODispatcher->stop();
 
-    delete flusher;
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        if ((*it)->dispatcher != dispatcher) {
+            (*it)->dispatcher->stop();
+        }
+    }
+
+    // Nothing writes to the database anymore.
+    writeSnapshot();
+
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        DBShard *shard = *it;
+        if (shard->dispatcher != dispatcher) {
+            delete shard->dispatcher;
+        }
+        delete shard->flusher;
+        delete shard;
+    }
     delete dispatcher;
     delete nonIODispatcher;
+    delete htSnapshot;
+    delete accessLog;
+    while (!warmupShards.empty()) {
+        delete warmupShards.back();
+        warmupShards.pop_back();
+    }
+}
+
+void EventuallyPersistentStore::writeSnapshot() {
+    if (htSnapshot == NULL) {
+        return;
+    }
+
+    bool complete = stats.warmupComplete.get() && stats.warmOOM.get() == 0
+        && !fullEviction && getQueuedCount() == 0;
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        complete &= (*it)->writing.empty();
+    }
+    if (!complete) {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Not writing a hash table snapshot; "
+                         "not all items are both in memory and on disk.\n");
+        return;
+    }
+
+    hrtime_t start = gethrtime();
+    size_t items(0);
+    if (htSnapshot->write(*this, items)) {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Wrote %d items to the hash table snapshot in %dms\n",
+                         static_cast<int>(items),
+                         static_cast<int>((gethrtime() - start) / 1000000));
+    } else {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to write the hash table snapshot.\n");
+    }
+}
+
+/**
+ * Counts the items read from one shard of the database at warmup.
+ */
+class WarmupShardCallback : public Callback<GetValue> {
+public:
+    WarmupShardCallback(LoadStorageKVPairCallback &c, WarmupShard &p, bool k)
+        : cb(c), progress(p), keysOnly(k) {}
+
+    void callback(GetValue &val) {
+        if (keysOnly) {
+            cb.loadNonResident(val);
+        } else {
+            cb.callback(val);
+        }
+        ++progress.loaded;
+    }
+
+private:
+    LoadStorageKVPairCallback &cb;
+    WarmupShard               &progress;
+    bool                       keysOnly;
+};
+
+/**
+ * Loads the shards of the database at warmup, a part each.
+ */
+class WarmupLoader : public WorkerJob {
+public:
+    WarmupLoader(KVStore *kvs, LoadStorageKVPairCallback &c,
+                 std::vector<WarmupShard*> &p, bool k)
+        : underlying(kvs), cb(c), progress(p), keysOnly(k) {}
+
+    void work(size_t part) {
+        WarmupShard &shard = *progress[part];
+        WarmupShardCallback scb(cb, shard, keysOnly);
+        shard.start.set(gethrtime());
+        if (keysOnly) {
+            underlying->dumpKeys(part, scb);
+        } else {
+            underlying->dump(part, scb);
+        }
+        shard.end.set(gethrtime());
+    }
+
+private:
+    KVStore                   *underlying;
+    LoadStorageKVPairCallback &cb;
+    std::vector<WarmupShard*> &progress;
+    bool                       keysOnly;
+};
+
+/**
+ * Puts the values read from disk into the items still missing them
+ * after a warmup that only read the keys.
+ */
+class WarmupValueCallback : public Callback<GetValue> {
+public:
+    /**
+     * @param e the store
+     * @param v whether the items read carry their vbucket version
+     *          (those read by ID don't)
+     */
+    WarmupValueCallback(EventuallyPersistentStore *e, bool v = true)
+        : ep(e), checkVersion(v), restored(0) {}
+
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        if (i == NULL) {
+            return;
+        }
+        uint16_t vbid = i->getVBucketId();
+
+        // Lock to prevent a race condition between a restore and delete
+        LockHolder lh(ep->vbsetMutex);
+        RCPtr<VBucket> vb = ep->getVBucket(vbid);
+        if (vb && vb->getState() != dead
+            && (!checkVersion
+                || ep->vbuckets.getBucketVersion(vbid) == val.getVBucketVersion())) {
+            int bucket_num = vb->ht.bucket(i->getKey());
+            LockHolder vblh(vb->ht.getMutex(bucket_num));
+            StoredValue *v = ep->fetchValidValue(vb, i->getKey(), bucket_num);
+            if (v && !v->isResident() && v->getId() == i->getId()
+                && v->valLength() == i->getNBytes()
+                && v->restoreValue(i->getValue(), ep->stats)) {
+                --ep->stats.numNonResident;
+                ++ep->stats.warmValues;
+                ++restored;
+            }
+        }
+        delete i;
+    }
+
+    size_t getRestored() {
+        return restored;
+    }
+
+private:
+    EventuallyPersistentStore *ep;
+    bool                       checkVersion;
+    size_t                     restored;
+};
+
+/**
+ * Pages in the values left on disk by warmup, a chunk at a time, until
+ * memory use reaches the low watermark.
+ *
+ * The values of the keys in the access log (if given) come first, then
+ * the others in the order they're stored in.
+ */
+class WarmupValueLoader : public DispatcherCallback {
+public:
+    WarmupValueLoader(EventuallyPersistentStore *e, EPStats &st, size_t n,
+                      shared_ptr<AccessLogReader> a)
+        : ep(e), stats(st), numShards(n), shard(0), after(0), alog(a),
+          alogStart(gethrtime()) {}
+
+    bool callback(Dispatcher &d, TaskId t) {
+        (void)d; (void)t;
+        if (StoredValue::getCurrentSize(stats) < stats.mem_low_wat && alog) {
+            if (!ep->warmupAccessLog(*alog, WARMUP_VALUE_CHUNK)) {
+                finishAccessLog();
+            }
+            return true;
+        }
+        if (StoredValue::getCurrentSize(stats) < stats.mem_low_wat) {
+            after = ep->warmupValues(shard, after, WARMUP_VALUE_CHUNK);
+            if (after < 0) {
+                ++shard;
+                after = 0;
+            }
+            if (shard < numShards) {
+                return true;
+            }
+        }
+
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Paged in %d values after warmup\n",
+                         static_cast<int>(stats.warmValues.get()));
+        if (alog) {
+            finishAccessLog();
+        }
+        stats.warmValuesComplete.set(true);
+        return false;
+    }
+
+    std::string description() {
+        std::stringstream ss;
+        if (alog) {
+            ss << "Paging in values of the access log after warmup";
+        } else {
+            ss << "Paging in values of shard " << shard << " after warmup";
+        }
+        return ss.str();
+    }
+
+private:
+
+    void finishAccessLog() {
+        stats.warmAlogTime.set((gethrtime() - alogStart) / 1000);
+        alog.reset();
+    }
+
+    EventuallyPersistentStore   *ep;
+    EPStats                     &stats;
+    size_t                       numShards;
+    size_t                       shard;
+    int64_t                      after;
+    shared_ptr<AccessLogReader>  alog;
+    hrtime_t                     alogStart;
+};
+
+int64_t EventuallyPersistentStore::warmupValues(size_t shard, int64_t after,
+                                                size_t limit) {
+    WarmupValueCallback cb(this);
+    return underlying->dumpFrom(shard, after, limit, cb);
+}
+
+/**
+ * Passes on the items read from disk that aren't in memory, dropping
+ * the others and those of older vbucket versions.
+ */
+class EvictedItemCallback : public Callback<GetValue> {
+public:
+    EvictedItemCallback(EventuallyPersistentStore *e, Callback<GetValue> &c)
+        : ep(e), cb(c) {}
+
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        if (i == NULL) {
+            return;
+        }
+        uint16_t vbid = i->getVBucketId();
+        RCPtr<VBucket> vb = ep->getVBucket(vbid);
+        if (vb && ep->vbuckets.getBucketVersion(vbid) == val.getVBucketVersion()) {
+            int bucket_num = vb->ht.bucket(i->getKey());
+            LockHolder lh(vb->ht.getMutex(bucket_num));
+            if (!vb->ht.unlocked_find(i->getKey(), bucket_num, true)) {
+                lh.unlock();
+                cb.callback(val);
+                return;
+            }
+        }
+        delete i;
+    }
+
+private:
+    EventuallyPersistentStore *ep;
+    Callback<GetValue>        &cb;
+};
+
+int64_t EventuallyPersistentStore::dumpEvicted(size_t shard, int64_t after,
+                                               size_t limit, bool keysOnly,
+                                               Callback<GetValue> &cb) {
+    EvictedItemCallback ecb(this, cb);
+    if (keysOnly) {
+        return underlying->dumpKeysFrom(shard, after, limit, ecb);
+    }
+    return underlying->dumpFrom(shard, after, limit, ecb);
+}
+
+/**
+ * Gives the keys of evicted items to the Bloom filters of their
+ * vbuckets being rebuilt.
+ */
+class BloomFilterRebuildCallback : public Callback<GetValue> {
+public:
+    BloomFilterRebuildCallback(EventuallyPersistentStore *e) : ep(e) {}
+
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        RCPtr<VBucket> vb = ep->getVBucket(i->getVBucketId());
+        if (vb) {
+            vb->bloomFilter.addRebuilt(i->getKey());
+        }
+        delete i;
+    }
+
+private:
+    EventuallyPersistentStore *ep;
+};
+
+size_t EventuallyPersistentStore::beginBloomFilterRebuild() {
+    size_t rv(0);
+    std::vector<int> buckets = vbuckets.getBuckets();
+    std::vector<int>::iterator it;
+    for (it = buckets.begin(); it != buckets.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(*it);
+        if (vb && vb->bloomFilter.wantsRebuild() && vb->bloomFilter.beginRebuild()) {
+            ++rv;
+        }
+    }
+    return rv;
+}
+
+int64_t EventuallyPersistentStore::rebuildBloomFilters(size_t shard, int64_t after,
+                                                       size_t limit) {
+    BloomFilterRebuildCallback cb(this);
+    return dumpEvicted(shard, after, limit, true, cb);
+}
+
+void EventuallyPersistentStore::completeBloomFilterRebuild() {
+    std::vector<int> buckets = vbuckets.getBuckets();
+    std::vector<int>::iterator it;
+    for (it = buckets.begin(); it != buckets.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(*it);
+        if (vb) {
+            vb->bloomFilter.endRebuild();
+        }
+    }
+}
+
+bool EventuallyPersistentStore::warmupAccessLog(AccessLogReader &alog,
+                                                size_t limit) {
+    std::vector<std::pair<uint16_t, std::string> > keys;
+    bool more = alog.next(limit, keys);
+    stats.warmAlogKeys += keys.size();
+
+    // Look up where the values are, so they can be read in order.
+    std::vector<std::pair<int64_t, std::string> > ids;
+    std::vector<std::pair<uint16_t, std::string> >::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(it->first);
+        if (!vb || vb->getState() == dead) {
+            continue;
+        }
+        int bucket_num = vb->ht.bucket(it->second);
+        LockHolder lh(vb->ht.getMutex(bucket_num));
+        StoredValue *v = fetchValidValue(vb, it->second, bucket_num);
+        if (v && !v->isResident() && v->hasId()) {
+            ids.push_back(std::make_pair(v->getId(), it->second));
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    WarmupValueCallback cb(this, false);
+    if (!ids.empty()) {
+        underlying->getMany(ids, cb);
+    }
+    stats.warmAlogLoaded += cb.getRestored();
+    return more;
+}
+
+void EventuallyPersistentStore::warmup() {
+    LoadStorageKVPairCallback cb(vbuckets, stats, this);
+    std::map<std::pair<uint16_t, uint16_t>, std::string> state =
+        underlying->listPersistedVbuckets();
+    std::map<std::pair<uint16_t, uint16_t>, std::string>::iterator it;
+    for (it = state.begin(); it != state.end(); ++it) {
+        std::pair<uint16_t, uint16_t> vbp = it->first;
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Reloading vbucket %d - was in %s state\n",
+                         vbp.first, it->second.c_str());
+        cb.initVBucket(vbp.first, vbp.second);
+    }
+
+    if (htSnapshot != NULL) {
+        size_t items(0);
+        snapshotResult = htSnapshot->load(cb, items);
+        // The database is going to change; never load it again.
+        htSnapshot->remove();
+        if (snapshotResult == snapshot_loaded) {
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Warmed up %d items from the hash table snapshot\n",
+                             static_cast<int>(items));
+            stats.warmValuesComplete.set(true);
+            return;
+        }
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Warming up from the database; hash table snapshot %s\n",
+                         HashTableSnapshot::toString(snapshotResult));
+        if (items > 0) {
+            clearWarmedUp();
+        }
+    }
+
+    bool keysOnly(metadataWarmup);
+    if (keysOnly && HashTable::getDefaultStorageValueType() == small) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Small stored values can't be left on disk; "
+                         "warming up with the values.\n");
+        keysOnly = false;
+    }
+
+    // With full eviction the items left on disk aren't in the hash
+    // tables to page in to.
+    shared_ptr<AccessLogReader> alog;
+    if (accessLog != NULL && !fullEviction
+        && HashTable::getDefaultStorageValueType() != small) {
+        alog.reset(new AccessLogReader(accessLog->getPath()));
+        if (alog->open()) {
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Warming up the keys, then the values in the access log\n");
+            keysOnly = true;
+        } else {
+            alog.reset();
+        }
+    }
+
+    // The shards are loaded on the visitor pool, the calling thread
+    // loading some of them too.
+    WarmupLoader loader(underlying, cb, warmupShards, keysOnly);
+    visitorPool.run(loader, warmupShards.size());
+
+    if (alog && !metadataWarmup) {
+        // Have the working set in memory before letting traffic in.
+        hrtime_t start = gethrtime();
+        bool more(true);
+        while (more && StoredValue::getCurrentSize(stats) < stats.mem_low_wat) {
+            more = warmupAccessLog(*alog, WARMUP_VALUE_CHUNK);
+        }
+        stats.warmAlogTime.set((gethrtime() - start) / 1000);
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Paged in %d values of the access log's %d keys\n",
+                         static_cast<int>(stats.warmAlogLoaded.get()),
+                         static_cast<int>(stats.warmAlogKeys.get()));
+        alog.reset();
+    }
+
+    if (keysOnly && !fullEviction) {
+        shared_ptr<DispatcherCallback> vcb(new WarmupValueLoader(this, stats,
+                                                                 warmupShards.size(),
+                                                                 alog));
+        dispatcher->schedule(vcb, NULL, Priority::WarmupValuePriority);
+    } else {
+        stats.warmValuesComplete.set(true);
+    }
+}
+
+void EventuallyPersistentStore::clearWarmedUp() {
+    std::vector<int> buckets = vbuckets.getBuckets();
+    std::vector<int>::iterator it;
+    for (it = buckets.begin(); it != buckets.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(*it);
+        if (vb) {
+            HashTableStatVisitor statvis;
+            vb->ht.visit(statvis);
+            vb->ht.clear();
+            vb->bloomFilter.clear();
+            vb->expiryIndex.clear();
+            stats.numNonResident.decr(statvis.numNonResident);
+            stats.currentSize.decr(statvis.memSize);
+            assert(stats.currentSize.get() < GIGANTOR);
+            stats.totalCacheSize.decr(statvis.memSize);
+        }
+    }
+    stats.warmedUp.set(0);
+    stats.warmDups.set(0);
 }
 
 void EventuallyPersistentStore::startDispatcher() {
@@ -362,28 +848,47 @@ void EventuallyPersistentStore::startNonIODispatcher() {
 }
 
 const Flusher* EventuallyPersistentStore::getFlusher() {
-    return flusher;
+    return shards[0]->flusher;
 }
 
 void EventuallyPersistentStore::startFlusher() {
-    flusher->start();
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        if ((*it)->dispatcher != dispatcher) {
+            (*it)->dispatcher->start();
+        }
+        (*it)->flusher->start();
+    }
 }
 
 void EventuallyPersistentStore::stopFlusher() {
-    bool rv = flusher->stop();
-    if (rv) {
-        flusher->wait();
+    std::vector<DBShard*>::iterator it;
+    // Stop them all first, so they finish their queues in parallel.
+    std::vector<bool> stopped;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        stopped.push_back((*it)->flusher->stop());
+    }
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (stopped[i]) {
+            shards[i]->flusher->wait();
+        }
     }
 }
 
 bool EventuallyPersistentStore::pauseFlusher() {
-    tctx.commitSoon();
-    flusher->pause();
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        (*it)->tctx.commitSoon();
+        (*it)->flusher->pause();
+    }
     return true;
 }
 
 bool EventuallyPersistentStore::resumeFlusher() {
-    flusher->resume();
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        (*it)->flusher->resume();
+    }
     return true;
 }
 
@@ -403,31 +908,344 @@ RCPtr<VBucket> EventuallyPersistentStore::getVBucket(uint16_t vbid,
     }
 }
 
-class Deleter {
-public:
-    Deleter(EventuallyPersistentStore *ep) : e(ep) {}
-    void operator() (std::pair<uint16_t, std::string> vk) {
-        RCPtr<VBucket> vb = e->getVBucket(vk.first);
-        if (vb) {
-            int bucket_num = vb->ht.bucket(vk.second);
-            LockHolder lh(vb->ht.getMutex(bucket_num));
+/**
+ * A key to delete (or a bucket to look in), along with where it lives.
+ */
+struct expired_key {
+    int lock_num;
+    int bucket_num;
+    const std::string *key;
 
-            StoredValue *v = vb->ht.unlocked_find(vk.second, bucket_num);
-            if (v) {
-                if (vb->ht.unlocked_softDelete(vk.second, bucket_num) == WAS_CLEAN) {
-                    e->queueDirty(vk.second, vb->getId(), queue_op_del);
-                }
+    bool operator<(const expired_key &other) const {
+        return lock_num < other.lock_num;
+    }
+};
+
+size_t EventuallyPersistentStore::deleteExpired(RCPtr<VBucket> &vb,
+                                                std::vector<std::string> &keys,
+                                                time_t asOf) {
+    // Take every lock once, however many of the keys it covers.
+    std::vector<expired_key> order;
+    order.reserve(keys.size());
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        expired_key ek;
+        ek.bucket_num = vb->ht.bucket(*it);
+        ek.lock_num = vb->ht.getLockNum(ek.bucket_num);
+        ek.key = &*it;
+        order.push_back(ek);
+    }
+    std::sort(order.begin(), order.end());
+
+    size_t deleted(0);
+    std::vector<expired_key>::iterator ek = order.begin();
+    while (ek != order.end()) {
+        int lock_num = ek->lock_num;
+        LockHolder lh(vb->ht.getMutexForLock(lock_num));
+        for (; ek != order.end() && ek->lock_num == lock_num; ++ek) {
+            const std::string &key = *ek->key;
+            // It may have been stored again since.
+            StoredValue *v = vb->ht.unlocked_find(key, ek->bucket_num);
+            if (!v || !v->isExpired(asOf)) {
+                continue;
+            }
+            if (vb->ht.unlocked_softDelete(key, ek->bucket_num) == WAS_CLEAN) {
+                queueDirty(key, vb->getId(), queue_op_del);
+            } else {
+                ++stats.totalCoalesced;
             }
+            ++deleted;
         }
     }
-private:
-    EventuallyPersistentStore *e;
-};
+    return deleted;
+}
+
+/**
+ * Find the keys of the expired items in the chains of the given
+ * bucket numbers, taking every lock once.
+ */
+static void findExpired(HashTable &ht, std::vector<int> &buckets,
+                        time_t asOf, std::vector<std::string> &keys) {
+    std::vector<expired_key> order;
+    order.reserve(buckets.size());
+    std::vector<int>::iterator it;
+    for (it = buckets.begin(); it != buckets.end(); ++it) {
+        expired_key ek;
+        ek.bucket_num = *it;
+        ek.lock_num = ht.getLockNum(*it);
+        ek.key = NULL;
+        order.push_back(ek);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<expired_key>::iterator ek = order.begin();
+    while (ek != order.end()) {
+        int lock_num = ek->lock_num;
+        LockHolder lh(ht.getMutexForLock(lock_num));
+        for (; ek != order.end() && ek->lock_num == lock_num; ++ek) {
+            ht.unlocked_findExpired(ek->bucket_num, asOf, keys);
+        }
+    }
+
+    // Buckets sharing a chain find the same items.
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+}
 
 void EventuallyPersistentStore::deleteMany(std::list<std::pair<uint16_t, std::string> > &keys) {
-    // This can be made a lot more efficient, but I'd rather see it
-    // show up in a profiling report first.
-    std::for_each(keys.begin(), keys.end(), Deleter(this));
+    std::map<uint16_t, std::vector<std::string> > byBucket;
+    std::list<std::pair<uint16_t, std::string> >::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        byBucket[it->first].push_back(it->second);
+    }
+
+    time_t now = ep_real_time();
+    std::map<uint16_t, std::vector<std::string> >::iterator b;
+    for (b = byBucket.begin(); b != byBucket.end(); ++b) {
+        RCPtr<VBucket> vb = getVBucket(b->first);
+        if (vb) {
+            deleteExpired(vb, b->second, now);
+        }
+    }
+}
+
+size_t EventuallyPersistentStore::deleteExpiredItems() {
+    time_t now = ep_real_time();
+    size_t deleted(0);
+    std::vector<int> buckets = vbuckets.getBuckets();
+    std::vector<int>::iterator it;
+    for (it = buckets.begin(); it != buckets.end(); ++it) {
+        // Only active vbuckets expire items; the others keep their
+        // keys indexed until they're made active.
+        RCPtr<VBucket> vb = getVBucket(*it, active);
+        if (!vb) {
+            continue;
+        }
+        std::vector<int> buckets;
+        std::vector<std::string> keys;
+        if (vb->expiryIndex.takeExpired(now, buckets, keys) > 0) {
+            // Evicted items are read back to be expired like the others.
+            restoreEvicted(vb, keys);
+            findExpired(vb->ht, buckets, now, keys);
+            deleted += deleteExpired(vb, keys, now);
+        }
+    }
+    stats.expired.incr(deleted);
+    return deleted;
+}
+
+size_t EventuallyPersistentStore::evictMany(std::list<std::pair<uint16_t, std::string> > &keys) {
+    size_t evicted(0);
+    std::list<std::pair<uint16_t, std::string> >::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        RCPtr<VBucket> vb = getVBucket(it->first);
+        if (!vb) {
+            continue;
+        }
+
+        const std::string &key = it->second;
+        int bucket_num = vb->ht.bucket(key);
+        LockHolder lh(vb->ht.getMutex(bucket_num));
+        StoredValue *v = vb->ht.unlocked_find(key, bucket_num, true);
+        if (!v || !v->isEvictable(ep_current_time())) {
+            continue;
+        }
+
+        // Placeholders of keys that aren't on disk just go away.
+        bool placeholder = v->isDeleted();
+        bool resident = v->isResident();
+        size_t valBytes = resident && !placeholder ? v->valLength() : 0;
+        if (!placeholder) {
+            // The filter must know the key before it can't be found
+            // in memory anymore.
+            vb->bloomFilter.add(key);
+            vb->expiryIndex.addEvicted(key, v->getExptime());
+        }
+        if (vb->ht.unlocked_del(key, bucket_num) && !placeholder) {
+            stats.valueEjectBytes.incr(valBytes);
+            ++evicted;
+            if (!resident) {
+                --stats.numNonResident;
+            }
+        }
+    }
+    stats.numKeyEjects.incr(evicted);
+    return evicted;
+}
+
+void EventuallyPersistentStore::visitParallel(ParallelVBucketVisitor &visitor) {
+    ParallelVBucketVisit visit(*this, visitor);
+    // Without a budget this only goes around again for visitors
+    // wanting another pass.
+    while (!visit.run()) {}
+}
+
+ParallelVBucketVisit::ParallelVBucketVisit(EventuallyPersistentStore &st,
+                                           ParallelVBucketVisitor &v,
+                                           const VisitBudget &b) :
+    store(st), visitor(v), budget(b) {
+    size_t n = std::max(store.getVisitorPool().getNumThreads(),
+                        static_cast<size_t>(1));
+    for (size_t i = 0; i < n; ++i) {
+        parts.push_back(visitor.fork(n));
+        cursors.push_back(VBucketMapCursor(i, n));
+        complete.push_back(false);
+    }
+}
+
+ParallelVBucketVisit::~ParallelVBucketVisit() {
+    std::vector<ParallelVBucketVisitor*>::iterator it;
+    for (it = parts.begin(); it != parts.end(); ++it) {
+        delete *it;
+    }
+}
+
+bool ParallelVBucketVisit::run() {
+    store.getVisitorPool().run(*this, parts.size());
+    bool rv = true;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        visitor.join(*parts[i]);
+        rv = rv && complete[i];
+    }
+    return rv;
+}
+
+void ParallelVBucketVisit::work(size_t part) {
+    if (complete[part]) {
+        return;
+    }
+    VisitBudget b(budget);
+    b.renew();
+    complete[part] = store.visit(*parts[part], cursors[part], b)
+        && !parts[part]->visitAgain();
+}
+
+bool EventuallyPersistentStore::isEvicted(RCPtr<VBucket> &vb,
+                                          const std::string &key,
+                                          int bucket_num) {
+    if (!fullEviction || vb->ht.unlocked_find(key, bucket_num, true)) {
+        return false;
+    }
+    if (!vb->bloomFilter.maybeContains(key)) {
+        ++stats.bfilterNegatives;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Pick true with a probability of how far over a threshold we are
+ * compared to how far we can go.
+ *
+ * Rather than a random number, the draw is the fraction of the given
+ * count times the golden ratio, which spreads evenly over [0, 1).
+ */
+static bool throttleDraw(size_t over, size_t range, uint32_t count) {
+    if (over >= range) {
+        return true;
+    }
+    double r = static_cast<double>(count * 2654435769U) / 4294967296.0;
+    return r < static_cast<double>(over) / static_cast<double>(range);
+}
+
+bool EventuallyPersistentStore::shouldThrottle(bool growsMemory) {
+    size_t start = stats.throttle_queue_len.get();
+    if (start > 0) {
+        size_t queued = stats.queue_size.get() + stats.flusher_todo.get();
+        if (queued > start && throttleDraw(queued - start, start, throttleDraws++)) {
+            ++stats.queueThrottled;
+            return true;
+        }
+    }
+
+    start = stats.throttle_mem_wat.get();
+    size_t max = StoredValue::getMaxDataSize(stats);
+    if (growsMemory && start > 0 && start < max) {
+        size_t used = StoredValue::getCurrentSize(stats);
+        if (used > start && throttleDraw(used - start, max - start, throttleDraws++)) {
+            ++stats.memThrottled;
+            return true;
+        }
+    }
+    return false;
+}
+
+void EventuallyPersistentStore::restoreEvicted(RCPtr<VBucket> &vb,
+                                              const std::vector<std::string> &keys) {
+    uint16_t vbid = vb->getId();
+    std::vector<std::string>::const_iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        int bucket_num = vb->ht.bucket(*it);
+        LockHolder lh(vb->ht.getMutex(bucket_num));
+        if (!isEvicted(vb, *it, bucket_num)) {
+            continue;
+        }
+        lh.unlock();
+
+        RememberingCallback<GetValue> gcb;
+        underlying->getByKey(*it, vbid, vbuckets.getBucketVersion(vbid), gcb);
+        gcb.waitForValue();
+        assert(gcb.fired);
+
+        LockHolder vlh(vbsetMutex);
+        restoreFetched(vb, *it, 0, gcb.val);
+        vlh.unlock();
+        delete gcb.val.getValue();
+    }
+}
+
+bool EventuallyPersistentStore::fetchEvicted(RCPtr<VBucket> &vb,
+                                             const std::string &key,
+                                             const void *cookie) {
+    int bucket_num = vb->ht.bucket(key);
+    LockHolder lh(vb->ht.getMutex(bucket_num));
+    if (isEvicted(vb, key, bucket_num)) {
+        bgFetch(key, vb->getId(), 0, cookie);
+        return true;
+    }
+    return false;
+}
+
+int64_t EventuallyPersistentStore::findEvictedId(const std::string &key,
+                                                 uint16_t vbid,
+                                                 uint16_t vb_version) {
+    std::vector<key_lookup> lookups;
+    lookups.push_back(key_lookup(key, vbid, vb_version));
+    underlying->getIds(lookups);
+    return lookups.front().id;
+}
+
+void EventuallyPersistentStore::findEvictedIds(std::vector<batched_set> &sets) {
+    // The new items that may replace evicted ones.
+    std::vector<key_lookup> lookups;
+    std::vector<Item*> items;
+    std::vector<batched_set>::iterator it;
+    for (it = sets.begin(); it != sets.end(); ++it) {
+        const Item &itm = *it->item;
+        if (itm.getId() > 0) {
+            continue;
+        }
+        RCPtr<VBucket> vb = getVBucket(itm.getVBucketId());
+        if (vb && vb->bloomFilter.maybeContains(itm.getKey())) {
+            lookups.push_back(key_lookup(itm.getKey(), itm.getVBucketId(),
+                                         it->vb_version));
+            items.push_back(const_cast<Item*>(it->item));
+        }
+    }
+    if (lookups.empty()) {
+        return;
+    }
+
+    underlying->getIds(lookups);
+    for (size_t i = 0; i < lookups.size(); ++i) {
+        int64_t rowid = lookups[i].id;
+        if (rowid > 0) {
+            items[i]->setId(rowid);
+            invokeOnLockedStoredValue(lookups[i].key, lookups[i].vbucket,
+                                      std::mem_fun(&StoredValue::setId),
+                                      rowid);
+        }
+    }
 }
 
 StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> vb,
@@ -442,6 +1260,8 @@ StoredValue *EventuallyPersistentStore::fetchValidValue(RCPtr<VBucket> vb,
         ++stats.expired;
         if (vb->ht.unlocked_softDelete(key, bucket_num) == WAS_CLEAN) {
             queueDirty(key, vb->getId(), queue_op_del);
+        } else {
+            ++stats.totalCoalesced;
         }
         return NULL;
     }
@@ -501,9 +1321,13 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &item,
         }
     }
 
+    if (!force && shouldThrottle(true)) {
+        return ENGINE_TMPFAIL;
+    }
+
     bool cas_op = (item.getCas() != 0);
 
-    mutation_type_t mtype = vb->ht.set(item, !force);
+    mutation_type_t mtype = vb->ht.set(item, !force, &vb->expiryIndex);
 
     switch(mtype) {
     case NOMEM:
@@ -515,10 +1339,15 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::set(const Item &item,
         return ENGINE_KEY_EEXISTS;
         break;
     case WAS_DIRTY:
-        // Do normal stuff, but don't enqueue dirty flags.
+        // Do normal stuff, but don't enqueue dirty flags; the item's
+        // entry in the queue will write out the latest value.
+        ++stats.totalCoalesced;
         break;
     case NOT_FOUND:
         if (cas_op) {
+            if (fullEviction && fetchEvicted(vb, item.getKey(), cookie)) {
+                return ENGINE_EWOULDBLOCK;
+            }
             return ENGINE_KEY_ENOENT;
         }
         // FALLTHROUGH
@@ -553,7 +1382,16 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::add(const Item &item,
         return ENGINE_NOT_STORED;
     }
 
-    switch (vb->ht.add(item)) {
+    if (shouldThrottle(true)) {
+        return ENGINE_TMPFAIL;
+    }
+
+    // An evicted item has to be brought back to tell whether it exists.
+    if (fullEviction && fetchEvicted(vb, item.getKey(), cookie)) {
+        return ENGINE_EWOULDBLOCK;
+    }
+
+    switch (vb->ht.add(item, true, true, &vb->expiryIndex)) {
     case ADD_NOMEM:
         return ENGINE_ENOMEM;
     case ADD_EXISTS:
@@ -617,7 +1455,7 @@ void EventuallyPersistentStore::setVBucketState(uint16_t vbid,
                                   NULL, Priority::NotifyVBStateChangePriority, 0, false);
         scheduleVBSnapshot(Priority::VBucketPersistLowPriority);
     } else {
-        RCPtr<VBucket> newvb(new VBucket(vbid, to, stats));
+        RCPtr<VBucket> newvb(new VBucket(vbid, to, stats, bloomFilterKeys));
         uint16_t vb_version = vbuckets.getBucketVersion(vbid);
         uint16_t vb_new_version = vb_version == (std::numeric_limits<uint16_t>::max() - 1) ?
                                   0 : vb_version + 1;
@@ -712,25 +1550,24 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
     // Go find the data
     RememberingCallback<GetValue> gcb;
 
-    underlying->get(key, rowid, gcb);
+    if (rowid == 0) {
+        underlying->getByKey(key, vbucket, vbuckets.getBucketVersion(vbucket), gcb);
+    } else {
+        underlying->get(key, rowid, gcb);
+    }
     gcb.waitForValue();
     assert(gcb.fired);
+    ENGINE_ERROR_CODE status = gcb.val.getStatus();
 
     // Lock to prevent a race condition between a fetch for restore and delete
     LockHolder lh(vbsetMutex);
 
     RCPtr<VBucket> vb = getVBucket(vbucket);
-    if (vb && vb->getState() == active && gcb.val.getStatus() == ENGINE_SUCCESS) {
-        int bucket_num = vb->ht.bucket(key);
-        LockHolder vblh(vb->ht.getMutex(bucket_num));
-        StoredValue *v = fetchValidValue(vb, key, bucket_num);
-
-        if (v && !v->isResident()) {
-            assert(gcb.val.getStatus() == ENGINE_SUCCESS);
-            if (v->restoreValue(gcb.val.getValue()->getValue(), stats)) {
-                --stats.numNonResident;
-            }
-            assert(v->isResident());
+    if (vb && vb->getState() == active) {
+        restoreFetched(vb, key, rowid, gcb.val);
+        if (rowid == 0) {
+            // The retried request finds its answer in memory.
+            status = ENGINE_SUCCESS;
         }
     }
 
@@ -754,10 +1591,42 @@ void EventuallyPersistentStore::completeBGFetch(const std::string &key,
         stats.bgMaxLoad.setIfBigger(l);
     }
 
-    engine.getServerApi()->cookie->notify_io_complete(cookie, gcb.val.getStatus());
+    engine.getServerApi()->cookie->notify_io_complete(cookie, status);
     delete gcb.val.getValue();
 }
 
+void EventuallyPersistentStore::restoreFetched(RCPtr<VBucket> &vb,
+                                               const std::string &key,
+                                               uint64_t rowid,
+                                               GetValue &gv) {
+    int bucket_num = vb->ht.bucket(key);
+    LockHolder lh(vb->ht.getMutex(bucket_num));
+    if (rowid == 0) {
+        // Unless the key came back meanwhile, put in what's on disk,
+        // or a placeholder saying there's nothing.
+        if (!vb->ht.unlocked_find(key, bucket_num, true)) {
+            if (gv.getStatus() == ENGINE_SUCCESS) {
+                Item *it = gv.getValue();
+                vb->ht.unlocked_restore(*it, bucket_num);
+                vb->expiryIndex.update(bucket_num, 0, it->getExptime());
+            } else {
+                ++stats.bgFetchMisses;
+                vb->ht.unlocked_restore(Item(key, 0, 0, value_t(), 0, -1,
+                                             vb->getId()),
+                                        bucket_num);
+            }
+        }
+    } else if (gv.getStatus() == ENGINE_SUCCESS) {
+        StoredValue *v = fetchValidValue(vb, key, bucket_num);
+        if (v && !v->isResident()) {
+            if (v->restoreValue(gv.getValue()->getValue(), stats)) {
+                --stats.numNonResident;
+            }
+            assert(v->isResident());
+        }
+    }
+}
+
 void EventuallyPersistentStore::bgFetch(const std::string &key,
                                         uint16_t vbucket,
                                         uint64_t rowid,
@@ -795,6 +1664,30 @@ GetValue EventuallyPersistentStore::get(const std::string &key,
     }
 
     int bucket_num = vb->ht.bucket(key);
+
+    // Plain hits and misses don't need the lock; anything that might
+    // change the item (expiry, background fetches) takes the usual path.
+    stored_value_snapshot snap;
+    if (vb->ht.optimisticFind(key, bucket_num, snap)) {
+        if (!snap.found && fullEviction && vb->bloomFilter.maybeContains(key)) {
+            // It may have been evicted, see below.
+        } else if (!snap.found || snap.deleted) {
+            if (!snap.found && fullEviction) {
+                ++stats.bfilterNegatives;
+            }
+            ++stats.optimisticGets;
+            return GetValue();
+        } else if (snap.resident
+                   && (snap.exptime == 0 || snap.exptime >= ep_real_time())) {
+            ++stats.optimisticGets;
+            uint64_t icas = snap.locked ? static_cast<uint64_t>(-1) : snap.cas;
+            return GetValue(new Item(key, snap.flags, snap.exptime, snap.value,
+                                     icas, snap.id, vbucket),
+                            ENGINE_SUCCESS, snap.id);
+        }
+    }
+    ++stats.optimisticGetFallbacks;
+
     LockHolder lh(vb->ht.getMutex(bucket_num));
     StoredValue *v = fetchValidValue(vb, key, bucket_num);
 
@@ -807,6 +1700,7 @@ GetValue EventuallyPersistentStore::get(const std::string &key,
             return GetValue(NULL, ENGINE_EWOULDBLOCK, v->getId());
         }
 
+        v->touch();
         // return an invalid cas value if the item is locked
         uint64_t icas = v->isLocked(ep_current_time())
             ? static_cast<uint64_t>(-1)
@@ -815,6 +1709,11 @@ GetValue EventuallyPersistentStore::get(const std::string &key,
                              v->getValue(), icas, v->getId(), vbucket),
                     ENGINE_SUCCESS, v->getId());
         return rv;
+    } else if (isEvicted(vb, key, bucket_num)) {
+        if (queueBG) {
+            bgFetch(key, vbucket, 0, cookie);
+        }
+        return GetValue(NULL, ENGINE_EWOULDBLOCK, 0);
     } else {
         GetValue rv;
         return rv;
@@ -875,6 +1774,29 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
     LockHolder lh(vb->ht.getMutex(bucket_num));
     StoredValue *v = fetchValidValue(vb, key, bucket_num);
 
+    if ((v && !v->isResident()) || (!v && isEvicted(vb, key, bucket_num))) {
+        // getl answers right away, so rather than waiting for a
+        // background fetch the item is read back from disk here.
+        uint64_t rowid = v ? v->getId() : 0;
+        lh.unlock();
+        RememberingCallback<GetValue> gcb;
+        if (rowid == 0) {
+            underlying->getByKey(key, vbucket, vbuckets.getBucketVersion(vbucket), gcb);
+        } else {
+            underlying->get(key, rowid, gcb);
+        }
+        gcb.waitForValue();
+        assert(gcb.fired);
+
+        LockHolder vblh(vbsetMutex);
+        restoreFetched(vb, key, rowid, gcb.val);
+        vblh.unlock();
+        delete gcb.val.getValue();
+
+        lh.lock();
+        v = fetchValidValue(vb, key, bucket_num);
+    }
+
     if (v) {
         if (v->isLocked(currentTime)) {
             GetValue rv;
@@ -956,16 +1878,29 @@ ENGINE_ERROR_CODE EventuallyPersistentStore::del(const std::string &key,
         }
     }
 
+    // A delete gives memory back, but still has to be persisted.
+    if (shouldThrottle(false)) {
+        return ENGINE_TMPFAIL;
+    }
+
     mutation_type_t delrv = vb->ht.softDelete(key);
+    if (delrv == NOT_FOUND && fullEviction && fetchEvicted(vb, key, cookie)) {
+        return ENGINE_EWOULDBLOCK;
+    }
     ENGINE_ERROR_CODE rv = delrv == NOT_FOUND ? ENGINE_KEY_ENOENT : ENGINE_SUCCESS;
 
     if (delrv == WAS_CLEAN) {
         queueDirty(key, vbucket, queue_op_del);
+    } else if (delrv == WAS_DIRTY) {
+        ++stats.totalCoalesced;
     }
     return rv;
 }
 
 void EventuallyPersistentStore::reset() {
+    if (htSnapshot != NULL) {
+        htSnapshot->remove();
+    }
     std::vector<int> buckets = vbuckets.getBuckets();
     std::vector<int>::iterator it;
     for (it = buckets.begin(); it != buckets.end(); ++it) {
@@ -974,6 +1909,8 @@ void EventuallyPersistentStore::reset() {
             HashTableStatVisitor statvis;
             vb->ht.visit(statvis);
             vb->ht.clear();
+            vb->bloomFilter.clear();
+            vb->expiryIndex.clear();
             stats.numNonResident.decr(statvis.numNonResident);
             stats.currentSize.decr(statvis.memSize);
             assert(stats.currentSize.get() < GIGANTOR);
@@ -984,33 +1921,38 @@ void EventuallyPersistentStore::reset() {
     queueDirty("", 0, queue_op_flush);
 }
 
-std::queue<QueuedItem>* EventuallyPersistentStore::beginFlush() {
+std::queue<QueuedItem>* EventuallyPersistentStore::beginFlush(DBShard &shard) {
     std::queue<QueuedItem> *rv(NULL);
-    if (towrite.empty() && writing.empty()) {
-        stats.dirtyAge = 0;
+    if (shard.towrite.empty() && shard.writing.empty()) {
+        if (getQueuedCount() == 0) {
+            stats.dirtyAge = 0;
+        }
     } else {
         assert(underlying);
-        towrite.getAll(writing);
-        stats.flusher_todo.set(writing.size());
-        stats.queue_size.set(towrite.size());
+        // What's left in writing was rejected, and is still counted.
+        size_t rejected = shard.writing.size();
+        shard.towrite.getAll(shard.writing);
+        stats.flusher_todo.incr(shard.writing.size() - rejected);
+        stats.queue_size.set(getQueuedCount());
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                         "Flushing %d items with %d still in queue\n",
-                         writing.size(), towrite.size());
-        rv = &writing;
+                         "Flushing %d items of shard %d with %d still in queue\n",
+                         shard.writing.size(), shard.id, shard.towrite.size());
+        rv = &shard.writing;
     }
     return rv;
 }
 
-void EventuallyPersistentStore::completeFlush(std::queue<QueuedItem> *rej,
+void EventuallyPersistentStore::completeFlush(DBShard &shard,
+                                              std::queue<QueuedItem> *rej,
                                               rel_time_t flush_start) {
     // Requeue the rejects.
-    stats.queue_size.incr(rej->size());
+    stats.flusher_todo.incr(rej->size());
     while (!rej->empty()) {
-        writing.push(rej->front());
+        shard.writing.push(rej->front());
         rej->pop();
     }
 
-    stats.queue_size.set(towrite.size() + writing.size());
+    stats.queue_size.set(getQueuedCount() + shard.writing.size());
     rel_time_t complete_time = ep_current_time();
     stats.flushDuration.set(complete_time - flush_start);
     stats.flushDurationHighWat.set(std::max(stats.flushDuration.get(),
@@ -1018,8 +1960,10 @@ void EventuallyPersistentStore::completeFlush(std::queue<QueuedItem> *rej,
     stats.cumulativeFlushTime.incr(complete_time - flush_start);
 }
 
-int EventuallyPersistentStore::flushSome(std::queue<QueuedItem> *q,
+int EventuallyPersistentStore::flushSome(DBShard &shard,
+                                         std::queue<QueuedItem> *q,
                                          std::queue<QueuedItem> *rejectQueue) {
+    TransactionContext &tctx = shard.tctx;
     if (!tctx.enter()) {
         ++stats.beginFailed;
         getLogger()->log(EXTENSION_LOG_WARNING, NULL,
@@ -1035,17 +1979,18 @@ int EventuallyPersistentStore::flushSome(std::queue<QueuedItem> *q,
     int oldest = stats.min_data_age;
     int completed(0);
     for (completed = 0; completed < tsz && !q->empty() && bgFetchQueue == 0; ++completed) {
-        int n = flushOne(q, rejectQueue);
+        int n = flushOne(shard, q, rejectQueue);
         if (n != 0 && n < oldest) {
             oldest = n;
         }
     }
+    flushPendingSets(shard);
+    tctx.leave(completed);
     if (bgFetchQueue > 0) {
         ++stats.flusherPreempts;
     } else {
         tctx.commit();
     }
-    tctx.leave(completed);
     return oldest;
 }
 
@@ -1080,7 +2025,7 @@ public:
                                                         bucket_num, true);
                 double current = static_cast<double>(StoredValue::getCurrentSize(*stats));
                 double lower = static_cast<double>(stats->mem_low_wat);
-                if (v && current > lower) {
+                if (v && !v->isInline() && current > lower) {
                     v->ejectValue(*stats);
                 }
             }
@@ -1167,15 +2112,46 @@ private:
     DISALLOW_COPY_AND_ASSIGN(PersistenceCallback);
 };
 
-int EventuallyPersistentStore::flushOneDeleteAll() {
-    underlying->reset();
+// The most sets collected before they're written out.
+static const size_t maxPendingSets = 1000;
+
+void EventuallyPersistentStore::flushPendingSets(DBShard &shard) {
+    std::vector<batched_set> &pendingSets = shard.pendingSets;
+    if (pendingSets.empty()) {
+        return;
+    }
+
+    if (fullEviction) {
+        findEvictedIds(pendingSets);
+    }
+
+    hrtime_t start = gethrtime();
+    underlying->setMany(pendingSets);
+    hrtime_t each = (gethrtime() - start) / 1000 / pendingSets.size();
+
+    std::vector<batched_set>::iterator it;
+    for (it = pendingSets.begin(); it != pendingSets.end(); ++it) {
+        if (it->item->getId() <= 0) {
+            stats.diskInsertHisto.add(each);
+        } else {
+            stats.diskUpdateHisto.add(each);
+        }
+        delete it->item;
+        delete it->cb;
+    }
+    pendingSets.clear();
+}
+
+int EventuallyPersistentStore::flushOneDeleteAll(DBShard &shard) {
+    flushPendingSets(shard);
+    underlying->reset(shard.id);
     return 1;
 }
 
 // While I actually know whether a delete or set was intended, I'm
 // still a bit better off running the older code that figures it out
 // based on what's in memory.
-int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
+int EventuallyPersistentStore::flushOneDelOrSet(DBShard &shard, QueuedItem &qi,
                                            std::queue<QueuedItem> *rejectQueue) {
 
     RCPtr<VBucket> vb = getVBucket(qi.getVBucketId());
@@ -1235,6 +2211,11 @@ int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
                 val = new Item(qi.getKey(), v->getFlags(), v->getExptime(),
                                v->getValue(), v->getCas(), rowid,
                                qi.getVBucketId());
+            } else {
+                // Mutations only queue clean items (dirty ones are
+                // already queued), so one coming in while this is
+                // being deleted must find it clean.
+                v->markClean(NULL);
             }
 
             if (rowid == -1) {
@@ -1257,26 +2238,40 @@ int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
             // requeue the persistence task and wait until the snapshot task is completed.
             if (vbuckets.isHighPriorityVbSnapshotScheduled()) {
                 lh.unlock();
-                towrite.push(qi);
-                stats.memOverhead.incr(qi.size());
-                assert(stats.memOverhead.get() < GIGANTOR);
-                ++stats.totalEnqueued;
-                stats.queue_size = towrite.size();
+                pushDirty(shard, qi);
             } else {
                 v->markClean(NULL);
                 lh.unlock();
-                BlockTimer timer(rowid == -1 ?
-                                 &stats.diskInsertHisto : &stats.diskUpdateHisto);
-                PersistenceCallback cb(qi, rejectQueue, this, queued, dirtied, &stats);
-                underlying->set(*val, qi.getVBucketVersion(), cb);
+                // The set is written out with others in the batch,
+                // which owns the copy from here on.  Should it replace
+                // an evicted item, the row to update is found then.
+                PersistenceCallback *cb = new PersistenceCallback(qi, rejectQueue, this,
+                                                                  queued, dirtied, &stats);
+                shard.pendingSets.push_back(batched_set(*val, qi.getVBucketVersion(),
+                                                        *cb));
+                val = NULL;
+                if (shard.pendingSets.size() >= maxPendingSets) {
+                    flushPendingSets(shard);
+                }
             }
         }
     } else if (deleted) {
         lh.unlock();
+        // Any earlier set of this key has to reach disk first.
+        flushPendingSets(shard);
+        if (rowid == -1 && fullEviction && vb->bloomFilter.maybeContains(qi.getKey())) {
+            // Likewise, this may delete an evicted item.
+            rowid = findEvictedId(qi.getKey(), qi.getVBucketId(),
+                                  qi.getVBucketVersion());
+        }
         BlockTimer timer(&stats.diskDelHisto);
         PersistenceCallback cb(qi, rejectQueue, this, queued, dirtied, &stats);
         if (rowid > 0) {
             underlying->del(qi.getKey(), rowid, cb);
+            if (fullEviction && vb->bloomFilter.maybeContains(qi.getKey())) {
+                // The filter keeps the key until it's rebuilt.
+                vb->bloomFilter.forget();
+            }
         } else {
             // bypass deletion if missing items, but still call the
             // deletion callback for clean cleanup.
@@ -1292,7 +2287,7 @@ int EventuallyPersistentStore::flushOneDelOrSet(QueuedItem &qi,
     return ret;
 }
 
-int EventuallyPersistentStore::flushOne(std::queue<QueuedItem> *q,
+int EventuallyPersistentStore::flushOne(DBShard &shard, std::queue<QueuedItem> *q,
                                         std::queue<QueuedItem> *rejectQueue) {
 
     QueuedItem qi = q->front();
@@ -1304,15 +2299,15 @@ int EventuallyPersistentStore::flushOne(std::queue<QueuedItem> *q,
     int rv = 0;
     switch (qi.getOperation()) {
     case queue_op_flush:
-        rv = flushOneDeleteAll();
+        rv = flushOneDeleteAll(shard);
         break;
     case queue_op_set:
         if (qi.getVBucketVersion() == vbuckets.getBucketVersion(qi.getVBucketId())) {
-            rv = flushOneDelOrSet(qi, rejectQueue);
+            rv = flushOneDelOrSet(shard, qi, rejectQueue);
         }
         break;
     case queue_op_del:
-        rv = flushOneDelOrSet(qi, rejectQueue);
+        rv = flushOneDelOrSet(shard, qi, rejectQueue);
         break;
     }
 
@@ -1326,19 +2321,40 @@ void EventuallyPersistentStore::queueDirty(const std::string &key, uint16_t vbid
         // Assume locked.
         uint16_t vb_version = vbuckets.getBucketVersion(vbid);
         QueuedItem qi(key, vbid, op, vb_version);
-        towrite.push(qi);
-        stats.memOverhead.incr(qi.size());
-        assert(stats.memOverhead.get() < GIGANTOR);
-        ++stats.totalEnqueued;
-        stats.queue_size = towrite.size();
+        if (op == queue_op_flush) {
+            // Every shard empties its own tables.
+            std::vector<DBShard*>::iterator it;
+            for (it = shards.begin(); it != shards.end(); ++it) {
+                pushDirty(**it, qi);
+            }
+        } else {
+            pushDirty(*shards[underlying->getShardId(key)], qi);
+        }
     }
 }
 
+void EventuallyPersistentStore::pushDirty(DBShard &shard, const QueuedItem &qi) {
+    shard.towrite.push(qi);
+    stats.memOverhead.incr(qi.size());
+    assert(stats.memOverhead.get() < GIGANTOR);
+    ++stats.totalEnqueued;
+    stats.queue_size = getQueuedCount();
+}
+
+size_t EventuallyPersistentStore::getQueuedCount() {
+    size_t rv(0);
+    std::vector<DBShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        rv += (*it)->towrite.size();
+    }
+    return rv;
+}
+
 void LoadStorageKVPairCallback::initVBucket(uint16_t vbid, uint16_t vb_version,
                                             vbucket_state_t state) {
     RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
     if (!vb) {
-        vb.reset(new VBucket(vbid, state, stats));
+        vb.reset(new VBucket(vbid, state, stats, epstore->getBloomFilterKeys()));
         vbuckets.addBucket(vb);
         vbuckets.setBucketVersion(vbid, vb_version);
     }
@@ -1347,7 +2363,7 @@ void LoadStorageKVPairCallback::initVBucket(uint16_t vbid, uint16_t vb_version,
     }
 }
 
-void LoadStorageKVPairCallback::callback(GetValue &val) {
+void LoadStorageKVPairCallback::load(GetValue &val, bool mayRetain) {
     Item *i = val.getValue();
     if (i != NULL) {
         uint16_t vb_version = vbuckets.getBucketVersion(i->getVBucketId());
@@ -1358,14 +2374,29 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
 
         RCPtr<VBucket> vb = vbuckets.getBucket(i->getVBucketId());
         if (!vb) {
-            vb.reset(new VBucket(i->getVBucketId(), dead, stats));
-            vbuckets.addBucket(vb);
-            vbuckets.setBucketVersion(i->getVBucketId(), val.getVBucketVersion());
+            LockHolder lh(mutex);
+            vb.reset(vbuckets.getBucket(i->getVBucketId()));
+            if (!vb) {
+                vb.reset(new VBucket(i->getVBucketId(), dead, stats,
+                                     epstore->getBloomFilterKeys()));
+                vbuckets.addBucket(vb);
+                vbuckets.setBucketVersion(i->getVBucketId(), val.getVBucketVersion());
+            }
         }
-        bool retain(shouldBeResident());
+        bool retain(mayRetain && shouldBeResident());
         bool succeeded(false);
 
-        switch (vb->ht.add(*i, false, retain)) {
+        if (!retain && epstore->isFullEviction()) {
+            // Leave it on disk altogether; it'll be fetched by key.
+            vb->bloomFilter.add(i->getKey());
+            vb->expiryIndex.addEvicted(i->getKey(), i->getExptime());
+            ++stats.numKeyEjects;
+            ++stats.warmedUp;
+            delete i;
+            return;
+        }
+
+        switch (vb->ht.add(*i, false, retain, &vb->expiryIndex)) {
         case ADD_SUCCESS:
         case ADD_UNDEL:
             // Yay
@@ -1380,17 +2411,14 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
             succeeded = true;
             break;
         case ADD_NOMEM:
-            if (hasPurged) {
+            if (!purgeOnce()) {
                 if (++stats.warmOOM == 1) {
                     getLogger()->log(EXTENSION_LOG_WARNING, NULL,
                                      "Warmup dataload failure: max_size too low.\n");
                 }
             } else {
-                getLogger()->log(EXTENSION_LOG_WARNING, NULL,
-                                 "Emergency startup purge to free space for load.\n");
-                purge();
                 // Try that item again.
-                switch(vb->ht.add(*i, false, retain)) {
+                switch(vb->ht.add(*i, false, retain, &vb->expiryIndex)) {
                 case ADD_SUCCESS:
                 case ADD_UNDEL:
                     succeeded = true;
@@ -1419,6 +2447,12 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
         if (succeeded && !retain) {
             ++stats.numValueEjects;
             ++stats.numNonResident;
+        } else if (!succeeded) {
+            // Still reachable with full eviction.
+            vb->bloomFilter.add(i->getKey());
+            if (epstore->isFullEviction()) {
+                vb->expiryIndex.addEvicted(i->getKey(), i->getExptime());
+            }
         }
 
         delete i;
@@ -1426,6 +2460,17 @@ void LoadStorageKVPairCallback::callback(GetValue &val) {
     ++stats.warmedUp;
 }
 
+bool LoadStorageKVPairCallback::purgeOnce() {
+    LockHolder lh(mutex);
+    if (hasPurged) {
+        return false;
+    }
+    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                     "Emergency startup purge to free space for load.\n");
+    purge();
+    return true;
+}
+
 void LoadStorageKVPairCallback::purge() {
 
     class EmergencyPurgeVisitor : public HashTableVisitor {
@@ -1433,7 +2478,8 @@ void LoadStorageKVPairCallback::purge() {
         EmergencyPurgeVisitor(EPStats &s) : stats(s) {}
 
         void visit(StoredValue *v) {
-            if (v->ejectValue(stats)) {
+            // Inline values take no space of their own.
+            if (!v->isInline() && v->ejectValue(stats)) {
                 ++stats.numValueEjects;
                 ++stats.numNonResident;
             }
@@ -1457,30 +2503,64 @@ void LoadStorageKVPairCallback::purge() {
 
 bool TransactionContext::enter() {
     if (!intxn) {
-        _remaining = txnSize.get();
-        intxn = underlying->begin();
+        _remaining = getEffectiveTxnSize();
+        updates = 0;
+        intxn = underlying->begin(shard);
     }
     return intxn;
 }
 
 void TransactionContext::leave(int completed) {
     _remaining -= completed;
+    updates += completed;
     if (remaining() <= 0 && intxn) {
         commit();
     }
 }
 
 void TransactionContext::commit() {
-    BlockTimer timer(&stats.diskCommitHisto);
+    if (!intxn) {
+        // Already committed on leaving.
+        return;
+    }
+    hrtime_t start = gethrtime();
     rel_time_t cstart = ep_current_time();
-    while (!underlying->commit()) {
+    while (!underlying->commit(shard)) {
         sleep(1);
         ++stats.commitFailed;
     }
     ++stats.flusherCommits;
     rel_time_t complete_time = ep_current_time();
+    hrtime_t commitMicros = (gethrtime() - start) / 1000;
+    stats.diskCommitHisto.add(commitMicros);
 
     stats.commit_time.set(complete_time - cstart);
     stats.cumulativeCommitTime.incr(complete_time - cstart);
     intxn = false;
+    adjustTxnSize(commitMicros);
+}
+
+void TransactionContext::adjustTxnSize(hrtime_t commitMicros) {
+    hrtime_t target = static_cast<hrtime_t>(commitTarget.get()) * 1000;
+    if (target == 0 || updates == 0) {
+        return;
+    }
+    int current = effectiveTxnSize.get();
+    // The number of updates that would have been committed in the
+    // target time at this commit's rate.
+    hrtime_t fit = static_cast<hrtime_t>(updates) * target / std::max(commitMicros,
+                                                                     static_cast<hrtime_t>(1));
+    if (commitMicros > target && current > MIN_ADAPTIVE_TXN_SIZE) {
+        int to = static_cast<int>(std::min(fit, static_cast<hrtime_t>(current)));
+        effectiveTxnSize.set(std::max(to, MIN_ADAPTIVE_TXN_SIZE));
+        ++stats.txnShrinks;
+    } else if (commitMicros < target / 2 && updates >= current
+               && current < txnSize.get()) {
+        // Only a transaction that was cut short by its size tells
+        // whether a bigger one would do.
+        hrtime_t to = std::min(fit, static_cast<hrtime_t>(current) * 2);
+        effectiveTxnSize.set(static_cast<int>(std::min(to,
+                                                       static_cast<hrtime_t>(txnSize.get()))));
+        ++stats.txnGrowths;
+    }
 }
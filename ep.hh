@@ -41,47 +41,26 @@ extern EXTENSION_LOGGER_DESCRIPTOR *getLogger(void);
 #include "queueditem.hh"
 #include "stats.hh"
 #include "locks.hh"
-#include "sqlite-kvstore.hh"
+#include "kvstore.hh"
+#include "htsnapshot.hh"
+#include "access_log.hh"
 #include "stored-value.hh"
 #include "atomic.hh"
 #include "dispatcher.hh"
 #include "vbucket.hh"
+#include "workerpool.hh"
 
 #define DEFAULT_TXN_SIZE 250000
 #define MAX_TXN_SIZE 10000000
+#define MIN_ADAPTIVE_TXN_SIZE 100
+#define MAX_COMMIT_TARGET 60000
 
 #define MAX_DATA_AGE_PARAM 86400
 #define MAX_BG_FETCH_DELAY 900
 
-/**
- * vbucket-aware hashtable visitor.
- */
-class VBucketVisitor : public HashTableVisitor {
-public:
-
-    VBucketVisitor() : HashTableVisitor() { }
-
-    /**
-     * Begin visiting a bucket.
-     *
-     * @param vbid the vbucket we are beginning to visit
-     *
-     * @return true iff we want to walk the hashtable in this vbucket
-     */
-    virtual bool visitBucket(RCPtr<VBucket> vb) {
-        currentBucket = vb;
-        return true;
-    }
-
-    // This is unused in all implementations so far.
-    void visit(StoredValue* v) {
-        (void)v;
-        abort();
-    }
-
-protected:
-    RCPtr<VBucket> currentBucket;
-};
+// Items (or access log keys) read at a time when paging in values
+// after warmup.
+#define WARMUP_VALUE_CHUNK 1000
 
 // Forward declaration
 class Flusher;
@@ -91,6 +70,9 @@ class EventuallyPersistentStore;
 /**
  * Helper class used to insert items into the storage by using
  * the KVStore::dump method to load items from the database
+ *
+ * The shards of the database may be loaded from threads of their own,
+ * all through the same callback.
  */
 class LoadStorageKVPairCallback : public Callback<GetValue> {
 public:
@@ -101,19 +83,42 @@ public:
     }
 
     void initVBucket(uint16_t vbid, uint16_t vb_version, vbucket_state_t state = dead);
-    void callback(GetValue &val);
+
+    void callback(GetValue &val) {
+        load(val, true);
+    }
+
+    /**
+     * Load an item whose value stays on disk.
+     *
+     * The item may carry only the length of its value.
+     */
+    void loadNonResident(GetValue &val) {
+        load(val, false);
+    }
 
 private:
 
+    void load(GetValue &val, bool mayRetain);
+
     bool shouldBeResident() {
         return StoredValue::getCurrentSize(stats) < stats.mem_low_wat;
     }
 
+    /**
+     * Purge values to make room, unless that was done before.
+     *
+     * @return true if this call purged
+     */
+    bool purgeOnce();
+
     void purge();
 
     VBucketMap &vbuckets;
     EPStats    &stats;
     EventuallyPersistentStore *epstore;
+    //! Serializes creating vbuckets and the emergency purge.
+    Mutex       mutex;
     bool        hasPurged;
 };
 
@@ -124,8 +129,9 @@ private:
 class TransactionContext {
 public:
 
-    TransactionContext(EPStats &st, StrategicSqlite3 *ss)
-        : stats(st), underlying(ss), _remaining(0), intxn(false) {}
+    TransactionContext(EPStats &st, KVStore *ss, size_t sh = 0)
+        : stats(st), underlying(ss), shard(sh), _remaining(0), updates(0),
+          intxn(false) {}
 
     /**
      * Call this whenever entering a transaction.
@@ -151,7 +157,9 @@ public:
      * Explicitly commit a transaction.
      *
      * This will reset the remaining counter and begin a new
-     * transaction for the next batch.
+     * transaction for the next batch.  With a commit target, the
+     * number of updates permitted in the next one is adjusted to how
+     * long this commit took.
      */
     void commit();
 
@@ -178,26 +186,104 @@ public:
 
     /**
      * Set the current number of updates permitted per transaction.
+     *
+     * With a commit target this is the most the adjusted size may
+     * grow to, and where adjusting starts over from.
      */
     void setTxnSize(int to) {
         txnSize.set(to);
+        effectiveTxnSize.set(to);
+    }
+
+    /**
+     * Get the number of updates the next transaction may hold.
+     */
+    int getEffectiveTxnSize() {
+        return commitTarget.get() > 0 ? effectiveTxnSize.get() : txnSize.get();
+    }
+
+    /**
+     * Get how long (in milliseconds) commits should take.
+     */
+    int getCommitTarget() {
+        return commitTarget.get();
+    }
+
+    /**
+     * Set how long (in milliseconds) commits should take, sizing
+     * transactions to match (0 for always using the full size).
+     */
+    void setCommitTarget(int to) {
+        commitTarget.set(to);
     }
 
 private:
+
+    void adjustTxnSize(hrtime_t commitMicros);
+
     EPStats          &stats;
-    StrategicSqlite3 *underlying;
+    KVStore          *underlying;
+    size_t            shard;
     int               _remaining;
+    int               updates;
     Atomic<int>       txnSize;
+    Atomic<int>       effectiveTxnSize;
+    Atomic<int>       commitTarget;
     bool              intxn;
 };
 
+/**
+ * The dirty queue, transaction and flusher of a database shard.
+ *
+ * Shards are written independently, each by its own flusher.  With a
+ * single shard, the flusher runs on the store's dispatcher; otherwise
+ * every shard has a dispatcher (thread) of its own.
+ */
+class DBShard {
+public:
+
+    DBShard(EPStats &st, KVStore *ss, size_t i)
+        : id(i), tctx(st, ss, i), flusher(NULL), dispatcher(NULL) {}
+
+    const size_t             id;
+    AtomicQueue<QueuedItem>  towrite;
+    std::queue<QueuedItem>   writing;
+    TransactionContext       tctx;
+    std::vector<batched_set> pendingSets;
+    Flusher                 *flusher;
+    Dispatcher              *dispatcher;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DBShard);
+};
+
+/**
+ * How far warmup got in loading one shard of the database (see
+ * KVStore::getNumDumpShards).
+ */
+class WarmupShard {
+public:
+
+    WarmupShard() {}
+
+    //! Number of items read so far.
+    Atomic<size_t>   loaded;
+    //! When loading started (0 if it didn't yet).
+    Atomic<hrtime_t> start;
+    //! When loading completed (0 if it didn't yet).
+    Atomic<hrtime_t> end;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(WarmupShard);
+};
+
 class EventuallyPersistentEngine;
 
 class EventuallyPersistentStore {
 public:
 
     EventuallyPersistentStore(EventuallyPersistentEngine &theEngine,
-                              StrategicSqlite3 *t, bool startVb0);
+                              KVStore *t, bool startVb0);
 
     ~EventuallyPersistentStore();
 
@@ -300,8 +386,14 @@ public:
     /**
      * Enqueue a background fetch for a key.
      *
+     * A rowid of 0 looks the key up by name, for keys that were
+     * evicted from memory altogether.  Either way the key is brought
+     * back into memory (by key, even if it's not on disk) before the
+     * requestor is notified.
+     *
      * @param the key to be bg fetched
      * @param vbucket the vbucket in which the key lives
+     * @param rowid the disk id of the item, or 0
      * @param cookie the cookie of the requestor
      */
     void bgFetch(const std::string &key,
@@ -334,46 +426,213 @@ public:
     bool deleteVBucket(uint16_t vbid);
 
     void visit(VBucketVisitor &visitor) {
+        VBucketMapCursor cursor;
+        VisitBudget budget;
+        visit(visitor, cursor, budget);
+    }
+
+    /**
+     * Visit the vbuckets on the worker pool, each thread taking a
+     * share of them.
+     */
+    void visitParallel(ParallelVBucketVisitor &visitor);
+
+    /**
+     * Get the pool of threads parallel visits run on.
+     */
+    WorkerPool &getVisitorPool() {
+        return visitorPool;
+    }
+
+    /**
+     * Visit the vbuckets, pausing when out of budget.
+     *
+     * A vbucket is begun (see VBucketVisitor::visitBucket) once; if
+     * it was replaced since the visit paused, the new one is visited
+     * from its start.
+     *
+     * @param visitor the visitor
+     * @param cursor where to start, updated to where to resume
+     * @param budget how much may be visited
+     * @return true if the visit is complete (the cursor is reset)
+     */
+    bool visit(VBucketVisitor &visitor, VBucketMapCursor &cursor,
+               VisitBudget &budget) {
         size_t maxSize = vbuckets.getSize();
-        for (size_t i = 0; i <= maxSize; ++i) {
-            assert(i <= std::numeric_limits<uint16_t>::max());
-            uint16_t vbid = static_cast<uint16_t>(i);
+        for (; cursor.vbid <= maxSize; cursor.vbid += cursor.step) {
+            assert(cursor.vbid <= std::numeric_limits<uint16_t>::max());
+            uint16_t vbid = static_cast<uint16_t>(cursor.vbid);
             RCPtr<VBucket> vb = vbuckets.getBucket(vbid);
-            if (vb) {
-                bool wantData = visitor.visitBucket(vb);
+            if (vb && vb.get() != cursor.current.get()) {
+                cursor.htCursor.reset();
+                cursor.current.reset();
                 // We could've lost this along the way.
-                if (wantData) {
-                    vb->ht.visit(visitor);
+                if (!visitor.visitBucket(vb)) {
+                    continue;
                 }
+                cursor.current.reset(vb);
+            }
+            if (vb && !vb->ht.visit(visitor, cursor.htCursor, budget)) {
+                return false;
+            }
+            cursor.current.reset();
+            if (budget.exhausted()) {
+                cursor.vbid += cursor.step;
+                return false;
             }
         }
+        cursor.reset();
+        return true;
     }
 
-    void warmup() {
-        LoadStorageKVPairCallback cb(vbuckets, stats, this);
-        std::map<std::pair<uint16_t, uint16_t>, std::string> state =
-            underlying->listPersistedVbuckets();
-        std::map<std::pair<uint16_t, uint16_t>, std::string>::iterator it;
-        for (it = state.begin(); it != state.end(); ++it) {
-            std::pair<uint16_t, uint16_t> vbp = it->first;
-            getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                             "Reloading vbucket %d - was in %s state\n",
-                             vbp.first, it->second.c_str());
-            cb.initVBucket(vbp.first, vbp.second);
-        }
-        underlying->dump(cb);
+    /**
+     * Load the vbuckets and items from the hash table snapshot, if
+     * there's a good one, or else from the database, reading its
+     * shards in parallel on the visitor pool.
+     *
+     * With an access log only the keys are read from the database,
+     * then the values of the keys in the log, and the rest after.
+     */
+    void warmup();
+
+    /**
+     * Page in values left on disk by a metadata-only warmup, reading
+     * some of the items of one shard of the database.
+     *
+     * @param shard the shard (see KVStore::getNumDumpShards)
+     * @param after start after the item with this ID
+     * @param limit the most items to read
+     * @return the ID to continue after, or -1 once the shard is done
+     */
+    int64_t warmupValues(size_t shard, int64_t after, size_t limit);
+
+    /**
+     * Read some of the items of one shard of the database that aren't
+     * in memory, as evicted items are, for a tap backfill to send.
+     *
+     * @param shard the shard (see KVStore::getNumDumpShards)
+     * @param after start after the item with this ID
+     * @param limit the most items to read
+     * @param keysOnly whether to skip reading the values (see
+     *        KVStore::dumpKeys)
+     * @param cb given those of the items read that aren't in memory,
+     *        which it then owns
+     * @return the ID to continue after, or -1 once the shard is done
+     */
+    int64_t dumpEvicted(size_t shard, int64_t after, size_t limit,
+                        bool keysOnly, Callback<GetValue> &cb);
+
+    /**
+     * Start rebuilding the Bloom filters of the vbuckets many of
+     * whose evicted keys are gone from disk.
+     *
+     * @return the number of filters being rebuilt
+     */
+    size_t beginBloomFilterRebuild();
+
+    /**
+     * Give the Bloom filters being rebuilt the keys of the items of a
+     * part of one shard of the database that aren't in memory.
+     *
+     * @param shard the shard (see KVStore::getNumDumpShards)
+     * @param after start after the item with this ID
+     * @param limit the most items to read
+     * @return the ID to continue after, or -1 once the shard is done
+     */
+    int64_t rebuildBloomFilters(size_t shard, int64_t after, size_t limit);
+
+    /**
+     * Replace the Bloom filters being rebuilt by what they were given.
+     */
+    void completeBloomFilterRebuild();
+
+    /**
+     * Page in the values of the next keys of the access log, for those
+     * items warmup left on disk.
+     *
+     * The values are read in the order they're stored in.
+     *
+     * @param alog the access log being read
+     * @param limit the most keys to read
+     * @return false once the whole log was read
+     */
+    bool warmupAccessLog(AccessLogReader &alog, size_t limit);
+
+    /**
+     * Write the access log, if there's one to write.
+     *
+     * @param keys set to the number of keys written
+     * @return true if the log was written
+     */
+    bool writeAccessLog(size_t &keys) {
+        return accessLog != NULL && accessLog->write(*this, keys);
+    }
+
+    /**
+     * Get how far warmup got in loading each shard of the database.
+     */
+    const std::vector<WarmupShard*> &getWarmupShards() {
+        return warmupShards;
+    }
+
+    /**
+     * Get what became of loading the hash table snapshot at warmup.
+     */
+    snapshot_load_t getSnapshotResult() {
+        return snapshotResult;
+    }
+
+    /**
+     * Get the version of the given vbucket.
+     */
+    uint16_t getVBucketVersion(uint16_t vbid) {
+        return vbuckets.getBucketVersion(vbid);
     }
 
     int getTxnSize() {
-        return tctx.getTxnSize();
+        return shards[0]->tctx.getTxnSize();
     }
 
     void setTxnSize(int to) {
-        tctx.setTxnSize(to);
+        std::vector<DBShard*>::iterator it;
+        for (it = shards.begin(); it != shards.end(); ++it) {
+            (*it)->tctx.setTxnSize(to);
+        }
+    }
+
+    /**
+     * Get the number of updates the next transactions may hold
+     * (averaged over the shards).
+     */
+    int getEffectiveTxnSize() {
+        int total(0);
+        std::vector<DBShard*>::iterator it;
+        for (it = shards.begin(); it != shards.end(); ++it) {
+            total += (*it)->tctx.getEffectiveTxnSize();
+        }
+        return total / static_cast<int>(shards.size());
+    }
+
+    int getCommitTarget() {
+        return shards[0]->tctx.getCommitTarget();
+    }
+
+    void setCommitTarget(int to) {
+        std::vector<DBShard*>::iterator it;
+        for (it = shards.begin(); it != shards.end(); ++it) {
+            (*it)->tctx.setCommitTarget(to);
+        }
     }
 
+    /**
+     * Get the flusher of the first shard, which also does the warmup.
+     */
     const Flusher* getFlusher();
 
+    size_t getNumShards() {
+        return shards.size();
+    }
+
     bool getKeyStats(const std::string &key, uint16_t vbucket,
                      key_stats &kstats);
 
@@ -381,13 +640,52 @@ public:
                    Callback<GetValue> &cb,
                    rel_time_t currentTime, uint32_t lockTimeout);
 
-    StrategicSqlite3* getUnderlying() {
+    KVStore* getUnderlying() {
         // This method might also be called leakAbstraction()
         return underlying;
     }
 
+    /**
+     * Delete the given expired items.
+     *
+     * Items stored again since they expired stay.
+     */
     void deleteMany(std::list<std::pair<uint16_t, std::string> > &);
 
+    /**
+     * Delete the items of active vbuckets that have expired, as found
+     * by their vbuckets' expiry indexes.
+     *
+     * @return the number of items deleted
+     */
+    size_t deleteExpiredItems();
+
+    /**
+     * Remove the given clean items from memory entirely.
+     *
+     * Their keys are remembered in their vbucket's Bloom filter, and
+     * they'll be fetched from disk by key on demand.  Items that were
+     * dirtied, locked, or deleted meanwhile stay.
+     *
+     * @return the number of items evicted
+     */
+    size_t evictMany(std::list<std::pair<uint16_t, std::string> > &);
+
+    /**
+     * True if clean items may be evicted from memory altogether
+     * instead of just their values.
+     */
+    bool isFullEviction() const {
+        return fullEviction;
+    }
+
+    /**
+     * Get the number of keys vbucket Bloom filters are sized for.
+     */
+    size_t getBloomFilterKeys() const {
+        return bloomFilterKeys;
+    }
+
 private:
 
     void scheduleVBSnapshot(const Priority &priority);
@@ -432,20 +730,117 @@ private:
         return v != NULL;
     }
 
-    std::queue<QueuedItem> *beginFlush();
-    void completeFlush(std::queue<QueuedItem> *rejects,
+    std::queue<QueuedItem> *beginFlush(DBShard &shard);
+    void completeFlush(DBShard &shard, std::queue<QueuedItem> *rejects,
                        rel_time_t flush_start);
 
-    int flushSome(std::queue<QueuedItem> *q,
+    int flushSome(DBShard &shard, std::queue<QueuedItem> *q,
                   std::queue<QueuedItem> *rejectQueue);
-    int flushOne(std::queue<QueuedItem> *q,
+    int flushOne(DBShard &shard, std::queue<QueuedItem> *q,
                  std::queue<QueuedItem> *rejectQueue);
-    int flushOneDeleteAll(void);
-    int flushOneDelOrSet(QueuedItem &qi, std::queue<QueuedItem> *rejectQueue);
+    int flushOneDeleteAll(DBShard &shard);
+    int flushOneDelOrSet(DBShard &shard, QueuedItem &qi,
+                         std::queue<QueuedItem> *rejectQueue);
+
+    /**
+     * Write out the sets collected by flushOneDelOrSet and call their
+     * callbacks.
+     */
+    void flushPendingSets(DBShard &shard);
+
+    /**
+     * Add an item to the dirty queue of a shard.
+     */
+    void pushDirty(DBShard &shard, const QueuedItem &qi);
+
+    /**
+     * Get the number of items in the dirty queues of all shards.
+     */
+    size_t getQueuedCount();
 
     StoredValue *fetchValidValue(RCPtr<VBucket> vb, const std::string &key,
                                  int bucket_num, bool wantsDeleted=false);
 
+    /**
+     * True if the given key isn't in memory but may be on disk.
+     *
+     * The bucket must be locked.
+     */
+    bool isEvicted(RCPtr<VBucket> &vb, const std::string &key, int bucket_num);
+
+    /**
+     * Delete those of the given keys of a vbucket that expired before
+     * the given time, taking each hash table lock only once.
+     *
+     * @return the number of items deleted
+     */
+    size_t deleteExpired(RCPtr<VBucket> &vb, std::vector<std::string> &keys,
+                         time_t asOf);
+
+    /**
+     * Decide whether a front-end mutation should be turned away to let
+     * the flusher (or the pager) catch up.
+     *
+     * Past a threshold the chance of being turned away grows linearly
+     * with how far past it we are, reaching certainty at twice the
+     * queue threshold or at the memory limit.
+     *
+     * @param growsMemory whether the mutation may use more memory
+     * @return true if the mutation should fail with a temporary error
+     */
+    bool shouldThrottle(bool growsMemory);
+
+    /**
+     * Schedule a background fetch of the given key if it was evicted.
+     *
+     * @return true if the requestor has to wait for the fetch
+     */
+    bool fetchEvicted(RCPtr<VBucket> &vb, const std::string &key,
+                      const void *cookie);
+
+    /**
+     * Read those of the given keys of a vbucket that are evicted back
+     * from disk (see restoreFetched).
+     */
+    void restoreEvicted(RCPtr<VBucket> &vb, const std::vector<std::string> &keys);
+
+    /**
+     * Put an item read back from disk into memory.
+     *
+     * @param rowid the id the item was read by, or 0 if it was read
+     *        by key after being evicted
+     * @param gv what was read
+     */
+    void restoreFetched(RCPtr<VBucket> &vb, const std::string &key,
+                        uint64_t rowid, GetValue &gv);
+
+    /**
+     * Look up the disk id of an item that was evicted from memory.
+     *
+     * @return the id, or -1 if the item isn't on disk
+     */
+    int64_t findEvictedId(const std::string &key, uint16_t vbid,
+                          uint16_t vb_version);
+
+    /**
+     * Give the new items of a batch of sets that replace evicted items
+     * the disk ids of those, looking them all up at once.
+     */
+    void findEvictedIds(std::vector<batched_set> &sets);
+
+    /**
+     * Write the hash table snapshot, if there's one to write.
+     *
+     * Only done once the flushers stopped, and when every item is in
+     * the hash tables and on disk.
+     */
+    void writeSnapshot();
+
+    /**
+     * Forget all items loaded at warmup, so they can be loaded again.
+     */
+    void clearWarmedUp();
+
     friend class Flusher;
     friend class BGFetchCallback;
     friend class VKeyStatBGFetchCallback;
@@ -453,27 +848,80 @@ private:
     friend class TapConnection;
     friend class PersistenceCallback;
     friend class Deleter;
+    friend class WarmupValueCallback;
+    friend class EvictedItemCallback;
 
     EventuallyPersistentEngine &engine;
     EPStats                    &stats;
     bool                       doPersistence;
-    StrategicSqlite3          *underlying;
+    KVStore                   *underlying;
     Dispatcher                *dispatcher;
     Dispatcher                *nonIODispatcher;
-    Flusher                   *flusher;
+    std::vector<DBShard*>      shards;
     VBucketMap                 vbuckets;
     SyncObject                 mutex;
-    AtomicQueue<QueuedItem>    towrite;
-    std::queue<QueuedItem>     writing;
     pthread_t                  thread;
     Atomic<size_t>             bgFetchQueue;
-    TransactionContext         tctx;
     Mutex                      vbsetMutex;
     uint32_t                   bgFetchDelay;
+    const bool                 fullEviction;
+    const size_t               bloomFilterKeys;
+    const bool                 metadataWarmup;
+    WorkerPool                 visitorPool;
+    HashTableSnapshot         *htSnapshot;
+    snapshot_load_t            snapshotResult;
+    AccessLog                 *accessLog;
+    std::vector<WarmupShard*>  warmupShards;
+    //! Counts the throttling draws (see shouldThrottle).
+    Atomic<uint32_t>           throttleDraws;
 
     DISALLOW_COPY_AND_ASSIGN(EventuallyPersistentStore);
 };
 
+/**
+ * A visit of all vbuckets split up among the threads of the store's
+ * worker pool, optionally done in slices.
+ *
+ * Each share covers every n-th vbucket.  The results of the shares
+ * are joined into the visitor after every slice.
+ */
+class ParallelVBucketVisit : public WorkerJob {
+public:
+
+    /**
+     * Set up a visit.
+     *
+     * @param st the store to visit
+     * @param v the visitor to collect the results in
+     * @param b how much each share may visit in a slice
+     */
+    ParallelVBucketVisit(EventuallyPersistentStore &st,
+                         ParallelVBucketVisitor &v,
+                         const VisitBudget &b = VisitBudget());
+
+    ~ParallelVBucketVisit();
+
+    /**
+     * Visit a slice and join its results into the visitor.
+     *
+     * @return true if the visit is complete
+     */
+    bool run();
+
+    void work(size_t part);
+
+private:
+    EventuallyPersistentStore              &store;
+    ParallelVBucketVisitor                 &visitor;
+    VisitBudget                             budget;
+    std::vector<ParallelVBucketVisitor*>    parts;
+    std::vector<VBucketMapCursor>           cursors;
+    //! Whether each share is done (a char each, as they're set in parallel).
+    std::vector<char>                       complete;
+
+    DISALLOW_COPY_AND_ASSIGN(ParallelVBucketVisit);
+};
+
 /**
  * Object whose existence maintains a counter incremented.
  *
@@ -59,6 +59,19 @@ static void validate(T v, T l, T h) {
     }
 }
 
+/**
+ * Parse a number of bytes, which may need more bits than an int.
+ */
+static uint64_t parseSize(const char *valz) {
+    char *ptr = NULL;
+    errno = 0;
+    uint64_t vsize = strtoull(valz, &ptr, 10);
+    if (ptr == valz || *ptr != '\0' || errno != 0 || strchr(valz, '-') != NULL) {
+        throw std::runtime_error("value out of range.");
+    }
+    return vsize;
+}
+
 // The Engine API specifies C linkage for the functions..
 extern "C" {
 
@@ -207,39 +220,27 @@ extern "C" {
             } else if (strcmp(keyz, "max_txn_size") == 0) {
                 validate(v, 1, MAX_TXN_SIZE);
                 e->setTxnSize(v);
+            } else if (strcmp(keyz, "txn_commit_target") == 0) {
+                validate(v, 0, MAX_COMMIT_TARGET);
+                e->setCommitTarget(v);
+            } else if (strcmp(keyz, "throttle_queue_len") == 0) {
+                validate(v, 0, std::numeric_limits<int>::max());
+                e->getEpStats().throttle_queue_len = static_cast<size_t>(v);
             } else if (strcmp(keyz, "bg_fetch_delay") == 0) {
                 validate(v, 0, MAX_BG_FETCH_DELAY);
                 e->setBGFetchDelay(static_cast<uint32_t>(v));
             } else if (strcmp(keyz, "max_size") == 0) {
-                // Want more bits than int.
-                char *ptr = NULL;
-                // TODO:  This parser isn't perfect.
-                uint64_t vsize = strtoull(valz, &ptr, 10);
-                validate(vsize, static_cast<uint64_t>(0),
-                         std::numeric_limits<uint64_t>::max());
                 EPStats &stats = e->getEpStats();
-                stats.maxDataSize = vsize;
+                stats.maxDataSize = parseSize(valz);
 
                 stats.mem_low_wat = percentOf(StoredValue::getMaxDataSize(stats), 0.6);
                 stats.mem_high_wat = percentOf(StoredValue::getMaxDataSize(stats), 0.75);
             } else if (strcmp(keyz, "mem_low_wat") == 0) {
-                // Want more bits than int.
-                char *ptr = NULL;
-                // TODO:  This parser isn't perfect.
-                uint64_t vsize = strtoull(valz, &ptr, 10);
-                validate(vsize, static_cast<uint64_t>(0),
-                         std::numeric_limits<uint64_t>::max());
-                EPStats &stats = e->getEpStats();
-                stats.mem_low_wat = vsize;
+                e->getEpStats().mem_low_wat = parseSize(valz);
             } else if (strcmp(keyz, "mem_high_wat") == 0) {
-                // Want more bits than int.
-                char *ptr = NULL;
-                // TODO:  This parser isn't perfect.
-                uint64_t vsize = strtoull(valz, &ptr, 10);
-                validate(vsize, static_cast<uint64_t>(0),
-                         std::numeric_limits<uint64_t>::max());
-                EPStats &stats = e->getEpStats();
-                stats.mem_high_wat = vsize;
+                e->getEpStats().mem_high_wat = parseSize(valz);
+            } else if (strcmp(keyz, "throttle_mem_wat") == 0) {
+                e->getEpStats().throttle_mem_wat = parseSize(valz);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -667,9 +668,11 @@ EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
 }
 
 EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server_api) :
-    dbname("/tmp/test.db"), initFile(NULL), postInitFile(NULL), dbStrategy(multi_db),
+    dbname("/tmp/test.db"), initFile(NULL), postInitFile(NULL), snapshotFile(NULL),
+    alogPath(NULL), dbStrategy(multi_db),
+    kvstoreType(sqlite_kvstore), dbShardHash(djb_hash),
     warmup(true), wait_for_warmup(true), fail_on_partial_warmup(true),
-    startVb0(true), sqliteStrategy(NULL), sqliteDb(NULL), epstore(NULL),
+    startVb0(true), sqliteStrategy(NULL), kvstore(NULL), epstore(NULL),
     databaseInitTime(0), tapIdleTimeout(DEFAULT_TAP_IDLE_TIMEOUT), nextTapNoop(0),
     startedEngineThreads(false), shutdown(false),
     getServerApiFunc(get_server_api), getlExtension(NULL),
@@ -678,7 +681,10 @@ EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server
     memHighWat(std::numeric_limits<size_t>::max()),
     minDataAge(DEFAULT_MIN_DATA_AGE),
     queueAgeCap(DEFAULT_QUEUE_AGE_CAP),
-    itemExpiryWindow(3), expiryPagerSleeptime(3600), dbShards(4), vb_del_chunk_size(1000)
+    itemExpiryWindow(3), expiryPagerSleeptime(3600),
+    alogSleeptime(3600), dbShards(4), vb_del_chunk_size(1000),
+    fullEviction(false), bfilterKeyCount(DEFAULT_BFILTER_KEY_COUNT),
+    metadataWarmup(false), pagerPolicy(clock_pager), visitorThreads(DEFAULT_VISITOR_THREADS)
 {
     interface.interface = 1;
     ENGINE_HANDLE_V1::get_info = EvpGetInfo;
@@ -715,15 +721,24 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
     size_t txnSize = 0;
+    size_t commitTarget = DEFAULT_TXN_COMMIT_TARGET;
+    size_t throttleQueueSize = 0;
+    size_t throttleMemWat = 0;
 
     resetStats();
     if (config != NULL) {
         char *dbn = NULL, *initf = NULL, *pinitf = NULL, *svaltype = NULL, *dbs=NULL;
+        char *htHash = NULL, *shardHash = NULL, *pagerPol = NULL, *kvs = NULL;
+        char *snapf = NULL, *alogp = NULL;
         size_t htBuckets = 0;
         size_t htLocks = 0;
+        bool htSlabs = HashTable::getSlabAllocation();
+        size_t htInlineMax = HashTable::getMaxInlineValue();
+        bool htLockStats = HashTable::getLockStats();
+        size_t htLockSpins = HashTable::getLockSpins();
         size_t maxSize = 0;
 
-        const int max_items = 31;
+        const int max_items = 50;
         struct config_item items[max_items];
         int ii = 0;
         memset(items, 0, sizeof(items));
@@ -747,6 +762,11 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         items[ii].datatype = DT_STRING;
         items[ii].value.dt_string = &dbs;
 
+        ++ii;
+        items[ii].key = "db_shard_hash";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &shardHash;
+
         ++ii;
         items[ii].key = "warmup";
         items[ii].datatype = DT_BOOL;
@@ -777,6 +797,21 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         items[ii].datatype = DT_SIZE;
         items[ii].value.dt_size = &htBuckets;
 
+        ++ii;
+        items[ii].key = "ht_slab_alloc";
+        items[ii].datatype = DT_BOOL;
+        items[ii].value.dt_bool = &htSlabs;
+
+        ++ii;
+        items[ii].key = "ht_inline_max";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &htInlineMax;
+
+        ++ii;
+        items[ii].key = "ht_hash";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &htHash;
+
         ++ii;
         items[ii].key = "stored_val_type";
         items[ii].datatype = DT_STRING;
@@ -787,6 +822,16 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         items[ii].datatype = DT_SIZE;
         items[ii].value.dt_size = &htLocks;
 
+        ++ii;
+        items[ii].key = "ht_lock_stats";
+        items[ii].datatype = DT_BOOL;
+        items[ii].value.dt_bool = &htLockStats;
+
+        ++ii;
+        items[ii].key = "ht_lock_spins";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &htLockSpins;
+
         ++ii;
         items[ii].key = "max_size";
         items[ii].datatype = DT_SIZE;
@@ -866,6 +911,66 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         items[ii].datatype = DT_SIZE;
         items[ii].value.dt_size = &TapConnection::bgMaxPending;
 
+        ++ii;
+        items[ii].key = "full_eviction";
+        items[ii].datatype = DT_BOOL;
+        items[ii].value.dt_bool = &fullEviction;
+
+        ++ii;
+        items[ii].key = "bfilter_key_count";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &bfilterKeyCount;
+
+        ++ii;
+        items[ii].key = "metadata_warmup";
+        items[ii].datatype = DT_BOOL;
+        items[ii].value.dt_bool = &metadataWarmup;
+
+        ++ii;
+        items[ii].key = "pager_policy";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &pagerPol;
+
+        ++ii;
+        items[ii].key = "visitor_threads";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &visitorThreads;
+
+        ++ii;
+        items[ii].key = "txn_commit_target";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &commitTarget;
+
+        ++ii;
+        items[ii].key = "throttle_queue_len";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &throttleQueueSize;
+
+        ++ii;
+        items[ii].key = "throttle_mem_wat";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &throttleMemWat;
+
+        ++ii;
+        items[ii].key = "kvstore";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &kvs;
+
+        ++ii;
+        items[ii].key = "ht_snapshot";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &snapf;
+
+        ++ii;
+        items[ii].key = "alog_path";
+        items[ii].datatype = DT_STRING;
+        items[ii].value.dt_string = &alogp;
+
+        ++ii;
+        items[ii].key = "alog_sleep";
+        items[ii].datatype = DT_SIZE;
+        items[ii].value.dt_size = &alogSleeptime;
+
         ++ii;
         items[ii].key = NULL;
 
@@ -883,11 +988,35 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
             if (pinitf != NULL) {
                 postInitFile = pinitf;
             }
+            if (snapf != NULL) {
+                snapshotFile = snapf;
+            }
+            if (alogp != NULL) {
+                alogPath = alogp;
+            }
+            if (kvs != NULL) {
+                if (strcmp(kvs, "memory") == 0) {
+                    kvstoreType = memory_kvstore;
+                } else if (strcmp(kvs, "sqlite") != 0) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Unhandled kvstore: %s", kvs);
+                }
+            }
             if (dbs != NULL) {
-                dbStrategy = strcmp(dbs, "multiDB") == 0 ? multi_db : single_db;
+                if (strcmp(dbs, "multiDB") == 0) {
+                    dbStrategy = multi_db;
+                } else if (strcmp(dbs, "shardedDB") == 0) {
+                    dbStrategy = sharded_db;
+                } else {
+                    dbStrategy = single_db;
+                }
             }
             HashTable::setDefaultNumBuckets(htBuckets);
             HashTable::setDefaultNumLocks(htLocks);
+            HashTable::setSlabAllocation(htSlabs);
+            HashTable::setMaxInlineValue(htInlineMax);
+            HashTable::setLockStats(htLockStats);
+            HashTable::setLockSpins(htLockSpins);
             StoredValue::setMaxDataSize(stats, maxSize);
 
             if (svaltype && !HashTable::setDefaultStorageValueType(svaltype)) {
@@ -895,6 +1024,31 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
                                  "Unhandled storage value type: %s",
                                  svaltype);
             }
+
+            if (htHash && !HashTable::setDefaultHashFunction(htHash)) {
+                getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                 "Unhandled hash function: %s", htHash);
+            }
+
+            if (pagerPol) {
+                if (strcmp(pagerPol, "clock") == 0) {
+                    pagerPolicy = clock_pager;
+                } else if (strcmp(pagerPol, "random") == 0) {
+                    pagerPolicy = random_pager;
+                } else {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Unhandled pager policy: %s", pagerPol);
+                }
+            }
+
+            if (shardHash) {
+                if (getHashFunction(shardHash)) {
+                    dbShardHash = getHashFunction(shardHash);
+                } else {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Unhandled hash function: %s", shardHash);
+                }
+            }
         }
     }
 
@@ -905,15 +1059,26 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
     if (ret == ENGINE_SUCCESS) {
         time_t start = ep_real_time();
         try {
-            if (dbStrategy == multi_db) {
+            if (kvstoreType == memory_kvstore) {
+                kvstore = new MemoryKVStore(stats, dbStrategy == sharded_db ? dbShards : 1,
+                                            dbShardHash);
+            } else if (dbStrategy == multi_db) {
                 sqliteStrategy = new MultiDBSqliteStrategy(*this, dbname,
                                                            initFile, postInitFile,
                                                            dbShards);
+            } else if (dbStrategy == sharded_db) {
+                sqliteStrategy = new ShardedSqliteStrategy(*this, dbname,
+                                                           initFile, postInitFile,
+                                                           dbShards);
             } else {
                 sqliteStrategy = new SqliteStrategy(*this, dbname, initFile,
                                                     postInitFile);
             }
-            sqliteDb = new StrategicSqlite3(*this, sqliteStrategy);
+            if (sqliteStrategy) {
+                sqliteStrategy->setShardHash(dbShardHash);
+                sqliteStrategy->setKeyIndex(fullEviction);
+                kvstore = new StrategicSqlite3(*this, sqliteStrategy);
+            }
         } catch (std::exception& e) {
             std::stringstream ss;
             ss << "Failed to create database: " << e.what() << std::endl;
@@ -928,7 +1093,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         }
 
         databaseInitTime = ep_real_time() - start;
-        epstore = new EventuallyPersistentStore(*this, sqliteDb, startVb0);
+        epstore = new EventuallyPersistentStore(*this, kvstore, startVb0);
         setMinDataAge(minDataAge);
         setQueueAgeCap(queueAgeCap);
 
@@ -955,9 +1120,13 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         if (txnSize > 0) {
             setTxnSize(txnSize);
         }
+        setCommitTarget(static_cast<int>(std::min(commitTarget,
+                                                  static_cast<size_t>(MAX_COMMIT_TARGET))));
 
         stats.mem_low_wat = memLowWat;
         stats.mem_high_wat = memHighWat;
+        stats.throttle_queue_len = throttleQueueSize;
+        stats.throttle_mem_wat = throttleMemWat;
 
         startEngineThreads();
 
@@ -981,14 +1150,40 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::initialize(const char* config) {
         }
 
         if (HashTable::getDefaultStorageValueType() != small) {
-            shared_ptr<DispatcherCallback> cb(new ItemPager(epstore, stats));
-            epstore->getDispatcher()->schedule(cb, NULL, Priority::ItemPagerPriority, 10);
+            shared_ptr<ItemPager> pager(new ItemPager(epstore, stats,
+                                                      pagerPolicy));
+            TaskId pagerTask;
+            epstore->getDispatcher()->schedule(pager, &pagerTask,
+                                               Priority::ItemPagerPriority, 10);
+            pager->setTask(epstore->getDispatcher(), pagerTask);
+            stats.memoryListener = pager.get();
             shared_ptr<DispatcherCallback> exp_cb(new ExpiredItemPager(epstore, stats,
                                                                        expiryPagerSleeptime));
             epstore->getDispatcher()->schedule(exp_cb, NULL, Priority::ItemPagerPriority,
                                                expiryPagerSleeptime);
+
+            if (fullEviction) {
+                shared_ptr<DispatcherCallback> bf_cb(new BloomFilterRebuilder(epstore, stats,
+                                                                              BFILTER_REBUILD_FREQ));
+                epstore->getDispatcher()->schedule(bf_cb, NULL, Priority::ItemPagerPriority,
+                                                   BFILTER_REBUILD_FREQ);
+            }
+
+            if (getAccessLogPath() != NULL) {
+                shared_ptr<DispatcherCallback> alog_cb(new AccessScanner(epstore, stats,
+                                                                         alogSleeptime));
+                epstore->getDispatcher()->schedule(alog_cb, NULL,
+                                                   Priority::AccessScannerPriority,
+                                                   alogSleeptime);
+            }
         }
 
+        shared_ptr<DispatcherCallback> htr(new HashtableResizer(epstore,
+                                                                HTRESIZER_FREQ));
+        epstore->getNonIODispatcher()->schedule(htr, NULL,
+                                                Priority::HTResizePriority,
+                                                HTRESIZER_FREQ);
+
         shared_ptr<StatSnap> sscb(new StatSnap(this));
         epstore->getDispatcher()->schedule(sscb, NULL, Priority::StatSnapPriority,
                                            STATSNAP_FREQ);
@@ -1208,7 +1403,7 @@ inline tap_event_t EventuallyPersistentEngine::doWalkTapQueue(const void *cookie
             }
             ++stats.numTapDeletes;
         } else if (r == ENGINE_EWOULDBLOCK) {
-            connection->queueBGFetch(key, gv.getId());
+            connection->queueBGFetch(key, gv.getId(), qi.getVBucketId());
             // This can optionally collect a few and batch them.
             connection->runBGFetch(epstore->getDispatcher(), cookie);
             // If there's an item ready, return NOOP so we'll come
@@ -1396,7 +1591,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::tapNotify(const void *cookie,
             v.reserve(ndata+2);
             v.append(static_cast<const char*>(data), ndata);
             v.append("\r\n");
-            shared_ptr<const Blob> vblob(Blob::New(v));
+            value_t vblob(Blob::New(v));
 
             Item *item = new Item(k, flags, exptime, vblob);
             item->setVBucketId(vbucket);
@@ -1482,10 +1677,17 @@ void EventuallyPersistentEngine::startEngineThreads(void)
     startedEngineThreads = true;
 }
 
+// Items read from disk at a time to backfill those not in memory.
+static const size_t BACKFILL_EVICTED_CHUNK = 1000;
+
 /**
  * VBucketVisitor to backfill a TapConnection.
+ *
+ * With full eviction, the items only on disk are read once the hash
+ * tables were visited, and handed to the connection as if they had
+ * been fetched for it.
  */
-class BackFillVisitor : public VBucketVisitor {
+class BackFillVisitor : public VBucketVisitor, public Callback<GetValue> {
 public:
     BackFillVisitor(EventuallyPersistentEngine *e, TapConnection *tc,
                     const void *token):
@@ -1517,6 +1719,27 @@ public:
         return valid;
     }
 
+    void visitEvicted(EventuallyPersistentStore *epstore) {
+        size_t shards = epstore->getUnderlying()->getNumDumpShards();
+        for (size_t shard = 0; shard < shards; ++shard) {
+            int64_t after = 0;
+            while (after >= 0 && shouldContinue()) {
+                after = epstore->dumpEvicted(shard, after, BACKFILL_EVICTED_CHUNK,
+                                             false, *this);
+            }
+        }
+    }
+
+    // Called with the items of visitEvicted.
+    void callback(GetValue &val) {
+        Item *i = val.getValue();
+        ReceivedItemTapOperation tapop;
+        if (!valid || !filter(i->getVBucketId())
+            || !engine->tapConnMap.performTapOp(name, tapop, i)) {
+            delete i;
+        }
+    }
+
     void apply(void) {
         setEvents();
         if (valid) {
@@ -1608,6 +1831,9 @@ extern "C" {
         BackFillThreadData *bftd = static_cast<BackFillThreadData *>(arg);
 
         bftd->epstore->visit(bftd->bfv);
+        if (bftd->epstore->isFullEviction()) {
+            bftd->bfv.visitEvicted(bftd->epstore);
+        }
         bftd->bfv.apply();
 
         delete bftd;
@@ -1702,10 +1928,17 @@ bool VBucketCountVisitor::visitBucket(RCPtr<VBucket> vb) {
     return false;
 }
 
+void VBucketCountVisitor::join(ParallelVBucketVisitor &part) {
+    VBucketCountVisitor &other = static_cast<VBucketCountVisitor&>(part);
+    total += other.total;
+    requestedState += other.requestedState;
+    other.total = other.requestedState = 0;
+}
+
 ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                                                             ADD_STAT add_stat) {
     VBucketCountVisitor countVisitor;
-    epstore->visit(countVisitor);
+    epstore->visitParallel(countVisitor);
 
     EPStats &epstats = getEpStats();
     add_casted_stat("ep_version", VERSION, add_stat, cookie);
@@ -1719,6 +1952,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.queue_age_cap, add_stat, cookie);
     add_casted_stat("ep_max_txn_size",
                     epstore->getTxnSize(), add_stat, cookie);
+    add_casted_stat("ep_txn_size",
+                    epstore->getEffectiveTxnSize(), add_stat, cookie);
+    add_casted_stat("ep_txn_commit_target",
+                    epstore->getCommitTarget(), add_stat, cookie);
+    add_casted_stat("ep_txn_shrinks", epstats.txnShrinks, add_stat, cookie);
+    add_casted_stat("ep_txn_growths", epstats.txnGrowths, add_stat, cookie);
     add_casted_stat("ep_data_age",
                     epstats.dataAge, add_stat, cookie);
     add_casted_stat("ep_data_age_highwat",
@@ -1729,6 +1968,16 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     epstats.tooOld, add_stat, cookie);
     add_casted_stat("ep_total_enqueued",
                     epstats.totalEnqueued, add_stat, cookie);
+    add_casted_stat("ep_total_coalesced",
+                    epstats.totalCoalesced, add_stat, cookie);
+    add_casted_stat("ep_throttle_queue_len",
+                    epstats.throttle_queue_len, add_stat, cookie);
+    add_casted_stat("ep_throttle_mem_wat",
+                    epstats.throttle_mem_wat, add_stat, cookie);
+    add_casted_stat("ep_queue_throttled",
+                    epstats.queueThrottled, add_stat, cookie);
+    add_casted_stat("ep_mem_throttled",
+                    epstats.memThrottled, add_stat, cookie);
     add_casted_stat("ep_total_new_items", stats.newItems, add_stat, cookie);
     add_casted_stat("ep_total_del_items", stats.delItems, add_stat, cookie);
     add_casted_stat("ep_total_persisted",
@@ -1740,6 +1989,8 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_item_begin_failed",
                     epstats.beginFailed, add_stat, cookie);
     add_casted_stat("ep_expired", epstats.expired, add_stat, cookie);
+    add_casted_stat("ep_expiry_index_size", epstats.expiryIndexSize,
+                    add_stat, cookie);
     add_casted_stat("ep_item_flush_expired",
                     epstats.flushExpired, add_stat, cookie);
     add_casted_stat("ep_queue_size",
@@ -1783,6 +2034,9 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
     add_casted_stat("ep_storage_type",
                     HashTable::getDefaultStorageValueTypeStr(),
                     add_stat, cookie);
+    add_casted_stat("ep_ht_hash",
+                    getHashFunctionName(HashTable::getDefaultHashFunction()),
+                    add_stat, cookie);
     add_casted_stat("ep_bg_fetched", epstats.bg_fetched, add_stat,
                     cookie);
     add_casted_stat("ep_num_pager_runs", epstats.pagerRuns, add_stat,
@@ -1793,8 +2047,53 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
                     cookie);
     add_casted_stat("ep_num_eject_failures", epstats.numFailedEjects, add_stat,
                     cookie);
+    add_casted_stat("ep_value_bytes_ejected", epstats.valueEjectBytes, add_stat,
+                    cookie);
+    size_t ejectedMB = epstats.valueEjectBytes.get() / (1024 * 1024);
+    add_casted_stat("ep_bg_fetches_per_mb_ejected",
+                    ejectedMB ? epstats.bg_fetched.get() / ejectedMB : 0,
+                    add_stat, cookie);
+    add_casted_stat("ep_pager_policy",
+                    pagerPolicy == clock_pager ? "clock" : "random",
+                    add_stat, cookie);
+    add_casted_stat("ep_pager_warm_skips", epstats.pagerWarmSkips, add_stat,
+                    cookie);
+    add_casted_stat("ep_pager_wakeups", epstats.pagerWakeups, add_stat,
+                    cookie);
+    add_casted_stat("ep_pager_response_time", epstats.pagerResponseTime,
+                    add_stat, cookie);
+    add_casted_stat("ep_pager_response_time_highwat",
+                    epstats.pagerResponseTimeHighWat, add_stat, cookie);
+    if (getAccessLogPath() != NULL) {
+        add_casted_stat("ep_alog_path", getAccessLogPath(), add_stat, cookie);
+        add_casted_stat("ep_alog_sleep_time", alogSleeptime, add_stat, cookie);
+        add_casted_stat("ep_num_alog_runs", epstats.alogRuns, add_stat, cookie);
+        add_casted_stat("ep_alog_keys", epstats.alogKeys, add_stat, cookie);
+        add_casted_stat("ep_alog_time", epstats.alogTime, add_stat, cookie);
+    }
+    add_casted_stat("ep_visitor_threads",
+                    epstore->getVisitorPool().getNumThreads(),
+                    add_stat, cookie);
     add_casted_stat("ep_num_not_my_vbuckets", epstats.numNotMyVBuckets, add_stat,
                     cookie);
+    add_casted_stat("ep_num_ht_resizes", epstats.htResizes, add_stat, cookie);
+    add_casted_stat("ep_ht_resize_time", epstats.htResizeTime, add_stat, cookie);
+    add_casted_stat("ep_optimistic_gets", epstats.optimisticGets, add_stat, cookie);
+    add_casted_stat("ep_optimistic_get_fallbacks", epstats.optimisticGetFallbacks,
+                    add_stat, cookie);
+    add_casted_stat("ep_epoch_retired", Epoch::getNumRetired(), add_stat, cookie);
+    add_casted_stat("ep_full_eviction", fullEviction ? "true" : "false",
+                    add_stat, cookie);
+    if (fullEviction) {
+        add_casted_stat("ep_bfilter_key_count", bfilterKeyCount, add_stat, cookie);
+        add_casted_stat("ep_num_key_ejects", epstats.numKeyEjects, add_stat, cookie);
+        add_casted_stat("ep_bfilter_negatives", epstats.bfilterNegatives,
+                        add_stat, cookie);
+        add_casted_stat("ep_bg_fetch_misses", epstats.bgFetchMisses,
+                        add_stat, cookie);
+        add_casted_stat("ep_bfilter_rebuilds", epstats.bfilterRebuilds,
+                        add_stat, cookie);
+    }
 
     if (warmup) {
         add_casted_stat("ep_warmup_thread",
@@ -1803,20 +2102,66 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
         add_casted_stat("ep_warmed_up", epstats.warmedUp, add_stat, cookie);
         add_casted_stat("ep_warmup_dups", epstats.warmDups, add_stat, cookie);
         add_casted_stat("ep_warmup_oom", epstats.warmOOM, add_stat, cookie);
+        add_casted_stat("ep_warmup_snapshot",
+                        HashTableSnapshot::toString(epstore->getSnapshotResult()),
+                        add_stat, cookie);
         if (epstats.warmupComplete.get()) {
             add_casted_stat("ep_warmup_time", epstats.warmupTime,
                             add_stat, cookie);
         }
+
+        if (metadataWarmup || getAccessLogPath() != NULL) {
+            add_casted_stat("ep_warmup_values", epstats.warmValues, add_stat, cookie);
+            add_casted_stat("ep_warmup_values_state",
+                            epstats.warmValuesComplete.get() ? "complete" : "running",
+                            add_stat, cookie);
+        }
+
+        if (getAccessLogPath() != NULL) {
+            add_casted_stat("ep_warmup_alog_keys", epstats.warmAlogKeys,
+                            add_stat, cookie);
+            add_casted_stat("ep_warmup_alog_loaded", epstats.warmAlogLoaded,
+                            add_stat, cookie);
+            add_casted_stat("ep_warmup_alog_time", epstats.warmAlogTime,
+                            add_stat, cookie);
+        }
+
+        const std::vector<WarmupShard*> &shards = epstore->getWarmupShards();
+        for (size_t i = 0; i < shards.size(); ++i) {
+            hrtime_t start = shards[i]->start.get();
+            if (start == 0) {
+                continue;
+            }
+            hrtime_t end = shards[i]->end.get();
+            hrtime_t elapsed = (end != 0 ? end : gethrtime()) - start;
+            size_t loaded = shards[i]->loaded.get();
+            char buf[64];
+            snprintf(buf, sizeof(buf), "ep_warmup_shard_%d_state", static_cast<int>(i));
+            add_casted_stat(buf, end != 0 ? "complete" : "running", add_stat, cookie);
+            snprintf(buf, sizeof(buf), "ep_warmup_shard_%d_loaded", static_cast<int>(i));
+            add_casted_stat(buf, loaded, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "ep_warmup_shard_%d_time", static_cast<int>(i));
+            add_casted_stat(buf, elapsed / 1000, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "ep_warmup_shard_%d_rate", static_cast<int>(i));
+            add_casted_stat(buf, elapsed > 0 ? loaded * 1000000000ULL / elapsed : 0,
+                            add_stat, cookie);
+        }
     }
 
     add_casted_stat("ep_tap_keepalive", tapKeepAlive,
                     add_stat, cookie);
 
+    add_casted_stat("ep_kvstore",
+                    kvstoreType == memory_kvstore ? "memory" : "sqlite",
+                    add_stat, cookie);
     add_casted_stat("ep_dbname", dbname, add_stat, cookie);
     add_casted_stat("ep_dbinit", databaseInitTime, add_stat, cookie);
     add_casted_stat("ep_dbshards", dbShards, add_stat, cookie);
-    add_casted_stat("ep_db_strategy",
-                    dbStrategy == multi_db ? "multiDB" : "singleDB",
+    add_casted_stat("ep_db_strategy", getStrategyName(dbStrategy),
+                    add_stat, cookie);
+    add_casted_stat("ep_db_shard_hash", getHashFunctionName(dbShardHash),
+                    add_stat, cookie);
+    add_casted_stat("ep_metadata_warmup", metadataWarmup ? "true" : "false",
                     add_stat, cookie);
     add_casted_stat("ep_warmup", warmup ? "true" : "false",
                     add_stat, cookie);
@@ -1870,6 +2215,16 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doEngineStats(const void *cookie,
 
     add_casted_stat("ep_num_non_resident", stats.numNonResident, add_stat, cookie);
 
+    add_casted_stat("ep_slab_bytes", epstats.slabBytes, add_stat, cookie);
+    add_casted_stat("ep_slab_used_bytes", epstats.slabUsedBytes, add_stat, cookie);
+    add_casted_stat("ep_slab_free_slabs", epstats.slabFreeSlabs, add_stat, cookie);
+    size_t slabBytes = epstats.slabBytes;
+    size_t fragPct = 0;
+    if (slabBytes > 0) {
+        fragPct = 100 - ((epstats.slabUsedBytes * 100) / slabBytes);
+    }
+    add_casted_stat("ep_slab_fragmentation", fragPct, add_stat, cookie);
+
     return ENGINE_SUCCESS;
 }
 
@@ -1905,7 +2260,7 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
 
         bool visitBucket(RCPtr<VBucket> vb) {
             uint16_t vbid = vb->getId();
-            char buf[16];
+            char buf[32];
             snprintf(buf, sizeof(buf), "vb_%d:state", vbid);
             add_casted_stat(buf, VBucket::toString(vb->getState()), add_stat, cookie);
 
@@ -1924,6 +2279,12 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
             add_casted_stat(buf, vb->ht.getNumItems(), add_stat, cookie);
             snprintf(buf, sizeof(buf), "vb_%d:counted", vbid);
             add_casted_stat(buf, depthVisitor.size, add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:resized", vbid);
+            add_casted_stat(buf, vb->ht.getNumResizes(), add_stat, cookie);
+            snprintf(buf, sizeof(buf), "vb_%d:load_factor", vbid);
+            std::stringstream lf;
+            lf << vb->ht.getLoadFactor();
+            add_casted_stat(buf, lf.str().c_str(), add_stat, cookie);
 
             return false;
         }
@@ -1939,6 +2300,127 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashStats(const void *cookie,
     return ENGINE_SUCCESS;
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doHashDepthStats(const void *cookie,
+                                                               ADD_STAT add_stat) {
+
+    class DepthHistogramVisitor : public HashTableDepthVisitor {
+    public:
+        DepthHistogramVisitor(Histogram<int> &h, Histogram<int> &t)
+            : histo(h), total(t) {}
+
+        void visit(int bucket, int depth) {
+            (void)bucket;
+            histo.add(depth);
+            total.add(depth);
+        }
+
+    private:
+        Histogram<int> &histo;
+        Histogram<int> &total;
+    };
+
+    class StatVBucketVisitor : public VBucketVisitor {
+    public:
+        StatVBucketVisitor(const void *c, ADD_STAT a,
+                           std::vector<int> &b, Histogram<int> &t)
+            : cookie(c), add_stat(a), bins(b), total(t) {}
+
+        bool visitBucket(RCPtr<VBucket> vb) {
+            FixedInputGenerator<int> gen(bins);
+            Histogram<int> histo(gen, bins.size() - 1);
+            DepthHistogramVisitor dv(histo, total);
+            vb->ht.visitDepth(dv);
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "vb_%d:depth", vb->getId());
+            add_casted_stat(buf, histo, add_stat, cookie);
+            return false;
+        }
+
+    private:
+        const void *cookie;
+        ADD_STAT add_stat;
+        std::vector<int> &bins;
+        Histogram<int> &total;
+    };
+
+    int starts[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 24, 32, 64, 128 };
+    std::vector<int> bins(starts, starts + sizeof(starts) / sizeof(starts[0]));
+    FixedInputGenerator<int> gen(bins);
+    Histogram<int> total(gen, bins.size() - 1);
+
+    StatVBucketVisitor svbv(cookie, add_stat, bins, total);
+    epstore->visit(svbv);
+    add_casted_stat("depth", total, add_stat, cookie);
+
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentEngine::doLockStats(const void *cookie,
+                                                          ADD_STAT add_stat) {
+
+    // Stripe i covers the same buckets in every vbucket, so the
+    // counters are summed up per stripe across all of them.
+    class LockStatVBucketVisitor : public VBucketVisitor {
+    public:
+        LockStatVBucketVisitor(std::vector<mutex_stats> &s) : stripes(s) {}
+
+        bool visitBucket(RCPtr<VBucket> vb) {
+            size_t n = vb->ht.getNumLocks();
+            if (stripes.size() < n) {
+                stripes.resize(n);
+            }
+            for (size_t i = 0; i < n; ++i) {
+                mutex_stats ms = vb->ht.getLockStats(static_cast<int>(i));
+                stripes[i].acquisitions += ms.acquisitions;
+                stripes[i].contended += ms.contended;
+                stripes[i].blocked += ms.blocked;
+                stripes[i].waitTime += ms.waitTime;
+                stripes[i].maxWait = std::max(stripes[i].maxWait, ms.maxWait);
+            }
+            return false;
+        }
+
+    private:
+        std::vector<mutex_stats> &stripes;
+    };
+
+    std::vector<mutex_stats> stripes;
+    LockStatVBucketVisitor lsv(stripes);
+    epstore->visit(lsv);
+
+    add_casted_stat("lock_stats", HashTable::getLockStats() ? "on" : "off",
+                    add_stat, cookie);
+    add_casted_stat("lock_spins", HashTable::getLockSpins(), add_stat, cookie);
+    add_casted_stat("ht_locks", stripes.size(), add_stat, cookie);
+
+    mutex_stats total;
+    char buf[64];
+    for (size_t i = 0; i < stripes.size(); ++i) {
+        const mutex_stats &ms = stripes[i];
+        total.acquisitions += ms.acquisitions;
+        total.contended += ms.contended;
+        total.blocked += ms.blocked;
+        total.waitTime += ms.waitTime;
+        total.maxWait = std::max(total.maxWait, ms.maxWait);
+
+        snprintf(buf, sizeof(buf), "stripe_%d:acquisitions", static_cast<int>(i));
+        add_casted_stat(buf, ms.acquisitions, add_stat, cookie);
+        snprintf(buf, sizeof(buf), "stripe_%d:contended", static_cast<int>(i));
+        add_casted_stat(buf, ms.contended, add_stat, cookie);
+        snprintf(buf, sizeof(buf), "stripe_%d:wait_time", static_cast<int>(i));
+        add_casted_stat(buf, ms.waitTime / 1000, add_stat, cookie);
+    }
+
+    add_casted_stat("acquisitions", total.acquisitions, add_stat, cookie);
+    add_casted_stat("contended", total.contended, add_stat, cookie);
+    add_casted_stat("blocked", total.blocked, add_stat, cookie);
+    add_casted_stat("wait_time", total.waitTime / 1000, add_stat, cookie);
+    add_casted_stat("max_wait", total.maxWait / 1000, add_stat, cookie);
+
+    return ENGINE_SUCCESS;
+}
+
 struct TapStatBuilder {
     TapStatBuilder(const void *c, ADD_STAT as)
         : cookie(c), add_stat(as), tap_queue(0), totalTaps(0) {}
@@ -2215,6 +2697,10 @@ ENGINE_ERROR_CODE EventuallyPersistentEngine::getStats(const void* cookie,
         rv = doTapStats(cookie, add_stat);
     } else if (nkey == 4 && strncmp(stat_key, "hash", 3) == 0) {
         rv = doHashStats(cookie, add_stat);
+    } else if (nkey == 10 && strncmp(stat_key, "hash_depth", 10) == 0) {
+        rv = doHashDepthStats(cookie, add_stat);
+    } else if (nkey == 5 && strncmp(stat_key, "locks", 5) == 0) {
+        rv = doLockStats(cookie, add_stat);
     } else if (nkey == 7 && strncmp(stat_key, "vbucket", 7) == 0) {
         rv = doVBucketStats(cookie, add_stat);
     } else if (nkey == 7 && strncmp(stat_key, "timings", 7) == 0) {
@@ -6,9 +6,11 @@
 #include "ep.hh"
 #include "flusher.hh"
 #include "sqlite-kvstore.hh"
+#include "memory-kvstore.hh"
 #include "ep_extension.h"
 #include "dispatcher.hh"
 #include "item_pager.hh"
+#include "htresizer.hh"
 
 #include <cstdio>
 #include <map>
@@ -34,6 +36,18 @@
 #define DEFAULT_QUEUE_AGE_CAP 900
 #endif
 
+#ifndef DEFAULT_BFILTER_KEY_COUNT
+#define DEFAULT_BFILTER_KEY_COUNT 100000
+#endif
+
+#ifndef DEFAULT_VISITOR_THREADS
+#define DEFAULT_VISITOR_THREADS 4
+#endif
+
+#ifndef DEFAULT_TXN_COMMIT_TARGET
+#define DEFAULT_TXN_COMMIT_TARGET 1000
+#endif
+
 extern "C" {
     EXPORT_FUNCTION
     ENGINE_ERROR_CODE create_instance(uint64_t interface,
@@ -66,12 +80,19 @@ private:
     const void *cookie;
 };
 
-class VBucketCountVisitor : public VBucketVisitor {
+class VBucketCountVisitor : public ParallelVBucketVisitor {
 public:
     VBucketCountVisitor() : requestedState(0), total(0), desired_state(active) { }
 
     bool visitBucket(RCPtr<VBucket> vb);
 
+    ParallelVBucketVisitor *fork(size_t parts) {
+        (void)parts;
+        return new VBucketCountVisitor();
+    }
+
+    void join(ParallelVBucketVisitor &part);
+
     void visit(StoredValue* v) {
         (void)v;
         assert(false); // this does not happen
@@ -92,7 +113,30 @@ private:
  */
 enum db_strategy {
     single_db,           //!< single database strategy
-    multi_db             //!< multi-database strategy
+    multi_db,            //!< multi-database strategy
+    sharded_db           //!< multi-database, a connection and flusher per shard
+};
+
+/**
+ * Get the name a database strategy is configured by.
+ */
+inline const char *getStrategyName(enum db_strategy s) {
+    switch (s) {
+    case multi_db:
+        return "multiDB";
+    case sharded_db:
+        return "shardedDB";
+    default:
+        return "singleDB";
+    }
+}
+
+/**
+ * Where items are persisted.
+ */
+enum kvstore_type {
+    sqlite_kvstore,      //!< SQLite databases laid out by the db strategy
+    memory_kvstore       //!< in memory only (for benchmarking)
 };
 
 /**
@@ -366,6 +410,10 @@ public:
         epstore->setTxnSize(to);
     }
 
+    void setCommitTarget(int to) {
+        epstore->setCommitTarget(to);
+    }
+
     void setBGFetchDelay(uint32_t to) {
         epstore->setBGFetchDelay(to);
     }
@@ -386,7 +434,7 @@ public:
 
     ~EventuallyPersistentEngine() {
         delete epstore;
-        delete sqliteDb;
+        delete kvstore;
         delete sqliteStrategy;
         delete getlExtension;
     }
@@ -413,6 +461,60 @@ public:
         return vb_del_chunk_size;
     }
 
+    bool isFullEviction() const {
+        return fullEviction;
+    }
+
+    size_t getBfilterKeyCount() const {
+        return bfilterKeyCount;
+    }
+
+    bool isMetadataWarmup() const {
+        return metadataWarmup;
+    }
+
+    size_t getVisitorThreads() const {
+        return visitorThreads;
+    }
+
+    /**
+     * Get the paths of all files the database is kept in.
+     */
+    std::vector<std::string> getDbFiles() const {
+        std::vector<std::string> rv;
+        rv.push_back(dbname);
+        if (dbStrategy != single_db) {
+            for (size_t i = 0; i < dbShards; ++i) {
+                std::stringstream ss;
+                ss << dbname << "-" << i << ".sqlite";
+                rv.push_back(ss.str());
+            }
+        }
+        return rv;
+    }
+
+    /**
+     * Get the file to keep the hash table snapshot in (NULL for none).
+     *
+     * A database that doesn't outlive the engine has no use for one.
+     */
+    const char *getSnapshotFile() const {
+        if (kvstoreType == memory_kvstore || strcmp(dbname, ":memory:") == 0) {
+            return NULL;
+        }
+        return snapshotFile;
+    }
+
+    /**
+     * Get the file to keep the access log in (NULL for none).
+     */
+    const char *getAccessLogPath() const {
+        if (kvstoreType == memory_kvstore || strcmp(dbname, ":memory:") == 0) {
+            return NULL;
+        }
+        return alogPath;
+    }
+
     SERVER_HANDLE_V1* getServerApi() { return serverApi; }
 
 private:
@@ -512,6 +614,8 @@ private:
     ENGINE_ERROR_CODE doEngineStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doVBucketStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doHashStats(const void *cookie, ADD_STAT add_stat);
+    ENGINE_ERROR_CODE doHashDepthStats(const void *cookie, ADD_STAT add_stat);
+    ENGINE_ERROR_CODE doLockStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doTapStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doTimingStats(const void *cookie, ADD_STAT add_stat);
     ENGINE_ERROR_CODE doDispatcherStats(const void *cookie, ADD_STAT add_stat);
@@ -557,14 +661,18 @@ private:
     const char *dbname;
     const char *initFile;
     const char *postInitFile;
+    const char *snapshotFile;
+    const char *alogPath;
     enum db_strategy dbStrategy;
+    enum kvstore_type kvstoreType;
+    hash_function_t dbShardHash;
     bool warmup;
     bool wait_for_warmup;
     bool fail_on_partial_warmup;
     bool startVb0;
     SERVER_HANDLE_V1 *serverApi;
     SqliteStrategy *sqliteStrategy;
-    StrategicSqlite3 *sqliteDb;
+    KVStore *kvstore;
     EventuallyPersistentStore *epstore;
     std::map<const void*, Item*> lookups;
     Mutex lookupMutex;
@@ -594,8 +702,14 @@ private:
     size_t queueAgeCap;
     size_t itemExpiryWindow;
     size_t expiryPagerSleeptime;
+    size_t alogSleeptime;
     size_t dbShards;
     size_t vb_del_chunk_size;
+    bool fullEviction;
+    size_t bfilterKeyCount;
+    bool metadataWarmup;
+    pager_policy pagerPolicy;
+    size_t visitorThreads;
     EPStats stats;
 };
 
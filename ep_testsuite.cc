@@ -129,6 +129,8 @@ static void rmdb(void) {
     unlink("/tmp/test.db-1.sqlite");
     unlink("/tmp/test.db-2.sqlite");
     unlink("/tmp/test.db-3.sqlite");
+    unlink("/tmp/test.snapshot");
+    unlink("/tmp/test.alog");
 }
 
 static bool teardown(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1) {
@@ -2841,6 +2843,175 @@ static enum test_result test_max_size_settings(ENGINE_HANDLE *h,
     return SUCCESS;
 }
 
+static enum test_result test_queue_throttle(ENGINE_HANDLE *h,
+                                           ENGINE_HANDLE_V1 *h1) {
+    check(get_int_stat(h, h1, "ep_throttle_queue_len") == 2,
+          "Incorrect initial throttle queue length.");
+
+    // Nothing gets old enough to flush, so every set stays queued
+    // until they all get turned away at twice the threshold.
+    item *i = NULL;
+    int stored(0);
+    ENGINE_ERROR_CODE last(ENGINE_SUCCESS);
+    for (int j = 0; j < 100; ++j) {
+        char key[8];
+        snprintf(key, sizeof(key), "key%d", j);
+        last = store(h, h1, NULL, OPERATION_SET, key, "somevalue", &i);
+        if (last == ENGINE_SUCCESS) {
+            ++stored;
+        } else {
+            check(last == ENGINE_TMPFAIL, "Expected a temporary failure.");
+        }
+    }
+    check(stored == 4, "Expected sets to be throttled at twice the threshold.");
+    check(last == ENGINE_TMPFAIL, "Expected the last set to be throttled.");
+    check(get_int_stat(h, h1, "ep_queue_throttled") == 100 - stored,
+          "Expected throttled sets to be counted.");
+    check(h1->remove(h, NULL, "key0", 4, 0, 0) == ENGINE_TMPFAIL,
+          "Expected the delete to be throttled.");
+
+    set_flush_param(h, h1, "throttle_queue_len", "0");
+    check(get_int_stat(h, h1, "ep_throttle_queue_len") == 0,
+          "Incorrect new throttle queue length.");
+    check(store(h, h1, NULL, OPERATION_SET, "key", "somevalue", &i) == ENGINE_SUCCESS,
+          "Failed set without throttling.");
+
+    return SUCCESS;
+}
+
+static enum test_result test_ht_snapshot(ENGINE_HANDLE *h,
+                                        ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "key1", "value1");
+    wait_for_persisted_value(h, h1, "key2", "value2");
+    wait_for_persisted_value(h, h1, "key3", "value3");
+    check(h1->remove(h, NULL, "key3", 4, 0, 0) == ENGINE_SUCCESS,
+          "Failed remove with value.");
+    wait_for_flusher_to_settle(h, h1);
+    evict_key(h, h1, "key2", 0, "Ejected.");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+
+    get_int_stat(h, h1, "ep_warmed_up");
+    check(vals["ep_warmup_snapshot"] == "loaded",
+          "Expected to warm up from the snapshot.");
+    check(get_int_stat(h, h1, "ep_warmed_up") == 2,
+          "Expected two items warmed up.");
+    check(get_int_stat(h, h1, "ep_num_non_resident") == 1,
+          "Expected the ejected item to stay non-resident.");
+    check_key_value(h, h1, "key1", "value1", 6);
+    check_key_value(h, h1, "key2", "value2", 6);
+    check(ENGINE_KEY_ENOENT == verify_key(h, h1, "key3"), "Expected missing key");
+
+    // A snapshot is only good once; without a clean shutdown the
+    // next warmup is from the database.
+    check(access("/tmp/test.snapshot", F_OK) != 0,
+          "Expected the snapshot to be gone after warmup.");
+
+    return SUCCESS;
+}
+
+static enum test_result test_warmup_shards(ENGINE_HANDLE *h,
+                                          ENGINE_HANDLE_V1 *h1) {
+    for (int j = 0; j < 20; ++j) {
+        std::stringstream ss;
+        ss << "key" << j;
+        wait_for_persisted_value(h, h1, ss.str().c_str(), "somevalue");
+    }
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+
+    check(get_int_stat(h, h1, "ep_warmed_up") == 20,
+          "Expected twenty items warmed up.");
+    int loaded(0);
+    for (int i = 0; i < 4; ++i) {
+        std::stringstream ss;
+        ss << "ep_warmup_shard_" << i << "_";
+        check(vals[ss.str() + "state"] == "complete",
+              "Expected every shard to be loaded.");
+        loaded += atoi(vals[ss.str() + "loaded"].c_str());
+    }
+    check(loaded == 20, "Expected the shards to add up to all items.");
+    check(vals.find("ep_warmup_shard_4_state") == vals.end(),
+          "Expected only four shards.");
+    check_key_value(h, h1, "key7", "somevalue", 9);
+
+    return SUCCESS;
+}
+
+static enum test_result test_metadata_warmup(ENGINE_HANDLE *h,
+                                            ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "key1", "value1");
+    wait_for_persisted_value(h, h1, "key2", "value2");
+    wait_for_persisted_value(h, h1, "key3", "value3");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+
+    check(get_int_stat(h, h1, "ep_warmed_up") == 3,
+          "Expected three items warmed up.");
+    check(vals["ep_metadata_warmup"] == "true",
+          "Expected a metadata warmup.");
+
+    // The values come in after warmup.
+    useconds_t sleepTime = 128;
+    int loaded = get_int_stat(h, h1, "ep_warmup_values");
+    while (vals["ep_warmup_values_state"] != "complete") {
+        decayingSleep(&sleepTime);
+        loaded = get_int_stat(h, h1, "ep_warmup_values");
+    }
+    check(loaded == 3, "Expected three values paged in.");
+    check(get_int_stat(h, h1, "ep_num_non_resident") == 0,
+          "Expected all values to be resident.");
+    check_key_value(h, h1, "key1", "value1", 6);
+    check_key_value(h, h1, "key2", "value2", 6);
+    check_key_value(h, h1, "key3", "value3", 6);
+
+    return SUCCESS;
+}
+
+static enum test_result test_access_log_warmup(ENGINE_HANDLE *h,
+                                              ENGINE_HANDLE_V1 *h1) {
+    wait_for_persisted_value(h, h1, "key1", "value1");
+    wait_for_persisted_value(h, h1, "key2", "value2");
+    wait_for_persisted_value(h, h1, "key3", "value3");
+
+    // Wait for a whole run after the items were stored.
+    useconds_t sleepTime = 128;
+    int runs = get_int_stat(h, h1, "ep_num_alog_runs");
+    while (get_int_stat(h, h1, "ep_num_alog_runs") < runs + 2) {
+        decayingSleep(&sleepTime);
+    }
+    check(get_int_stat(h, h1, "ep_alog_keys") == 3,
+          "Expected three keys in the access log.");
+
+    testHarness.reload_engine(&h, &h1,
+                              testHarness.engine_path,
+                              testHarness.default_engine_cfg,
+                              true);
+
+    check(get_int_stat(h, h1, "ep_warmed_up") == 3,
+          "Expected three items warmed up.");
+    check(get_int_stat(h, h1, "ep_warmup_alog_keys") == 3,
+          "Expected three keys read from the access log.");
+    check(get_int_stat(h, h1, "ep_warmup_alog_loaded") == 3,
+          "Expected the values of the access log paged in.");
+    check(get_int_stat(h, h1, "ep_num_non_resident") == 0,
+          "Expected all values to be resident.");
+    check_key_value(h, h1, "key1", "value1", 6);
+    check_key_value(h, h1, "key2", "value2", 6);
+    check_key_value(h, h1, "key3", "value3", 6);
+
+    return SUCCESS;
+}
+
 static enum test_result test_validate_engine_handle(ENGINE_HANDLE *h, ENGINE_HANDLE_V1 *h1)
 {
     (void)h;
@@ -2866,6 +3037,17 @@ engine_test_t* get_tests(void) {
          "max_size=4096;ht_locks=1;ht_size=3"},
         {"test max_size changes", test_max_size_settings, NULL, teardown,
          "max_size=1000;ht_locks=1;ht_size=3"},
+        {"test queue throttle", test_queue_throttle, NULL, teardown,
+         "throttle_queue_len=2;min_data_age=600"},
+        {"test hash table snapshot", test_ht_snapshot, NULL, teardown,
+         "ht_snapshot=/tmp/test.snapshot"},
+        {"test warmup shards", test_warmup_shards, NULL, teardown, NULL},
+        {"test metadata warmup", test_metadata_warmup, NULL, teardown,
+         "metadata_warmup=true"},
+        {"test warmup shards (sharded db)", test_warmup_shards, NULL, teardown,
+         "db_strategy=shardedDB"},
+        {"test access log warmup", test_access_log_warmup, NULL, teardown,
+         "alog_path=/tmp/test.alog;alog_sleep=1"},
         {"test whitespace dbname", test_whitespace_db, NULL, teardown,
          "dbname=" WHITESPACE_DB ";ht_locks=1;ht_size=3"},
         {"test db shards", test_db_shards, NULL, teardown, "db_shards=5"},
@@ -2873,6 +3055,13 @@ engine_test_t* get_tests(void) {
          NULL, teardown, "db_strategy=singleDB"},
         {"test single in-memory db strategy", test_single_db_strategy,
          NULL, teardown, "db_strategy=singleDB;dbname=:memory:"},
+        {"set+get hit (memory kvstore)", test_set_get_hit,
+         NULL, teardown, "kvstore=memory"},
+        {"set/delete (memory kvstore)", test_set_delete,
+         NULL, teardown, "kvstore=memory"},
+        {"set/delete (sharded memory kvstore)", test_set_delete, NULL, teardown,
+         "kvstore=memory;db_strategy=shardedDB;db_shards=4"},
+        {"flush (memory kvstore)", test_flush, NULL, teardown, "kvstore=memory"},
         {"get miss", test_get_miss, NULL, teardown, NULL},
         {"set", test_set, NULL, teardown, NULL},
         {"concurrent set", test_conc_set, NULL, teardown, NULL},
@@ -0,0 +1,210 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <deque>
+#include <vector>
+
+#include "epoch.hh"
+
+//! Maximum number of threads that may read optimistically at once.
+#define EPOCH_MAX_THREADS 256
+//! Number of retirements between attempts to reclaim memory.
+#define EPOCH_RECLAIM_BATCH 64
+
+/**
+ * Something retired, waiting for all readers that may see it to leave.
+ */
+struct epoch_retired {
+    uint64_t        epoch;      //!< Global epoch at the time of retirement.
+    value_t         value;      //!< A value reference to drop, if any.
+    epoch_reclaim_t fn;         //!< Function freeing obj, if any.
+    void           *obj;        //!< The object to free.
+    void           *ctx;        //!< Argument passed along to fn.
+};
+
+/**
+ * Per-thread epoch state.
+ */
+struct epoch_record {
+    epoch_record() : active(0), inUse(0), sinceReclaim(0) {}
+
+    //! Epoch this thread is reading in, 0 if it isn't reading.
+    volatile uint64_t          active;
+    // Keep the active flags of different threads off each other's
+    // cache lines.
+    char                       padding[56];
+    volatile int               inUse;
+    SpinLock                   lock;
+    //! Things retired by this thread (oldest first).
+    std::deque<epoch_retired>  limbo;
+    size_t                     sinceReclaim;
+};
+
+static void releaseRecord(void *arg);
+
+static epoch_record records[EPOCH_MAX_THREADS];
+//! Holds what threads without a record (or exited threads) retired.
+static epoch_record overflow;
+//! Records ever handed out (all of them live below this index).
+static Atomic<size_t> numRecords;
+//! The current epoch; 0 is reserved for "not reading".
+static Atomic<uint64_t> globalEpoch(1);
+static Atomic<size_t> numRetired;
+static ThreadLocal<epoch_record*> myRecord(releaseRecord);
+
+/**
+ * Get the calling thread's record, claiming one if needed.
+ *
+ * @return the record, or NULL if all of them are taken
+ */
+static epoch_record *record() {
+    epoch_record *r = myRecord.get();
+    if (r == NULL) {
+        for (size_t i = 0; i < EPOCH_MAX_THREADS; ++i) {
+            if (records[i].inUse == 0
+                && ep_sync_bool_compare_and_swap(&records[i].inUse, 0, 1)) {
+                r = &records[i];
+                numRecords.setIfBigger(i + 1);
+                myRecord = r;
+                break;
+            }
+        }
+    }
+    return r;
+}
+
+/**
+ * Give back the record of an exiting thread.
+ *
+ * Whatever it still has in limbo is left to the overflow record.
+ */
+static void releaseRecord(void *arg) {
+    epoch_record *r = static_cast<epoch_record*>(arg);
+    SpinLockHolder lh(&r->lock);
+    SpinLockHolder olh(&overflow.lock);
+    overflow.limbo.insert(overflow.limbo.end(), r->limbo.begin(), r->limbo.end());
+    olh.unlock();
+    r->limbo.clear();
+    r->sinceReclaim = 0;
+    r->active = 0;
+    ep_sync_synchronize();
+    r->inUse = 0;
+}
+
+/**
+ * Move the global epoch forward if every reader has seen it.
+ */
+static bool tryAdvance() {
+    uint64_t g = globalEpoch.get();
+    size_t n = numRecords.get();
+    ep_sync_synchronize();
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t a = records[i].active;
+        if (a != 0 && a != g) {
+            return false;
+        }
+    }
+    return globalEpoch.cas(g, g + 1);
+}
+
+/**
+ * Free everything in the given record that no reader can see anymore.
+ */
+static void reclaim(epoch_record *r) {
+    std::vector<epoch_retired> ready;
+    uint64_t g = globalEpoch.get();
+    SpinLockHolder lh(&r->lock);
+    while (!r->limbo.empty() && r->limbo.front().epoch + 2 <= g) {
+        ready.push_back(r->limbo.front());
+        r->limbo.pop_front();
+    }
+    r->sinceReclaim = 0;
+    lh.unlock();
+
+    // The callbacks may take other locks, so run them without ours.
+    std::vector<epoch_retired>::iterator it;
+    for (it = ready.begin(); it != ready.end(); ++it) {
+        if (it->fn) {
+            it->fn(it->obj, it->ctx);
+        }
+    }
+    numRetired.decr(ready.size());
+}
+
+static void retire(epoch_retired &e) {
+    // Whatever was unlinked before this point must not be seen by
+    // anyone entering in the epoch we're about to read.
+    ep_sync_synchronize();
+    e.epoch = globalEpoch.get();
+    ++numRetired;
+
+    epoch_record *r = record();
+    if (r == NULL) {
+        r = &overflow;
+    }
+    SpinLockHolder lh(&r->lock);
+    r->limbo.push_back(e);
+    bool due = ++r->sinceReclaim >= EPOCH_RECLAIM_BATCH;
+    lh.unlock();
+
+    if (due) {
+        tryAdvance();
+        reclaim(r);
+        if (r != &overflow) {
+            reclaim(&overflow);
+        }
+    }
+}
+
+bool Epoch::enter() {
+    epoch_record *r = record();
+    if (r == NULL) {
+        return false;
+    }
+    r->active = globalEpoch.get();
+    ep_sync_synchronize();
+    return true;
+}
+
+void Epoch::exit() {
+    epoch_record *r = myRecord.get();
+    assert(r);
+    ep_sync_synchronize();
+    r->active = 0;
+}
+
+void Epoch::retire(const value_t &v) {
+    if (v) {
+        epoch_retired e;
+        e.value = v;
+        e.fn = NULL;
+        e.obj = e.ctx = NULL;
+        ::retire(e);
+    }
+}
+
+void Epoch::retire(epoch_reclaim_t fn, void *obj, void *ctx) {
+    epoch_retired e;
+    e.fn = fn;
+    e.obj = obj;
+    e.ctx = ctx;
+    ::retire(e);
+}
+
+void Epoch::synchronize() {
+    uint64_t target = globalEpoch.get() + 2;
+    while (globalEpoch.get() < target) {
+        if (!tryAdvance()) {
+            sched_yield();
+        }
+    }
+    size_t n = numRecords.get();
+    for (size_t i = 0; i < n; ++i) {
+        reclaim(&records[i]);
+    }
+    reclaim(&overflow);
+}
+
+size_t Epoch::getNumRetired() {
+    return numRetired.get();
+}
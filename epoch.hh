@@ -0,0 +1,92 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EPOCH_HH
+#define EPOCH_HH 1
+
+#include "common.hh"
+#include "atomic.hh"
+#include "item.hh"
+
+/**
+ * Function freeing a retired object.
+ */
+typedef void (*epoch_reclaim_t)(void *obj, void *ctx);
+
+/**
+ * Epoch based reclamation for lock-free readers.
+ *
+ * Readers bracket their unlocked accesses with enter() and exit()
+ * (see EpochGuard).  Anything a reader could still be looking at is
+ * handed to retire() instead of being freed, and is only freed once
+ * every reader that was active at the time has left.
+ */
+class Epoch {
+public:
+
+    /**
+     * Start an unlocked read on the calling thread.
+     *
+     * @return false if the thread can't read optimistically (too many
+     *         threads), in which case it must lock instead
+     */
+    static bool enter();
+
+    /**
+     * End an unlocked read started by a successful enter().
+     */
+    static void exit();
+
+    /**
+     * Drop a value reference once no reader can see it anymore.
+     */
+    static void retire(const value_t &v);
+
+    /**
+     * Free an object once no reader can see it anymore.
+     *
+     * @param fn function freeing the object
+     * @param obj the object
+     * @param ctx extra argument passed to fn
+     */
+    static void retire(epoch_reclaim_t fn, void *obj, void *ctx);
+
+    /**
+     * Wait for all current readers to finish and free everything
+     * retired so far.
+     *
+     * Must not be called from within an unlocked read.
+     */
+    static void synchronize();
+
+    /**
+     * Get the number of retired objects not freed yet.
+     */
+    static size_t getNumRetired();
+};
+
+/**
+ * RAII holder of an unlocked read section.
+ */
+class EpochGuard {
+public:
+    EpochGuard() : isEntered(Epoch::enter()) {}
+
+    ~EpochGuard() {
+        if (isEntered) {
+            Epoch::exit();
+        }
+    }
+
+    /**
+     * True if the read section was entered.
+     */
+    bool entered() const {
+        return isEntered;
+    }
+
+private:
+    bool isEntered;
+
+    DISALLOW_COPY_AND_ASSIGN(EpochGuard);
+};
+
+#endif /* EPOCH_HH */
@@ -0,0 +1,518 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Replay a trace of gets and sets against the hash tables and the item
+ * pager's visitor with each pager policy, to compare eviction changes
+ * offline.
+ *
+ * Time is taken from the trace rather than the clock, and the disk is
+ * a map remembering the size of every value stored: a stored item is
+ * persisted right away, and reading a value that isn't in memory
+ * counts as a background fetch.
+ *
+ * A trace has one operation per line:
+ *
+ *   <seconds> get <key>
+ *   <seconds> set <key> <bytes> [<ttl>]
+ *   <seconds> del <key>
+ *
+ * where seconds count from the start of the trace.  Without a trace,
+ * a Zipf distributed one is made up (see usage()).
+ *
+ * Each policy runs in its own child process, as in hashtable_bench.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "item.hh"
+#include "stored-value.hh"
+#include "stats.hh"
+#include "vbucket.hh"
+#include "epoch.hh"
+#include "hash.hh"
+#include "item_pager.hh"
+#include "paging_visitor.hh"
+
+//! The time the replayed trace started at.
+static const time_t simEpoch = 1000000000;
+//! The current time of the replay (seconds since simEpoch).
+static rel_time_t simNow = 0;
+
+extern "C" {
+    static rel_time_t sim_current_time(void) {
+        return simNow;
+    }
+
+    static time_t sim_abs_time(rel_time_t offset) {
+        return simEpoch + offset;
+    }
+
+    rel_time_t (*ep_current_time)() = sim_current_time;
+    time_t (*ep_abs_time)(rel_time_t) = sim_abs_time;
+
+    time_t ep_real_time() {
+        return ep_abs_time(ep_current_time());
+    }
+
+    static const char* sim_get_logger_name(void) {
+        return "eviction_sim";
+    }
+
+    static void sim_get_logger_log(EXTENSION_LOG_LEVEL severity,
+                                   const void* client_cookie,
+                                   const char *fmt, ...) {
+        (void)severity;
+        (void)client_cookie;
+        (void)fmt;
+    }
+}
+
+EXTENSION_LOGGER_DESCRIPTOR* getLogger() {
+    static EXTENSION_LOGGER_DESCRIPTOR logger;
+    logger.get_name = sim_get_logger_name;
+    logger.log = sim_get_logger_log;
+    return &logger;
+}
+
+enum sim_op_type { sim_get, sim_set, sim_del };
+
+/**
+ * An operation of a trace.
+ */
+struct sim_op {
+    rel_time_t  when;
+    sim_op_type type;
+    std::string key;
+    size_t      nbytes;
+    time_t      ttl;
+};
+
+/**
+ * How to run the replay.
+ */
+struct sim_config {
+    size_t quota;
+    size_t vbuckets;
+    bool   fullEviction;
+    bool   wakeups;
+    size_t pagerInterval;
+};
+
+/**
+ * What came out of a replay.
+ */
+struct sim_results {
+    size_t gets;
+    size_t hits;
+    size_t misses;
+    size_t bgFetches;
+    size_t tmpOOMs;
+    size_t pagerRuns;
+    size_t evicted;
+    hrtime_t pagerCPU;
+};
+
+/**
+ * Stands in for the item pager's task being woken up.
+ */
+class SimPressure : public MemoryPressureListener {
+public:
+    SimPressure() : pending(false) {}
+    void memoryPressure() { pending = true; }
+    bool pending;
+};
+
+static hrtime_t cpuTime() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return static_cast<hrtime_t>(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000
+        + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/**
+ * The replay of a trace with one pager policy.
+ */
+class Simulation {
+public:
+
+    Simulation(const sim_config &c, pager_policy p) :
+        config(c), policy(p), hand(0), nextId(0), nextCheck(0) {
+        memset(&results, 0, sizeof(results));
+        stats.maxDataSize = config.quota;
+        stats.mem_low_wat = static_cast<size_t>(config.quota * 0.6);
+        stats.mem_high_wat = static_cast<size_t>(config.quota * 0.75);
+        if (config.wakeups) {
+            stats.memoryListener = &pressure;
+        }
+        for (size_t i = 0; i < config.vbuckets; ++i) {
+            vbuckets.push_back(RCPtr<VBucket>(new VBucket(static_cast<int>(i),
+                                                          active, stats)));
+        }
+    }
+
+    void run(const std::vector<sim_op> &trace) {
+        std::vector<sim_op>::const_iterator it;
+        for (it = trace.begin(); it != trace.end(); ++it) {
+            simNow = it->when;
+            switch (it->type) {
+            case sim_get:
+                get(it->key);
+                break;
+            case sim_set:
+                set(it->key, it->nbytes, it->ttl);
+                break;
+            case sim_del:
+                del(it->key);
+                break;
+            }
+            if (pressure.pending || simNow >= nextCheck) {
+                page();
+            }
+        }
+    }
+
+    void report(std::ostream &out) {
+        out << (policy == clock_pager ? "clock" : "random") << " pager"
+            << (config.fullEviction ? ", full eviction" : "") << std::endl
+            << "  gets: " << results.gets << ", hits: " << results.hits
+            << " (" << percent(results.hits, results.gets) << "%)"
+            << ", misses: " << results.misses << std::endl
+            << "  bg fetches: " << results.bgFetches << std::endl
+            << "  value bytes ejected: " << stats.valueEjectBytes.get()
+            << ", items evicted: " << results.evicted
+            << ", warm skips: " << stats.pagerWarmSkips.get() << std::endl
+            << "  pager runs: " << results.pagerRuns
+            << ", cpu: " << results.pagerCPU / 1000 << "ms" << std::endl
+            << "  tmp oom errors: " << results.tmpOOMs << std::endl;
+    }
+
+private:
+
+    static double percent(size_t n, size_t of) {
+        return of ? 100.0 * static_cast<double>(n) / static_cast<double>(of) : 0.0;
+    }
+
+    RCPtr<VBucket> &vbucketFor(const std::string &key) {
+        return vbuckets[murmur_hash(key.data(), key.length()) % vbuckets.size()];
+    }
+
+    value_t makeValue(size_t nbytes) {
+        return value_t(Blob::New(nbytes, 'x'));
+    }
+
+    void persisted(StoredValue *v) {
+        if (!v->hasId()) {
+            v->setId(++nextId);
+        }
+        v->markClean(NULL);
+    }
+
+    void get(std::string key) {
+        ++results.gets;
+        RCPtr<VBucket> &vb = vbucketFor(key);
+        StoredValue *v = vb->ht.find(key);
+        if (v && v->isExpired(ep_real_time())) {
+            vb->ht.del(key);
+            disk.erase(key);
+            v = NULL;
+        }
+
+        if (v && v->isResident()) {
+            ++results.hits;
+            v->touch();
+        } else if (v) {
+            ++results.bgFetches;
+            v->restoreValue(makeValue(v->valLength()), stats);
+        } else if (disk.find(key) != disk.end()) {
+            // Only full eviction leaves items on disk alone.
+            ++results.bgFetches;
+            Item itm(key, 0, disk[key].second, makeValue(disk[key].first));
+            if (vb->ht.add(itm, false) == ADD_NOMEM) {
+                ++results.tmpOOMs;
+            } else {
+                persisted(vb->ht.find(key));
+            }
+        } else {
+            ++results.misses;
+        }
+    }
+
+    void set(std::string key, size_t nbytes, time_t ttl) {
+        RCPtr<VBucket> &vb = vbucketFor(key);
+        time_t exptime = ttl ? ep_real_time() + ttl : 0;
+        Item itm(key, 0, exptime, makeValue(nbytes));
+        if (vb->ht.set(itm) == NOMEM) {
+            ++results.tmpOOMs;
+            return;
+        }
+        persisted(vb->ht.find(key));
+        disk[key] = std::make_pair(nbytes, exptime);
+    }
+
+    void del(std::string key) {
+        vbucketFor(key)->ht.del(key);
+        disk.erase(key);
+    }
+
+    /**
+     * Do what a run of the item pager would.
+     */
+    void page() {
+        pressure.pending = false;
+        nextCheck = simNow + config.pagerInterval;
+
+        double current = static_cast<double>(StoredValue::getCurrentSize(stats));
+        double upper = static_cast<double>(stats.mem_high_wat);
+        double lower = static_cast<double>(stats.mem_low_wat);
+        if (current <= upper) {
+            return;
+        }
+
+        ++results.pagerRuns;
+        hrtime_t start = cpuTime();
+        double toFree = PagingVisitor::bytesToFree(current, lower, upper);
+        PagingVisitor pv(stats, toFree / current, config.fullEviction);
+        if (policy == clock_pager) {
+            pv.startClock(static_cast<size_t>(toFree), hand);
+        }
+        do {
+            std::vector<RCPtr<VBucket> >::iterator it;
+            for (it = vbuckets.begin(); it != vbuckets.end() && pv.shouldContinue(); ++it) {
+                if (pv.visitBucket(*it)) {
+                    (*it)->ht.visit(pv);
+                }
+            }
+        } while (pv.visitAgain());
+        hand = pv.getHand();
+        stats.pagerWarmSkips.incr(pv.numWarmSkips());
+
+        std::list<std::pair<uint16_t, std::string> > expired, evicted;
+        pv.takeFound(expired, evicted);
+        std::list<std::pair<uint16_t, std::string> >::iterator it;
+        for (it = expired.begin(); it != expired.end(); ++it) {
+            vbuckets[it->first]->ht.del(it->second);
+            disk.erase(it->second);
+        }
+        for (it = evicted.begin(); it != evicted.end(); ++it) {
+            HashTable &ht = vbuckets[it->first]->ht;
+            StoredValue *v = ht.find(it->second);
+            size_t valBytes = v && v->isResident() ? v->valLength() : 0;
+            if (ht.del(it->second)) {
+                stats.valueEjectBytes.incr(valBytes);
+                ++results.evicted;
+            }
+        }
+        Epoch::synchronize();
+        results.pagerCPU += cpuTime() - start;
+    }
+
+    sim_config                     config;
+    pager_policy                   policy;
+    EPStats                        stats;
+    SimPressure                    pressure;
+    std::vector<RCPtr<VBucket> >   vbuckets;
+    //! The size and expiry time of every value on disk.
+    std::map<std::string, std::pair<size_t, time_t> > disk;
+    sim_results                    results;
+    uint16_t                       hand;
+    int64_t                        nextId;
+    rel_time_t                     nextCheck;
+};
+
+static bool readTrace(const char *path, std::vector<sim_op> &trace) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    std::string line;
+    size_t lineno = 0;
+    while (std::getline(in, line)) {
+        ++lineno;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        double when;
+        std::string type;
+        sim_op op;
+        op.nbytes = 0;
+        op.ttl = 0;
+        if (!(fields >> when >> type >> op.key)) {
+            std::cerr << path << ":" << lineno << ": bad line" << std::endl;
+            return false;
+        }
+        op.when = static_cast<rel_time_t>(when);
+        if (type == "get") {
+            op.type = sim_get;
+        } else if (type == "set") {
+            op.type = sim_set;
+            if (!(fields >> op.nbytes)) {
+                std::cerr << path << ":" << lineno << ": set without a size" << std::endl;
+                return false;
+            }
+            fields >> op.ttl;
+        } else if (type == "del") {
+            op.type = sim_del;
+        } else {
+            std::cerr << path << ":" << lineno << ": unknown operation "
+                      << type << std::endl;
+            return false;
+        }
+        trace.push_back(op);
+    }
+    return true;
+}
+
+/**
+ * Make up a trace of keys picked with a Zipf distribution.
+ *
+ * A key is set the first time it's picked; after that it's read with
+ * the given probability and set otherwise.
+ */
+static void makeTrace(size_t nkeys, size_t nops, double skew, double getRatio,
+                      size_t nbytes, size_t rate, std::vector<sim_op> &trace) {
+    std::vector<double> cdf(nkeys);
+    double sum = 0;
+    for (size_t i = 0; i < nkeys; ++i) {
+        sum += 1.0 / pow(static_cast<double>(i + 1), skew);
+        cdf[i] = sum;
+    }
+
+    srand48(42);
+    std::vector<bool> stored(nkeys, false);
+    trace.reserve(nops);
+    for (size_t i = 0; i < nops; ++i) {
+        size_t k = std::lower_bound(cdf.begin(), cdf.end(), drand48() * sum)
+            - cdf.begin();
+        k = std::min(k, nkeys - 1);
+        std::stringstream ss;
+        ss << "key:" << k;
+
+        sim_op op;
+        op.when = static_cast<rel_time_t>(i / rate);
+        op.key = ss.str();
+        op.nbytes = nbytes;
+        op.ttl = 0;
+        op.type = (stored[k] && drand48() < getRatio) ? sim_get : sim_set;
+        stored[k] = true;
+        trace.push_back(op);
+    }
+}
+
+static void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [options] [trace]" << std::endl
+              << "  -m <bytes>     memory quota (64MB)" << std::endl
+              << "  -v <n>         number of vbuckets (16)" << std::endl
+              << "  -p <policy>    only run clock or random" << std::endl
+              << "  -f             full eviction" << std::endl
+              << "  -W             only run the pager every interval" << std::endl
+              << "  -i <seconds>   pager interval (10)" << std::endl
+              << "Without a trace, one is made up:" << std::endl
+              << "  -k <n>         keys (200000)" << std::endl
+              << "  -n <n>         operations (2000000)" << std::endl
+              << "  -z <skew>      Zipf skew (0.99)" << std::endl
+              << "  -g <ratio>     gets per operation (0.9)" << std::endl
+              << "  -s <bytes>     value size (512)" << std::endl
+              << "  -r <n>         operations per second (10000)" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    sim_config config;
+    config.quota = 64 * 1024 * 1024;
+    config.vbuckets = 16;
+    config.fullEviction = false;
+    config.wakeups = true;
+    config.pagerInterval = 10;
+
+    size_t nkeys = 200000, nops = 2000000, nbytes = 512, rate = 10000;
+    double skew = 0.99, getRatio = 0.9;
+    std::vector<pager_policy> policies;
+
+    int c;
+    while ((c = getopt(argc, argv, "m:v:p:fWi:k:n:z:g:s:r:")) != -1) {
+        switch (c) {
+        case 'm': config.quota = strtoul(optarg, NULL, 10); break;
+        case 'v': config.vbuckets = strtoul(optarg, NULL, 10); break;
+        case 'p':
+            if (strcmp(optarg, "clock") == 0) {
+                policies.push_back(clock_pager);
+            } else if (strcmp(optarg, "random") == 0) {
+                policies.push_back(random_pager);
+            } else {
+                usage(argv[0]);
+            }
+            break;
+        case 'f': config.fullEviction = true; break;
+        case 'W': config.wakeups = false; break;
+        case 'i': config.pagerInterval = strtoul(optarg, NULL, 10); break;
+        case 'k': nkeys = strtoul(optarg, NULL, 10); break;
+        case 'n': nops = strtoul(optarg, NULL, 10); break;
+        case 'z': skew = strtod(optarg, NULL); break;
+        case 'g': getRatio = strtod(optarg, NULL); break;
+        case 's': nbytes = strtoul(optarg, NULL, 10); break;
+        case 'r': rate = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (config.vbuckets == 0 || config.vbuckets > 65536 || nkeys == 0 || rate == 0) {
+        usage(argv[0]);
+    }
+    if (policies.empty()) {
+        policies.push_back(clock_pager);
+        policies.push_back(random_pager);
+    }
+
+    std::vector<sim_op> trace;
+    if (optind < argc) {
+        if (!readTrace(argv[optind], trace)) {
+            std::cerr << "Can't read trace " << argv[optind] << std::endl;
+            return 1;
+        }
+    } else {
+        makeTrace(nkeys, nops, skew, getRatio, nbytes, rate, trace);
+    }
+
+    std::set<std::string> keys;
+    std::vector<sim_op>::iterator it;
+    for (it = trace.begin(); it != trace.end(); ++it) {
+        keys.insert(it->key);
+    }
+    HashTable::setDefaultNumBuckets(std::max(keys.size() / config.vbuckets,
+                                             static_cast<size_t>(47)));
+    std::cout << trace.size() << " operations on " << keys.size()
+              << " keys, " << config.quota << " bytes of memory" << std::endl;
+
+    for (size_t i = 0; i < policies.size(); ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            srand(42);
+            Simulation sim(config, policies[i]);
+            sim.run(trace);
+            sim.report(std::cout);
+            exit(0);
+        } else if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
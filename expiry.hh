@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EXPIRY_HH
+#define EXPIRY_HH 1
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "common.hh"
+#include "locks.hh"
+#include "stats.hh"
+
+/**
+ * The hash table buckets (see HashTable::bucket) of a vbucket's items
+ * that are due to expire, ordered by the second they expire at.
+ *
+ * An item is in the index at most once, at the expiry time it was
+ * last stored with; storing it again moves it (or takes it out,
+ * without an expiry time).  The index isn't told about deletes, and
+ * items sharing a bucket number share their entries, so whoever
+ * takes a bucket number from it has to check the items themselves.
+ *
+ * Items evicted from memory altogether can't be found by bucket
+ * number anymore, so the index keeps their keys instead.  These
+ * aren't moved when stored again either; the items read back from
+ * disk have to be checked too.
+ */
+class ExpiryIndex {
+public:
+
+    ExpiryIndex(EPStats &st) : stats(st) {}
+
+    ~ExpiryIndex() {
+        clear();
+    }
+
+    /**
+     * Move an item from the expiry time it was stored with to the one
+     * it's stored with now.
+     *
+     * Items that never expire don't get near the index's lock.  Call
+     * this with the item's bucket locked, so updates of the same item
+     * can't cross.
+     *
+     * @param bucket_num the item's bucket number
+     * @param oldExp the expiry time it had (0 for never, or if it's new)
+     * @param newExp the expiry time it has now (0 for never)
+     */
+    void update(int bucket_num, time_t oldExp, time_t newExp) {
+        if (oldExp == newExp) {
+            return;
+        }
+        LockHolder lh(mutex);
+        if (oldExp != 0) {
+            std::multiset<entry_t>::iterator it =
+                entries.find(entry_t(oldExp, bucket_num));
+            if (it != entries.end()) {
+                entries.erase(it);
+                forget(1, entrySize());
+            }
+        }
+        if (newExp != 0) {
+            entries.insert(entry_t(newExp, bucket_num));
+            ++stats.expiryIndexSize;
+            stats.memOverhead.incr(entrySize());
+        }
+    }
+
+    /**
+     * Remember the key of an item evicted from memory altogether.
+     *
+     * @param key the key
+     * @param exptime when it expires (0 for never)
+     */
+    void addEvicted(const std::string &key, time_t exptime) {
+        if (exptime == 0) {
+            return;
+        }
+        LockHolder lh(mutex);
+        evicted.insert(std::make_pair(exptime, key));
+        ++stats.expiryIndexSize;
+        stats.memOverhead.incr(evictedSize(key));
+    }
+
+    /**
+     * Take out all entries that expired before the given time.
+     *
+     * @param asOf the time to compare expiry times to (as
+     *        StoredValue::isExpired does)
+     * @param out where to add the bucket numbers
+     * @param evictedKeys where to add the keys of evicted items
+     * @return the number of entries taken
+     */
+    size_t takeExpired(time_t asOf, std::vector<int> &out,
+                       std::vector<std::string> &evictedKeys) {
+        LockHolder lh(mutex);
+        std::multiset<entry_t>::iterator it = entries.begin();
+        std::multiset<entry_t>::iterator end = entries.lower_bound(entry_t(asOf, 0));
+        size_t taken(0);
+        for (; it != end; ++it, ++taken) {
+            out.push_back(it->second);
+        }
+        entries.erase(entries.begin(), end);
+        forget(taken, taken * entrySize());
+
+        std::multimap<time_t, std::string>::iterator e = evicted.begin();
+        std::multimap<time_t, std::string>::iterator eend = evicted.lower_bound(asOf);
+        size_t bytes(0), keys(0);
+        for (; e != eend; ++e, ++keys) {
+            bytes += evictedSize(e->second);
+            evictedKeys.push_back(e->second);
+        }
+        evicted.erase(evicted.begin(), eend);
+        forget(keys, bytes);
+        return taken + keys;
+    }
+
+    /**
+     * Forget all entries.
+     */
+    void clear() {
+        LockHolder lh(mutex);
+        size_t n = entries.size();
+        entries.clear();
+        forget(n, n * entrySize());
+
+        size_t bytes(0);
+        std::multimap<time_t, std::string>::iterator e;
+        for (e = evicted.begin(); e != evicted.end(); ++e) {
+            bytes += evictedSize(e->second);
+        }
+        n = evicted.size();
+        evicted.clear();
+        forget(n, bytes);
+    }
+
+    /**
+     * Get the number of entries in the index.
+     */
+    size_t size() {
+        LockHolder lh(mutex);
+        return entries.size() + evicted.size();
+    }
+
+    /**
+     * Get the earliest expiry time in the index (0 if empty).
+     */
+    time_t nextExpiry() {
+        LockHolder lh(mutex);
+        if (evicted.empty()) {
+            return entries.empty() ? 0 : entries.begin()->first;
+        } else if (entries.empty()) {
+            return evicted.begin()->first;
+        }
+        return std::min(entries.begin()->first, evicted.begin()->first);
+    }
+
+private:
+
+    typedef std::pair<time_t, int> entry_t;
+
+    // A tree node: its color and three links, then the entry.
+    static size_t entrySize() {
+        return 4 * sizeof(void*) + sizeof(entry_t);
+    }
+
+    // Likewise, plus the key's own allocation.
+    static size_t evictedSize(const std::string &key) {
+        return 4 * sizeof(void*) + sizeof(std::pair<time_t, std::string>)
+            + 3 * sizeof(size_t) + key.size() + 1;
+    }
+
+    void forget(size_t n, size_t bytes) {
+        stats.expiryIndexSize.decr(n);
+        stats.memOverhead.decr(bytes);
+        assert(stats.memOverhead.get() < GIGANTOR);
+    }
+
+    Mutex                                mutex;
+    std::multiset<entry_t>               entries;
+    std::multimap<time_t, std::string>   evicted;
+    EPStats                             &stats;
+
+    DISALLOW_COPY_AND_ASSIGN(ExpiryIndex);
+};
+
+#endif /* EXPIRY_HH */
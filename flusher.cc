@@ -98,8 +98,17 @@ enum flusher_state Flusher::state() const {
     return _state;
 }
 
-void Flusher::initialize(TaskId tid) {
+void Flusher::initialize(Dispatcher &d, TaskId tid) {
     assert(task.get() == tid.get());
+    if (shard->id != 0) {
+        if (store->stats.warmupComplete.get()) {
+            transition_state(running);
+        } else {
+            d.snooze(tid, DEFAULT_MIN_SLEEP_TIME);
+        }
+        return;
+    }
+
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                      "Initializing flusher; warming up\n");
 
@@ -134,7 +143,7 @@ bool Flusher::step(Dispatcher &d, TaskId tid) {
     try {
         switch (_state) {
         case initializing:
-            initialize(tid);
+            initialize(d, tid);
             return true;
         case paused:
             return false;
@@ -207,7 +216,7 @@ int Flusher::doFlush() {
     // On a fresh entry, flushQueue is null and we need to build one.
     if (!flushQueue) {
         flushRv = store->stats.min_data_age;
-        flushQueue = store->beginFlush();
+        flushQueue = store->beginFlush(*shard);
         if (flushQueue) {
             getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                              "Beginning a write queue flush.\n");
@@ -219,7 +228,7 @@ int Flusher::doFlush() {
     // Now do the every pass thing.
     if (flushQueue) {
         if (!flushQueue->empty()) {
-            int n = store->flushSome(flushQueue, rejectQueue);
+            int n = store->flushSome(*shard, flushQueue, rejectQueue);
             if (_state == pausing) {
                 transition_state(paused);
             }
@@ -227,7 +236,7 @@ int Flusher::doFlush() {
         }
 
         if (flushQueue->empty()) {
-            store->completeFlush(rejectQueue, flushStart);
+            store->completeFlush(*shard, rejectQueue, flushStart);
             getLogger()->log(EXTENSION_LOG_INFO, NULL,
                              "Completed a flush, age of oldest item was %ds\n",
                              flushRv);
@@ -37,13 +37,18 @@ private:
 
 /**
  * Manage persistence of data for an EventuallyPersistentStore.
+ *
+ * Each database shard has a flusher writing out its dirty queue.  The
+ * flusher of the first shard warms up the store; the others wait for
+ * it to finish.
  */
 class Flusher {
 public:
 
-    Flusher(EventuallyPersistentStore *st, Dispatcher *d) :
-        store(st), _state(initializing), dispatcher(d),
+    Flusher(EventuallyPersistentStore *st, DBShard *sh) :
+        store(st), shard(sh), _state(initializing), dispatcher(sh->dispatcher),
         flushRv(0), prevFlushRv(0), minSleepTime(0.1), flushQueue(NULL) {
+        assert(dispatcher);
     }
 
     ~Flusher() {
@@ -60,7 +65,7 @@ public:
     bool pause();
     bool resume();
 
-    void initialize(TaskId);
+    void initialize(Dispatcher&, TaskId);
 
     void start(void);
     void wake(void);
@@ -76,6 +81,7 @@ private:
     double computeMinSleepTime();
 
     EventuallyPersistentStore *store;
+    DBShard *shard;
     volatile enum flusher_state _state;
     Mutex taskMutex;
     TaskId task;
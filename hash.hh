@@ -0,0 +1,84 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HASH_HH
+#define HASH_HH 1
+
+#include <cstring>
+
+#include "common.hh"
+
+/**
+ * A function hashing a key into 32 bits.
+ */
+typedef uint32_t (*hash_function_t)(const char *str, size_t len);
+
+/**
+ * The byte-at-a-time DJB hash that was used everywhere originally.
+ *
+ * This produces exactly the values the original (signed int)
+ * implementation did, which matters where hashes were persisted, such
+ * as the mapping of keys to database shards.
+ */
+inline uint32_t djb_hash(const char *str, size_t len) {
+    uint32_t h = 5381;
+    for (size_t i = 0; i < len; ++i) {
+        h = ((h << 5) + h) ^ static_cast<uint32_t>(static_cast<int>(str[i]));
+    }
+    return h;
+}
+
+/**
+ * MurmurHash64A, consuming the key a word at a time, folded to 32 bits.
+ */
+inline uint32_t murmur_hash(const char *str, size_t len) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x8445d61a4e774912ULL ^ (static_cast<uint64_t>(len) * m);
+
+    const char *end = str + (len & ~static_cast<size_t>(7));
+    for (; str != end; str += 8) {
+        uint64_t k;
+        std::memcpy(&k, str, sizeof(k));
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char *tail = reinterpret_cast<const unsigned char*>(str);
+    size_t rest = len & 7;
+    if (rest > 0) {
+        for (size_t i = rest; i > 0; --i) {
+            h ^= static_cast<uint64_t>(tail[i - 1]) << (8 * (i - 1));
+        }
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+/**
+ * Look up a hash function by name ("djb" or "murmur").
+ *
+ * @return the hash function, or NULL if the name is unknown
+ */
+inline hash_function_t getHashFunction(const char *name) {
+    if (strcmp(name, "djb") == 0) {
+        return djb_hash;
+    } else if (strcmp(name, "murmur") == 0) {
+        return murmur_hash;
+    }
+    return NULL;
+}
+
+/**
+ * Get the name of a hash function returned by getHashFunction.
+ */
+inline const char *getHashFunctionName(hash_function_t f) {
+    return f == djb_hash ? "djb" : (f == murmur_hash ? "murmur" : "unknown");
+}
+
+#endif /* HASH_HH */
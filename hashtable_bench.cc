@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare StoredValue allocation strategies.
+ *
+ * Each strategy runs in its own child process so the resident set
+ * sizes don't pollute each other.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "item.hh"
+#include "stored-value.hh"
+#include "stats.hh"
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+static size_t residentBytes() {
+    size_t rv = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp) {
+        unsigned long size, resident;
+        if (fscanf(fp, "%lu %lu", &size, &resident) == 2) {
+            rv = resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        }
+        fclose(fp);
+    }
+    return rv;
+}
+
+static std::vector<std::string> generateKeys(size_t num) {
+    std::vector<std::string> rv;
+    rv.reserve(num);
+    for (size_t i = 0; i < num; ++i) {
+        char buf[64];
+        // Vary the key length a bit to exercise several size classes.
+        snprintf(buf, sizeof(buf), "%s:%lu", (i % 3) ? "key" : "longer_key_name",
+                 static_cast<unsigned long>(i));
+        rv.push_back(std::string(buf));
+    }
+    return rv;
+}
+
+static void report(const char *name, size_t n, hrtime_t elapsed) {
+    double secs = static_cast<double>(elapsed) / 1000000000.0;
+    std::cout << "  " << name << ": " << n << " ops in " << secs << "s ("
+              << static_cast<size_t>(static_cast<double>(n) / secs) << " ops/s)"
+              << std::endl;
+}
+
+/**
+ * A StoredValue allocation strategy to measure.
+ */
+struct bench_mode {
+    const char *name;
+    bool        slabs;
+    size_t      maxInline;
+};
+
+static void run(const bench_mode &mode, size_t nitems, size_t vallen) {
+    EPStats stats;
+    HashTable::setSlabAllocation(mode.slabs);
+    HashTable::setMaxInlineValue(mode.maxInline);
+    std::vector<std::string> keys = generateKeys(nitems);
+    std::string val(vallen, 'x');
+
+    size_t rssBefore = residentBytes();
+    HashTable h(stats, nitems, 0);
+
+    hrtime_t start = gethrtime();
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        Item itm(*it, 0, 0, val.data(), val.length());
+        h.set(itm);
+    }
+    hrtime_t setTime = gethrtime() - start;
+
+    // Churn: drop every other key and put them back.
+    start = gethrtime();
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        h.del(keys[i]);
+    }
+    for (size_t i = 0; i < keys.size(); i += 2) {
+        Item itm(keys[i], 0, 0, val.data(), val.length());
+        h.set(itm);
+    }
+    hrtime_t churnTime = gethrtime() - start;
+
+    size_t rssAfter = residentBytes();
+
+    // Fetch everything the way the front end does.
+    start = gethrtime();
+    size_t fetched = 0;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        StoredValue *v = h.find(*it);
+        if (v && v->getValue()->length() == vallen) {
+            ++fetched;
+        }
+    }
+    hrtime_t getTime = gethrtime() - start;
+    assert(fetched == keys.size());
+
+    // Read everything in place, the way the snapshot writer does.
+    start = gethrtime();
+    fetched = 0;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        StoredValue *v = h.find(*it);
+        if (v && v->valLength() == vallen && v->getValueData()[0] == 'x') {
+            ++fetched;
+        }
+    }
+    hrtime_t readTime = gethrtime() - start;
+    assert(fetched == keys.size());
+
+    std::cout << mode.name << std::endl;
+    report("set", keys.size(), setTime);
+    report("del+set", keys.size(), churnTime);
+    report("get", keys.size(), getTime);
+    report("read in place", keys.size(), readTime);
+    std::cout << "  rss growth: " << (rssAfter - rssBefore) << " bytes ("
+              << (rssAfter - rssBefore) / keys.size() << " per item)" << std::endl
+              << "  accounted size: " << stats.currentSize.get() << std::endl;
+    if (mode.slabs) {
+        std::cout << "  slab bytes: " << stats.slabBytes.get()
+                  << ", used: " << stats.slabUsedBytes.get()
+                  << ", free slabs: " << stats.slabFreeSlabs.get() << std::endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t nitems = 1000000;
+    size_t vallen = 32;
+    if (argc > 1) {
+        nitems = static_cast<size_t>(strtoul(argv[1], NULL, 10));
+    }
+    if (argc > 2) {
+        vallen = static_cast<size_t>(strtoul(argv[2], NULL, 10));
+    }
+
+    bench_mode modes[] = {
+        { "malloc allocation", false, 0 },
+        { "slab allocation", true, 0 },
+        { "slab allocation, inline values", true, 64 }
+    };
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            run(modes[i], nitems, vallen);
+            exit(0);
+        } else if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        int status;
+        waitpid(pid, &status, 0);
+    }
+    return 0;
+}
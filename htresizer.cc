@@ -0,0 +1,40 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+
+#include "config.h"
+
+#include "common.hh"
+#include "htresizer.hh"
+#include "ep.hh"
+
+/**
+ * Look at all the hash tables and resize any whose load factor is
+ * out of range.
+ */
+class ResizingVisitor : public VBucketVisitor {
+public:
+
+    ResizingVisitor() : resized(0) {}
+
+    bool visitBucket(RCPtr<VBucket> vb) {
+        if (vb->ht.resize()) {
+            ++resized;
+        }
+        return false;
+    }
+
+    size_t resized;
+};
+
+bool HashtableResizer::callback(Dispatcher &d, TaskId t) {
+    ResizingVisitor rv;
+    store->visit(rv);
+
+    if (rv.resized > 0) {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Resized %d hash tables\n",
+                         static_cast<int>(rv.resized));
+    }
+
+    d.snooze(t, sleepTime);
+    return true;
+}
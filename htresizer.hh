@@ -0,0 +1,41 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HTRESIZER_HH
+#define HTRESIZER_HH 1
+
+#include "common.hh"
+#include "dispatcher.hh"
+
+//! How often (in seconds) the hash tables are checked for resizing.
+const int HTRESIZER_FREQ(60);
+
+// Forward declaration.
+class EventuallyPersistentStore;
+
+/**
+ * Dispatcher job that periodically grows or shrinks the hash tables
+ * of all vbuckets to keep their load factors reasonable.
+ */
+class HashtableResizer : public DispatcherCallback {
+public:
+
+    /**
+     * Construct a HashtableResizer.
+     *
+     * @param s the store (where we'll visit)
+     * @param stime number of seconds to wait between runs
+     */
+    HashtableResizer(EventuallyPersistentStore *s, size_t stime) :
+        store(s), sleepTime(static_cast<double>(stime)) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() {
+        return std::string("Adjusting hash table sizes.");
+    }
+
+private:
+    EventuallyPersistentStore *store;
+    double                     sleepTime;
+};
+
+#endif /* HTRESIZER_HH */
@@ -0,0 +1,338 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "htsnapshot.hh"
+#include "ep.hh"
+
+static const char SNAPSHOT_MAGIC[8] = { 'E', 'P', 'H', 'T', 'S', 'N', 'A', 'P' };
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+// Items are written out in blocks of about this many bytes.
+static const size_t SNAPSHOT_BLOCK_SIZE = 1024 * 1024;
+// Size of the stdio buffers used to read and write the file.
+static const size_t SNAPSHOT_IO_BUFFER = 4 * 1024 * 1024;
+
+struct snapshot_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t dbStamp;
+};
+
+struct snapshot_block {
+    uint32_t count;
+    uint32_t length;
+    uint64_t checksum;
+};
+
+/**
+ * FNV-1a over a block's bytes.
+ */
+static uint64_t checksum(const char *p, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= static_cast<uint8_t>(p[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+template <typename T>
+static void put(std::vector<char> &buf, T v) {
+    const char *p = reinterpret_cast<const char*>(&v);
+    buf.insert(buf.end(), p, p + sizeof(v));
+}
+
+/**
+ * Reads the fields of the items in a block, never past its end.
+ */
+class BlockReader {
+public:
+    BlockReader(const std::vector<char> &b) : buf(b), pos(0) {}
+
+    template <typename T>
+    bool get(T &v) {
+        return get(&v, sizeof(v));
+    }
+
+    bool get(void *to, size_t len) {
+        if (buf.size() - pos < len) {
+            return false;
+        }
+        std::memcpy(to, &buf[pos], len);
+        pos += len;
+        return true;
+    }
+
+    const char *skip(size_t len) {
+        if (buf.size() - pos < len) {
+            return NULL;
+        }
+        const char *rv = len > 0 ? &buf[pos] : "";
+        pos += len;
+        return rv;
+    }
+
+private:
+    const std::vector<char> &buf;
+    size_t                   pos;
+};
+
+/**
+ * Writes the items of every vbucket visited, giving up at the first
+ * one that isn't persisted.
+ */
+class SnapshotWriter : public VBucketVisitor {
+public:
+
+    SnapshotWriter(EventuallyPersistentStore &st, FILE *f)
+        : store(st), fp(f), vbVersion(0), blockCount(0), count(0),
+          failed(false) {}
+
+    bool visitBucket(RCPtr<VBucket> vb) {
+        if (failed) {
+            return false;
+        }
+        currentBucket = vb;
+        vbVersion = store.getVBucketVersion(vb->getId());
+        return true;
+    }
+
+    void visit(StoredValue *v) {
+        if (failed || v->isDeleted()) {
+            return;
+        }
+        if (v->isDirty() || !v->hasId()) {
+            failed = true;
+            return;
+        }
+
+        std::string key(v->getKey());
+        bool resident(v->isResident());
+        put<uint16_t>(buf, currentBucket->getId());
+        put<uint16_t>(buf, vbVersion);
+        put<uint8_t>(buf, static_cast<uint8_t>(key.length()));
+        put<uint8_t>(buf, resident ? 1 : 0);
+        put<uint32_t>(buf, v->getFlags());
+        put<int64_t>(buf, static_cast<int64_t>(v->getExptime()));
+        put<uint64_t>(buf, v->getCas());
+        put<int64_t>(buf, v->getId());
+        put<uint32_t>(buf, static_cast<uint32_t>(v->valLength()));
+        buf.insert(buf.end(), key.begin(), key.end());
+        if (resident) {
+            const char *data = v->getValueData();
+            buf.insert(buf.end(), data, data + v->valLength());
+        }
+
+        ++blockCount;
+        ++count;
+        if (buf.size() >= SNAPSHOT_BLOCK_SIZE) {
+            writeBlock();
+        }
+    }
+
+    /**
+     * Write out what's left and the empty block ending the file.
+     *
+     * @return true if every item was written
+     */
+    bool finish() {
+        writeBlock();
+        if (!failed) {
+            snapshot_block end = { 0, 0, 0 };
+            failed = fwrite(&end, sizeof(end), 1, fp) != 1;
+        }
+        return !failed;
+    }
+
+    size_t getCount() {
+        return count;
+    }
+
+private:
+
+    void writeBlock() {
+        if (failed || blockCount == 0) {
+            return;
+        }
+        snapshot_block b;
+        b.count = blockCount;
+        b.length = static_cast<uint32_t>(buf.size());
+        b.checksum = checksum(&buf[0], buf.size());
+        failed = fwrite(&b, sizeof(b), 1, fp) != 1
+            || fwrite(&buf[0], buf.size(), 1, fp) != 1;
+        buf.clear();
+        blockCount = 0;
+    }
+
+    EventuallyPersistentStore &store;
+    FILE                      *fp;
+    std::vector<char>          buf;
+    uint16_t                   vbVersion;
+    uint32_t                   blockCount;
+    size_t                     count;
+    bool                       failed;
+};
+
+bool HashTableSnapshot::getDBStamp(uint64_t &stamp) {
+    std::vector<char> buf;
+    std::vector<std::string>::const_iterator it;
+    for (it = dbFiles.begin(); it != dbFiles.end(); ++it) {
+        struct stat st;
+        if (stat(it->c_str(), &st) != 0) {
+            return false;
+        }
+        put<uint64_t>(buf, static_cast<uint64_t>(st.st_size));
+        put<uint64_t>(buf, static_cast<uint64_t>(st.st_mtime));
+    }
+    stamp = buf.empty() ? 0 : checksum(&buf[0], buf.size());
+    return true;
+}
+
+bool HashTableSnapshot::write(EventuallyPersistentStore &store, size_t &items) {
+    items = 0;
+    snapshot_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.version = SNAPSHOT_VERSION;
+    if (!getDBStamp(h.dbStamp)) {
+        return false;
+    }
+
+    // Written next to it first, so a snapshot is either complete or
+    // not there at all.
+    std::string tmp(path + ".tmp");
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL) {
+        return false;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_IO_BUFFER);
+
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    SnapshotWriter writer(store, fp);
+    if (ok) {
+        store.visit(writer);
+        ok = writer.finish();
+    }
+    ok = fflush(fp) == 0 && ok;
+    ok = fsync(fileno(fp)) == 0 && ok;
+    ok = fclose(fp) == 0 && ok;
+
+    if (ok && rename(tmp.c_str(), path.c_str()) == 0) {
+        items = writer.getCount();
+        return true;
+    }
+    unlink(tmp.c_str());
+    return false;
+}
+
+snapshot_load_t HashTableSnapshot::load(LoadStorageKVPairCallback &cb,
+                                        size_t &items) {
+    items = 0;
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return snapshot_missing;
+    }
+    setvbuf(fp, NULL, _IOFBF, SNAPSHOT_IO_BUFFER);
+
+    snapshot_header h;
+    uint64_t dbStamp(0);
+    if (fread(&h, sizeof(h), 1, fp) != 1
+        || std::memcmp(h.magic, SNAPSHOT_MAGIC, sizeof(h.magic)) != 0
+        || h.version != SNAPSHOT_VERSION) {
+        fclose(fp);
+        return snapshot_corrupt;
+    }
+    if (!getDBStamp(dbStamp) || dbStamp != h.dbStamp) {
+        fclose(fp);
+        return snapshot_stale;
+    }
+
+    time_t now = ep_real_time();
+    snapshot_load_t rv = snapshot_corrupt;
+    std::vector<char> buf;
+    snapshot_block b;
+    while (fread(&b, sizeof(b), 1, fp) == 1) {
+        if (b.count == 0 && b.length == 0) {
+            rv = snapshot_loaded;
+            break;
+        }
+        buf.resize(b.length);
+        if (b.length == 0 || fread(&buf[0], b.length, 1, fp) != 1
+            || checksum(&buf[0], buf.size()) != b.checksum) {
+            break;
+        }
+
+        BlockReader r(buf);
+        uint32_t i;
+        for (i = 0; i < b.count; ++i) {
+            uint16_t vbid, vbVersion;
+            uint8_t nkey, resident;
+            uint32_t flags, nbytes;
+            int64_t exptime, id;
+            uint64_t cas;
+            if (!(r.get(vbid) && r.get(vbVersion) && r.get(nkey) && r.get(resident)
+                  && r.get(flags) && r.get(exptime) && r.get(cas) && r.get(id)
+                  && r.get(nbytes))) {
+                break;
+            }
+            const char *key = r.skip(nkey);
+            const char *data = resident ? r.skip(nbytes) : "";
+            if (key == NULL || data == NULL) {
+                break;
+            }
+            // The database wouldn't return these either.
+            if (exptime != 0 && exptime <= now) {
+                continue;
+            }
+
+            if (resident) {
+                GetValue gv(new Item(std::string(key, nkey), static_cast<int>(flags),
+                                     static_cast<time_t>(exptime), data, nbytes,
+                                     cas, id, vbid),
+                            ENGINE_SUCCESS, -1, vbVersion);
+                cb.callback(gv);
+            } else {
+                GetValue gv(new Item(key, static_cast<size_t>(nkey),
+                                     static_cast<size_t>(nbytes),
+                                     static_cast<int>(flags),
+                                     static_cast<time_t>(exptime),
+                                     cas, id, vbid, false),
+                            ENGINE_SUCCESS, -1, vbVersion);
+                cb.loadNonResident(gv);
+            }
+            ++items;
+        }
+        if (i != b.count) {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return rv;
+}
+
+void HashTableSnapshot::remove() {
+    unlink(path.c_str());
+}
+
+const char *HashTableSnapshot::toString(snapshot_load_t r) {
+    switch (r) {
+    case snapshot_loaded:
+        return "loaded";
+    case snapshot_missing:
+        return "missing";
+    case snapshot_stale:
+        return "stale";
+    case snapshot_corrupt:
+        return "corrupt";
+    default:
+        return "off";
+    }
+}
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HTSNAPSHOT_HH
+#define HTSNAPSHOT_HH 1
+
+#include <string>
+#include <vector>
+
+#include "common.hh"
+
+class EventuallyPersistentStore;
+class LoadStorageKVPairCallback;
+
+/**
+ * What became of warming up from a hash table snapshot.
+ */
+enum snapshot_load_t {
+    snapshot_off,               //!< no snapshot file is configured
+    snapshot_loaded,            //!< all items came from the snapshot
+    snapshot_missing,           //!< there was no snapshot to load
+    snapshot_stale,             //!< the database changed after the snapshot
+    snapshot_corrupt            //!< the snapshot was damaged
+};
+
+/**
+ * A file holding all items of the hash tables, written at a clean
+ * shutdown so the next warmup doesn't have to go through the
+ * database.
+ *
+ * It is only taken when every item is persisted, so it holds exactly
+ * what the database does.  The values of items that weren't resident
+ * are left out; they're loaded non-resident and fetched from the
+ * database when asked for.
+ *
+ * The file starts with a header recording the sizes and modification
+ * times of the database files, and is then written in blocks, each
+ * with a checksum, ending with an empty block.  Numbers are in the byte
+ * order of the machine writing it.
+ */
+class HashTableSnapshot {
+public:
+
+    /**
+     * @param p the path of the snapshot file
+     * @param db the files of the database the snapshot is of
+     */
+    HashTableSnapshot(const std::string &p, const std::vector<std::string> &db)
+        : path(p), dbFiles(db) {}
+
+    /**
+     * Write the items of all vbuckets of a store.
+     *
+     * Nothing is written if any item isn't persisted yet.
+     *
+     * @param store the store, with its flushers stopped
+     * @param items set to the number of items written
+     * @return true if the snapshot was written
+     */
+    bool write(EventuallyPersistentStore &store, size_t &items);
+
+    /**
+     * Load all items from the snapshot.
+     *
+     * When the snapshot turns out to be corrupt, some items may
+     * already have been loaded.
+     *
+     * @param cb the callback loading the items into the hash tables
+     * @param items set to the number of items loaded
+     * @return what became of it
+     */
+    snapshot_load_t load(LoadStorageKVPairCallback &cb, size_t &items);
+
+    /**
+     * Remove the snapshot file (if any), so it's never loaded after
+     * the database changes.
+     */
+    void remove();
+
+    static const char *toString(snapshot_load_t r);
+
+private:
+
+    bool getDBStamp(uint64_t &stamp);
+
+    const std::string              path;
+    const std::vector<std::string> dbFiles;
+
+    DISALLOW_COPY_AND_ASSIGN(HashTableSnapshot);
+};
+
+#endif /* HTSNAPSHOT_HH */
@@ -14,8 +14,11 @@
 
 /**
  * A blob is a minimal sized storage for data up to 2^32 bytes long.
+ *
+ * Blobs carry their own reference count so a value_t is just a
+ * pointer.
  */
-class Blob {
+class Blob : public RCValue {
 public:
 
     // Constructors.
@@ -105,7 +108,7 @@ private:
     DISALLOW_COPY_AND_ASSIGN(Blob);
 };
 
-typedef shared_ptr<const Blob> value_t;
+typedef SingleThreadedRCPtr<const Blob> value_t;
 
 /**
  * The Item structure we use to pass information between the memcached
@@ -114,20 +117,29 @@ typedef shared_ptr<const Blob> value_t;
  */
 class Item {
 public:
+    /**
+     * Create an item with a zero-filled value of the given length.
+     *
+     * Without a value (withValue false), the item only records the
+     * length of the value, as read by KVStore::dumpKeys.
+     */
     Item(const void* k, const size_t nk, const size_t nb,
          const int fl, const time_t exp, uint64_t theCas = 0,
-         int64_t i = -1, uint16_t vbid = 0) :
-        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid)
+         int64_t i = -1, uint16_t vbid = 0, bool withValue = true) :
+        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid),
+        nbytes(static_cast<uint32_t>(nb))
     {
         key.assign(static_cast<const char*>(k), nk);
         assert(id != 0);
-        setData(NULL, nb);
+        if (withValue) {
+            setData(NULL, nb);
+        }
     }
 
     Item(const std::string &k, const int fl, const time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0) :
-        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid)
+        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid), nbytes(0)
     {
         key.assign(k);
         assert(id != 0);
@@ -136,7 +148,8 @@ public:
 
     Item(const std::string &k, const int fl, const time_t exp,
          value_t val, uint64_t theCas = 0,  int64_t i = -1, uint16_t vbid = 0) :
-        flags(fl), exptime(exp), value(val), cas(theCas), id(i), vbucketId(vbid)
+        flags(fl), exptime(exp), value(val), cas(theCas), id(i), vbucketId(vbid),
+        nbytes(0)
     {
         assert(id != 0);
         key.assign(k);
@@ -145,7 +158,7 @@ public:
     Item(const void *k, uint16_t nk, const int fl, const time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0,
          int64_t i = -1, uint16_t vbid = 0) :
-        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid)
+        flags(fl), exptime(exp), cas(theCas), id(i), vbucketId(vbid), nbytes(0)
     {
         assert(id != 0);
         key.assign(static_cast<const char*>(k), nk);
@@ -170,12 +183,17 @@ public:
         return id;
     }
 
+    void setId(int64_t to) {
+        assert(to != 0);
+        id = to;
+    }
+
     int getNKey() const {
         return static_cast<int>(key.length());
     }
 
     uint32_t getNBytes() const {
-        return static_cast<uint32_t>(value->length());
+        return value ? static_cast<uint32_t>(value->length()) : nbytes;
     }
 
     time_t getExptime() const {
@@ -259,6 +277,8 @@ private:
     uint64_t cas;
     int64_t id;
     uint16_t vbucketId;
+    //! The length of the value when there isn't one.
+    uint32_t nbytes;
 
     static uint64_t nextCas(void) {
         uint64_t ret;
@@ -5,145 +5,138 @@
 #include <cstdlib>
 #include <utility>
 #include <list>
+#include <algorithm>
 
 #include "common.hh"
 #include "item_pager.hh"
 #include "ep.hh"
+#include "paging_visitor.hh"
 
 static const double threshold = 75.0;
 
-/**
- * As part of the ItemPager, visit all of the objects in memory and
- * eject some within a constrained probability
- */
-class PagingVisitor : public VBucketVisitor {
-public:
-
-    /**
-     * Construct a PagingVisitor that will attempt to evict the given
-     * percentage of objects.
-     *
-     * @param pcnt percentage of objects to attempt to evict (0-1)
-     */
-    PagingVisitor(EPStats &st, double pcnt) : stats(st), percent(pcnt),
-                                              ejected(0), failedEjects(0),
-                                              startTime(ep_real_time()) {}
-
-    void visit(StoredValue *v) {
-
-        // Remember expired objects -- we're going to delete them.
-        if (v->isExpired(startTime)) {
-            expired.push_back(std::make_pair(currentBucket->getId(), v->getKey()));
-            return;
-        }
+//! Items the pager visits before letting other tasks run.
+static const size_t sliceItems = 10000;
+//! Time (in usec) the pager runs for before letting other tasks run.
+static const hrtime_t sliceTime = 10000;
 
-        double r = static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
-        if (percent >= r) {
-            if (v->ejectValue(stats)) {
-                ++ejected;
-            } else {
-                ++failedEjects;
+bool ItemPager::callback(Dispatcher &d, TaskId t) {
+    if (!visitor) {
+        double current = static_cast<double>(StoredValue::getCurrentSize(stats));
+        double upper = static_cast<double>(stats.mem_high_wat);
+        double lower = static_cast<double>(stats.mem_low_wat);
+        if (current <= upper) {
+            // Whatever went past the high water mark has been freed
+            // without us.
+            hrtime_t crossed = stats.memHighWatCrossed.get();
+            if (crossed != 0) {
+                stats.memHighWatCrossed.cas(crossed, 0);
             }
+            d.snooze(t, 10);
+            return true;
         }
-    }
-
-    /**
-     * Get the number of items ejected during the visit.
-     */
-    size_t numEjected() { return ejected; }
-
-    /**
-     * Get the number of ejection failures.
-     *
-     * An ejection failure is the state when an ejection was
-     * requested, but did not work for some reason (either object was
-     * dirty, or too small, or something).
-     */
-    size_t numFailedEjects() { return failedEjects; }
-
-    std::list<std::pair<uint16_t, std::string> > expired;
-
-private:
-    EPStats &stats;
-    double   percent;
-    size_t   ejected;
-    size_t   failedEjects;
-    time_t   startTime;
-};
-
-/**
- * As part of the ExpiredItemPager, visit all of the objects in memory and
- * purge all the expired items from memory and disk
- */
-class ExpiryPagingVisitor : public VBucketVisitor {
-public:
-
-    /**
-     * Construct a ExpiryPagingVisitor that will attempt to purge all the
-     * expired items from memory and disk.
-     *
-     * @param st stats for engine
-     */
-    ExpiryPagingVisitor(EPStats &st) : stats(st), startTime(ep_real_time()) {}
-
-    void visit(StoredValue *v) {
-        if (v->isExpired(startTime)) {
-            expired.push_back(std::make_pair(currentBucket->getId(), v->getKey()));
-        }
-    }
-
-    std::list<std::pair<uint16_t, std::string> > expired;
-
-private:
-    EPStats &stats;
-    time_t   startTime;
-};
-
-bool ItemPager::callback(Dispatcher &d, TaskId t) {
-    double current = static_cast<double>(StoredValue::getCurrentSize(stats));
-    double upper = static_cast<double>(stats.mem_high_wat);
-    double lower = static_cast<double>(stats.mem_low_wat);
-    if (current > upper) {
 
         ++stats.pagerRuns;
+        running.set(true);
+        numEvicted = 0;
 
-        double toKill = (current - static_cast<double>(lower)) / current;
+        double toFree = PagingVisitor::bytesToFree(current, lower, upper);
+        double toKill = toFree / current;
 
         std::stringstream ss;
         ss << "Using " << StoredValue::getCurrentSize(stats)
            << " bytes of memory, paging out %0f%% of items." << std::endl;
         getLogger()->log(EXTENSION_LOG_INFO, NULL, ss.str().c_str(),
                          (toKill*100.0));
-        PagingVisitor pv(stats, toKill);
-        store->visit(pv);
-
-        stats.numValueEjects.incr(pv.numEjected());
-        stats.numNonResident.incr(pv.numEjected());
-        stats.numFailedEjects.incr(pv.numFailedEjects());
-        stats.expired.incr(pv.expired.size());
+        visitor.reset(new PagingVisitor(stats, toKill, store->isFullEviction()));
+        if (policy == clock_pager) {
+            visitor->startClock(static_cast<size_t>(toFree), hand);
+        }
+        visit.reset(new ParallelVBucketVisit(*store, *visitor,
+                                             VisitBudget(sliceItems, sliceTime)));
+    }
 
-        store->deleteMany(pv.expired);
+    bool complete = visit->run();
+    purge();
+    if (!complete) {
+        // Let the tasks that are more urgent (such as background
+        // fetches) run before we go on.
+        d.snooze(t, 0);
+        return true;
+    }
 
-        getLogger()->log(EXTENSION_LOG_INFO, NULL,
-                         "Paged out %d values\n", pv.numEjected());
+    hand = visitor->getHand();
+    stats.numValueEjects.incr(visitor->numEjected());
+    stats.numNonResident.incr(visitor->numEjected());
+    stats.numFailedEjects.incr(visitor->numFailedEjects());
+    stats.pagerWarmSkips.incr(visitor->numWarmSkips());
+
+    hrtime_t crossed = stats.memHighWatCrossed.get();
+    if (crossed != 0 && stats.memHighWatCrossed.cas(crossed, 0)) {
+        hrtime_t took = (gethrtime() - crossed) / 1000;
+        stats.pagerResponseTime.set(took);
+        stats.pagerResponseTimeHighWat.setIfBigger(took);
     }
 
+    getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                     "Paged out %d values and %d items\n",
+                     visitor->numEjected(), numEvicted);
+    visit.reset();
+    visitor.reset();
+    running.set(false);
+
     d.snooze(t, 10);
     return true;
 }
 
-bool ExpiredItemPager::callback(Dispatcher &d, TaskId t) {
-    ++stats.expiryPagerRuns;
-
-    PagingVisitor pv(stats, -1);
-    store->visit(pv);
+void ItemPager::purge() {
+    std::list<std::pair<uint16_t, std::string> > expired, evicted;
+    visitor->takeFound(expired, evicted);
+    stats.expired.incr(expired.size());
+    store->deleteMany(expired);
+    numEvicted += store->evictMany(evicted);
+}
 
-    stats.expired.incr(pv.expired.size());
-    store->deleteMany(pv.expired);
+void ItemPager::memoryPressure() {
+    ++stats.pagerWakeups;
+    if (running.get()) {
+        return;
+    }
+    LockHolder lh(taskMutex);
+    if (dispatcher && task) {
+        dispatcher->wake(task, &task);
+    }
+}
 
+bool ExpiredItemPager::callback(Dispatcher &d, TaskId t) {
+    ++stats.expiryPagerRuns;
+    size_t purged = store->deleteExpiredItems();
     getLogger()->log(EXTENSION_LOG_INFO, NULL,
-                     "Purged %d expired items\n", pv.expired.size());
+                     "Purged %d expired items\n", purged);
     d.snooze(t, sleepTime);
     return true;
 }
 
+//! Keys read from disk before letting other tasks run.
+static const size_t rebuildChunk = 10000;
+
+bool BloomFilterRebuilder::callback(Dispatcher &d, TaskId t) {
+    if (after < 0) {
+        if (!stats.warmupComplete.get() || store->beginBloomFilterRebuild() == 0) {
+            d.snooze(t, sleepTime);
+            return true;
+        }
+        shard = 0;
+        after = 0;
+    }
+
+    after = store->rebuildBloomFilters(shard, after, rebuildChunk);
+    if (after < 0 && ++shard < store->getUnderlying()->getNumDumpShards()) {
+        after = 0;
+    }
+    if (after < 0) {
+        store->completeBloomFilterRebuild();
+        ++stats.bfilterRebuilds;
+        d.snooze(t, sleepTime);
+    }
+    return true;
+}
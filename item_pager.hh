@@ -3,17 +3,35 @@
 #define ITEM_PAGER_HH 1
 
 #include "common.hh"
+#include "atomic.hh"
 #include "dispatcher.hh"
+#include "locks.hh"
 #include "stats.hh"
 
-// Forward declaration.
+// Forward declarations.
 class EventuallyPersistentStore;
+class PagingVisitor;
+class ParallelVBucketVisit;
+
+/**
+ * How the item pager picks the values to eject.
+ */
+enum pager_policy {
+    clock_pager,                //!< Sweep a clock over values not read lately.
+    random_pager                //!< Eject values at random.
+};
 
 /**
  * Dispatcher job responsible for periodically pushing data out of
  * memory.
+ *
+ * A run is split up among the store's visitor threads and done in
+ * slices, letting the other tasks of the dispatcher go in between.
+ *
+ * Besides checking every so often, the pager is woken up as soon as
+ * memory use goes past the high water mark (see setTask).
  */
-class ItemPager : public DispatcherCallback {
+class ItemPager : public DispatcherCallback, public MemoryPressureListener {
 public:
 
     /**
@@ -21,22 +39,69 @@ public:
      *
      * @param s the store (where we'll visit)
      * @param st the stats
+     * @param p how to pick the values to eject
      */
-    ItemPager(EventuallyPersistentStore *s, EPStats &st) :
-        store(s), stats(st) {}
+    ItemPager(EventuallyPersistentStore *s, EPStats &st,
+              pager_policy p = clock_pager) :
+        store(s), stats(st), policy(p), hand(0), numEvicted(0),
+        dispatcher(NULL), running(false) {}
+
+    ~ItemPager() {
+        if (stats.memoryListener == this) {
+            stats.memoryListener = NULL;
+        }
+    }
 
     bool callback(Dispatcher &d, TaskId t);
 
     std::string description() { return std::string("Paging out items."); }
 
+    /**
+     * Tell the pager the task it was scheduled as, so memory pressure
+     * can wake it up.
+     *
+     * @param d the dispatcher it was scheduled on
+     * @param t the task
+     */
+    void setTask(Dispatcher *d, TaskId t) {
+        LockHolder lh(taskMutex);
+        dispatcher = d;
+        task = t;
+    }
+
+    /**
+     * Wake the pager up, unless it's already paging out.
+     */
+    void memoryPressure();
+
 private:
+
+    //! Delete the expired items and evict the items found so far.
+    void purge();
+
     EventuallyPersistentStore *store;
     EPStats                   &stats;
+    pager_policy               policy;
+    //! The vbucket the clock stopped at on the last run.
+    uint16_t                   hand;
+    //! Items evicted altogether in the run in progress.
+    size_t                     numEvicted;
+    //! The run in progress, if any.
+    shared_ptr<PagingVisitor>  visitor;
+    shared_ptr<ParallelVBucketVisit> visit;
+    //! Where this pager is scheduled, for waking it up.
+    Dispatcher                *dispatcher;
+    TaskId                     task;
+    Mutex                      taskMutex;
+    //! True while a run is in progress.
+    Atomic<bool>               running;
 };
 
 /**
  * Dispatcher job responsible for purging expired items from
  * memory and disk.
+ *
+ * Only the items found in the vbuckets' expiry indexes are looked at.
  */
 class ExpiredItemPager : public DispatcherCallback {
 public:
@@ -62,4 +127,42 @@ private:
     double                     sleepTime;
 };
 
+//! How often (in seconds) to check whether Bloom filters want a rebuild.
+const int BFILTER_REBUILD_FREQ(60);
+
+/**
+ * Dispatcher job rebuilding the Bloom filters of full eviction once
+ * many of the keys they were given are gone from disk.
+ *
+ * The database is read a chunk of keys at a time, letting the other
+ * tasks of the dispatcher go in between.
+ */
+class BloomFilterRebuilder : public DispatcherCallback {
+public:
+
+    /**
+     * Construct a BloomFilterRebuilder.
+     *
+     * @param s the store
+     * @param st the stats
+     * @param stime number of seconds to wait between checks
+     */
+    BloomFilterRebuilder(EventuallyPersistentStore *s, EPStats &st,
+                         size_t stime) :
+        store(s), stats(st), sleepTime(static_cast<double>(stime)),
+        shard(0), after(-1) {}
+
+    bool callback(Dispatcher &d, TaskId t);
+
+    std::string description() { return std::string("Rebuilding Bloom filters."); }
+
+private:
+    EventuallyPersistentStore *store;
+    EPStats                   &stats;
+    double                     sleepTime;
+    //! Where the rebuild in progress is, if any.
+    size_t                     shard;
+    int64_t                    after;
+};
+
 #endif /* ITEM_PAGER_HH */
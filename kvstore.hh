@@ -0,0 +1,261 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef KVSTORE_HH
+#define KVSTORE_HH 1
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "item.hh"
+#include "callbacks.hh"
+
+/**
+ * Result of database mutation operations.
+ *
+ * This is a pair where .first is the number of rows affected, and
+ * .second is the ID that was generated (if any).  .second will be 0
+ * on updates (not generating an ID).
+ *
+ * .first will be -1 if there was an error performing the update.
+ *
+ * .first will be 0 if the update did not error, but did not occur.
+ * This would generally be considered a fatal condition (in practice,
+ * it requires you to be firing an update at a missing rowid).
+ */
+typedef std::pair<int, int64_t> mutation_result;
+
+/**
+ * An item to persist with KVStore::setMany.
+ */
+struct batched_set {
+    batched_set(const Item &i, uint16_t v, Callback<mutation_result> &c) :
+        item(&i), vb_version(v), cb(&c) {}
+
+    const Item                *item;
+    uint16_t                   vb_version;
+    Callback<mutation_result> *cb;
+};
+
+/**
+ * A key whose ID to look up with KVStore::getIds.
+ */
+struct key_lookup {
+    key_lookup(const std::string &k, uint16_t vb, uint16_t v) :
+        key(k), vbucket(vb), vb_version(v), id(-1) {}
+
+    std::string key;
+    uint16_t    vbucket;
+    uint16_t    vb_version;
+    int64_t     id;
+};
+
+/**
+ * Persistent storage the store writes items to and reads them back
+ * from.
+ *
+ * Items are identified by the ID (rowid) the store gave them when
+ * first written.  The store may be split in shards, each holding a
+ * part of the keys and written in transactions of its own.
+ */
+class KVStore {
+public:
+
+    virtual ~KVStore() {}
+
+    /**
+     * Reset the store to a clean state.
+     */
+    virtual void reset() = 0;
+
+    /**
+     * Remove all items from one shard.
+     *
+     * With a single shard this resets the whole store.
+     */
+    virtual void reset(size_t shard) = 0;
+
+    /**
+     * Get the number of shards that can be written to independently
+     * (each in transactions of its own).
+     */
+    virtual size_t getNumShards() = 0;
+
+    /**
+     * Get the shard holding the given key.
+     */
+    virtual size_t getShardId(const std::string &key) = 0;
+
+    /**
+     * Begin a transaction on the main store (if not already in one).
+     */
+    virtual bool begin() = 0;
+
+    /**
+     * Begin a transaction on the given shard (if not already in one).
+     */
+    virtual bool begin(size_t shard) = 0;
+
+    /**
+     * Commit a transaction on the main store (unless not currently
+     * in one).
+     *
+     * Returns false if the commit fails.
+     */
+    virtual bool commit() = 0;
+
+    /**
+     * Commit a transaction on the given shard (unless not currently in
+     * one).
+     *
+     * Returns false if the commit fails.
+     */
+    virtual bool commit(size_t shard) = 0;
+
+    /**
+     * Rollback a transaction on the main store (unless not currently
+     * in one).
+     */
+    virtual void rollback() = 0;
+
+    /**
+     * Insert (if the item has no ID yet) or update an item.
+     *
+     * @param item the item
+     * @param vb_version the current version of its vbucket
+     * @param cb called with the result
+     */
+    virtual void set(const Item &item, uint16_t vb_version,
+                     Callback<mutation_result> &cb) = 0;
+
+    /**
+     * Persist many items at once.
+     *
+     * Every item's callback is called with what set() would have
+     * given it.
+     *
+     * @param batch the items, their vbucket versions and callbacks
+     */
+    virtual void setMany(std::vector<batched_set> &batch) = 0;
+
+    /**
+     * Get an item by its ID.
+     */
+    virtual void get(const std::string &key, uint64_t rowid,
+                     Callback<GetValue> &cb) = 0;
+
+    /**
+     * Get an item by its key instead of its ID.
+     *
+     * @param key the key of the item
+     * @param vbucket the vbucket the item belongs to
+     * @param vb_version the current version of that vbucket
+     * @param cb called with the item, or with an ENOENT result
+     */
+    virtual void getByKey(const std::string &key, uint16_t vbucket,
+                          uint16_t vb_version, Callback<GetValue> &cb) = 0;
+
+    /**
+     * Look up the IDs of many items by key at once, without reading
+     * their values.
+     *
+     * @param lookups the keys, with their vbuckets and the current
+     *        versions of those; the id of every one found is set, the
+     *        others are left at -1
+     */
+    virtual void getIds(std::vector<key_lookup> &lookups) = 0;
+
+    /**
+     * Get many items by their IDs at once.
+     *
+     * @param ids the IDs of the items, with their keys
+     * @param cb called with every item found, in no particular order
+     */
+    virtual void getMany(const std::vector<std::pair<int64_t, std::string> > &ids,
+                         Callback<GetValue> &cb) = 0;
+
+    /**
+     * Delete an item by its ID.
+     *
+     * @param cb called with the number of items deleted (-1 on error)
+     */
+    virtual void del(const std::string &key, uint64_t rowid,
+                     Callback<int> &cb) = 0;
+
+    /**
+     * Delete the items of a vbucket up to the given version whose IDs
+     * are in the given (inclusive) range.
+     */
+    virtual bool delVBucket(uint16_t vbucket, uint16_t vb_version,
+                            std::pair<int64_t, int64_t> row_range) = 0;
+
+    /**
+     * Get the vbucket states last snapshotted.
+     */
+    virtual std::map<std::pair<uint16_t, uint16_t>, std::string> listPersistedVbuckets() = 0;
+
+    /**
+     * Take a snapshot of the stats.
+     */
+    virtual bool snapshotStats(const std::map<std::string, std::string> &m) = 0;
+
+    /**
+     * Take a snapshot of the vbucket states.
+     */
+    virtual bool snapshotVBuckets(const std::map<std::pair<uint16_t, uint16_t>,
+                                                 std::string> &m) = 0;
+
+    /**
+     * Pass every item that hasn't expired to the given callback.
+     */
+    virtual void dump(Callback<GetValue> &cb) = 0;
+
+    /**
+     * Get the number of shards dump(shard, cb) reads.
+     *
+     * These are how the items are laid out in storage, which may be
+     * more than the shards written independently.
+     */
+    virtual size_t getNumDumpShards() = 0;
+
+    /**
+     * Pass every item of one shard that hasn't expired to the given
+     * callback.
+     *
+     * Different shards may be dumped from threads of their own at the
+     * same time, as long as nothing is written meanwhile.
+     */
+    virtual void dump(size_t shard, Callback<GetValue> &cb) = 0;
+
+    /**
+     * Like dump(shard, cb), but without reading the values.
+     *
+     * The items carry only the length of their values (see
+     * LoadStorageKVPairCallback::loadNonResident).
+     */
+    virtual void dumpKeys(size_t shard, Callback<GetValue> &cb) = 0;
+
+    /**
+     * Pass some of the items of one shard that haven't expired to the
+     * given callback, in the order of their IDs.
+     *
+     * Unlike the other dumps, this may be done while the store is
+     * being written.
+     *
+     * @param shard the shard (see getNumDumpShards)
+     * @param after start with the first item with a greater ID
+     * @param limit the most items to pass
+     * @param cb the callback
+     * @return the ID to continue after, or -1 once the shard is done
+     */
+    virtual int64_t dumpFrom(size_t shard, int64_t after, size_t limit,
+                             Callback<GetValue> &cb) = 0;
+
+    /**
+     * Like dumpFrom, but without reading the values (see dumpKeys).
+     */
+    virtual int64_t dumpKeysFrom(size_t shard, int64_t after, size_t limit,
+                                 Callback<GetValue> &cb) = 0;
+};
+
+#endif /* KVSTORE_HH */
@@ -60,6 +60,7 @@ private:
 /**
  * RAII lock holder over multiple locks.
  */
+template <typename M = Mutex>
 class MultiLockHolder {
 public:
 
@@ -69,7 +70,7 @@ public:
      * @param m beginning of an array of locks
      * @param n the number of locks to lock
      */
-    MultiLockHolder(Mutex *m, size_t n) : mutexes(m),
+    MultiLockHolder(M *m, size_t n) : mutexes(m),
                                           locked(NULL),
                                           n_locks(n) {
         locked = new bool[n];
@@ -86,7 +87,7 @@ public:
      */
     void lock() {
         for (size_t i = 0; i < n_locks; i++) {
-            mutexes[i].acquire();
+            static_cast<Mutex&>(mutexes[i]).acquire();
             locked[i] = true;
         }
     }
@@ -98,13 +99,13 @@ public:
         for (size_t i = 0; i < n_locks; i++) {
             if (locked[i]) {
                 locked[i] = false;
-                mutexes[i].release();
+                static_cast<Mutex&>(mutexes[i]).release();
             }
         }
     }
 
 private:
-    Mutex  *mutexes;
+    M      *mutexes;
     bool   *locked;
     size_t  n_locks;
 
@@ -0,0 +1,300 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include "memory-kvstore.hh"
+
+MemoryKVStore::MemoryKVStore(EPStats &st, size_t n, hash_function_t h) :
+    stats(st), shardHash(h), lastRowId(0) {
+    assert(n > 0);
+    for (size_t i = 0; i < n; ++i) {
+        shards.push_back(new shard());
+    }
+}
+
+MemoryKVStore::~MemoryKVStore() {
+    while (!shards.empty()) {
+        delete shards.back();
+        shards.pop_back();
+    }
+}
+
+void MemoryKVStore::shard::clear() {
+    std::map<int64_t, row*>::iterator it;
+    for (it = rows.begin(); it != rows.end(); ++it) {
+        delete it->second;
+    }
+    rows.clear();
+    keys.clear();
+}
+
+void MemoryKVStore::reset() {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        LockHolder lh(shards[i]->mutex);
+        shards[i]->clear();
+    }
+    LockHolder lh(mainMutex);
+    vbStates.clear();
+    statsSnap.clear();
+}
+
+void MemoryKVStore::reset(size_t sh) {
+    if (shards.size() == 1) {
+        reset();
+        return;
+    }
+    shard &s = *shards.at(sh);
+    LockHolder lh(s.mutex);
+    s.clear();
+}
+
+void MemoryKVStore::set(const Item &itm, uint16_t vb_version,
+                        Callback<mutation_result> &cb) {
+    shard &s = forKey(itm.getKey());
+    std::pair<uint16_t, std::string> k(itm.getVBucketId(), itm.getKey());
+    mutation_result p(1, 0);
+
+    ++stats.io_num_write;
+    stats.io_write_bytes += itm.getKey().length() + itm.getNBytes();
+
+    LockHolder lh(s.mutex);
+    if (itm.getId() <= 0) {
+        p.second = lastRowId.incr(1) + 1;
+        s.rows[p.second] = new row(itm, p.second, vb_version);
+        s.keys[k] = p.second;
+    } else {
+        std::map<int64_t, row*>::iterator it = s.rows.find(itm.getId());
+        if (it == s.rows.end()) {
+            // Don't bring back a row that's gone.
+            p.first = 0;
+        } else {
+            delete it->second;
+            it->second = new row(itm, itm.getId(), vb_version);
+            s.keys[k] = itm.getId();
+        }
+    }
+    lh.unlock();
+
+    if (p.first == 1) {
+        stats.totalPersisted++;
+    }
+    cb.callback(p);
+}
+
+void MemoryKVStore::setMany(std::vector<batched_set> &batch) {
+    std::vector<batched_set>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        set(*it->item, it->vb_version, *it->cb);
+    }
+}
+
+GetValue MemoryKVStore::found(const std::string &key, const row &r) {
+    ++stats.io_num_read;
+    stats.io_read_bytes += key.length() + r.item.getNBytes();
+    return GetValue(new Item(key, r.item.getFlags(), r.item.getExptime(),
+                             r.item.getValue(), r.item.getCas(),
+                             r.item.getId(), r.item.getVBucketId()));
+}
+
+void MemoryKVStore::get(const std::string &key, uint64_t rowid,
+                        Callback<GetValue> &cb) {
+    shard &s = forKey(key);
+    GetValue rv;
+    LockHolder lh(s.mutex);
+    std::map<int64_t, row*>::iterator it = s.rows.find(static_cast<int64_t>(rowid));
+    if (it != s.rows.end()) {
+        rv = found(key, *it->second);
+    }
+    lh.unlock();
+    cb.callback(rv);
+}
+
+void MemoryKVStore::getByKey(const std::string &key, uint16_t vbucket,
+                             uint16_t vb_version, Callback<GetValue> &cb) {
+    shard &s = forKey(key);
+    GetValue rv;
+    LockHolder lh(s.mutex);
+    std::map<std::pair<uint16_t, std::string>, int64_t>::iterator k;
+    k = s.keys.find(std::make_pair(vbucket, key));
+    if (k != s.keys.end()) {
+        std::map<int64_t, row*>::iterator it = s.rows.find(k->second);
+        if (it != s.rows.end() && it->second->vb_version == vb_version) {
+            rv = found(key, *it->second);
+        }
+    }
+    lh.unlock();
+    cb.callback(rv);
+}
+
+void MemoryKVStore::getIds(std::vector<key_lookup> &lookups) {
+    std::vector<key_lookup>::iterator l;
+    for (l = lookups.begin(); l != lookups.end(); ++l) {
+        shard &s = forKey(l->key);
+        LockHolder lh(s.mutex);
+        std::map<std::pair<uint16_t, std::string>, int64_t>::iterator k;
+        k = s.keys.find(std::make_pair(l->vbucket, l->key));
+        if (k != s.keys.end()) {
+            std::map<int64_t, row*>::iterator it = s.rows.find(k->second);
+            if (it != s.rows.end() && it->second->vb_version == l->vb_version) {
+                l->id = k->second;
+            }
+        }
+    }
+}
+
+void MemoryKVStore::getMany(const std::vector<std::pair<int64_t, std::string> > &ids,
+                            Callback<GetValue> &cb) {
+    std::vector<std::pair<int64_t, std::string> >::const_iterator it;
+    for (it = ids.begin(); it != ids.end(); ++it) {
+        shard &s = forKey(it->second);
+        LockHolder lh(s.mutex);
+        std::map<int64_t, row*>::iterator r = s.rows.find(it->first);
+        if (r == s.rows.end()) {
+            continue;
+        }
+        GetValue rv(found(it->second, *r->second));
+        lh.unlock();
+        cb.callback(rv);
+    }
+}
+
+void MemoryKVStore::del(const std::string &key, uint64_t rowid,
+                        Callback<int> &cb) {
+    shard &s = forKey(key);
+    int rv(0);
+    LockHolder lh(s.mutex);
+    std::map<int64_t, row*>::iterator it = s.rows.find(static_cast<int64_t>(rowid));
+    if (it != s.rows.end()) {
+        std::pair<uint16_t, std::string> k(it->second->item.getVBucketId(), key);
+        std::map<std::pair<uint16_t, std::string>, int64_t>::iterator ki = s.keys.find(k);
+        if (ki != s.keys.end() && ki->second == it->first) {
+            s.keys.erase(ki);
+        }
+        delete it->second;
+        s.rows.erase(it);
+        rv = 1;
+    }
+    lh.unlock();
+
+    if (rv > 0) {
+        stats.totalPersisted++;
+    }
+    cb.callback(rv);
+}
+
+bool MemoryKVStore::delVBucket(uint16_t vbucket, uint16_t vb_version,
+                               std::pair<int64_t, int64_t> row_range) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shard &s = *shards[i];
+        LockHolder lh(s.mutex);
+        std::map<int64_t, row*>::iterator it = s.rows.lower_bound(row_range.first);
+        while (it != s.rows.end() && it->first <= row_range.second) {
+            row *r = it->second;
+            if (r->item.getVBucketId() == vbucket && r->vb_version <= vb_version) {
+                std::pair<uint16_t, std::string> k(vbucket, r->item.getKey());
+                std::map<std::pair<uint16_t, std::string>, int64_t>::iterator ki;
+                ki = s.keys.find(k);
+                if (ki != s.keys.end() && ki->second == it->first) {
+                    s.keys.erase(ki);
+                }
+                delete r;
+                s.rows.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+    ++stats.io_num_write;
+    return true;
+}
+
+std::map<std::pair<uint16_t, uint16_t>, std::string>
+MemoryKVStore::listPersistedVbuckets() {
+    LockHolder lh(mainMutex);
+    return vbStates;
+}
+
+bool MemoryKVStore::snapshotStats(const std::map<std::string, std::string> &m) {
+    LockHolder lh(mainMutex);
+    statsSnap = m;
+    return true;
+}
+
+bool MemoryKVStore::snapshotVBuckets(const std::map<std::pair<uint16_t, uint16_t>,
+                                                    std::string> &m) {
+    LockHolder lh(mainMutex);
+    vbStates = m;
+    return true;
+}
+
+void MemoryKVStore::dump(Callback<GetValue> &cb) {
+    for (size_t i = 0; i < shards.size(); ++i) {
+        dump(i, cb);
+    }
+}
+
+void MemoryKVStore::dump(size_t sh, Callback<GetValue> &cb) {
+    dumpShard(sh, false, cb);
+}
+
+void MemoryKVStore::dumpKeys(size_t sh, Callback<GetValue> &cb) {
+    dumpShard(sh, true, cb);
+}
+
+GetValue MemoryKVStore::dumped(const row &r, bool keysOnly) {
+    const Item &itm = r.item;
+    ++stats.io_num_read;
+    Item *rv;
+    if (keysOnly) {
+        stats.io_read_bytes += itm.getKey().length();
+        rv = new Item(itm.getKey().data(), itm.getKey().length(),
+                      static_cast<size_t>(itm.getNBytes()), itm.getFlags(),
+                      itm.getExptime(), itm.getCas(), itm.getId(),
+                      itm.getVBucketId(), false);
+    } else {
+        stats.io_read_bytes += itm.getKey().length() + itm.getNBytes();
+        rv = new Item(itm.getKey(), itm.getFlags(), itm.getExptime(),
+                      itm.getValue(), itm.getCas(), itm.getId(),
+                      itm.getVBucketId());
+    }
+    return GetValue(rv, ENGINE_SUCCESS, -1, r.vb_version);
+}
+
+void MemoryKVStore::dumpShard(size_t sh, bool keysOnly, Callback<GetValue> &cb) {
+    time_t now = ep_real_time();
+    shard &s = *shards.at(sh);
+    LockHolder lh(s.mutex);
+    std::map<int64_t, row*>::iterator it;
+    for (it = s.rows.begin(); it != s.rows.end(); ++it) {
+        const Item &itm = it->second->item;
+        if (itm.getExptime() != 0 && itm.getExptime() <= now) {
+            continue;
+        }
+        GetValue gv(dumped(*it->second, keysOnly));
+        cb.callback(gv);
+    }
+}
+
+int64_t MemoryKVStore::dumpShardFrom(size_t sh, int64_t after, size_t limit,
+                                     bool keysOnly, Callback<GetValue> &cb) {
+    time_t now = ep_real_time();
+    std::vector<GetValue> items;
+    shard &s = *shards.at(sh);
+    LockHolder lh(s.mutex);
+    std::map<int64_t, row*>::iterator it = s.rows.upper_bound(after);
+    for (; it != s.rows.end() && items.size() < limit; ++it) {
+        const Item &itm = it->second->item;
+        if (itm.getExptime() != 0 && itm.getExptime() <= now) {
+            continue;
+        }
+        items.push_back(dumped(*it->second, keysOnly));
+    }
+    bool done = it == s.rows.end();
+    lh.unlock();
+
+    std::vector<GetValue>::iterator gv;
+    for (gv = items.begin(); gv != items.end(); ++gv) {
+        after = gv->getValue()->getId();
+        cb.callback(*gv);
+    }
+    return done ? -1 : after;
+}
@@ -0,0 +1,172 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef MEMORY_KVSTORE_HH
+#define MEMORY_KVSTORE_HH 1
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "common.hh"
+#include "atomic.hh"
+#include "hash.hh"
+#include "kvstore.hh"
+#include "locks.hh"
+#include "stats.hh"
+
+/**
+ * A KVStore keeping everything in memory, for measuring the engine
+ * without the cost of a database.
+ *
+ * Nothing survives the engine; transactions do nothing.  Each shard
+ * has a lock of its own, so flushers of different shards don't wait
+ * for each other.
+ */
+class MemoryKVStore : public KVStore {
+public:
+
+    /**
+     * Create an empty store.
+     *
+     * @param st the stats to count reads and writes in
+     * @param n the number of shards
+     * @param h the hash mapping keys to shards
+     */
+    MemoryKVStore(EPStats &st, size_t n = 1, hash_function_t h = djb_hash);
+
+    ~MemoryKVStore();
+
+    void reset();
+
+    void reset(size_t sh);
+
+    size_t getNumShards() {
+        return shards.size();
+    }
+
+    size_t getShardId(const std::string &key) {
+        return shardHash(key.data(), key.size()) % shards.size();
+    }
+
+    bool begin() {
+        return true;
+    }
+
+    bool begin(size_t sh) {
+        (void)sh;
+        return true;
+    }
+
+    bool commit() {
+        return true;
+    }
+
+    bool commit(size_t sh) {
+        (void)sh;
+        return true;
+    }
+
+    void rollback() {}
+
+    void set(const Item &item, uint16_t vb_version, Callback<mutation_result> &cb);
+
+    void setMany(std::vector<batched_set> &batch);
+
+    void get(const std::string &key, uint64_t rowid, Callback<GetValue> &cb);
+
+    void getByKey(const std::string &key, uint16_t vbucket,
+                  uint16_t vb_version, Callback<GetValue> &cb);
+
+    void getIds(std::vector<key_lookup> &lookups);
+
+    void getMany(const std::vector<std::pair<int64_t, std::string> > &ids,
+                 Callback<GetValue> &cb);
+
+    void del(const std::string &key, uint64_t rowid, Callback<int> &cb);
+
+    bool delVBucket(uint16_t vbucket, uint16_t vb_version,
+                    std::pair<int64_t, int64_t> row_range);
+
+    std::map<std::pair<uint16_t, uint16_t>, std::string> listPersistedVbuckets();
+
+    bool snapshotStats(const std::map<std::string, std::string> &m);
+
+    bool snapshotVBuckets(const std::map<std::pair<uint16_t, uint16_t>, std::string> &m);
+
+    void dump(Callback<GetValue> &cb);
+
+    size_t getNumDumpShards() {
+        return shards.size();
+    }
+
+    void dump(size_t sh, Callback<GetValue> &cb);
+
+    void dumpKeys(size_t sh, Callback<GetValue> &cb);
+
+    int64_t dumpFrom(size_t sh, int64_t after, size_t limit,
+                     Callback<GetValue> &cb) {
+        return dumpShardFrom(sh, after, limit, false, cb);
+    }
+
+    int64_t dumpKeysFrom(size_t sh, int64_t after, size_t limit,
+                         Callback<GetValue> &cb) {
+        return dumpShardFrom(sh, after, limit, true, cb);
+    }
+
+private:
+
+    /**
+     * A stored item (sharing the value it was written with) and the
+     * version of its vbucket it was written at.
+     */
+    struct row {
+        row(const Item &i, int64_t id, uint16_t v)
+            : item(i.getKey(), i.getFlags(), i.getExptime(), i.getValue(),
+                   i.getCas(), id, i.getVBucketId()),
+              vb_version(v) {}
+
+        Item     item;
+        uint16_t vb_version;
+
+        DISALLOW_COPY_AND_ASSIGN(row);
+    };
+
+    /**
+     * The items of a shard by ID, and the IDs by vbucket and key.
+     */
+    struct shard {
+        ~shard() {
+            clear();
+        }
+
+        void clear();
+
+        Mutex                                                    mutex;
+        std::map<int64_t, row*>                                  rows;
+        std::map<std::pair<uint16_t, std::string>, int64_t>      keys;
+    };
+
+    shard &forKey(const std::string &key) {
+        return *shards[getShardId(key)];
+    }
+
+    GetValue found(const std::string &key, const row &r);
+
+    GetValue dumped(const row &r, bool keysOnly);
+
+    void dumpShard(size_t sh, bool keysOnly, Callback<GetValue> &cb);
+
+    int64_t dumpShardFrom(size_t sh, int64_t after, size_t limit,
+                          bool keysOnly, Callback<GetValue> &cb);
+
+    EPStats                                               &stats;
+    hash_function_t                                        shardHash;
+    std::vector<shard*>                                    shards;
+    Atomic<int64_t>                                        lastRowId;
+    Mutex                                                  mainMutex;
+    std::map<std::pair<uint16_t, uint16_t>, std::string>   vbStates;
+    std::map<std::string, std::string>                     statsSnap;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryKVStore);
+};
+
+#endif /* MEMORY_KVSTORE_HH */
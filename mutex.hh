@@ -9,9 +9,12 @@
 #include <cerrno>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 #include "common.hh"
 
+template <typename M> class MultiLockHolder;
+
 /**
  * Abstraction built on top of pthread mutexes
  */
@@ -43,9 +46,9 @@ protected:
 
     // The holders of locks twiddle these flags.
     friend class LockHolder;
-    friend class MultiLockHolder;
+    template <typename M> friend class MultiLockHolder;
 
-    void acquire() {
+    virtual void acquire() {
         int e;
         if ((e = pthread_mutex_lock(&mutex)) != 0) {
             std::string message = "MUTEX ERROR: Failed to acquire lock: ";
@@ -55,7 +58,7 @@ protected:
         setHolder();
     }
 
-    void release() {
+    virtual void release() {
 #ifndef WIN32
         assert(holder == pthread_self());
         holder = 0;
@@ -82,4 +85,122 @@ protected:
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
 
+//! Size of a cache line, for keeping hot locks off each other's lines.
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Contention counters of an AdaptiveMutex.
+ */
+struct mutex_stats {
+    mutex_stats() : acquisitions(0), contended(0), blocked(0),
+                    waitTime(0), maxWait(0) {}
+
+    size_t   acquisitions;      //!< Number of times the lock was taken.
+    size_t   contended;         //!< Acquisitions that found it held.
+    size_t   blocked;           //!< Acquisitions that had to sleep for it.
+    hrtime_t waitTime;          //!< Total time (ns) spent waiting for it.
+    hrtime_t maxWait;           //!< Longest wait (ns) for it.
+};
+
+/**
+ * A mutex that spins for a while before blocking when it's contended.
+ *
+ * Like glibc's adaptive mutexes, the number of spins is adjusted to
+ * how long the lock has recently taken to become free, up to a
+ * configured maximum (0 never spins, which is right on a single CPU).
+ *
+ * It can also count how often and how long it was waited for; the
+ * counters are only updated while the lock is held.
+ */
+class AdaptiveMutex : public Mutex {
+public:
+    AdaptiveMutex() : maxSpins(0), spins(0), tracking(false) {}
+
+    /**
+     * Set the most times a contended acquire spins before blocking.
+     */
+    void setMaxSpins(uint32_t to) {
+        maxSpins = to;
+    }
+
+    /**
+     * Turn contention counting on or off.
+     */
+    void setTracking(bool to) {
+        tracking = to;
+    }
+
+    /**
+     * Get the contention counters (only maintained when tracking).
+     */
+    mutex_stats getStats() const {
+        return stats;
+    }
+
+protected:
+    void acquire() {
+        if (pthread_mutex_trylock(&mutex) == 0) {
+            setHolder();
+            if (tracking) {
+                ++stats.acquisitions;
+            }
+            return;
+        }
+
+        hrtime_t start = tracking ? gethrtime() : 0;
+        uint32_t limit = std::min(maxSpins, spins * 2 + 10);
+        uint32_t n = 0;
+        bool acquired = false;
+        while (n < limit) {
+            ++n;
+            cpuRelax();
+            if (pthread_mutex_trylock(&mutex) == 0) {
+                acquired = true;
+                break;
+            }
+        }
+        if (acquired) {
+            setHolder();
+        } else {
+            Mutex::acquire();
+        }
+        spins += (static_cast<int32_t>(n) - static_cast<int32_t>(spins)) / 8;
+
+        if (tracking) {
+            hrtime_t waited = gethrtime() - start;
+            ++stats.acquisitions;
+            ++stats.contended;
+            if (!acquired) {
+                ++stats.blocked;
+            }
+            stats.waitTime += waited;
+            stats.maxWait = std::max(stats.maxWait, waited);
+        }
+    }
+
+private:
+    static void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__("pause" ::: "memory");
+#endif
+    }
+
+    uint32_t    maxSpins;
+    uint32_t    spins;
+    bool        tracking;
+    mutex_stats stats;
+
+    DISALLOW_COPY_AND_ASSIGN(AdaptiveMutex);
+};
+
+/**
+ * A lock padded out to fill whole cache lines, so arrays of them
+ * (allocated CACHE_LINE_SIZE aligned) don't false share.
+ */
+template <typename M>
+class CacheLinePadded : public M {
+private:
+    char padding[CACHE_LINE_SIZE - sizeof(M) % CACHE_LINE_SIZE];
+};
+
 #endif
@@ -0,0 +1,253 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef PAGING_VISITOR_HH
+#define PAGING_VISITOR_HH 1
+
+#include <cstdlib>
+#include <algorithm>
+#include <list>
+#include <string>
+#include <utility>
+
+#include "common.hh"
+#include "stats.hh"
+#include "stored-value.hh"
+#include "vbucket.hh"
+
+//! Most times the clock goes around in a single pager run.
+static const int maxSweeps = MAX_TEMPERATURE + 1;
+//! Values expiring within this many seconds are preferred for ejection.
+static const time_t expiryHorizon = 300;
+//! Values this many times larger than average are preferred for ejection.
+static const size_t largeValueFactor = 2;
+
+/**
+ * As part of the ItemPager, visit all of the objects in memory and
+ * eject some of them.
+ *
+ * By default values are ejected at random with a given probability.
+ * With a clock (see startClock), the visit sweeps over the values
+ * until enough memory was freed, ejecting the cold ones and letting
+ * the others cool down for the next sweep.  Large values and values
+ * about to expire get ejected a sweep earlier than the rest.
+ */
+class PagingVisitor : public ParallelVBucketVisitor {
+public:
+
+    /**
+     * Construct a PagingVisitor that will attempt to evict the given
+     * percentage of objects.
+     *
+     * @param pcnt percentage of objects to attempt to evict (0-1)
+     * @param full true if clean objects should be evicted altogether
+     */
+    PagingVisitor(EPStats &st, double pcnt, bool full = false) :
+        stats(st), percent(pcnt), fullEviction(full), clock(false),
+        target(0), freed(0), hand(0), sweeps(0), valueBytes(0),
+        valuesSeen(0), ejected(0), failedEjects(0), warmSkips(0),
+        startTime(ep_real_time()) {}
+
+    /**
+     * Pick values by a clock instead of at random.
+     *
+     * @param bytes the amount of memory to free
+     * @param from the vbucket to start the first sweep at
+     */
+    void startClock(size_t bytes, uint16_t from) {
+        clock = true;
+        target = bytes;
+        hand = from;
+    }
+
+    bool visitBucket(RCPtr<VBucket> vb) {
+        if (clock) {
+            if (done() || (sweeps == 0 && vb->getId() < hand)) {
+                return false;
+            }
+            hand = vb->getId();
+        }
+        return VBucketVisitor::visitBucket(vb);
+    }
+
+    bool shouldContinue() {
+        return !clock || !done();
+    }
+
+    void visit(StoredValue *v) {
+
+        // Remember expired objects -- we're going to delete them.
+        if (v->isExpired(startTime)) {
+            if (sweeps == 0) {
+                expired.push_back(std::make_pair(currentBucket->getId(), v->getKey()));
+            }
+            return;
+        }
+
+        if (clock) {
+            sweep(v);
+            return;
+        }
+
+        double r = static_cast<double>(std::rand()) / static_cast<double>(RAND_MAX);
+        if (percent >= r) {
+            eject(v);
+        }
+    }
+
+    /**
+     * Prepare for another sweep of the clock.
+     *
+     * @return false if the visit is over
+     */
+    bool visitAgain() {
+        return clock && !done() && ++sweeps < maxSweeps;
+    }
+
+    ParallelVBucketVisitor *fork(size_t parts) {
+        PagingVisitor *pv = new PagingVisitor(stats, percent, fullEviction);
+        if (clock) {
+            // Every share frees its part of the memory.
+            pv->startClock(target / parts + 1, hand);
+        }
+        return pv;
+    }
+
+    void join(ParallelVBucketVisitor &part) {
+        PagingVisitor &other = static_cast<PagingVisitor&>(part);
+        expired.splice(expired.end(), other.expired);
+        evicted.splice(evicted.end(), other.evicted);
+        ejected += other.ejected;
+        failedEjects += other.failedEjects;
+        warmSkips += other.warmSkips;
+        other.ejected = other.failedEjects = other.warmSkips = 0;
+        if (other.clock && other.done()) {
+            hand = other.hand;
+        }
+    }
+
+    /**
+     * True once the clock freed as much memory as it was asked to.
+     */
+    bool done() { return freed >= target; }
+
+    /**
+     * Get the vbucket the clock stopped at.
+     */
+    uint16_t getHand() { return hand; }
+
+    /**
+     * Get the number of items ejected during the visit.
+     */
+    size_t numEjected() { return ejected; }
+
+    /**
+     * Get the number of ejection failures.
+     *
+     * An ejection failure is the state when an ejection was
+     * requested, but did not work for some reason (either object was
+     * dirty, or too small, or something).
+     */
+    size_t numFailedEjects() { return failedEjects; }
+
+    /**
+     * Get the number of values spared because they were read lately.
+     */
+    size_t numWarmSkips() { return warmSkips; }
+
+    /**
+     * Take the expired items and the items to evict found so far.
+     *
+     * @param exp where to add the expired items
+     * @param evict where to add the items to evict altogether
+     */
+    void takeFound(std::list<std::pair<uint16_t, std::string> > &exp,
+                   std::list<std::pair<uint16_t, std::string> > &evict) {
+        exp.splice(exp.end(), expired);
+        evict.splice(evict.end(), evicted);
+    }
+
+    /**
+     * Get the amount of memory a pager run should free.
+     *
+     * That's enough to get down to the low water mark, plus as much
+     * again as memory use went over the high water mark, so a burst
+     * of writes that got us there doesn't take us straight back.
+     *
+     * @param current the memory in use
+     * @param lower the low water mark
+     * @param upper the high water mark
+     */
+    static double bytesToFree(double current, double lower, double upper) {
+        return std::min(current, (current - lower) + (current - upper));
+    }
+
+private:
+
+    std::list<std::pair<uint16_t, std::string> > expired;
+    std::list<std::pair<uint16_t, std::string> > evicted;
+
+    void sweep(StoredValue *v) {
+        if (done()) {
+            return;
+        }
+        bool evictable = fullEviction && v->isEvictable(ep_current_time());
+        if (!v->isResident() && !evictable) {
+            return;
+        }
+
+        size_t len = v->valLength();
+        valueBytes += len;
+        ++valuesSeen;
+
+        // Values that would cost much memory or are going away soon
+        // anyway only get a single read's worth of a second chance.
+        uint8_t spare = 0;
+        time_t exptime = v->getExptime();
+        if (len > largeValueFactor * valueBytes / valuesSeen
+            || (exptime != 0 && exptime < startTime + expiryHorizon)) {
+            spare = 1;
+        }
+
+        if (v->getTemperature() > spare) {
+            v->cool();
+            ++warmSkips;
+        } else {
+            eject(v);
+        }
+    }
+
+    void eject(StoredValue *v) {
+        if (fullEviction && v->isEvictable(ep_current_time())) {
+            // The node can't go while we're visiting its bucket.
+            evicted.push_back(std::make_pair(currentBucket->getId(), v->getKey()));
+            freed += v->size();
+        } else if (v->isInline()) {
+            // Its space is part of the item, ejecting it frees nothing.
+            ++failedEjects;
+        } else {
+            size_t len = v->valLength();
+            if (v->ejectValue(stats)) {
+                ++ejected;
+                freed += len;
+            } else {
+                ++failedEjects;
+            }
+        }
+    }
+
+    EPStats &stats;
+    double   percent;
+    bool     fullEviction;
+    bool     clock;
+    size_t   target;
+    size_t   freed;
+    uint16_t hand;
+    int      sweeps;
+    size_t   valueBytes;
+    size_t   valuesSeen;
+    size_t   ejected;
+    size_t   failedEjects;
+    size_t   warmSkips;
+    time_t   startTime;
+};
+
+#endif /* PAGING_VISITOR_HH */
@@ -24,6 +24,9 @@ const Priority Priority::VKeyStatBgFetcherPriority("vkey_stat_bg_fetcher_priorit
 const Priority Priority::NotifyVBStateChangePriority("notify_vb_state_change_priority", 4);
 const Priority Priority::FlusherPriority("flusher_priority", 5);
 const Priority Priority::ItemPagerPriority("item_pager_priority", 7);
+const Priority Priority::HTResizePriority("hashtable_resize_priority", 8);
 const Priority Priority::VBucketDeletionPriority("vbucket_deletion_priority", 9);
 const Priority Priority::VBucketPersistLowPriority("vbucket_persist_low_priority", 9);
 const Priority Priority::StatSnapPriority("statsnap_priority", 9);
+const Priority Priority::WarmupValuePriority("warmup_value_priority", 10);
+const Priority Priority::AccessScannerPriority("access_scanner_priority", 10);
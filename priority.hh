@@ -18,9 +18,12 @@ public:
     static const Priority NotifyVBStateChangePriority;
     static const Priority FlusherPriority;
     static const Priority ItemPagerPriority;
+    static const Priority HTResizePriority;
     static const Priority VBucketDeletionPriority;
     static const Priority VBucketPersistLowPriority;
     static const Priority StatSnapPriority;
+    static const Priority WarmupValuePriority;
+    static const Priority AccessScannerPriority;
 
     bool operator==(const Priority &other) const {
         return other.getPriorityValue() == this->priority;
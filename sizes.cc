@@ -43,6 +43,7 @@ int main(int argc, char **argv) {
     display("Blob", sizeof(Blob));
     display("value_t", sizeof(value_t));
     display("HashTable", sizeof(HashTable));
+    display("SlabAllocator", sizeof(SlabAllocator));
     display("Item", sizeof(Item));
     display("QueuedItem", sizeof(QueuedItem));
     display("VBucket", sizeof(VBucket));
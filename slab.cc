@@ -0,0 +1,220 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "slab.hh"
+
+// The header occupies the first chunks of every slab.
+static const size_t slabHeaderSize = ((sizeof(slab_header) + SLAB_CHUNK_ALIGN - 1)
+                                      / SLAB_CHUNK_ALIGN) * SLAB_CHUNK_ALIGN;
+
+// Slabs shared by all allocators: the rest of the last arena mapped,
+// and the slabs given back, linked through their first word.
+static SpinLock arenaLock;
+static char *arenaNext(NULL);
+static char *arenaEnd(NULL);
+static void *spareSlabs(NULL);
+
+/**
+ * Get a SLAB_SIZE aligned region of SLAB_ARENA_SIZE bytes straight
+ * from the kernel.
+ *
+ * posix_memalign leaves a lot of unusable padding behind for
+ * allocations this size, which defeats the purpose of the slabs.
+ */
+static char *mapArena() {
+    size_t len = SLAB_ARENA_SIZE + SLAB_SIZE;
+    char *mem = static_cast<char*>(mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANON, -1, 0));
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t addr = reinterpret_cast<uintptr_t>(mem);
+    size_t head = (SLAB_SIZE - (addr & (SLAB_SIZE - 1))) & (SLAB_SIZE - 1);
+    if (head > 0) {
+        munmap(mem, head);
+    }
+    size_t tail = len - head - SLAB_ARENA_SIZE;
+    if (tail > 0) {
+        munmap(mem + head + SLAB_ARENA_SIZE, tail);
+    }
+    return mem + head;
+}
+
+static void *getSlab() {
+    SpinLockHolder lh(&arenaLock);
+    if (spareSlabs != NULL) {
+        void *rv = spareSlabs;
+        spareSlabs = *static_cast<void**>(rv);
+        return rv;
+    }
+    if (arenaNext == arenaEnd) {
+        char *arena = mapArena();
+        if (arena == NULL) {
+            return NULL;
+        }
+        arenaNext = arena;
+        arenaEnd = arena + SLAB_ARENA_SIZE;
+    }
+    void *rv = arenaNext;
+    arenaNext += SLAB_SIZE;
+    return rv;
+}
+
+static void putSlab(void *p) {
+    // Give back all but the page holding the link; the mapping stays.
+    static const size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    if (pageSize < SLAB_SIZE) {
+        madvise(static_cast<char*>(p) + pageSize, SLAB_SIZE - pageSize,
+                MADV_DONTNEED);
+    }
+    SpinLockHolder lh(&arenaLock);
+    *static_cast<void**>(p) = spareSlabs;
+    spareSlabs = p;
+}
+
+SlabAllocator::~SlabAllocator() {
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); ++i) {
+        slab_class &c = classes[i];
+        // Anything still allocated at this point has leaked, but only
+        // the fully free slabs can be found from here.
+        while (c.partial) {
+            slab_header *s = c.partial;
+            c.partial = s->next;
+            if (s->used == 0) {
+                --c.numEmpty;
+                --freeSlabs;
+                --c.numSlabs;
+                slabBytes.decr(SLAB_SIZE);
+                stats.slabBytes.decr(SLAB_SIZE);
+                stats.slabFreeSlabs.decr(1);
+                putSlab(s);
+            }
+        }
+    }
+}
+
+slab_header *SlabAllocator::newSlab(size_t cls) {
+    void *mem = getSlab();
+    if (mem == NULL) {
+        return NULL;
+    }
+    slab_header *s = static_cast<slab_header*>(mem);
+    s->prev = s->next = NULL;
+    s->freeList = NULL;
+    s->unused = static_cast<char*>(mem) + slabHeaderSize;
+    s->used = 0;
+    s->capacity = static_cast<uint16_t>((SLAB_SIZE - slabHeaderSize) / chunkSize(cls));
+    s->cls = static_cast<uint16_t>(cls);
+
+    slabBytes.incr(SLAB_SIZE);
+    stats.slabBytes.incr(SLAB_SIZE);
+    return s;
+}
+
+void SlabAllocator::freeSlab(slab_class &c, slab_header *s) {
+    unlink(c, s);
+    --c.numSlabs;
+    slabBytes.decr(SLAB_SIZE);
+    stats.slabBytes.decr(SLAB_SIZE);
+    putSlab(s);
+}
+
+void SlabAllocator::unlink(slab_class &c, slab_header *s) {
+    if (s->prev) {
+        s->prev->next = s->next;
+    } else {
+        assert(c.partial == s);
+        c.partial = s->next;
+    }
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+    s->prev = s->next = NULL;
+}
+
+void SlabAllocator::push(slab_class &c, slab_header *s) {
+    s->prev = NULL;
+    s->next = c.partial;
+    if (c.partial) {
+        c.partial->prev = s;
+    }
+    c.partial = s;
+}
+
+void *SlabAllocator::allocate(size_t len) {
+    if (len > SLAB_MAX_CHUNK) {
+        return ::operator new(len);
+    }
+
+    size_t cls = classFor(len);
+    slab_class &c = classes[cls];
+    SpinLockHolder lh(&c.lock);
+
+    slab_header *s = c.partial;
+    if (s == NULL) {
+        s = newSlab(cls);
+        if (s == NULL) {
+            throw std::bad_alloc();
+        }
+        ++c.numSlabs;
+        push(c, s);
+    } else if (s->used == 0) {
+        --c.numEmpty;
+        --freeSlabs;
+        stats.slabFreeSlabs.decr(1);
+    }
+
+    void *rv;
+    if (s->freeList) {
+        rv = s->freeList;
+        s->freeList = *static_cast<void**>(rv);
+    } else {
+        rv = s->unused;
+        s->unused += chunkSize(cls);
+    }
+    if (++s->used == s->capacity) {
+        unlink(c, s);
+    }
+
+    usedBytes.incr(len);
+    stats.slabUsedBytes.incr(len);
+    return rv;
+}
+
+void SlabAllocator::release(void *p, size_t len) {
+    if (len > SLAB_MAX_CHUNK) {
+        ::operator delete(p);
+        return;
+    }
+
+    slab_header *s = slabFor(p);
+    assert(s->cls == classFor(len));
+    slab_class &c = classes[s->cls];
+    SpinLockHolder lh(&c.lock);
+
+    if (s->used == s->capacity) {
+        push(c, s);
+    }
+    *static_cast<void**>(p) = s->freeList;
+    s->freeList = p;
+
+    if (--s->used == 0) {
+        if (c.numEmpty > 0) {
+            // We already keep a spare for this class.
+            freeSlab(c, s);
+        } else {
+            ++c.numEmpty;
+            ++freeSlabs;
+            stats.slabFreeSlabs.incr(1);
+        }
+    }
+
+    usedBytes.decr(len);
+    stats.slabUsedBytes.decr(len);
+}
@@ -0,0 +1,126 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SLAB_HH
+#define SLAB_HH 1
+
+#include "common.hh"
+#include "atomic.hh"
+#include "stats.hh"
+
+//! Size (and alignment) of each slab.
+#define SLAB_SIZE 16384
+//! Size of the regions mapped to carve slabs from.
+#define SLAB_ARENA_SIZE (16 * 1024 * 1024)
+//! Granularity of the size classes.
+#define SLAB_CHUNK_ALIGN 8
+//! Largest chunk served from slabs; anything bigger goes to malloc.
+#define SLAB_MAX_CHUNK 512
+
+/**
+ * Header placed at the start of every slab.
+ */
+struct slab_header {
+    slab_header *prev;          //!< Previous slab with free chunks.
+    slab_header *next;          //!< Next slab with free chunks.
+    void        *freeList;      //!< Chunks released back to this slab.
+    char        *unused;        //!< Start of never-used chunks.
+    uint16_t     used;          //!< Chunks currently handed out.
+    uint16_t     capacity;      //!< Total number of chunks in this slab.
+    uint16_t     cls;           //!< The size class of this slab.
+};
+
+/**
+ * A size class of the slab allocator.
+ */
+struct slab_class {
+    slab_class() : partial(NULL), numSlabs(0), numEmpty(0) {}
+
+    SpinLock     lock;
+    //! Slabs that have at least one free chunk.
+    slab_header *partial;
+    size_t       numSlabs;
+    size_t       numEmpty;
+};
+
+/**
+ * Allocator handing out fixed size chunks carved from larger aligned
+ * slabs.
+ *
+ * Sizes are grouped into classes of SLAB_CHUNK_ALIGN bytes, so the
+ * StoredValues of a hash table (whose sizes only vary by key length)
+ * are packed densely without per-allocation malloc overhead.
+ *
+ * The slabs of all allocators come from SLAB_ARENA_SIZE regions that
+ * are mapped as needed and never unmapped, so there are few mappings
+ * and getting a slab rarely takes a system call.  Slabs that become
+ * empty go back to a free list shared by all allocators, with their
+ * pages given back to the system; each class keeps one around to
+ * avoid thrashing.
+ */
+class SlabAllocator {
+public:
+
+    SlabAllocator(EPStats &st) : stats(st) {}
+
+    ~SlabAllocator();
+
+    /**
+     * Allocate a chunk of at least len bytes.
+     *
+     * @throws std::bad_alloc if memory can't be obtained
+     */
+    void *allocate(size_t len);
+
+    /**
+     * Return a chunk previously obtained from allocate.
+     *
+     * @param p the chunk
+     * @param len the length passed to allocate
+     */
+    void release(void *p, size_t len);
+
+    /**
+     * Total bytes held in slabs.
+     */
+    size_t getSlabBytes() { return slabBytes; }
+
+    /**
+     * Bytes actually requested by the chunks handed out.
+     */
+    size_t getUsedBytes() { return usedBytes; }
+
+    /**
+     * Number of slabs that are entirely free.
+     */
+    size_t getNumFreeSlabs() { return freeSlabs; }
+
+private:
+
+    static size_t classFor(size_t len) {
+        return (len + SLAB_CHUNK_ALIGN - 1) / SLAB_CHUNK_ALIGN;
+    }
+
+    static size_t chunkSize(size_t cls) {
+        return cls * SLAB_CHUNK_ALIGN;
+    }
+
+    static slab_header *slabFor(void *p) {
+        return reinterpret_cast<slab_header*>(reinterpret_cast<uintptr_t>(p)
+                                              & ~(static_cast<uintptr_t>(SLAB_SIZE) - 1));
+    }
+
+    slab_header *newSlab(size_t cls);
+    void freeSlab(slab_class &c, slab_header *s);
+
+    static void unlink(slab_class &c, slab_header *s);
+    static void push(slab_class &c, slab_header *s);
+
+    EPStats        &stats;
+    slab_class      classes[SLAB_MAX_CHUNK / SLAB_CHUNK_ALIGN + 1];
+    Atomic<size_t>  slabBytes;
+    Atomic<size_t>  usedBytes;
+    Atomic<size_t>  freeSlabs;
+
+    DISALLOW_COPY_AND_ASSIGN(SlabAllocator);
+};
+
+#endif /* SLAB_HH */
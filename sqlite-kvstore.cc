@@ -2,6 +2,9 @@
 #include "config.h"
 #include <string.h>
 #include <cstdlib>
+#include <algorithm>
+#include <set>
+#include <stdexcept>
 
 #include "sqlite-kvstore.hh"
 #include "sqlite-pst.hh"
@@ -9,14 +12,14 @@
 
 StrategicSqlite3::StrategicSqlite3(EventuallyPersistentEngine &theEngine, SqliteStrategy *s) :
     engine(theEngine), stats(engine.getEpStats()), strategy(s),
-    intransaction(false) {
+    mainConn(NULL) {
     open();
 }
 
 
-int64_t StrategicSqlite3::lastRowId() {
-    assert(db);
-    return static_cast<int64_t>(sqlite3_last_insert_rowid(db));
+int64_t StrategicSqlite3::lastRowId(sqlite3 *dbh) {
+    assert(dbh);
+    return static_cast<int64_t>(sqlite3_last_insert_rowid(dbh));
 }
 
 void StrategicSqlite3::insert(const Item &itm, uint16_t vb_version,
@@ -40,7 +43,7 @@ void StrategicSqlite3::insert(const Item &itm, uint16_t vb_version,
         stats.totalPersisted++;
     }
 
-    int64_t newId = lastRowId();
+    int64_t newId = lastRowId(forKey(itm.getKey()).db);
 
     std::pair<int, int64_t> p(rv, newId);
     cb.callback(p);
@@ -73,10 +76,138 @@ void StrategicSqlite3::update(const Item &itm, uint16_t vb_version,
     upd_stmt->reset();
 }
 
+// Rows written by one statement of setMany, staying well under
+// sqlite's default limit of 999 bindings.
+static const size_t maxBatchRows = 100;
+
+int StrategicSqlite3::bindItem(PreparedStatement *st, int pos,
+                               const batched_set &bs) {
+    const Item &itm = *bs.item;
+    st->bind(pos++, itm.getKey());
+    st->bind(pos++, const_cast<Item&>(itm).getData(), itm.getNBytes());
+    st->bind(pos++, itm.getFlags());
+    st->bind(pos++, itm.getExptime());
+    st->bind64(pos++, itm.getCas());
+    st->bind(pos++, itm.getVBucketId());
+    st->bind(pos++, bs.vb_version);
+
+    ++stats.io_num_write;
+    stats.io_write_bytes += itm.getKey().length() + itm.getNBytes();
+    return pos;
+}
+
+void StrategicSqlite3::insertMany(connection &c, Statements *st,
+                                  std::vector<batched_set> &items) {
+    for (size_t start = 0; start < items.size(); start += maxBatchRows) {
+        size_t n = std::min(maxBatchRows, items.size() - start);
+        PreparedStatement *ins_stmt = st->ins_many(n);
+        int pos = 1;
+        for (size_t i = start; i < start + n; ++i) {
+            assert(items[i].item->getId() <= 0);
+            pos = bindItem(ins_stmt, pos, items[i]);
+        }
+
+        int rv = ins_stmt->execute();
+        bool inserted = rv == static_cast<int>(n);
+        // The rows got consecutive rowids, the last one being last.
+        int64_t firstId = inserted ? lastRowId(c.db) - static_cast<int64_t>(n) + 1 : 0;
+        ins_stmt->reset();
+
+        for (size_t i = 0; i < n; ++i) {
+            mutation_result p(inserted ? 1 : -1,
+                              inserted ? firstId + static_cast<int64_t>(i) : 0);
+            if (inserted) {
+                stats.totalPersisted++;
+            }
+            items[start + i].cb->callback(p);
+        }
+    }
+}
+
+void StrategicSqlite3::updateMany(Statements *st, std::vector<batched_set> &items) {
+    for (size_t start = 0; start < items.size(); start += maxBatchRows) {
+        size_t n = std::min(maxBatchRows, items.size() - start);
+
+        // Replacing a row that's gone would bring it back, so only
+        // the rows still there are written; the others are reported
+        // as not updated, as update() would.
+        std::set<int64_t> existing;
+        PreparedStatement *sel_stmt = st->sel_rowids(n);
+        for (size_t i = 0; i < n; ++i) {
+            sel_stmt->bind64(static_cast<int>(i + 1), items[start + i].item->getId());
+        }
+        bool failed = false;
+        try {
+            while (sel_stmt->fetch()) {
+                existing.insert(static_cast<int64_t>(sel_stmt->column_int64(0)));
+            }
+        } catch (std::runtime_error &e) {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to look up rows to update: %s\n", e.what());
+            failed = true;
+        }
+        sel_stmt->reset();
+
+        if (!failed && !existing.empty()) {
+            PreparedStatement *rep_stmt = st->rep_many(existing.size());
+            int pos = 1;
+            for (size_t i = start; i < start + n; ++i) {
+                int64_t id = items[i].item->getId();
+                if (existing.find(id) != existing.end()) {
+                    rep_stmt->bind64(pos++, id);
+                    pos = bindItem(rep_stmt, pos, items[i]);
+                }
+            }
+            failed = rep_stmt->execute() < 0;
+            rep_stmt->reset();
+        }
+
+        for (size_t i = start; i < start + n; ++i) {
+            int rv = -1;
+            if (!failed) {
+                rv = existing.find(items[i].item->getId()) != existing.end() ? 1 : 0;
+            }
+            if (rv == 1) {
+                stats.totalPersisted++;
+            }
+            mutation_result p(rv, 0);
+            items[i].cb->callback(p);
+        }
+    }
+}
+
+void StrategicSqlite3::setMany(std::vector<batched_set> &batch) {
+    // Inserts and updates of every table.
+    std::map<Statements*, std::pair<std::vector<batched_set>,
+                                    std::vector<batched_set> > > groups;
+    std::vector<batched_set>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        std::pair<std::vector<batched_set>, std::vector<batched_set> > &shard =
+            groups[strategy->forKey(it->item->getKey())];
+        if (it->item->getId() <= 0) {
+            shard.first.push_back(*it);
+        } else {
+            shard.second.push_back(*it);
+        }
+    }
+
+    std::map<Statements*, std::pair<std::vector<batched_set>,
+                                    std::vector<batched_set> > >::iterator s;
+    for (s = groups.begin(); s != groups.end(); ++s) {
+        const batched_set &first = s->second.first.empty() ?
+            s->second.second.front() : s->second.first.front();
+        connection &c = forKey(first.item->getKey());
+        LockHolder lh(c.mutex);
+        insertMany(c, s->first, s->second.first);
+        updateMany(s->first, s->second.second);
+    }
+}
+
 std::map<std::pair<uint16_t, uint16_t>, std::string>
 StrategicSqlite3::listPersistedVbuckets() {
     std::map<std::pair<uint16_t, uint16_t>, std::string> rv;
 
+    LockHolder lh(mainConn->mutex);
     PreparedStatement *st = strategy->getGetVBucketStateST();
 
     while (st->fetch()) {
@@ -92,6 +223,7 @@ StrategicSqlite3::listPersistedVbuckets() {
 
 void StrategicSqlite3::set(const Item &itm, uint16_t vb_version,
                            Callback<mutation_result> &cb) {
+    LockHolder lh(forKey(itm.getKey()).mutex);
     if (itm.getId() <= 0) {
         insert(itm, vb_version, cb);
     } else {
@@ -101,6 +233,7 @@ void StrategicSqlite3::set(const Item &itm, uint16_t vb_version,
 
 void StrategicSqlite3::get(const std::string &key,
                            uint64_t rowid, Callback<GetValue> &cb) {
+    LockHolder lh(forKey(key).mutex);
     PreparedStatement *sel_stmt = strategy->forKey(key)->sel();
     sel_stmt->bind64(1, rowid);
 
@@ -125,6 +258,152 @@ void StrategicSqlite3::get(const std::string &key,
     sel_stmt->reset();
 }
 
+void StrategicSqlite3::getByKey(const std::string &key, uint16_t vbucket,
+                                uint16_t vb_version, Callback<GetValue> &cb) {
+    LockHolder lh(forKey(key).mutex);
+    PreparedStatement *sel_stmt = strategy->forKey(key)->sel_key();
+    sel_stmt->bind(1, key);
+    sel_stmt->bind(2, vbucket);
+    sel_stmt->bind(3, vb_version);
+
+    ++stats.io_num_read;
+
+    if(sel_stmt->fetch()) {
+        GetValue rv(new Item(key.data(),
+                             static_cast<uint16_t>(key.length()),
+                             sel_stmt->column_int(1),
+                             sel_stmt->column_int(2),
+                             sel_stmt->column_blob(0),
+                             sel_stmt->column_bytes(0),
+                             sel_stmt->column_int64(3),
+                             sel_stmt->column_int64(4),
+                             static_cast<uint16_t>(sel_stmt->column_int(5))));
+        stats.io_read_bytes += key.length() + rv.getValue()->getNBytes();
+        cb.callback(rv);
+    } else {
+        GetValue rv;
+        cb.callback(rv);
+    }
+    sel_stmt->reset();
+}
+
+void StrategicSqlite3::getIdsMany(Statements *st,
+                                  std::vector<key_lookup*> &lookups) {
+    for (size_t start = 0; start < lookups.size(); start += maxBatchRows) {
+        size_t n = std::min(maxBatchRows, lookups.size() - start);
+        std::map<std::pair<uint16_t, std::string>, key_lookup*> wanted;
+        PreparedStatement *sel_stmt = st->sel_keys(n);
+        for (size_t i = 0; i < n; ++i) {
+            key_lookup *l = lookups[start + i];
+            sel_stmt->bind(static_cast<int>(i + 1), l->key);
+            wanted[std::make_pair(l->vbucket, l->key)] = l;
+        }
+
+        ++stats.io_num_read;
+        try {
+            while (sel_stmt->fetch()) {
+                std::string k(static_cast<const char*>(sel_stmt->column_blob(0)),
+                              static_cast<size_t>(sel_stmt->column_bytes(0)));
+                uint16_t vbucket = static_cast<uint16_t>(sel_stmt->column_int(1));
+                std::map<std::pair<uint16_t, std::string>, key_lookup*>::iterator it;
+                it = wanted.find(std::make_pair(vbucket, k));
+                if (it != wanted.end()
+                    && it->second->vb_version == sel_stmt->column_int(2)) {
+                    it->second->id = sel_stmt->column_int64(3);
+                }
+            }
+        } catch (std::runtime_error &e) {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to look up rows by key: %s\n", e.what());
+        }
+        sel_stmt->reset();
+    }
+}
+
+void StrategicSqlite3::getIds(std::vector<key_lookup> &lookups) {
+    // The keys of every table.
+    std::map<Statements*, std::vector<key_lookup*> > groups;
+    std::vector<key_lookup>::iterator it;
+    for (it = lookups.begin(); it != lookups.end(); ++it) {
+        groups[strategy->forKey(it->key)].push_back(&*it);
+    }
+
+    std::map<Statements*, std::vector<key_lookup*> >::iterator s;
+    for (s = groups.begin(); s != groups.end(); ++s) {
+        LockHolder lh(forKey(s->second.front()->key).mutex);
+        getIdsMany(s->first, s->second);
+    }
+}
+
+void StrategicSqlite3::getManyRows(Statements *st,
+                                   std::vector<const std::pair<int64_t, std::string>*> &rows,
+                                   Callback<GetValue> &cb) {
+    for (size_t start = 0; start < rows.size(); start += maxBatchRows) {
+        size_t n = std::min(maxBatchRows, rows.size() - start);
+        std::map<int64_t, const std::string*> wanted;
+        PreparedStatement *sel_stmt = st->sel_many(n);
+        for (size_t i = 0; i < n; ++i) {
+            const std::pair<int64_t, std::string> *r = rows[start + i];
+            sel_stmt->bind64(static_cast<int>(i + 1), r->first);
+            wanted[r->first] = &r->second;
+        }
+
+        try {
+            while (sel_stmt->fetch()) {
+                std::map<int64_t, const std::string*>::iterator it;
+                it = wanted.find(sel_stmt->column_int64(4));
+                if (it == wanted.end()) {
+                    continue;
+                }
+                const std::string &key = *it->second;
+                ++stats.io_num_read;
+                GetValue rv(new Item(key.data(),
+                                     static_cast<uint16_t>(key.length()),
+                                     sel_stmt->column_int(1),
+                                     sel_stmt->column_int(2),
+                                     sel_stmt->column_blob(0),
+                                     sel_stmt->column_bytes(0),
+                                     sel_stmt->column_int64(3),
+                                     sel_stmt->column_int64(4),
+                                     static_cast<uint16_t>(sel_stmt->column_int(5))));
+                stats.io_read_bytes += key.length() + rv.getValue()->getNBytes();
+                cb.callback(rv);
+            }
+        } catch (std::runtime_error &e) {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to read rows by id: %s\n", e.what());
+        }
+        sel_stmt->reset();
+    }
+}
+
+void StrategicSqlite3::getMany(const std::vector<std::pair<int64_t, std::string> > &ids,
+                               Callback<GetValue> &cb) {
+    // The rows of every table.
+    std::map<Statements*, std::vector<const std::pair<int64_t, std::string>*> > groups;
+    std::vector<std::pair<int64_t, std::string> >::const_iterator it;
+    for (it = ids.begin(); it != ids.end(); ++it) {
+        groups[strategy->forKey(it->second)].push_back(&*it);
+    }
+
+    std::map<Statements*, std::vector<const std::pair<int64_t, std::string>*> >::iterator s;
+    for (s = groups.begin(); s != groups.end(); ++s) {
+        LockHolder lh(forKey(s->second.front()->second).mutex);
+        getManyRows(s->first, s->second, cb);
+    }
+}
+
+void StrategicSqlite3::reset(size_t shard) {
+    if (shards.size() == 1) {
+        reset();
+        return;
+    }
+    connection &c = *shards.at(shard);
+    LockHolder lh(c.mutex);
+    rollback_UNLOCKED(c);
+    strategy->clearShard(shard);
+}
+
 void StrategicSqlite3::reset() {
     if (db) {
         rollback();
@@ -139,6 +418,7 @@ void StrategicSqlite3::reset() {
 
 void StrategicSqlite3::del(const std::string &key, uint64_t rowid,
                            Callback<int> &cb) {
+    LockHolder lh(forKey(key).mutex);
     PreparedStatement *del_stmt = strategy->forKey(key)->del();
     del_stmt->bind64(1, rowid);
     int rv = del_stmt->execute();
@@ -150,6 +430,7 @@ void StrategicSqlite3::del(const std::string &key, uint64_t rowid,
 }
 
 void StrategicSqlite3::delInvalidItem(const std::string &key, uint64_t rowid) {
+    LockHolder lh(forKey(key).mutex);
     PreparedStatement *del_stmt = strategy->forKey(key)->del();
     del_stmt->bind64(1, rowid);
     int rv = del_stmt->execute();
@@ -163,9 +444,9 @@ bool StrategicSqlite3::delVBucket(uint16_t vbucket, uint16_t vb_version,
                                   std::pair<int64_t, int64_t> row_range) {
     bool rv = true;
     const std::vector<Statements*> statements = strategy->allStatements();
-    std::vector<Statements*>::const_iterator it;
-    for (it = statements.begin(); it != statements.end(); ++it) {
-        PreparedStatement *del_stmt = (*it)->del_vb();
+    for (size_t i = 0; i < statements.size(); ++i) {
+        LockHolder lh(forStatements(i).mutex);
+        PreparedStatement *del_stmt = statements[i]->del_vb();
         del_stmt->bind(1, vbucket);
         del_stmt->bind(2, vb_version);
         del_stmt->bind64(3, row_range.first);
@@ -216,7 +497,8 @@ bool StrategicSqlite3::storeMap(PreparedStatement *clearSt,
                                 const std::map<T, std::string> &m,
                                 bool pairKey) {
     bool rv(false);
-    if (!begin()) {
+    LockHolder lh(mainConn->mutex);
+    if (!begin_UNLOCKED(*mainConn)) {
         return false;
     }
     try {
@@ -227,10 +509,10 @@ bool StrategicSqlite3::storeMap(PreparedStatement *clearSt,
         map_setter<T> ms(insSt, rv, pairKey);
         std::for_each(m.begin(), m.end(), ms);
 
-        commit();
+        commit_UNLOCKED(*mainConn);
         rv = true;
     } catch(...) {
-        rollback();
+        rollback_UNLOCKED(*mainConn);
     }
     return rv;
 }
@@ -238,29 +520,113 @@ bool StrategicSqlite3::storeMap(PreparedStatement *clearSt,
 void StrategicSqlite3::dump(Callback<GetValue> &cb) {
 
     const std::vector<Statements*> statements = strategy->allStatements();
-    std::vector<Statements*>::const_iterator it;
-    for (it = statements.begin(); it != statements.end(); ++it) {
-        PreparedStatement *st = (*it)->all();
+    for (size_t i = 0; i < statements.size(); ++i) {
+        LockHolder lh(forStatements(i).mutex);
+        PreparedStatement *st = statements[i]->all();
         st->reset();
         st->bind(1, ep_real_time());
-        while (st->fetch()) {
-            ++stats.io_num_read;
-            GetValue rv(new Item(st->column_blob(0),
-                                 static_cast<uint16_t>(st->column_bytes(0)),
-                                 st->column_int(2),
-                                 st->column_int(3),
-                                 st->column_blob(1),
-                                 st->column_bytes(1),
-                                 0,
-                                 st->column_int64(7),
-                                 static_cast<uint16_t>(st->column_int(5))),
-                        ENGINE_SUCCESS,
-                        -1,
-                        static_cast<uint16_t>(st->column_int(6)));
-            stats.io_read_bytes += rv.getValue()->getKey().length() + rv.getValue()->getNBytes();
-            cb.callback(rv);
+        dumpRows(st, false, cb);
+    }
+}
+
+void StrategicSqlite3::dumpShard(size_t shard, bool keysOnly,
+                                 Callback<GetValue> &cb) {
+    std::string file(strategy->tableFile(shard));
+    sqlite3 *dbh(NULL);
+    Statements *st(NULL);
+    // An in-memory database can't be opened again.
+    if (strategy->allStatements().size() > 1 && !file.empty() && file != ":memory:"
+        && sqlite3_open_v2(file.c_str(), &dbh, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK) {
+        try {
+            st = new Statements(dbh, "kv");
+        } catch (std::runtime_error &e) {
+            getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                             "Failed to read %s over a connection of its own: %s\n",
+                             file.c_str(), e.what());
         }
+    }
 
-        st->reset();
+    LockHolder lh(forStatements(shard).mutex);
+    if (st == NULL) {
+        sqlite3_close(dbh);
+        dbh = NULL;
+        st = strategy->allStatements().at(shard);
+    } else {
+        lh.unlock();
+    }
+
+    PreparedStatement *pst = keysOnly ? st->all_keys() : st->all();
+    pst->reset();
+    pst->bind(1, ep_real_time());
+    dumpRows(pst, keysOnly, cb);
+
+    if (dbh != NULL) {
+        delete st;
+        sqlite3_close(dbh);
+    }
+}
+
+int64_t StrategicSqlite3::dumpShardFrom(size_t shard, int64_t after, size_t limit,
+                                        bool keysOnly, Callback<GetValue> &cb) {
+    std::vector<GetValue> items;
+    items.reserve(limit);
+    LockHolder lh(forStatements(shard).mutex);
+    Statements *sts = strategy->allStatements().at(shard);
+    PreparedStatement *st = keysOnly ? sts->from_keys() : sts->from();
+    st->reset();
+    st->bind64(1, static_cast<uint64_t>(after));
+    st->bind(2, ep_real_time());
+    st->bind(3, static_cast<int>(limit));
+    while (st->fetch()) {
+        items.push_back(rowValue(st, keysOnly));
+    }
+    st->reset();
+    lh.unlock();
+
+    // Don't hold up the flusher while the items are handed out.
+    std::vector<GetValue>::iterator it;
+    for (it = items.begin(); it != items.end(); ++it) {
+        after = it->getValue()->getId();
+        cb.callback(*it);
+    }
+    return items.size() < limit ? -1 : after;
+}
+
+void StrategicSqlite3::dumpRows(PreparedStatement *st, bool keysOnly,
+                                Callback<GetValue> &cb) {
+    while (st->fetch()) {
+        GetValue rv(rowValue(st, keysOnly));
+        cb.callback(rv);
+    }
+    st->reset();
+}
+
+GetValue StrategicSqlite3::rowValue(PreparedStatement *st, bool keysOnly) {
+    ++stats.io_num_read;
+    Item *itm;
+    if (keysOnly) {
+        itm = new Item(st->column_blob(0),
+                       static_cast<size_t>(st->column_bytes(0)),
+                       static_cast<size_t>(st->column_int(1)),
+                       st->column_int(2),
+                       static_cast<time_t>(st->column_int(3)),
+                       0,
+                       st->column_int64(7),
+                       static_cast<uint16_t>(st->column_int(5)),
+                       false);
+        stats.io_read_bytes += itm->getKey().length();
+    } else {
+        itm = new Item(st->column_blob(0),
+                       static_cast<uint16_t>(st->column_bytes(0)),
+                       st->column_int(2),
+                       st->column_int(3),
+                       st->column_blob(1),
+                       st->column_bytes(1),
+                       0,
+                       st->column_int64(7),
+                       static_cast<uint16_t>(st->column_int(5)));
+        stats.io_read_bytes += itm->getKey().length() + itm->getNBytes();
     }
+    return GetValue(itm, ENGINE_SUCCESS, -1,
+                    static_cast<uint16_t>(st->column_int(6)));
 }
@@ -11,29 +11,19 @@
 #include "embedded/sqlite3.h"
 #endif
 
+#include "kvstore.hh"
 #include "sqlite-pst.hh"
 #include "sqlite-strategies.hh"
-#include "item.hh"
+#include "locks.hh"
 
 class EventuallyPersistentEngine;
 class EPStats;
 
 /**
- * Result of database mutation operations.
- *
- * This is a pair where .first is the number of rows affected, and
- * .second is the ID that was generated (if any).  .second will be 0
- * on updates (not generating an ID).
- *
- * .first will be -1 if there was an error performing the update.
- *
- * .first will be 0 if the update did not error, but did not occur.
- * This would generally be considered a fatal condition (in practice,
- * it requires you to be firing an update at a missing rowid).
+ * A KVStore keeping the items in SQLite databases, laid out by a
+ * SqliteStrategy.
  */
-typedef std::pair<int, int64_t> mutation_result;
-
-class StrategicSqlite3 {
+class StrategicSqlite3 : public KVStore {
 public:
 
     /**
@@ -54,39 +44,75 @@ public:
     void reset();
 
     /**
-     * Begin a transaction (if not already in one).
+     * Remove all items from one shard.
+     *
+     * With a single shard this resets the whole database.
+     */
+    void reset(size_t shard);
+
+    /**
+     * Get the number of shards that can be written to independently
+     * (each in transactions of its own).
+     */
+    size_t getNumShards() {
+        return shards.size();
+    }
+
+    /**
+     * Get the shard holding the given key.
+     */
+    size_t getShardId(const std::string &key) {
+        return strategy->shardOf(key);
+    }
+
+    /**
+     * Begin a transaction on the main database (if not already in
+     * one).
      */
     bool begin() {
-        if(!intransaction) {
-            if (execute("begin immediate") != -1) {
-                intransaction = true;
-            }
-        }
-        return intransaction;
+        LockHolder lh(mainConn->mutex);
+        return begin_UNLOCKED(*mainConn);
+    }
+
+    /**
+     * Begin a transaction on the given shard (if not already in one).
+     */
+    bool begin(size_t shard) {
+        connection &c = *shards.at(shard);
+        LockHolder lh(c.mutex);
+        return begin_UNLOCKED(c);
     }
 
     /**
-     * Commit a transaction (unless not currently in one).
+     * Commit a transaction on the main database (unless not currently
+     * in one).
      *
      * Returns false if the commit fails.
      */
     bool commit() {
-        if(intransaction) {
-            // If commit returns -1, we're still in a transaction.
-            intransaction = (execute("commit") == -1);
-        }
-        // !intransaction == not in a transaction == committed
-        return !intransaction;
+        LockHolder lh(mainConn->mutex);
+        return commit_UNLOCKED(*mainConn);
+    }
+
+    /**
+     * Commit a transaction on the given shard (unless not currently in
+     * one).
+     *
+     * Returns false if the commit fails.
+     */
+    bool commit(size_t shard) {
+        connection &c = *shards.at(shard);
+        LockHolder lh(c.mutex);
+        return commit_UNLOCKED(c);
     }
 
     /**
-     * Rollback a transaction (unless not currently in one).
+     * Rollback a transaction on the main database (unless not
+     * currently in one).
      */
     void rollback() {
-        if(intransaction) {
-            intransaction = false;
-            execute("rollback");
-        }
+        LockHolder lh(mainConn->mutex);
+        rollback_UNLOCKED(*mainConn);
     }
 
     /**
@@ -94,11 +120,52 @@ public:
      */
     void set(const Item &item, uint16_t vb_version, Callback<mutation_result> &cb);
 
+    /**
+     * Persist many items at once.
+     *
+     * The items are grouped by the shard they belong to, and new and
+     * existing ones are each written many rows per statement.  Every
+     * item's callback is called with what set() would have given it.
+     *
+     * @param batch the items, their vbucket versions and callbacks
+     */
+    void setMany(std::vector<batched_set> &batch);
+
     /**
      * Overrides get().
      */
     void get(const std::string &key, uint64_t rowid, Callback<GetValue> &cb);
 
+    /**
+     * Get an item by its key instead of its rowid.
+     *
+     * This is much slower than get() unless the tables are indexed by
+     * key (see SqliteStrategy::setKeyIndex).
+     *
+     * @param key the key of the item
+     * @param vbucket the vbucket the item belongs to
+     * @param vb_version the current version of that vbucket
+     * @param cb called with the item, or with an ENOENT result
+     */
+    void getByKey(const std::string &key, uint16_t vbucket,
+                  uint16_t vb_version, Callback<GetValue> &cb);
+
+    /**
+     * Overrides getIds().
+     *
+     * The keys of a table are looked up a hundred at a time, so this
+     * too wants the tables indexed by key.
+     */
+    void getIds(std::vector<key_lookup> &lookups);
+
+    /**
+     * Overrides getMany().
+     *
+     * The rows of a table are read a hundred at a time.
+     */
+    void getMany(const std::vector<std::pair<int64_t, std::string> > &ids,
+                 Callback<GetValue> &cb);
+
     /**
      * Overrides del().
      */
@@ -127,25 +194,137 @@ public:
      */
     void dump(Callback<GetValue> &cb);
 
+    /**
+     * Get the number of database files holding items.
+     */
+    size_t getNumDumpShards() {
+        return strategy->allStatements().size();
+    }
+
+    /**
+     * Dump the items of one database file over a read-only connection
+     * of its own, so the files can be read from threads of their own.
+     *
+     * With only one file, that's the main database, which may be
+     * written meanwhile; it's read over the main connection.
+     */
+    void dump(size_t shard, Callback<GetValue> &cb) {
+        dumpShard(shard, false, cb);
+    }
+
+    /**
+     * Like dump(shard, cb), but only reading the length of each value.
+     */
+    void dumpKeys(size_t shard, Callback<GetValue> &cb) {
+        dumpShard(shard, true, cb);
+    }
+
+    /**
+     * Overrides dumpFrom().
+     */
+    int64_t dumpFrom(size_t shard, int64_t after, size_t limit,
+                     Callback<GetValue> &cb) {
+        return dumpShardFrom(shard, after, limit, false, cb);
+    }
+
+    /**
+     * Overrides dumpKeysFrom().
+     */
+    int64_t dumpKeysFrom(size_t shard, int64_t after, size_t limit,
+                         Callback<GetValue> &cb) {
+        return dumpShardFrom(shard, after, limit, true, cb);
+    }
+
 private:
+
+    /**
+     * A database connection, with the lock serializing its use (the
+     * shards may be written from threads of their own) and whether
+     * it's in a transaction.
+     */
+    struct connection {
+        connection(sqlite3 *d) : db(d), intransaction(false) {}
+
+        sqlite3 *db;
+        Mutex    mutex;
+        bool     intransaction;
+    };
+
     /**
      * Shortcut to execute a simple query.
      *
      * @param query a simple query with no bindings to execute directly
      */
     int execute(const char *query) {
-        PreparedStatement st(db, query);
+        return execute(db, query);
+    }
+
+    static int execute(sqlite3 *dbh, const char *query) {
+        PreparedStatement st(dbh, query);
         return st.execute();
     }
 
+    bool begin_UNLOCKED(connection &c) {
+        if(!c.intransaction) {
+            if (execute(c.db, "begin immediate") != -1) {
+                c.intransaction = true;
+            }
+        }
+        return c.intransaction;
+    }
+
+    bool commit_UNLOCKED(connection &c) {
+        if(c.intransaction) {
+            // If commit returns -1, we're still in a transaction.
+            c.intransaction = (execute(c.db, "commit") == -1);
+        }
+        // !intransaction == not in a transaction == committed
+        return !c.intransaction;
+    }
+
+    void rollback_UNLOCKED(connection &c) {
+        if(c.intransaction) {
+            c.intransaction = false;
+            execute(c.db, "rollback");
+        }
+    }
+
+    /**
+     * Get the connection of the shard holding the given key.
+     */
+    connection &forKey(const std::string &key) {
+        return *shards.at(strategy->shardOf(key));
+    }
+
+    /**
+     * Get the connection the statements at the given index of the
+     * strategy's list run on.
+     */
+    connection &forStatements(size_t idx) {
+        return shards.size() == 1 ? *shards[0] : *shards.at(idx);
+    }
+
     template <typename T>
     bool storeMap(PreparedStatement *clearSt,
                   PreparedStatement *insSt,
                   const std::map<T, std::string> &m, bool pairKey = false);
 
+    void dumpShard(size_t shard, bool keysOnly, Callback<GetValue> &cb);
+    int64_t dumpShardFrom(size_t shard, int64_t after, size_t limit,
+                          bool keysOnly, Callback<GetValue> &cb);
+    void dumpRows(PreparedStatement *st, bool keysOnly, Callback<GetValue> &cb);
+    GetValue rowValue(PreparedStatement *st, bool keysOnly);
+
     void insert(const Item &itm, uint16_t vb_version, Callback<mutation_result> &cb);
     void update(const Item &itm, uint16_t vb_version, Callback<mutation_result> &cb);
-    int64_t lastRowId();
+    void insertMany(connection &c, Statements *st, std::vector<batched_set> &items);
+    void updateMany(Statements *st, std::vector<batched_set> &items);
+    void getIdsMany(Statements *st, std::vector<key_lookup*> &lookups);
+    void getManyRows(Statements *st,
+                     std::vector<const std::pair<int64_t, std::string>*> &rows,
+                     Callback<GetValue> &cb);
+    int bindItem(PreparedStatement *st, int pos, const batched_set &bs);
+    int64_t lastRowId(sqlite3 *dbh);
 
     EventuallyPersistentEngine &engine;
     EPStats &stats;
@@ -158,18 +337,30 @@ private:
     void open() {
         assert(strategy);
         db = strategy->open();
-        intransaction = false;
+        for (size_t i = 0; i < strategy->numShards(); ++i) {
+            shards.push_back(new connection(strategy->shardDB(i)));
+        }
+        // With a single shard, it's the main database.
+        mainConn = shards.size() == 1 ? shards[0] : new connection(db);
     }
 
     void close() {
         strategy->close();
-        intransaction = false;
+        if (shards.empty() || mainConn != shards[0]) {
+            delete mainConn;
+        }
+        while (!shards.empty()) {
+            delete shards.back();
+            shards.pop_back();
+        }
+        mainConn = NULL;
         db = NULL;
     }
 
     SqliteStrategy *strategy;
 
-    bool intransaction;
+    std::vector<connection *> shards;
+    connection               *mainConn;
 };
 
 #endif /* SQLITE_BASE_H */
@@ -141,12 +141,39 @@ void Statements::initStatements() {
              "from %s where rowid = ?", tableName.c_str());
     sel_stmt = new PreparedStatement(db, buf);
 
+    // Same columns as above.
+    snprintf(buf, sizeof(buf),
+             "select v, flags, exptime, cas, rowid, vbucket "
+             "from %s where k = ? and vbucket = ? and vb_version = ?",
+             tableName.c_str());
+    sel_key_stmt = new PreparedStatement(db, buf);
+
     // k=0, v=1, flags=2, exptime=3, cas=4, vbucket=5, rowid=6
     snprintf(buf, sizeof(buf),
              "select k, v, flags, exptime, cas, vbucket, vb_version, rowid "
              "from %s where exptime = 0 or exptime > ?", tableName.c_str());
     all_stmt = new PreparedStatement(db, buf);
 
+    // Same columns, but v=1 is the length of the value.
+    snprintf(buf, sizeof(buf),
+             "select k, length(v), flags, exptime, cas, vbucket, vb_version, rowid "
+             "from %s where exptime = 0 or exptime > ?", tableName.c_str());
+    all_keys_stmt = new PreparedStatement(db, buf);
+
+    // Same columns as all.
+    snprintf(buf, sizeof(buf),
+             "select k, v, flags, exptime, cas, vbucket, vb_version, rowid "
+             "from %s where rowid > ? and (exptime = 0 or exptime > ?) "
+             "order by rowid limit ?", tableName.c_str());
+    from_stmt = new PreparedStatement(db, buf);
+
+    // Same columns as all_keys.
+    snprintf(buf, sizeof(buf),
+             "select k, length(v), flags, exptime, cas, vbucket, vb_version, rowid "
+             "from %s where rowid > ? and (exptime = 0 or exptime > ?) "
+             "order by rowid limit ?", tableName.c_str());
+    from_keys_stmt = new PreparedStatement(db, buf);
+
     snprintf(buf, sizeof(buf),
              "delete from %s where rowid = ?",
              tableName.c_str());
@@ -157,3 +184,97 @@ void Statements::initStatements() {
              "rowid between ? and ?", tableName.c_str());
     del_vb_stmt = new PreparedStatement(db, buf);
 }
+
+void Statements::destroyAll(std::map<size_t, PreparedStatement*> &cache) {
+    std::map<size_t, PreparedStatement*>::iterator it;
+    for (it = cache.begin(); it != cache.end(); ++it) {
+        delete it->second;
+    }
+    cache.clear();
+}
+
+// Multi-row values lists need a newer sqlite than we may be built
+// with, so the rows are selected and put together instead.
+static std::string selectRows(size_t rows, const char *row) {
+    std::stringstream ss;
+    for (size_t i = 0; i < rows; ++i) {
+        ss << (i == 0 ? " select " : " union all select ") << row;
+    }
+    return ss.str();
+}
+
+PreparedStatement *Statements::ins_many(size_t rows) {
+    assert(rows > 0);
+    PreparedStatement *&st = ins_many_stmts[rows];
+    if (st) {
+        return st;
+    }
+    std::string query("insert into " + tableName
+                      + " (k, v, flags, exptime, cas, vbucket, vb_version)"
+                      + selectRows(rows, "?, ?, ?, ?, ?, ?, ?"));
+    st = new PreparedStatement(db, query.c_str());
+    return st;
+}
+
+PreparedStatement *Statements::rep_many(size_t rows) {
+    assert(rows > 0);
+    PreparedStatement *&st = rep_many_stmts[rows];
+    if (st) {
+        return st;
+    }
+    std::string query("insert or replace into " + tableName
+                      + " (rowid, k, v, flags, exptime, cas, vbucket, vb_version)"
+                      + selectRows(rows, "?, ?, ?, ?, ?, ?, ?, ?"));
+    st = new PreparedStatement(db, query.c_str());
+    return st;
+}
+
+PreparedStatement *Statements::sel_rowids(size_t rows) {
+    assert(rows > 0);
+    PreparedStatement *&st = sel_rowids_stmts[rows];
+    if (st) {
+        return st;
+    }
+    std::stringstream ss;
+    ss << "select rowid from " << tableName << " where rowid in (";
+    for (size_t i = 0; i < rows; ++i) {
+        ss << (i == 0 ? "?" : ", ?");
+    }
+    ss << ")";
+    st = new PreparedStatement(db, ss.str().c_str());
+    return st;
+}
+
+PreparedStatement *Statements::sel_many(size_t rows) {
+    assert(rows > 0);
+    PreparedStatement *&st = sel_many_stmts[rows];
+    if (st) {
+        return st;
+    }
+    std::stringstream ss;
+    ss << "select v, flags, exptime, cas, rowid, vbucket from " << tableName
+       << " where rowid in (";
+    for (size_t i = 0; i < rows; ++i) {
+        ss << (i == 0 ? "?" : ", ?");
+    }
+    ss << ")";
+    st = new PreparedStatement(db, ss.str().c_str());
+    return st;
+}
+
+PreparedStatement *Statements::sel_keys(size_t rows) {
+    assert(rows > 0);
+    PreparedStatement *&st = sel_keys_stmts[rows];
+    if (st) {
+        return st;
+    }
+    std::stringstream ss;
+    ss << "select k, vbucket, vb_version, rowid from " << tableName
+       << " where k in (";
+    for (size_t i = 0; i < rows; ++i) {
+        ss << (i == 0 ? "?" : ", ?");
+    }
+    ss << ")";
+    st = new PreparedStatement(db, ss.str().c_str());
+    return st;
+}
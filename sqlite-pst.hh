@@ -2,6 +2,7 @@
 #ifndef SQLITE_PST_H
 #define SQLITE_PST_H 1
 
+#include <map>
 #include <string>
 #include <stdio.h>
 #include <inttypes.h>
@@ -176,10 +177,21 @@ public:
         delete ins_stmt;
         delete upd_stmt;
         delete sel_stmt;
+        delete sel_key_stmt;
         delete del_stmt;
         delete del_vb_stmt;
         delete all_stmt;
-        ins_stmt = upd_stmt = sel_stmt = del_stmt = del_vb_stmt = all_stmt = NULL;
+        delete all_keys_stmt;
+        delete from_stmt;
+        delete from_keys_stmt;
+        ins_stmt = upd_stmt = sel_stmt = sel_key_stmt = NULL;
+        del_stmt = del_vb_stmt = all_stmt = all_keys_stmt = NULL;
+        from_stmt = from_keys_stmt = NULL;
+        destroyAll(ins_many_stmts);
+        destroyAll(rep_many_stmts);
+        destroyAll(sel_rowids_stmts);
+        destroyAll(sel_keys_stmts);
+        destroyAll(sel_many_stmts);
     }
 
     PreparedStatement *ins() {
@@ -194,6 +206,10 @@ public:
         return sel_stmt;
     }
 
+    PreparedStatement *sel_key() {
+        return sel_key_stmt;
+    }
+
     PreparedStatement *del() {
         return del_stmt;
     }
@@ -205,18 +221,92 @@ public:
     PreparedStatement *all() {
         return all_stmt;
     }
+
+    /**
+     * Get a statement selecting what all() does, but with the length
+     * of each value in place of the value.
+     */
+    PreparedStatement *all_keys() {
+        return all_keys_stmt;
+    }
+
+    /**
+     * Get a statement selecting what all() does, for a number of rows
+     * after the given rowid, in rowid order.
+     *
+     * It takes the rowid, the time and the number of rows.
+     */
+    PreparedStatement *from() {
+        return from_stmt;
+    }
+
+    /**
+     * Get a statement selecting what all_keys() does, in the manner of
+     * from().
+     */
+    PreparedStatement *from_keys() {
+        return from_keys_stmt;
+    }
+
+    /**
+     * Get a statement inserting the given number of rows.
+     *
+     * It takes the same bindings as ins(), once for every row.  The
+     * rows get consecutive rowids, in order.
+     */
+    PreparedStatement *ins_many(size_t rows);
+
+    /**
+     * Get a statement replacing the given number of rows by rowid.
+     *
+     * It takes the rowid followed by the bindings of ins(), once for
+     * every row.
+     */
+    PreparedStatement *rep_many(size_t rows);
+
+    /**
+     * Get a statement selecting which of the given number of rowids
+     * exist.
+     */
+    PreparedStatement *sel_rowids(size_t rows);
+
+    /**
+     * Get a statement selecting the k, vbucket, vb_version and rowid
+     * of the rows having any of the given number of keys.
+     */
+    PreparedStatement *sel_keys(size_t rows);
+
+    /**
+     * Get a statement selecting the given number of rows by rowid,
+     * with the same columns as sel().
+     */
+    PreparedStatement *sel_many(size_t rows);
+
 private:
 
     void initStatements();
 
+    void destroyAll(std::map<size_t, PreparedStatement*> &cache);
+
     sqlite3           *db;
     std::string        tableName;
     PreparedStatement *ins_stmt;
     PreparedStatement *upd_stmt;
     PreparedStatement *sel_stmt;
+    PreparedStatement *sel_key_stmt;
     PreparedStatement *del_stmt;
     PreparedStatement *del_vb_stmt;
     PreparedStatement *all_stmt;
+    PreparedStatement *all_keys_stmt;
+    PreparedStatement *from_stmt;
+    PreparedStatement *from_keys_stmt;
+
+    // The statements for many rows at once, by number of rows.
+    std::map<size_t, PreparedStatement*> ins_many_stmts;
+    std::map<size_t, PreparedStatement*> rep_many_stmts;
+    std::map<size_t, PreparedStatement*> sel_rowids_stmts;
+    std::map<size_t, PreparedStatement*> sel_keys_stmts;
+    std::map<size_t, PreparedStatement*> sel_many_stmts;
 
     DISALLOW_COPY_AND_ASSIGN(Statements);
 };
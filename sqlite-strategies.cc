@@ -58,6 +58,8 @@ void SqliteStrategy::destroyMetaStatements(void) {
     delete sel_vb_stmt;
     delete clear_stats_stmt;
     delete ins_stat_stmt;
+    ins_vb_stmt = clear_vb_stmt = sel_vb_stmt = NULL;
+    clear_stats_stmt = ins_stat_stmt = NULL;
 }
 
 void SqliteStrategy::initMetaTables() {
@@ -96,6 +98,9 @@ void SqliteStrategy::initTables(void) {
                 "  cas integer,"
                 "  v text)");
     }
+    if (keyIndex) {
+        execute("create index if not exists kv_key on kv (k)");
+    }
 }
 
 void SqliteStrategy::initMetaStatements(void) {
@@ -129,8 +134,12 @@ void SqliteStrategy::destroyTables(void) {
 }
 
 void SqliteStrategy::doFile(const char * const fn) {
+    doFile(db, fn);
+}
+
+void SqliteStrategy::doFile(sqlite3 *dbh, const char * const fn) {
     if (fn) {
-        SqliteEvaluator eval(db);
+        SqliteEvaluator eval(dbh);
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
                          "Running db script: %s\n", fn);
         eval.eval(fn);
@@ -148,6 +157,17 @@ void SqliteStrategy::execute(const char * const query) {
 // ----------------------------------------------------------------------
 //
 
+static std::string shardFile(const char *filename, size_t idx) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s-%d.sqlite", filename, static_cast<int>(idx));
+    return std::string(buf);
+}
+
+std::string MultiDBSqliteStrategy::tableFile(size_t idx) {
+    assert(idx < static_cast<size_t>(numTables));
+    return shardFile(filename, idx);
+}
+
 void MultiDBSqliteStrategy::initTables() {
     char buf[1024];
 
@@ -174,6 +194,11 @@ void MultiDBSqliteStrategy::initTables() {
                      "  v text)", i);
             execute(buf);
         }
+        if (keyIndex) {
+            snprintf(buf, sizeof(buf),
+                     "create index if not exists kv_%d.kv_key on kv (k)", i);
+            execute(buf);
+        }
     }
 }
 
@@ -193,3 +218,90 @@ void MultiDBSqliteStrategy::destroyTables() {
         execute(buf);
     }
 }
+
+//
+// ----------------------------------------------------------------------
+// Sharded strategy
+// ----------------------------------------------------------------------
+//
+
+static void executeOn(sqlite3 *dbh, const char * const query) {
+    PreparedStatement st(dbh, query);
+    st.execute();
+}
+
+std::string ShardedSqliteStrategy::tableFile(size_t idx) {
+    assert(idx < static_cast<size_t>(numTables));
+    return shardFile(filename, idx);
+}
+
+void ShardedSqliteStrategy::initTables() {
+    char buf[1024];
+
+    for (int i = 0; i < numTables; i++) {
+        snprintf(buf, sizeof(buf), "%s-%d.sqlite", filename, i);
+        sqlite3 *shard(NULL);
+        if (sqlite3_open(buf, &shard) != SQLITE_OK) {
+            sqlite3_close(shard);
+            throw std::runtime_error("Error initializing sqlite3 shard");
+        }
+        shardDbs.push_back(shard);
+
+        if (sqlite3_extended_result_codes(shard, 1) != SQLITE_OK) {
+            throw std::runtime_error("Error enabling extended RCs");
+        }
+
+        doFile(shard, initFile);
+
+        PreparedStatement st(shard, "select name from sqlite_master where name='kv'");
+        if (schema_version == 0 && st.fetch()) {
+            executeOn(shard, "alter table kv add column"
+                      " vb_version integer default 0");
+        } else {
+            executeOn(shard, "create table if not exists kv"
+                      " (vbucket integer,"
+                      "  vb_version integer,"
+                      "  k varchar(250),"
+                      "  flags integer,"
+                      "  exptime integer,"
+                      "  cas integer,"
+                      "  v text)");
+        }
+        if (keyIndex) {
+            executeOn(shard, "create index if not exists kv_key on kv (k)");
+        }
+    }
+}
+
+void ShardedSqliteStrategy::initStatements() {
+    initMetaStatements();
+    std::vector<sqlite3 *>::iterator it;
+    for (it = shardDbs.begin(); it != shardDbs.end(); ++it) {
+        statements.push_back(new Statements(*it, "kv"));
+    }
+}
+
+void ShardedSqliteStrategy::destroyTables() {
+    std::vector<sqlite3 *>::iterator it;
+    for (it = shardDbs.begin(); it != shardDbs.end(); ++it) {
+        executeOn(*it, "drop table if exists kv");
+    }
+}
+
+void ShardedSqliteStrategy::clearShard(size_t shard) {
+    sqlite3 *dbh = shardDbs.at(shard);
+    // Without a where clause sqlite drops all rows at once.
+    executeOn(dbh, "delete from kv");
+    executeOn(dbh, "vacuum");
+}
+
+void ShardedSqliteStrategy::close() {
+    // The statements have to go before the connections they run on.
+    destroyStatements();
+    std::vector<sqlite3 *>::iterator it;
+    for (it = shardDbs.begin(); it != shardDbs.end(); ++it) {
+        sqlite3_close(*it);
+    }
+    shardDbs.clear();
+    SqliteStrategy::close();
+}
@@ -3,9 +3,12 @@
 #define SQLITE_STRATEGIES_H 1
 
 #include <cstdlib>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include "common.hh"
+#include "hash.hh"
 #include "sqlite-pst.hh"
 
 class EventuallyPersistentEngine;
@@ -25,7 +28,8 @@ public:
         db(NULL),
         statements(),
         ins_vb_stmt(NULL), clear_vb_stmt(NULL), sel_vb_stmt(NULL),
-        clear_stats_stmt(NULL), ins_stat_stmt(NULL)
+        clear_stats_stmt(NULL), ins_stat_stmt(NULL), keyIndex(false),
+        shardHash(djb_hash)
     { }
 
     virtual ~SqliteStrategy() {
@@ -37,16 +41,74 @@ public:
     }
 
     Statements *forKey(const std::string &key) {
-        assert(statements.size() > 0);
-        int h=5381;
-        int i=0;
-        const char *str = key.c_str();
+        return statements.at(statementsIndex(key));
+    }
+
+    /**
+     * Get the number of shards that can be written to independently,
+     * each over its own database connection.
+     */
+    virtual size_t numShards() {
+        return 1;
+    }
+
+    /**
+     * Get the shard holding the given key.
+     */
+    virtual size_t shardOf(const std::string &key) {
+        (void)key;
+        return 0;
+    }
 
-        for(i=0; str[i] != 0x00; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
+    /**
+     * Get the database connection of the given shard.
+     */
+    virtual sqlite3 *shardDB(size_t shard) {
+        assert(shard == 0);
+        (void)shard;
+        return db;
+    }
 
-        return statements.at(std::abs(h) % (int)statements.size());
+    /**
+     * Get the file holding the table of the statements at the given
+     * index of allStatements(), for reading it over a connection of
+     * its own.
+     */
+    virtual std::string tableFile(size_t idx) {
+        assert(idx == 0);
+        (void)idx;
+        return filename;
+    }
+
+    /**
+     * Remove all items from the given shard.
+     *
+     * Only strategies with more than one shard need this; the others
+     * reset the whole store.
+     */
+    virtual void clearShard(size_t shard) {
+        (void)shard;
+        throw std::logic_error("This strategy can't clear a single shard");
+    }
+
+    /**
+     * Set the hash function used to map keys to shards.
+     *
+     * Shards already holding data must keep using the hash function
+     * they were written with (djb, the default).
+     */
+    void setShardHash(hash_function_t f) {
+        shardHash = f;
+    }
+
+    /**
+     * Index the kv tables by key when opening them.
+     *
+     * Items are normally fetched by rowid; this is only needed when
+     * they're looked up by key (full eviction), and slows down writes.
+     */
+    void setKeyIndex(bool to) {
+        keyIndex = to;
     }
 
     PreparedStatement *getInsVBucketStateST() {
@@ -83,9 +145,23 @@ public:
     void execute(const char * const query);
 
     sqlite3 *open(void);
-    void close(void);
+    virtual void close(void);
 
 protected:
+
+    /**
+     * Get the index of the statements for the given key.
+     */
+    size_t statementsIndex(const std::string &key) {
+        assert(statements.size() > 0);
+        // Keys were always hashed up to the first NUL and reduced
+        // this way; keep doing so, or existing rows would be looked
+        // up in the wrong shard.
+        const char *str = key.c_str();
+        int h = static_cast<int>(shardHash(str, strlen(str)));
+        return std::abs(h) % (int)statements.size();
+    }
+
     EventuallyPersistentEngine &engine;
     const char * const filename;
     const char * const initFile;
@@ -99,11 +175,16 @@ protected:
     PreparedStatement *sel_vb_stmt;
 
     void doFile(const char * const filename);
+    void doFile(sqlite3 *dbh, const char * const filename);
 
     PreparedStatement *clear_stats_stmt;
     PreparedStatement *ins_stat_stmt;
 
+    bool keyIndex;
+
 private:
+    hash_function_t shardHash;
+
     DISALLOW_COPY_AND_ASSIGN(SqliteStrategy);
 };
 
@@ -124,6 +205,8 @@ public:
         numTables(n)
     {}
 
+    std::string tableFile(size_t idx);
+
     void initTables(void);
     void initStatements(void);
     void destroyTables(void);
@@ -132,4 +215,60 @@ private:
     int numTables;
 };
 
+//
+// ----------------------------------------------------------------------
+// Sharded strategy
+// ----------------------------------------------------------------------
+//
+
+/**
+ * Keep the items in the same shard files as MultiDBSqliteStrategy,
+ * but open each with its own connection rather than attaching them
+ * to the main one.
+ *
+ * The shards can then be written by a flusher each, with transactions
+ * of their own.  The main database only keeps the vbucket states and
+ * the stats snapshot.
+ */
+class ShardedSqliteStrategy : public SqliteStrategy {
+public:
+    ShardedSqliteStrategy(EventuallyPersistentEngine &theEngine,
+                          const char * const fn,
+                          const char * const finit = NULL,
+                          const char * const pfinit = NULL,
+                          int n=4):
+        SqliteStrategy(theEngine, fn, finit, pfinit),
+        numTables(n)
+    {}
+
+    ~ShardedSqliteStrategy() {
+        close();
+    }
+
+    size_t numShards() {
+        return numTables;
+    }
+
+    size_t shardOf(const std::string &key) {
+        return statementsIndex(key);
+    }
+
+    sqlite3 *shardDB(size_t shard) {
+        return shardDbs.at(shard);
+    }
+
+    std::string tableFile(size_t idx);
+
+    void clearShard(size_t shard);
+
+    void initTables(void);
+    void initStatements(void);
+    void destroyTables(void);
+    void close(void);
+
+private:
+    int numTables;
+    std::vector<sqlite3 *> shardDbs;
+};
+
 #endif /* SQLITE_STRATEGIES_H */
@@ -13,13 +13,29 @@
 #define DEFAULT_MAX_DATA_SIZE (static_cast<size_t>(-1))
 #endif
 
+/**
+ * Something to tell when memory use goes past the high water mark.
+ */
+class MemoryPressureListener {
+public:
+    virtual ~MemoryPressureListener() {}
+
+    /**
+     * Called by whoever pushed memory use past the high water mark.
+     *
+     * This may be called with hash table locks held, so it mustn't
+     * do much more than hand off the work.
+     */
+    virtual void memoryPressure() = 0;
+};
+
 /**
  * Global engine stats container.
  */
 class EPStats {
 public:
 
-    EPStats() : maxDataSize(DEFAULT_MAX_DATA_SIZE) {}
+    EPStats() : maxDataSize(DEFAULT_MAX_DATA_SIZE), memoryListener(NULL) {}
 
     //! How long it took us to load the data from disk.
     Atomic<hrtime_t> warmupTime;
@@ -31,6 +47,22 @@ public:
     Atomic<size_t> warmDups;
     //! Number of OOM failures at warmup time.
     Atomic<size_t> warmOOM;
+    //! Number of values paged in after a metadata warmup.
+    Atomic<size_t> warmValues;
+    //! Whether paging in values after a metadata warmup is done.
+    Atomic<bool> warmValuesComplete;
+    //! Number of keys read from the access log at warmup.
+    Atomic<size_t> warmAlogKeys;
+    //! Number of values paged in for the keys in the access log.
+    Atomic<size_t> warmAlogLoaded;
+    //! How long paging in the values of the access log took (us).
+    Atomic<hrtime_t> warmAlogTime;
+    //! Number of times the access log was written.
+    Atomic<size_t> alogRuns;
+    //! Number of keys in the access log last written.
+    Atomic<size_t> alogKeys;
+    //! How long writing the access log last took (us).
+    Atomic<hrtime_t> alogTime;
 
     //! size of the input queue
     Atomic<size_t> queue_size;
@@ -38,6 +70,10 @@ public:
     Atomic<size_t> flusher_todo;
     //! Number of transaction commits.
     Atomic<size_t> flusherCommits;
+    //! Number of times a slow commit made transactions smaller.
+    Atomic<size_t> txnShrinks;
+    //! Number of times a fast commit made transactions bigger.
+    Atomic<size_t> txnGrowths;
     //! Number of times the flusher was preempted for a read
     Atomic<size_t> flusherPreempts;
     //! Total time spent flushing.
@@ -52,6 +88,8 @@ public:
     Atomic<size_t> totalPersisted;
     //! Cumulative number of items added to the queue.
     Atomic<size_t> totalEnqueued;
+    //! Mutations of items that were already queued (not queued again).
+    Atomic<size_t> totalCoalesced;
     //! Number of new items created in the DB.
     Atomic<size_t> newItems;
     //! Number of items removed from the DB.
@@ -99,8 +137,38 @@ public:
     Atomic<size_t> numValueEjects;
     //! Number of times a value could not be ejected
     Atomic<size_t> numFailedEjects;
+    //! Bytes of values ejected from memory
+    Atomic<size_t> valueEjectBytes;
+    //! Number of values the pager spared because they were read recently
+    Atomic<size_t> pagerWarmSkips;
+    //! Number of times the pager was woken by memory use going past mem_high_wat
+    Atomic<size_t> pagerWakeups;
+    //! When memory use last went past mem_high_wat (0 once dealt with)
+    Atomic<hrtime_t> memHighWatCrossed;
+    //! Time (in usec) from going past mem_high_wat to the end of the pager run
+    Atomic<hrtime_t> pagerResponseTime;
+    //! Longest time (in usec) from going past mem_high_wat to the end of the pager run
+    Atomic<hrtime_t> pagerResponseTimeHighWat;
+    //! Number of keys in the expiry indexes of all vbuckets
+    Atomic<size_t> expiryIndexSize;
+    //! Number of items evicted from memory altogether (full eviction)
+    Atomic<size_t> numKeyEjects;
+    //! Number of lookups of absent keys a Bloom filter kept off disk
+    Atomic<size_t> bfilterNegatives;
+    //! Number of background fetches by key that found nothing on disk
+    Atomic<size_t> bgFetchMisses;
+    //! Number of times Bloom filters were rebuilt
+    Atomic<size_t> bfilterRebuilds;
     //! Number of times "Not my bucket" happened
     Atomic<size_t> numNotMyVBuckets;
+    //! Number of times a hash table was resized.
+    Atomic<size_t> htResizes;
+    //! Total time (in usec) spent resizing hash tables.
+    Atomic<hrtime_t> htResizeTime;
+    //! Number of gets served without taking a hash table lock.
+    Atomic<size_t> optimisticGets;
+    //! Number of gets that had to fall back to locking.
+    Atomic<size_t> optimisticGetFallbacks;
 
     //! Max allowable memory size.
     Atomic<size_t> maxDataSize;
@@ -112,17 +180,34 @@ public:
     Atomic<size_t> memOverhead;
     //! Number of nonResident items
     Atomic<size_t> numNonResident;
+    //! Bytes held in StoredValue slabs.
+    Atomic<size_t> slabBytes;
+    //! Bytes of slab memory handed out to StoredValues.
+    Atomic<size_t> slabUsedBytes;
+    //! Number of entirely free slabs kept around.
+    Atomic<size_t> slabFreeSlabs;
 
     //! Pager low water mark.
     Atomic<size_t> mem_low_wat;
     //! Pager high water mark
     Atomic<size_t> mem_high_wat;
+    //! Told when memory use goes past the high water mark, if set.
+    MemoryPressureListener *memoryListener;
 
     //! Number of times unrecoverable oom errors happened while processing operations.
     Atomic<size_t> oom_errors;
     //! Number of times temporary oom errors encountered while processing operations.
     Atomic<size_t> tmp_oom_errors;
 
+    //! Dirty queue size past which mutations start being throttled (0 for never).
+    Atomic<size_t> throttle_queue_len;
+    //! Memory use past which mutations start being throttled (0 for never).
+    Atomic<size_t> throttle_mem_wat;
+    //! Number of mutations turned away because the dirty queue was too long.
+    Atomic<size_t> queueThrottled;
+    //! Number of mutations turned away because memory use was too high.
+    Atomic<size_t> memThrottled;
+
     //! Number of read related io operations
     Atomic<size_t> io_num_read;
     //! Number of write related io operations
@@ -272,6 +357,19 @@ public:
         pagerRuns.set(0);
         numValueEjects.set(0);
         numFailedEjects.set(0);
+        valueEjectBytes.set(0);
+        pagerWarmSkips.set(0);
+        pagerWakeups.set(0);
+        txnShrinks.set(0);
+        txnGrowths.set(0);
+        queueThrottled.set(0);
+        memThrottled.set(0);
+        pagerResponseTime.set(0);
+        pagerResponseTimeHighWat.set(0);
+        numKeyEjects.set(0);
+        bfilterNegatives.set(0);
+        bgFetchMisses.set(0);
+        bfilterRebuilds.set(0);
         io_num_read.set(0);
         io_num_write.set(0);
         io_read_bytes.set(0);
@@ -1,20 +1,49 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "config.h"
 #include <cassert>
+#include <new>
+#include <unistd.h>
 #include "stored-value.hh"
 
 #ifndef DEFAULT_HT_SIZE
 #define DEFAULT_HT_SIZE 12582917
 #endif
 
+//! Values up to this size are stored inside the StoredValue by default.
+#define DEFAULT_MAX_INLINE_VALUE 64
+
+//! Grow the table once chains average more than this many items.
+#define HT_MAX_LOAD_FACTOR 2
+//! Shrink the table once it has more than this many buckets per item.
+#define HT_MIN_LOAD_FACTOR_INV 8
+
+//! Times a contended lock spins before blocking (on SMP machines).
+#define DEFAULT_LOCK_SPINS 100
+
+//! Unlocked reads attempted before optimisticFind gives up.
+#define HT_OPTIMISTIC_ATTEMPTS 4
+//! Longest chain an unlocked read walks before starting over.
+#define HT_OPTIMISTIC_MAX_CHAIN 1024
+
 size_t HashTable::defaultNumBuckets = DEFAULT_HT_SIZE;
 size_t HashTable::defaultNumLocks = 193;
 enum stored_value_type HashTable::defaultStoredValueType = featured;
+bool HashTable::useSlabs = true;
+size_t HashTable::maxInlineValue = DEFAULT_MAX_INLINE_VALUE;
+uint8_t HashTable::fingerprintMask = (1 << FINGERPRINT_BITS) - 1;
+hash_function_t HashTable::defaultHashFunction = murmur_hash;
+bool HashTable::trackLocks = false;
+// Spinning for a lock only helps if its holder can run meanwhile.
+size_t HashTable::lockSpins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? DEFAULT_LOCK_SPINS : 0;
 
 static inline size_t getDefault(size_t x, size_t d) {
     return x == 0 ? d : x;
 }
 
+static void freeTable(void *table, void *) {
+    free(table);
+}
+
 /**
  * Get the number of buckets for a hash table.
  *
@@ -55,6 +84,28 @@ void HashTable::setDefaultNumLocks(size_t to) {
     }
 }
 
+void HashTable::allocateLocks() {
+    // new[] doesn't align beyond what the ABI requires.
+    void *mem = NULL;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, n_locks * sizeof(stripe_mutex_t)) != 0) {
+        throw std::bad_alloc();
+    }
+    mutexes = static_cast<stripe_mutex_t*>(mem);
+    for (size_t i = 0; i < n_locks; ++i) {
+        new (&mutexes[i]) stripe_mutex_t();
+        mutexes[i].setMaxSpins(static_cast<uint32_t>(lockSpins));
+        mutexes[i].setTracking(trackLocks);
+    }
+}
+
+void HashTable::freeLocks() {
+    for (size_t i = 0; i < n_locks; ++i) {
+        mutexes[i].~stripe_mutex_t();
+    }
+    free(mutexes);
+    mutexes = NULL;
+}
+
 size_t HashTable::clear(bool deactivate) {
     size_t rv = 0;
 
@@ -62,16 +113,34 @@ size_t HashTable::clear(bool deactivate) {
         // If not deactivating, assert we're already active.
         assert(active());
     }
-    MultiLockHolder mlh(mutexes, n_locks);
+    MultiLockHolder<stripe_mutex_t> mlh(mutexes, n_locks);
     if (deactivate) {
         active(false);
     }
+    // Nobody reads a table that's being destroyed, but otherwise
+    // optimistic readers may still be walking these chains.
     for (int i = 0; i < (int)size; i++) {
         while (values[i]) {
             ++rv;
             StoredValue *v = values[i];
             values[i] = v->next;
-            delete v;
+            if (deactivate) {
+                valFact.destroy(v);
+            } else {
+                retire(v);
+            }
+        }
+    }
+    for (int i = 0; i < (int)oldSize; i++) {
+        while (oldValues[i]) {
+            ++rv;
+            StoredValue *v = oldValues[i];
+            oldValues[i] = v->next;
+            if (deactivate) {
+                valFact.destroy(v);
+            } else {
+                retire(v);
+            }
         }
     }
 
@@ -80,52 +149,205 @@ size_t HashTable::clear(bool deactivate) {
     return rv;
 }
 
+bool HashTable::optimisticFind(const std::string &key, int bucket_num,
+                               stored_value_snapshot &snap) {
+    assert(active());
+    EpochGuard eg;
+    if (!eg.entered()) {
+        return false;
+    }
+
+    int l = mutexForBucket(bucket_num);
+    stripe_mutex_t &m = mutexes[l];
+    uint8_t fp = fingerprint(bucket_num);
+    rel_time_t now = ep_current_time();
+
+    for (int attempt = 0; attempt < HT_OPTIMISTIC_ATTEMPTS; ++attempt) {
+        uint32_t seq = m.readBegin();
+        if (seq & 1) {
+            // A writer has the stripe right now.
+            continue;
+        }
+
+        // The table pointers only change with every lock held, so
+        // once validated they're consistent with each other.
+        bool mig = migrated[l];
+        StoredValue **table = mig ? values : oldValues;
+        size_t tableSize = mig ? size : oldSize;
+        if (m.readRetry(seq) || table == NULL || tableSize == 0) {
+            continue;
+        }
+
+        StoredValue *v = table[bucket_num % tableSize];
+        size_t steps = 0;
+        while (v && !keyMatches(v, key, fp) && steps++ < HT_OPTIMISTIC_MAX_CHAIN) {
+            v = v->next;
+        }
+        if (steps > HT_OPTIMISTIC_MAX_CHAIN) {
+            continue;
+        }
+
+        snap.found = v != NULL;
+        if (v && !v->snapshot(snap, now)) {
+            continue;
+        }
+        if (!m.readRetry(seq)) {
+            if (v) {
+                v->touch();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
 void HashTable::visit(HashTableVisitor &visitor) {
+    HashTableCursor cursor;
+    VisitBudget budget;
+    visit(visitor, cursor, budget);
+}
+
+bool HashTable::visit(HashTableVisitor &visitor, HashTableCursor &cursor,
+                      VisitBudget &budget) {
     if (numItems.get() == 0 || !active()) {
-        return;
+        cursor.reset();
+        return true;
     }
     VisitorTracker vt(&visitors);
     bool aborted = !visitor.shouldContinue();
-    size_t visited = 0;
-    for (int l = 0; active() && !aborted && l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(getMutex(l));
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+    for (; active() && !aborted && cursor.lock < static_cast<int>(n_locks);
+         ++cursor.lock) {
+        int l = cursor.lock;
+        LockHolder lh(getMutexForLock(l));
+        // Each stripe lives in exactly one of the tables at any time.
+        StoredValue **table = migrated[l] ? values : oldValues;
+        size_t tableSize = migrated[l] ? size : oldSize;
+        if (cursor.tableSize != tableSize) {
+            // New stripe, or the table changed since we paused.
+            cursor.bucket = l;
+            cursor.tableSize = tableSize;
+        }
+        while (cursor.bucket < static_cast<int>(tableSize)) {
+            int i = cursor.bucket;
             assert(l == mutexForBucket(i));
-            StoredValue *v = values[i];
-            while (v) {
-                visitor.visit(v);
-                v = v->next;
+            cursor.bucket += n_locks;
+            StoredValue *v = table[i];
+            if (v) {
+                size_t seen = 0;
+                while (v) {
+                    visitor.visit(v);
+                    v = v->next;
+                    ++seen;
+                }
+                budget.spend(seen);
+                if (budget.exhausted()) {
+                    return false;
+                }
             }
-            ++visited;
         }
         lh.unlock();
+        cursor.tableSize = 0;
         aborted = !visitor.shouldContinue();
     }
-    assert(aborted || visited == size);
+    cursor.reset();
+    return true;
 }
 
 void HashTable::visitDepth(HashTableDepthVisitor &visitor) {
     if (numItems.get() == 0 || !active()) {
         return;
     }
-    size_t visited = 0;
     VisitorTracker vt(&visitors);
 
     for (int l = 0; l < static_cast<int>(n_locks); l++) {
-        LockHolder lh(getMutex(l));
-        for (int i = l; i < static_cast<int>(size); i+= n_locks) {
+        LockHolder lh(getMutexForLock(l));
+        StoredValue **table = migrated[l] ? values : oldValues;
+        size_t tableSize = migrated[l] ? size : oldSize;
+        for (int i = l; i < static_cast<int>(tableSize); i+= n_locks) {
             size_t depth = 0;
-            StoredValue *p = values[i];
+            StoredValue *p = table[i];
             while (p) {
                 depth++;
                 p = p->next;
             }
             visitor.visit(i, depth);
-            ++visited;
         }
     }
+}
 
-    assert(visited == size);
+bool HashTable::resize() {
+    if (!active()) {
+        return false;
+    }
+    size_t items = numItems.get();
+    size_t target;
+    if (items > size * HT_MAX_LOAD_FACTOR) {
+        target = items;
+    } else if (items * HT_MIN_LOAD_FACTOR_INV < size && size > n_locks) {
+        target = items;
+    } else {
+        return false;
+    }
+    return resize(target);
+}
+
+bool HashTable::resize(size_t to) {
+    assert(active());
+    LockHolder rlh(resizeLock);
+
+    size_t newSize = alignToLocks(to, n_locks);
+    if (newSize == size) {
+        return false;
+    }
+
+    hrtime_t start = gethrtime();
+    StoredValue **newValues = static_cast<StoredValue**>(calloc(newSize,
+                                                                sizeof(StoredValue*)));
+    if (newValues == NULL) {
+        // Not worth failing over -- we'll just keep the current table.
+        return false;
+    }
+    stats.memOverhead.incr(newSize * sizeof(StoredValue*));
+
+    // Swapping the tables is the only step that needs every lock.
+    MultiLockHolder<stripe_mutex_t> mlh(mutexes, n_locks);
+    oldValues = values;
+    oldSize = size;
+    values = newValues;
+    size = newSize;
+    std::fill(migrated, migrated + n_locks, false);
+    mlh.unlock();
+
+    for (int l = 0; l < static_cast<int>(n_locks); l++) {
+        LockHolder lh(getMutexForLock(l));
+        for (int i = l; i < static_cast<int>(oldSize); i += n_locks) {
+            while (oldValues[i]) {
+                StoredValue *v = oldValues[i];
+                oldValues[i] = v->next;
+                int b = bucket(v->getKeyBytes(), v->getKeyLen()) % size;
+                assert(mutexForBucket(b) == l);
+                v->next = values[b];
+                values[b] = v;
+            }
+        }
+        migrated[l] = true;
+    }
+
+    MultiLockHolder<stripe_mutex_t> done(mutexes, n_locks);
+    StoredValue **toFree = oldValues;
+    size_t freed = oldSize;
+    oldValues = NULL;
+    oldSize = 0;
+    done.unlock();
+
+    // Optimistic readers may still be looking at the old table.
+    Epoch::retire(freeTable, toFree, NULL);
+    stats.memOverhead.decr(freed * sizeof(StoredValue*));
+
+    ++numResizes;
+    ++stats.htResizes;
+    stats.htResizeTime.incr((gethrtime() - start) / 1000);
+    return true;
 }
 
 bool HashTable::setDefaultStorageValueType(const char *t) {
@@ -144,6 +366,14 @@ void HashTable::setDefaultStorageValueType(enum stored_value_type t) {
     defaultStoredValueType = t;
 }
 
+bool HashTable::setDefaultHashFunction(const char *name) {
+    hash_function_t f = name ? getHashFunction(name) : NULL;
+    if (f) {
+        defaultHashFunction = f;
+    }
+    return f != NULL;
+}
+
 enum stored_value_type HashTable::getDefaultStorageValueType() {
     return defaultStoredValueType;
 }
@@ -191,8 +421,17 @@ void StoredValue::increaseCurrentSize(EPStats &st, size_t by, bool residentOnly)
     if (!residentOnly) {
         st.totalCacheSize.incr(by);
     }
-    st.currentSize.incr(by);
-    assert(st.currentSize.get() < GIGANTOR);
+    size_t before = st.currentSize.incr(by);
+    assert(before + by < GIGANTOR);
+
+    size_t highWat = st.mem_high_wat.get();
+    if (highWat > 0 && before <= highWat && before + by > highWat) {
+        st.memHighWatCrossed.cas(0, gethrtime());
+        MemoryPressureListener *l = st.memoryListener;
+        if (l) {
+            l->memoryPressure();
+        }
+    }
 }
 
 void StoredValue::reduceCurrentSize(EPStats &st, size_t by, bool residentOnly) {
@@ -209,9 +448,11 @@ void StoredValue::reduceCurrentSize(EPStats &st, size_t by, bool residentOnly) {
 }
 
 /**
- * Is there enough space for this thing?
+ * Is there enough space for this thing?  Without its value, it's
+ * created holding only the value's length, like an ejected one.
  */
-bool StoredValue::hasAvailableSpace(EPStats &st, const Item &item) {
-    return getCurrentSize(st) + sizeof(StoredValue) + item.getNKey() + item.getNBytes()
+bool StoredValue::hasAvailableSpace(EPStats &st, const Item &item, bool withValue) {
+    size_t valSize = withValue ? item.getNBytes() : sizeof(blobval);
+    return getCurrentSize(st) + sizeof(StoredValue) + item.getNKey() + valSize
         <= getMaxDataSize(st);
 }
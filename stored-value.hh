@@ -10,6 +10,10 @@
 #include "item.hh"
 #include "locks.hh"
 #include "stats.hh"
+#include "slab.hh"
+#include "hash.hh"
+#include "epoch.hh"
+#include "expiry.hh"
 
 extern "C" {
     extern rel_time_t (*ep_current_time)();
@@ -40,6 +44,7 @@ struct feature_data {
     rel_time_t lock_expiry;     //!< getl lock expiration
     bool       locked : 1;      //!< True if this item is locked
     bool       resident : 1;    //!< True if this object's value is in memory.
+    uint8_t    temperature;     //!< Recent reads, aged by the item pager.
     uint8_t    keylen;          //!< Length of the key
     char       keybytes[1];     //!< The key itself.
 };
@@ -52,6 +57,19 @@ union stored_value_bodies {
     struct feature_data feature; //!< The featured type.
 };
 
+//! Bits of the dirtiness timestamp kept in a StoredValue.
+#define DIRTINESS_BITS 22
+//! Bits of the key hash kept in a StoredValue.
+#define FINGERPRINT_BITS 7
+//! Highest temperature reads can warm a StoredValue up to.
+#define MAX_TEMPERATURE 3
+
+/**
+ * Bytes preceding the inline value storage of a StoredValue (the
+ * capacity and the current length).
+ */
+#define INLINE_VALUE_OVERHEAD 2
+
 /**
  * Contents stored when swapped out.
  */
@@ -60,6 +78,22 @@ union blobval {
     char     chlen[4];          //!< The length as a four byte integer
 };
 
+/**
+ * A copy of what a reader needs from a StoredValue, taken without
+ * holding its lock (see HashTable::optimisticFind).
+ */
+struct stored_value_snapshot {
+    bool     found;             //!< True if the key exists at all.
+    bool     deleted;           //!< True if the item is logically deleted.
+    bool     resident;          //!< True if the value is in memory.
+    bool     locked;            //!< True if the item is (getl) locked.
+    time_t   exptime;           //!< Expiration time.
+    uint32_t flags;             //!< Client-defined flags.
+    uint64_t cas;               //!< CAS identifier.
+    int64_t  id;                //!< Persistence ID.
+    value_t  value;             //!< The value (when resident).
+};
+
 /**
  * In-memory storage for an item.
  */
@@ -101,7 +135,7 @@ public:
      */
     void markClean(rel_time_t *dataAge) {
         if (dataAge) {
-            *dataAge = dirtiness << 2;
+            *dataAge = getDataAge();
         }
         _isDirty = 0;
     }
@@ -175,11 +209,40 @@ public:
 
     /**
      * Get this item's value.
+     *
+     * Values stored inline are copied into a new Blob here, for
+     * holders that outlive the lock; getValueData reads them in place.
      */
     value_t getValue() const {
+        if (_isInline) {
+            const uint8_t *area = inlineArea();
+            return value_t(Blob::New(reinterpret_cast<const char*>(area)
+                                     + INLINE_VALUE_OVERHEAD, area[1]));
+        }
         return value;
     }
 
+    /**
+     * Get the bytes of this item's value where they're kept, without
+     * copying.  Its length is valLength().
+     *
+     * The item must be resident and not deleted, and the pointer is
+     * only good while the item's lock is held.
+     */
+    const char *getValueData() const {
+        if (_isInline) {
+            return reinterpret_cast<const char*>(inlineArea()) + INLINE_VALUE_OVERHEAD;
+        }
+        return value->getData();
+    }
+
+    /**
+     * True if this item's value is currently stored inline.
+     */
+    bool isInline() const {
+        return _isInline;
+    }
+
     /**
      * Get the expiration time of this item.
      *
@@ -214,7 +277,7 @@ public:
                   uint32_t newFlags, time_t newExp, uint64_t theCas,
                   EPStats &stats) {
         reduceCurrentSize(stats, size());
-        value = v;
+        assignValue(v);
         setResident();
         flags = newFlags;
         if (!_isSmall) {
@@ -225,9 +288,31 @@ public:
         increaseCurrentSize(stats, size());
     }
 
+    /**
+     * Set a new value for this item that stays on disk.
+     *
+     * @param len the length of the new value
+     * @param newFlags the new client-defined flags
+     * @param newExp the new expiration
+     * @param theCas thenew CAS identifier
+     */
+    void setLength(size_t len,
+                   uint32_t newFlags, time_t newExp, uint64_t theCas,
+                   EPStats &stats) {
+        reduceCurrentSize(stats, size());
+        assignLength(len);
+        flags = newFlags;
+        extra.feature.cas = theCas;
+        extra.feature.exptime = newExp;
+        markDirty();
+        increaseCurrentSize(stats, size());
+    }
+
     size_t valLength() {
         if (isDeleted()) {
             return 0;
+        } else if (_isInline) {
+            return inlineArea()[1];
         } else if (isResident()) {
             return value->length();
         } else {
@@ -238,15 +323,26 @@ public:
         }
     }
 
+    /**
+     * Let go of this item's value, keeping its length.
+     *
+     * An inline value is only marked as not resident: its space is
+     * part of the item, so there's nothing to free.
+     *
+     * @return true if the value was ejected
+     */
     bool ejectValue(EPStats &stats) {
         if (isResident() && isClean() && !isDeleted() && !_isSmall) {
+            if (_isInline) {
+                extra.feature.resident = false;
+                extra.feature.temperature = 0;
+                return true;
+            }
             size_t oldsize = size();
-            blobval uval;
-            uval.len = valLength();
-            shared_ptr<Blob> sp(Blob::New(uval.chlen, sizeof(uval)));
-            extra.feature.resident = false;
-            value = sp;
+            size_t len = valLength();
+            assignLength(len);
             size_t newsize = size();
+            stats.valueEjectBytes.incr(len);
 
             // ejecting the value may increase the object size....
             if (oldsize < newsize) {
@@ -265,7 +361,8 @@ public:
             assert(v);
             assert(v->length() == valLength());
             extra.feature.resident = true;
-            value = v;
+            extra.feature.temperature = 1;
+            assignValue(v);
 
             size_t newsize = size();
             if (oldsize < newsize) {
@@ -295,10 +392,15 @@ public:
      * Get the time of dirtiness of this item.
      *
      * Note that the clock loses four bits of resolution, so the
-     * timestamp only has four seconds of accuracy.
+     * timestamp only has four seconds of accuracy.  Only the low
+     * DIRTINESS_BITS of it are stored; the rest is recovered from the
+     * current time, assuming the item was dirtied less than ~194
+     * days ago.
      */
     rel_time_t getDataAge() const {
-        return dirtiness << 2;
+        rel_time_t now = ep_current_time() >> 2;
+        rel_time_t ago = (now - dirtiness) & ((1 << DIRTINESS_BITS) - 1);
+        return (ago <= now ? now - ago : dirtiness) << 2;
     }
 
     /**
@@ -385,6 +487,19 @@ public:
         return id == -2;
     }
 
+    /**
+     * True if this item may be dropped from memory altogether.
+     *
+     * That's the case when disk holds exactly what it does, or for a
+     * deleted placeholder, when disk holds nothing either.
+     *
+     * @param curtime the current time, for locks
+     */
+    bool isEvictable(rel_time_t curtime) {
+        return isClean() && !isPendingId() && !isLocked(curtime)
+            && (hasId() || isDeleted());
+    }
+
     /**
      * Set this item to be pending an ID.
      */
@@ -411,15 +526,20 @@ public:
     size_t size() {
         // This differs from valLength in that it reports the
         // *resident* length instead of the length of the actual value
-        // as it existed.
+        // as it existed.  Inline values are covered by the inline
+        // capacity, which is part of the StoredValue itself.
+        size_t base = sizeOf(_isSmall) + getKeyLen() + inlineSize();
+        size_t kalign = std::min(sizeof(void*),
+                                 sizeof(void*) - base % sizeof(void*));
+        if (_isInline) {
+            return base + kalign;
+        }
+
         size_t vallen = isDeleted() ? 0 : value->length();
         size_t valign = std::min(sizeof(void*),
                                  sizeof(void*) - vallen % sizeof(void*));
-        size_t kalign = std::min(sizeof(void*),
-                                 sizeof(void*) - getKeyLen() % sizeof(void*));
 
-        return sizeOf(_isSmall) + getKeyLen() + vallen +
-            sizeof(value_t) + valign + kalign;
+        return base + vallen + sizeof(value_t) + valign + kalign;
     }
 
     /**
@@ -451,11 +571,45 @@ public:
         }
     }
 
+    /**
+     * Record a read of this value for the item pager's clock.
+     *
+     * Readers may call this without the lock.  The temperature has a
+     * byte to itself, so a racing update can lose a step of warmth
+     * but can't disturb anything else.
+     */
+    void touch() {
+        if (!_isSmall) {
+            volatile uint8_t *t = &extra.feature.temperature;
+            if (*t < MAX_TEMPERATURE) {
+                *t = *t + 1;
+            }
+        }
+    }
+
+    /**
+     * Get how often this value was read since the pager last went by.
+     *
+     * @return 0 for cold values, up to MAX_TEMPERATURE
+     */
+    uint8_t getTemperature() const {
+        return _isSmall ? 0 : extra.feature.temperature;
+    }
+
+    /**
+     * Let the value cool down a step as the pager's clock goes by.
+     */
+    void cool() {
+        if (!_isSmall && extra.feature.temperature > 0) {
+            --extra.feature.temperature;
+        }
+    }
+
     /**
      * True if this object is logically deleted.
      */
     bool isDeleted() const {
-        return value.get() == NULL;
+        return !_isInline && value.get() == NULL;
     }
 
     /**
@@ -464,7 +618,9 @@ public:
     void del(EPStats &stats) {
         size_t oldsize = size();
 
+        Epoch::retire(value);
         value.reset();
+        _isInline = 0;
         markDirty();
 
         size_t newsize = size();
@@ -492,6 +648,17 @@ public:
         return base + (small ? sizeof(struct small_data) : sizeof(struct feature_data));
     }
 
+    /**
+     * Get the number of bytes allocated for a StoredValue.
+     *
+     * @param small if true, the small variety, otherwise featured
+     * @param keylen the length of the key
+     * @param inlineCap the capacity reserved for an inline value
+     */
+    static size_t allocSize(bool small, size_t keylen, size_t inlineCap) {
+        return sizeOf(small) + keylen + INLINE_VALUE_OVERHEAD + inlineCap;
+    }
+
     /**
      * Set the maximum amount of data this instance can store.
      *
@@ -518,9 +685,11 @@ public:
 private:
 
     StoredValue(const Item &itm, StoredValue *n, EPStats &stats,
-                bool setDirty = true, bool small = false) :
-        value(itm.getValue()), next(n), id(itm.getId()),
-        dirtiness(0), _isSmall(small), flags(itm.getFlags())
+                bool setDirty = true, bool small = false,
+                uint8_t inlineCap = 0, bool withValue = true) :
+        value(), next(n), id(itm.getId()),
+        dirtiness(0), _fingerprint(0), _isSmall(small), _isInline(0),
+        flags(itm.getFlags())
     {
 
         if (_isSmall) {
@@ -530,10 +699,18 @@ private:
             extra.feature.exptime = itm.getExptime();
             extra.feature.locked = false;
             extra.feature.resident = true;
+            extra.feature.temperature = 1;
             extra.feature.lock_expiry = 0;
             extra.feature.keylen = itm.getKey().length();
         }
 
+        inlineArea()[0] = inlineCap;
+        if (withValue) {
+            assignValue(itm.getValue());
+        } else {
+            assignLength(itm.getNBytes());
+        }
+
         if (setDirty) {
             markDirty();
         } else {
@@ -549,15 +726,108 @@ private:
         }
     }
 
+    /**
+     * The inline value storage, located right after the key.
+     *
+     * The first byte holds the capacity, the second one the length
+     * of the value currently stored there.
+     */
+    uint8_t *inlineArea() {
+        return reinterpret_cast<uint8_t*>(const_cast<char*>(getKeyBytes()))
+            + getKeyLen();
+    }
+
+    const uint8_t *inlineArea() const {
+        return reinterpret_cast<const uint8_t*>(getKeyBytes()) + getKeyLen();
+    }
+
+    size_t inlineSize() const {
+        return INLINE_VALUE_OVERHEAD + inlineArea()[0];
+    }
+
+    /**
+     * Store a value, inline if it fits.
+     */
+    void assignValue(const value_t &v) {
+        // Optimistic readers may still be copying the old value.
+        Epoch::retire(value);
+        uint8_t *area = inlineArea();
+        if (v && area[0] > 0 && v->length() <= area[0]) {
+            area[1] = static_cast<uint8_t>(v->length());
+            std::memcpy(area + INLINE_VALUE_OVERHEAD, v->getData(), v->length());
+            value.reset();
+            _isInline = 1;
+        } else {
+            value = v;
+            _isInline = 0;
+        }
+    }
+
+    /**
+     * Keep only the length of a value that isn't resident.
+     */
+    void assignLength(size_t len) {
+        assert(!_isSmall);
+        blobval uval;
+        uval.len = static_cast<uint32_t>(len);
+        Epoch::retire(value);
+        value.reset(Blob::New(uval.chlen, sizeof(uval)));
+        _isInline = 0;
+        extra.feature.resident = false;
+        extra.feature.temperature = 0;
+    }
+
+    /**
+     * Copy this item out for a reader not holding its lock.
+     *
+     * The copy may be garbage if a writer got in the way, so the
+     * caller has to validate it before use.
+     *
+     * @return false if the copy is obviously inconsistent
+     */
+    bool snapshot(stored_value_snapshot &snap, rel_time_t now) const {
+        bool inl = _isInline;
+        if (inl) {
+            const uint8_t *area = inlineArea();
+            uint8_t len = area[1];
+            if (len > area[0]) {
+                return false;
+            }
+            snap.value.reset(Blob::New(reinterpret_cast<const char*>(area)
+                                       + INLINE_VALUE_OVERHEAD, len));
+        } else {
+            // Replaced values are retired, so this one stays valid
+            // until the reader leaves its epoch.
+            snap.value.reset(value.get());
+        }
+        snap.deleted = !inl && !snap.value;
+        snap.flags = flags;
+        snap.id = id;
+        if (_isSmall) {
+            snap.resident = true;
+            snap.locked = false;
+            snap.exptime = 0;
+            snap.cas = 0;
+        } else {
+            snap.resident = extra.feature.resident;
+            snap.locked = extra.feature.locked && now <= extra.feature.lock_expiry;
+            snap.exptime = extra.feature.exptime;
+            snap.cas = extra.feature.cas;
+        }
+        return true;
+    }
+
     friend class HashTable;
     friend class StoredValueFactory;
 
-    value_t      value;          // 16 bytes
+    value_t      value;          // 8 bytes
     StoredValue *next;           // 8 bytes
     int64_t      id;             // 8 bytes
-    uint32_t     dirtiness : 30; // 30 bits -+
-    bool         _isSmall  :  1; // 1 bit    | 4 bytes
-    bool         _isDirty  :  1; // 1 bit  --+
+    uint32_t     dirtiness    : DIRTINESS_BITS;   // 22 bits -+
+    uint32_t     _fingerprint : FINGERPRINT_BITS; // 7 bits    |
+    bool         _isSmall     : 1;                // 1 bit     | 4 bytes
+    bool         _isDirty     : 1;                // 1 bit     |
+    bool         _isInline    : 1;                // 1 bit   --+
     uint32_t     flags;          // 4 bytes
 
 
@@ -565,7 +835,7 @@ private:
 
     static void increaseCurrentSize(EPStats&, size_t by, bool residentOnly = false);
     static void reduceCurrentSize(EPStats&, size_t by, bool residentOnly = false);
-    static bool hasAvailableSpace(EPStats&, const Item &item);
+    static bool hasAvailableSpace(EPStats&, const Item &item, bool withValue = true);
 
     DISALLOW_COPY_AND_ASSIGN(StoredValue);
 };
@@ -618,6 +888,96 @@ public:
     virtual bool shouldContinue() { return true; }
 };
 
+/**
+ * How much of a visit may be done in one go.
+ *
+ * A visit with a budget pauses once it's been through the given
+ * number of items or has run for the given time (whichever comes
+ * first), so it can be picked up again later from its cursor.
+ */
+class VisitBudget {
+public:
+
+    /**
+     * Create a budget.
+     *
+     * @param items the number of items to visit, 0 for any
+     * @param usecs the time to visit for, 0 for as long as it takes
+     */
+    VisitBudget(size_t items = 0, hrtime_t usecs = 0) :
+        maxItems(items), maxTime(usecs * 1000), visited(0), start(gethrtime()) {}
+
+    /**
+     * Account for visited items.
+     */
+    void spend(size_t items) {
+        visited += items;
+    }
+
+    /**
+     * True if the visit should pause now.
+     */
+    bool exhausted() const {
+        return (maxItems > 0 && visited >= maxItems)
+            || (maxTime > 0 && gethrtime() - start >= maxTime);
+    }
+
+    /**
+     * Get the number of items visited so far.
+     */
+    size_t getVisited() const {
+        return visited;
+    }
+
+    /**
+     * Start over with the same limits.
+     */
+    void renew() {
+        visited = 0;
+        start = gethrtime();
+    }
+
+private:
+    size_t   maxItems;
+    hrtime_t maxTime;
+    size_t   visited;
+    hrtime_t start;
+};
+
+/**
+ * Where a hash table visit done in several goes stands.
+ */
+class HashTableCursor {
+public:
+    HashTableCursor() : lock(0), bucket(0), tableSize(0) {}
+
+    /**
+     * Go back to the start of the table.
+     */
+    void reset() {
+        lock = 0;
+        bucket = 0;
+        tableSize = 0;
+    }
+
+    /**
+     * True if the visit hasn't gotten anywhere yet.
+     */
+    bool atStart() const {
+        return lock == 0 && tableSize == 0;
+    }
+
+private:
+    //! The lock stripe being visited.
+    int    lock;
+    //! The next bucket to visit within that stripe.
+    int    bucket;
+    //! Size of the table the bucket is in (0 if not within a stripe).
+    size_t tableSize;
+
+    friend class HashTable;
+};
+
 /**
  * Hash table visitor that reports the depth of each hashtable bucket.
  */
@@ -718,7 +1078,9 @@ public:
     /**
      * Create a new StoredValueFactory of the given type.
      */
-    StoredValueFactory(EPStats &s, enum stored_value_type t = featured) : stats(&s), type(t) {}
+    StoredValueFactory(EPStats &s, enum stored_value_type t = featured,
+                       SlabAllocator *a = NULL, size_t im = 0) :
+        stats(&s), type(t), slabs(a), inlineMax(std::min(im, static_cast<size_t>(UCHAR_MAX))) {}
 
     /**
      * Create a new StoredValue with the given item.
@@ -726,33 +1088,60 @@ public:
      * @param itm the item the StoredValue should contain
      * @param n the the top of the hash bucket into which this will be inserted
      * @param setDirty if true, mark this item as dirty after creating it
+     * @param withValue if false, create it non-resident, with only
+     *                  the length of the item's value (small values
+     *                  are always stored)
      */
     StoredValue *operator ()(const Item &itm, StoredValue *n,
-                             bool setDirty = true) {
+                             bool setDirty = true, bool withValue = true) {
         switch(type) {
         case small:
-            return newStoredValue(itm, n, setDirty, true);
+            return newStoredValue(itm, n, setDirty, true, true);
             break;
         case featured:
-            return newStoredValue(itm, n, setDirty, false);
+            return newStoredValue(itm, n, setDirty, false, withValue);
             break;
         default:
             abort();
         };
     }
 
+    /**
+     * Destroy a StoredValue created by this factory.
+     */
+    void destroy(StoredValue *v) {
+        if (slabs) {
+            size_t len = StoredValue::allocSize(v->_isSmall, v->getKeyLen(),
+                                                v->inlineArea()[0]);
+            v->~StoredValue();
+            slabs->release(v, len);
+        } else {
+            delete v;
+        }
+    }
+
 private:
 
     StoredValue* newStoredValue(const Item &itm, StoredValue *n, bool setDirty,
-                                bool small) {
-        size_t base = StoredValue::sizeOf(small);
-
+                                bool small, bool withValue) {
         std::string key = itm.getKey();
         assert(key.length() < 256);
-        size_t len = key.length() + base;
 
-        StoredValue *t = new (::operator new(len))
-            StoredValue(itm, n, *stats, setDirty, small);
+        // Values that fit get stored right behind the key, with the
+        // capacity rounded up to fill the whole allocation chunk.
+        size_t cap = 0;
+        value_t val = itm.getValue();
+        if (withValue && val && val->length() <= inlineMax) {
+            size_t need = StoredValue::allocSize(small, key.length(), val->length());
+            size_t chunk = ((need + SLAB_CHUNK_ALIGN - 1) / SLAB_CHUNK_ALIGN) * SLAB_CHUNK_ALIGN;
+            cap = std::min(val->length() + chunk - need, inlineMax);
+        }
+        size_t len = StoredValue::allocSize(small, key.length(), cap);
+
+        void *mem = slabs ? slabs->allocate(len) : ::operator new(len);
+        StoredValue *t = new (mem) StoredValue(itm, n, *stats, setDirty, small,
+                                               static_cast<uint8_t>(cap),
+                                               withValue);
         if (small) {
             std::memcpy(t->extra.small.keybytes, key.data(), key.length());
         } else {
@@ -764,9 +1153,16 @@ private:
 
     EPStats                *stats;
     enum stored_value_type  type;
+    SlabAllocator          *slabs;
+    size_t                  inlineMax;
 
 };
 
+/**
+ * A hash table lock stripe, alone on its cache line(s).
+ */
+typedef CacheLinePadded<SeqMutex> stripe_mutex_t;
+
 /**
  * A container of StoredValue instances.
  */
@@ -781,15 +1177,22 @@ public:
      * @param t the type of StoredValues this hash table will contain
      */
     HashTable(EPStats &st, size_t s = 0, size_t l = 0,
-              enum stored_value_type t = featured) : stats(st), valFact(st, t) {
-        size = HashTable::getNumBuckets(s);
+              enum stored_value_type t = featured) : stats(st), slabs(st),
+                                                     valFact(st, t) {
         n_locks = HashTable::getNumLocks(l);
-        valFact = StoredValueFactory(st, getDefaultStorageValueType());
+        size = HashTable::alignToLocks(HashTable::getNumBuckets(s), n_locks);
+        valFact = StoredValueFactory(st, getDefaultStorageValueType(),
+                                     useSlabs ? &slabs : NULL, maxInlineValue);
+        hashFunction = defaultHashFunction;
         assert(size > 0);
         assert(n_locks > 0);
         assert(visitors == 0);
         values = static_cast<StoredValue**>(calloc(size, sizeof(StoredValue*)));
-        mutexes = new Mutex[n_locks];
+        oldValues = NULL;
+        oldSize = 0;
+        allocateLocks();
+        migrated = new bool[n_locks];
+        std::fill(migrated, migrated + n_locks, true);
         activeState = true;
     }
 
@@ -799,15 +1202,21 @@ public:
         while (visitors > 0) {
             usleep(100);
         }
-        delete []mutexes;
+        freeLocks();
+        delete []migrated;
         free(values);
         values = NULL;
+        free(oldValues);
+        oldValues = NULL;
+        // Things deleted earlier may still be waiting for readers to
+        // leave, and they need our allocator to go away.
+        Epoch::synchronize();
     }
 
     size_t memorySize() {
         return sizeof(HashTable)
-            + (size * sizeof(StoredValue*))
-            + (n_locks * sizeof(Mutex));
+            + ((size + oldSize) * sizeof(StoredValue*))
+            + (n_locks * (sizeof(stripe_mutex_t) + sizeof(bool)));
     }
 
     /**
@@ -815,6 +1224,40 @@ public:
      */
     size_t getSize(void) { return size; }
 
+    /**
+     * Get the number of times this hash table has been resized.
+     */
+    size_t getNumResizes(void) { return numResizes; }
+
+    /**
+     * Get the current load factor (items per bucket) of this hash table.
+     */
+    double getLoadFactor(void) {
+        return static_cast<double>(numItems.get()) / static_cast<double>(size);
+    }
+
+    /**
+     * Resize the hash table if its load factor has drifted outside
+     * the range we consider healthy.
+     *
+     * @return true if the table was resized
+     */
+    bool resize();
+
+    /**
+     * Resize the hash table to (approximately) the given number of
+     * buckets.
+     *
+     * Items are migrated one lock stripe at a time, so front-end
+     * operations only ever wait for the stripe they need while the
+     * migration is going on.
+     *
+     * @param to the desired number of buckets (rounded up to a
+     *           multiple of the number of locks)
+     * @return true if the table was resized
+     */
+    bool resize(size_t to);
+
     /**
      * Get the number of locks in this hash table.
      */
@@ -847,13 +1290,33 @@ public:
         return unlocked_find(key, bucket_num);
     }
 
+    /**
+     * Copy out the item with the given key without taking its lock.
+     *
+     * The chain is walked under the seqlock of the bucket's lock
+     * stripe, retrying if a writer held the stripe meanwhile; the
+     * nodes and values seen are kept alive by the epoch the reader
+     * runs in.  An item found counts as read (see StoredValue::touch).
+     *
+     * @param key the key to find
+     * @param bucket_num the bucket number of the key
+     * @param snap where the item is copied to
+     * @return false if no consistent copy could be made (the caller
+     *         should lock and look again); otherwise snap.found says
+     *         whether the key exists
+     */
+    bool optimisticFind(const std::string &key, int bucket_num,
+                        stored_value_snapshot &snap);
+
     /**
      * Set a new Item into this hashtable.
      *
      * @param the Item to store
+     * @param expiries the expiry index to keep up to date, if any
      * @return a result indicating the status of the store
      */
-    mutation_type_t set(const Item &val, bool honorMemLimit=true) {
+    mutation_type_t set(const Item &val, bool honorMemLimit=true,
+                        ExpiryIndex *expiries=NULL) {
         assert(active());
         mutation_type_t rv = NOT_FOUND;
         int bucket_num = bucket(val.getKey());
@@ -877,9 +1340,13 @@ public:
             }
             itm.setCas();
             rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
+            time_t oldExp = v->getExptime();
             v->setValue(itm.getValue(),
                         itm.getFlags(), itm.getExptime(),
                         itm.getCas(), stats);
+            if (expiries) {
+                expiries->update(bucket_num, oldExp, v->getExptime());
+            }
         } else {
             if (itm.getCas() != 0) {
                 return NOT_FOUND;
@@ -890,9 +1357,14 @@ public:
             }
 
             itm.setCas();
-            v = valFact(itm, values[bucket_num]);
-            values[bucket_num] = v;
+            StoredValue **head = chainFor(bucket_num);
+            v = valFact(itm, *head);
+            v->_fingerprint = fingerprint(bucket_num);
+            *head = v;
             ++numItems;
+            if (expiries) {
+                expiries->update(bucket_num, 0, v->getExptime());
+            }
         }
         return rv;
     }
@@ -903,9 +1375,11 @@ public:
      * @param val the item to store
      * @param isDirty true if the item should be marked dirty on store
      * @param storeVal true if the value should be stored (paged-in)
+     * @param expiries the expiry index to keep up to date, if any
      * @return an indication of what happened
      */
-    add_type_t add(const Item &val, bool isDirty = true, bool storeVal = true) {
+    add_type_t add(const Item &val, bool isDirty = true, bool storeVal = true,
+                   ExpiryIndex *expiries = NULL) {
         assert(active());
         int bucket_num = bucket(val.getKey());
         LockHolder lh(getMutex(bucket_num));
@@ -916,24 +1390,34 @@ public:
         } else {
             Item &itm = const_cast<Item&>(val);
             itm.setCas();
-            if (!StoredValue::hasAvailableSpace(stats, itm)) {
+            if (!StoredValue::hasAvailableSpace(stats, itm, storeVal)) {
                 return ADD_NOMEM;
             }
+            time_t oldExp = 0;
             if (v) {
-                v->setValue(itm.getValue(),
-                            itm.getFlags(), itm.getExptime(),
-                            itm.getCas(), stats);
+                oldExp = v->getExptime();
+                if (storeVal || v->_isSmall) {
+                    v->setValue(itm.getValue(),
+                                itm.getFlags(), itm.getExptime(),
+                                itm.getCas(), stats);
+                } else {
+                    v->setLength(itm.getNBytes(),
+                                 itm.getFlags(), itm.getExptime(),
+                                 itm.getCas(), stats);
+                }
                 rv = v->isDirty() ? ADD_UNDEL : ADD_SUCCESS;
                 if (isDirty) {
                     v->markDirty();
                 }
             } else {
-                v = valFact(itm, values[bucket_num], isDirty);
-                values[bucket_num] = v;
+                StoredValue **head = chainFor(bucket_num);
+                v = valFact(itm, *head, isDirty, storeVal);
+                v->_fingerprint = fingerprint(bucket_num);
+                *head = v;
                 ++numItems;
             }
-            if (!storeVal) {
-                v->ejectValue(stats);
+            if (expiries) {
+                expiries->update(bucket_num, oldExp, v->getExptime());
             }
 
             assert(v->isDirty() == isDirty);
@@ -942,6 +1426,25 @@ public:
         return rv;
     }
 
+    /**
+     * Put an item read from disk back into the hash table, clean.
+     *
+     * The bucket must be locked and must not hold the key at all.  An
+     * item without a value goes in as a deleted placeholder, recording
+     * that the key isn't on disk either.
+     *
+     * @param itm the item, with the disk id
+     * @param bucket_num the (locked) bucket the key belongs in
+     */
+    void unlocked_restore(const Item &itm, int bucket_num) {
+        assert(active());
+        StoredValue **head = chainFor(bucket_num);
+        StoredValue *v = valFact(itm, *head, false);
+        v->_fingerprint = fingerprint(bucket_num);
+        *head = v;
+        ++numItems;
+    }
+
     /**
      * Mark the given record logically deleted.
      *
@@ -979,9 +1482,10 @@ public:
      */
     StoredValue *unlocked_find(const std::string &key, int bucket_num,
                                bool wantsDeleted=false) {
-        StoredValue *v = values[bucket_num];
+        uint8_t fp = fingerprint(bucket_num);
+        StoredValue *v = *chainFor(bucket_num);
         while (v) {
-            if (v->hasKey(key)) {
+            if (keyMatches(v, key, fp)) {
                 if (wantsDeleted || !v->isDeleted()) {
                     return v;
                 } else {
@@ -993,22 +1497,42 @@ public:
         return NULL;
     }
 
+    /**
+     * Find the keys of the expired items sharing the chain of the
+     * given bucket number.
+     *
+     * The chain also holds items of other bucket numbers; expired
+     * ones among them are found as well.
+     *
+     * @param bucket_num the bucket number (must already be locked)
+     * @param asOf the time to compare expiry times to
+     * @param out where to add the keys
+     */
+    void unlocked_findExpired(int bucket_num, time_t asOf,
+                              std::vector<std::string> &out) {
+        StoredValue *v = *chainFor(bucket_num);
+        for (; v; v = v->next) {
+            if (!v->isDeleted() && v->isExpired(asOf)) {
+                out.push_back(v->getKey());
+            }
+        }
+    }
+
     /**
      * Get the bucket number for the given C string key.
      *
+     * The bucket number does not depend on the current size of the
+     * table, so it stays valid across a concurrent resize.  It
+     * selects the lock (see getMutex) and, once that lock is held,
+     * the hash chain within whichever table currently owns it.
+     *
      * @param str the string
      * @param len the number of bytes to use for hash computation
      * @return the bucket number for this key
      */
     inline int bucket(const char *str, const size_t len) {
         assert(active());
-        int h=5381;
-
-        for(size_t i=0; i < len; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return abs(h % (int)size);
+        return static_cast<int>(hashFunction(str, len) & INT_MAX);
     }
 
     /**
@@ -1034,6 +1558,27 @@ public:
         return mutexes[lock_num];
     }
 
+    /**
+     * Get the contention counters of the given lock.
+     *
+     * These are only maintained while lock stats are on (see
+     * setLockStats).
+     */
+    mutex_stats getLockStats(int lock_num) {
+        assert(lock_num < (int)n_locks);
+        return mutexes[lock_num].getStats();
+    }
+
+    /**
+     * Get the number of the lock covering a bucket (see getMutexForLock).
+     *
+     * Like the bucket number, this doesn't change with the size of
+     * the table.
+     */
+    inline int getLockNum(int bucket_num) {
+        return mutexForBucket(bucket_num);
+    }
+
     /**
      * Get the mutex for a bucket (for doing your own lock management).
      *
@@ -1055,34 +1600,37 @@ public:
      */
     bool unlocked_del(const std::string &key, int bucket_num) {
         assert(active());
-        StoredValue *v = values[bucket_num];
+        StoredValue **head = chainFor(bucket_num);
+        StoredValue *v = *head;
 
         // Special case empty bucket.
         if (!v) {
             return false;
         }
 
+        uint8_t fp = fingerprint(bucket_num);
+
         // Special case the first one
-        if (v->hasKey(key)) {
+        if (keyMatches(v, key, fp)) {
             if (v->isLocked(ep_current_time())) {
                 return false;
             }
-            values[bucket_num] = v->next;
+            *head = v->next;
             v->reduceCurrentSize(stats, v->size());
-            delete v;
+            retire(v);
             --numItems;
             return true;
         }
 
         while (v->next) {
-            if (v->next->hasKey(key)) {
+            if (keyMatches(v->next, key, fp)) {
                 StoredValue *tmp = v->next;
                 if (tmp->isLocked(ep_current_time())) {
                     return false;
                 }
                 v->next = v->next->next;
                 tmp->reduceCurrentSize(stats, tmp->size());
-                delete tmp;
+                retire(tmp);
                 --numItems;
                 return true;
             } else {
@@ -1111,6 +1659,23 @@ public:
      */
     void visit(HashTableVisitor &visitor);
 
+    /**
+     * Visit items within this hashtable, pausing when out of budget.
+     *
+     * The visit picks up where the cursor says and leaves it where
+     * it paused; the lock of the stripe being visited is dropped in
+     * between.  If the table was resized meanwhile, the stripe the
+     * visit paused in is visited from its start again, so some items
+     * may be seen twice.
+     *
+     * @param visitor the visitor
+     * @param cursor where to start, updated to where to resume
+     * @param budget how much may be visited (spent as items are seen)
+     * @return true if the visit is complete (the cursor is reset)
+     */
+    bool visit(HashTableVisitor &visitor, HashTableCursor &cursor,
+               VisitBudget &budget);
+
     /**
      * Visit all items within this call with a depth visitor.
      */
@@ -1164,27 +1729,151 @@ public:
      */
     static const char* getDefaultStorageValueTypeStr();
 
+    /**
+     * Set the hash function used by newly created hash tables.
+     *
+     * @param name the name of the hash function (see getHashFunction)
+     * @return true if the name is known
+     */
+    static bool setDefaultHashFunction(const char *name);
+
+    /**
+     * Get the hash function used by newly created hash tables.
+     */
+    static hash_function_t getDefaultHashFunction() {
+        return defaultHashFunction;
+    }
+
+    /**
+     * Set whether newly created hash tables allocate their
+     * StoredValues from a slab allocator.
+     */
+    static void setSlabAllocation(bool to) { useSlabs = to; }
+
+    /**
+     * True if newly created hash tables use a slab allocator.
+     */
+    static bool getSlabAllocation() { return useSlabs; }
+
+    /**
+     * Set whether chain walks compare the stored hash fingerprints
+     * before the keys (only worth turning off for benchmarking).
+     */
+    static void setFingerprinting(bool to) {
+        fingerprintMask = to ? (1 << FINGERPRINT_BITS) - 1 : 0;
+    }
+
+    /**
+     * Set the largest value newly created StoredValues will store
+     * inline rather than in a separate Blob (0 disables inline
+     * values; anything above 255 is capped at 255).
+     */
+    static void setMaxInlineValue(size_t to) { maxInlineValue = to; }
+
+    /**
+     * Get the largest value stored inline by new StoredValues.
+     */
+    static size_t getMaxInlineValue() { return maxInlineValue; }
+
+    /**
+     * Set whether newly created hash tables count lock contention.
+     */
+    static void setLockStats(bool to) { trackLocks = to; }
+
+    /**
+     * True if newly created hash tables count lock contention.
+     */
+    static bool getLockStats() { return trackLocks; }
+
+    /**
+     * Set how many times a contended lock of a newly created hash
+     * table spins before blocking.
+     */
+    static void setLockSpins(size_t to) { lockSpins = to; }
+
+    /**
+     * Get how many times contended hash table locks spin.
+     */
+    static size_t getLockSpins() { return lockSpins; }
+
 private:
     inline bool active() { return activeState = true; }
+
+    void allocateLocks();
+    void freeLocks();
+
+    /**
+     * Destroy an unlinked StoredValue once no reader can see it.
+     */
+    void retire(StoredValue *v) {
+        Epoch::retire(destroyRetired, v, &valFact);
+    }
+
+    static void destroyRetired(void *v, void *fact) {
+        static_cast<StoredValueFactory*>(fact)->destroy(static_cast<StoredValue*>(v));
+    }
     inline void active(bool newv) { activeState = newv; }
 
+    /**
+     * Fold a bucket number (the full key hash) into the fingerprint
+     * stored with each StoredValue.
+     */
+    static uint8_t fingerprint(int bucket_num) {
+        uint32_t h = static_cast<uint32_t>(bucket_num);
+        return static_cast<uint8_t>((h ^ (h >> 7) ^ (h >> 14) ^ (h >> 21))
+                                    & ((1 << FINGERPRINT_BITS) - 1));
+    }
+
+    /**
+     * True if the given StoredValue holds the given key, only looking
+     * at the key bytes when the fingerprints match.
+     */
+    static bool keyMatches(const StoredValue *v, const std::string &key,
+                           uint8_t fp) {
+        return ((v->_fingerprint ^ fp) & fingerprintMask) == 0 && v->hasKey(key);
+    }
+
     size_t               size;
     size_t               n_locks;
     StoredValue        **values;
-    Mutex               *mutexes;
+    //! Table being migrated away from during a resize (else NULL).
+    StoredValue        **oldValues;
+    size_t               oldSize;
+    stripe_mutex_t      *mutexes;
+    //! Per lock: true once that stripe lives entirely in values.
+    bool                *migrated;
+    Mutex                resizeLock;
     EPStats&             stats;
+    SlabAllocator        slabs;
     StoredValueFactory   valFact;
+    hash_function_t      hashFunction;
     Atomic<size_t>       visitors;
     Atomic<size_t>       numItems;
+    Atomic<size_t>       numResizes;
     bool                 activeState;
 
     static size_t                 defaultNumBuckets;
     static size_t                 defaultNumLocks;
     static enum stored_value_type defaultStoredValueType;
+    static bool                   useSlabs;
+    static size_t                 maxInlineValue;
+    static uint8_t                fingerprintMask;
+    static hash_function_t        defaultHashFunction;
+    static bool                   trackLocks;
+    static size_t                 lockSpins;
+
+    /**
+     * Round a bucket count up to a multiple of the number of locks.
+     *
+     * Every table size is a multiple of n_locks, so a key maps to
+     * the same lock no matter which table it currently lives in.
+     */
+    static size_t alignToLocks(size_t s, size_t l) {
+        return std::max(((s + l - 1) / l) * l, l);
+    }
 
     inline int mutexForBucket(int bucket_num) {
         assert(active());
-        assert(bucket_num < (int)size);
         assert(bucket_num >= 0);
         int lock_num = bucket_num % (int)n_locks;
         assert(lock_num < (int)n_locks);
@@ -1192,6 +1881,20 @@ private:
         return lock_num;
     }
 
+    /**
+     * Get the head of the hash chain for the given bucket number.
+     *
+     * The lock covering the bucket must be held.
+     */
+    inline StoredValue **chainFor(int bucket_num) {
+        int lock_num = mutexForBucket(bucket_num);
+        if (!migrated[lock_num]) {
+            assert(oldValues);
+            return &oldValues[bucket_num % oldSize];
+        }
+        return &values[bucket_num % size];
+    }
+
     DISALLOW_COPY_AND_ASSIGN(HashTable);
 };
 
@@ -9,6 +9,8 @@
 #include <item.hh>
 #include <stats.hh>
 
+#include "threadtests.hh"
+
 extern "C" {
     static rel_time_t basic_current_time(void) {
         return 0;
@@ -36,6 +38,8 @@ public:
                 std::string key = v->getKey();
                 value_t val = v->getValue();
                 assert(key.compare(val->to_s()) == 0);
+                assert(key.compare(0, std::string::npos, v->getValueData(),
+                                   v->valLength()) == 0);
             }
         }
     }
@@ -218,6 +222,196 @@ static void testAdd() {
     assert(count(h, false) == nkeys);
 }
 
+static void testExpiryUpdates() {
+    HashTable h(global_stats, 5, 1);
+    ExpiryIndex idx(global_stats);
+    std::string k("expiring");
+    int bucket_num = h.bucket(k);
+
+    // Items that never expire stay out of the index.
+    Item i1(k, 0, 0, "v", 1);
+    assert(h.set(i1, true, &idx) == NOT_FOUND);
+    assert(idx.size() == 0);
+
+    Item i2(k, 0, 100, "v", 1);
+    assert(h.set(i2, true, &idx) == WAS_DIRTY);
+    assert(idx.size() == 1);
+    assert(idx.nextExpiry() == 100);
+
+    Item i3(k, 0, 200, "v", 1);
+    assert(h.set(i3, true, &idx) == WAS_DIRTY);
+    assert(idx.size() == 1);
+    assert(idx.nextExpiry() == 200);
+
+    std::vector<int> buckets;
+    std::vector<std::string> evicted;
+    assert(idx.takeExpired(201, buckets, evicted) == 1);
+    assert(buckets.size() == 1 && buckets[0] == bucket_num);
+
+    std::vector<std::string> keys;
+    {
+        LockHolder lh(h.getMutex(bucket_num));
+        h.unlocked_findExpired(bucket_num, 200, keys);
+        assert(keys.empty());
+        h.unlocked_findExpired(bucket_num, 201, keys);
+    }
+    assert(keys.size() == 1 && keys[0] == k);
+
+    assert(h.softDelete(k) == WAS_DIRTY);
+    Item i4(k, 0, 300, "v", 1);
+    assert(h.add(i4, true, true, &idx) == ADD_UNDEL);
+    assert(idx.size() == 1);
+    assert(idx.nextExpiry() == 300);
+}
+
+static void testRestore() {
+    HashTable h(global_stats, 5, 1);
+    std::string key("restored");
+    int bucket_num = h.bucket(key);
+
+    // An item read back from disk is clean and keeps its id, so it
+    // may go again.
+    Item onDisk(key, 0, 0, "diskvalue", 9, 0, 42);
+    {
+        LockHolder lh(h.getMutex(bucket_num));
+        h.unlocked_restore(onDisk, bucket_num);
+    }
+    StoredValue *v = h.find(key);
+    assert(v);
+    assert(v->isClean());
+    assert(v->getId() == 42);
+    assert(v->isEvictable(0));
+
+    Item update(key, 0, 0, "newvalue", 8);
+    assert(h.set(update) == WAS_CLEAN);
+    assert(!v->isEvictable(0));
+    v->markClean(NULL);
+    assert(v->isEvictable(0));
+    {
+        LockHolder lh(h.getMutex(bucket_num));
+        assert(h.unlocked_del(key, bucket_num));
+    }
+    assert(!h.find(key));
+
+    // A placeholder for a key that's nowhere is a clean deletion; it
+    // hides nothing from add.
+    Item nothing(key, 0, 0, value_t(), 0, -1, 0);
+    {
+        LockHolder lh(h.getMutex(bucket_num));
+        h.unlocked_restore(nothing, bucket_num);
+        v = h.unlocked_find(key, bucket_num, true);
+        assert(v);
+        assert(v->isDeleted());
+        assert(v->isEvictable(0));
+    }
+    assert(!h.find(key));
+    assert(h.softDelete(key) == NOT_FOUND);
+    Item added(key, 0, 0, "added", 5);
+    assert(h.add(added) == ADD_UNDEL);
+    assert(h.find(key));
+    assert(!h.find(key)->isEvictable(0));
+}
+
+static void testTemperature() {
+    HashTable h(global_stats, 5, 1);
+    std::string key("warm");
+    Item i(key, 0, 0, "value", 5);
+    assert(h.set(i) == NOT_FOUND);
+    StoredValue *v = h.find(key);
+    assert(v);
+    assert(v->getTemperature() == 1);
+
+    // Reads warm an item up, but only so far.
+    stored_value_snapshot snap;
+    for (int j = 0; j < MAX_TEMPERATURE + 2; ++j) {
+        assert(h.optimisticFind(key, h.bucket(key), snap));
+        assert(snap.found);
+    }
+    assert(v->getTemperature() == MAX_TEMPERATURE);
+
+    for (int j = 0; j < MAX_TEMPERATURE + 2; ++j) {
+        v->cool();
+    }
+    assert(v->getTemperature() == 0);
+    v->touch();
+    assert(v->getTemperature() == 1);
+
+    // An ejected value is cold; one read back was just asked for.
+    // This one is inline, so ejecting it frees nothing.
+    v->markClean(NULL);
+    size_t ejectedBytes = global_stats.valueEjectBytes.get();
+    assert(v->ejectValue(global_stats));
+    assert(v->getTemperature() == 0);
+    assert(global_stats.valueEjectBytes.get() == ejectedBytes);
+    assert(v->restoreValue(value_t(Blob::New("value", 5)), global_stats));
+    assert(v->getTemperature() == 1);
+}
+
+static void testSlicedVisit() {
+    HashTable h(global_stats, 6000, 3);
+    const int nkeys = 5000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    // Budgets are checked between buckets, so slices may run over by
+    // a chain.
+    Counter c(true);
+    HashTableCursor cursor;
+    int slices = 0;
+    bool done = false;
+    while (!done) {
+        VisitBudget budget(100);
+        done = h.visit(c, cursor, budget);
+        assert(budget.getVisited() >= (done ? 0 : 100));
+        ++slices;
+    }
+    assert(c.count == static_cast<size_t>(nkeys));
+    assert(slices > nkeys / 200);
+    assert(cursor.atStart());
+
+    // A resize in between may make the visit see some items again,
+    // but none are missed.
+    Counter c2(true);
+    VisitBudget budget(nkeys / 2);
+    assert(!h.visit(c2, cursor, budget));
+    assert(h.resize(h.getSize() * 2));
+    VisitBudget unlimited;
+    assert(h.visit(c2, cursor, unlimited));
+    assert(c2.count >= static_cast<size_t>(nkeys));
+    assert(c2.count < static_cast<size_t>(nkeys) + nkeys / 2);
+}
+
+class PressureCounter : public MemoryPressureListener {
+public:
+    PressureCounter() : count(0) {}
+    void memoryPressure() { ++count; }
+    int count;
+};
+
+static void testMemoryPressure() {
+    EPStats st;
+    st.maxDataSize = 64*1024*1024;
+    PressureCounter pc;
+    st.memoryListener = &pc;
+    HashTable h(st, 5, 1);
+    std::string key("k0");
+    Item i(key, 0, 0, "value", 5);
+    assert(h.set(i) == NOT_FOUND);
+
+    // Only going from under the high water mark to over it counts.
+    st.mem_high_wat.set(StoredValue::getCurrentSize(st) + 100);
+    std::vector<std::string> keys = generateKeys(20, 1);
+    storeMany(h, keys);
+    assert(StoredValue::getCurrentSize(st) > st.mem_high_wat.get());
+    assert(pc.count == 1);
+    assert(st.memHighWatCrossed.get() != 0);
+
+    st.mem_high_wat.set(StoredValue::getCurrentSize(st) + 100);
+    std::vector<std::string> more = generateKeys(40, 20);
+    storeMany(h, more);
+    assert(pc.count == 2);
+}
+
 static void testDepthCounting() {
     HashTable h(global_stats, 5, 1);
     const int nkeys = 5000;
@@ -240,6 +434,457 @@ static void testPoisonKey() {
     assert(count(h) == 1);
 }
 
+static void testResize() {
+    HashTable h(global_stats, 5, 3);
+    // Sizes are always aligned to the number of locks.
+    assert(h.getSize() == 6);
+
+    const int nkeys = 5000;
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+
+    size_t resizes = global_stats.htResizes.get();
+    assert(h.resize());
+    assert(h.getNumResizes() == 1);
+    assert(global_stats.htResizes.get() == resizes + 1);
+    assert(h.getSize() >= static_cast<size_t>(nkeys));
+    assert(h.getSize() % h.getNumLocks() == 0);
+    assert(h.getLoadFactor() <= 1.0);
+    // Load factor is fine now, nothing more to do.
+    assert(!h.resize());
+
+    assert(count(h) == nkeys);
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string key = *it;
+        assert(h.find(key));
+    }
+
+    for (it = keys.begin() + 10; it != keys.end(); it++) {
+        std::string key = *it;
+        assert(h.del(key));
+    }
+    assert(h.resize());
+    assert(h.getNumResizes() == 2);
+    assert(h.getSize() < 100);
+    assert(count(h) == 10);
+    for (it = keys.begin(); it != keys.begin() + 10; it++) {
+        std::string key = *it;
+        assert(h.find(key));
+    }
+}
+
+class ResizeUnderLoad : public Generator<bool> {
+public:
+
+    ResizeUnderLoad(HashTable &ht, std::vector<std::string> &k) :
+        h(ht), keys(k) {}
+
+    bool operator()() {
+        if (role++ == 0) {
+            for (int i = 0; i < 50; ++i) {
+                h.resize(i % 2 == 0 ? 3 : 10007);
+            }
+        } else {
+            for (int i = 0; i < 20; ++i) {
+                std::vector<std::string>::iterator it;
+                for (it = keys.begin(); it != keys.end(); it++) {
+                    std::string key = *it;
+                    assert(h.find(key));
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    HashTable                &h;
+    std::vector<std::string> &keys;
+    Atomic<int>               role;
+};
+
+static void testConcurrentResize() {
+    HashTable h(global_stats, 30, 3);
+    std::vector<std::string> keys = generateKeys(2000);
+    storeMany(h, keys);
+
+    ResizeUnderLoad rul(h, keys);
+    getCompletedThreads<bool>(4, &rul);
+
+    assert(h.getNumResizes() == 50);
+    assert(count(h) == 2000);
+}
+
+static void checkSnapshot(const std::string &key, const stored_value_snapshot &snap) {
+    if (snap.found && !snap.deleted) {
+        assert(snap.value);
+        std::string val = snap.value->to_s();
+        assert(val.compare(0, key.length(), key) == 0);
+        assert(val.length() == key.length() || val.length() == key.length() + 100);
+    }
+}
+
+class OptimisticReadsUnderLoad : public Generator<bool> {
+public:
+    OptimisticReadsUnderLoad(HashTable &ht, std::vector<std::string> &k,
+                             std::vector<std::string> &d) :
+        h(ht), keys(k), dels(d), role(0) {}
+
+    bool operator()() {
+        int me = role++;
+        if (me == 0) {
+            for (int i = 0; i < 50; ++i) {
+                h.resize(i % 2 == 0 ? 3 : 10007);
+            }
+        } else if (me == 1) {
+            // Flip values between inline and Blob sized ones, and
+            // keep deleting and recreating some other keys.
+            for (int i = 0; i < 20; ++i) {
+                std::vector<std::string>::iterator it;
+                for (it = keys.begin(); it != keys.end(); ++it) {
+                    std::string val(*it);
+                    if (i % 2 == 0) {
+                        val.append(100, 'x');
+                    }
+                    Item itm(*it, 0, 0, val.data(), val.length());
+                    h.set(itm);
+                }
+                for (it = dels.begin(); it != dels.end(); ++it) {
+                    if (i % 2 == 0) {
+                        h.del(*it);
+                    } else {
+                        store(h, *it);
+                    }
+                }
+            }
+        } else {
+            size_t hits = 0;
+            for (int i = 0; i < 20; ++i) {
+                for (size_t j = 0; j < keys.size(); ++j) {
+                    stored_value_snapshot snap;
+                    if (h.optimisticFind(keys[j], h.bucket(keys[j]), snap)) {
+                        assert(snap.found && !snap.deleted);
+                        checkSnapshot(keys[j], snap);
+                        ++hits;
+                    }
+                    if (h.optimisticFind(dels[j], h.bucket(dels[j]), snap)) {
+                        checkSnapshot(dels[j], snap);
+                    }
+                }
+            }
+            assert(hits > 0);
+        }
+        return true;
+    }
+
+private:
+    HashTable                &h;
+    std::vector<std::string> &keys;
+    std::vector<std::string> &dels;
+    Atomic<int>               role;
+};
+
+static void testOptimisticFind() {
+    HashTable h(global_stats, 30, 3);
+    std::vector<std::string> keys = generateKeys(2000);
+    std::vector<std::string> dels = generateKeys(4000, 2000);
+    storeMany(h, keys);
+
+    stored_value_snapshot snap;
+    assert(h.optimisticFind(keys[0], h.bucket(keys[0]), snap));
+    assert(snap.found && !snap.deleted && snap.resident);
+    assert(snap.value->to_s() == keys[0]);
+    assert(h.optimisticFind(dels[0], h.bucket(dels[0]), snap));
+    assert(!snap.found);
+
+    // Readers may only see whole values, whatever the writers do.
+    OptimisticReadsUnderLoad orul(h, keys, dels);
+    getCompletedThreads<bool>(4, &orul);
+    assert(count(h, false) == 4000);
+
+    assert(h.softDelete(keys[1]) == WAS_DIRTY);
+    assert(h.optimisticFind(keys[1], h.bucket(keys[1]), snap));
+    assert(snap.found && snap.deleted);
+
+    StoredValue *v = h.find(keys[2]);
+    v->markClean(NULL);
+    assert(v->ejectValue(global_stats));
+    assert(h.optimisticFind(keys[2], h.bucket(keys[2]), snap));
+    assert(snap.found && !snap.resident);
+
+    // Nothing retired is freed while a reader might still look.
+    Epoch::synchronize();
+    assert(Epoch::getNumRetired() == 0);
+}
+
+static void testLockStripes() {
+    assert(sizeof(stripe_mutex_t) % CACHE_LINE_SIZE == 0);
+    HashTable::setLockStats(true);
+    HashTable h(global_stats, 30, 3);
+    HashTable::setLockStats(false);
+    for (int i = 0; i < 3; ++i) {
+        uintptr_t addr = reinterpret_cast<uintptr_t>(&h.getMutexForLock(i));
+        assert(addr % CACHE_LINE_SIZE == 0);
+    }
+
+    std::vector<std::string> keys = generateKeys(2000);
+    storeMany(h, keys);
+    size_t acquisitions = 0;
+    for (int i = 0; i < 3; ++i) {
+        mutex_stats ms = h.getLockStats(i);
+        assert(ms.contended <= ms.acquisitions);
+        assert(ms.blocked <= ms.contended);
+        acquisitions += ms.acquisitions;
+    }
+    assert(acquisitions == keys.size());
+
+    // Hammer the stripes from several threads; everything still works
+    // whether the locks spin or sleep.
+    ResizeUnderLoad rul(h, keys);
+    getCompletedThreads<bool>(4, &rul);
+    assert(count(h) == 2000);
+    acquisitions = 0;
+    for (int i = 0; i < 3; ++i) {
+        acquisitions += h.getLockStats(i).acquisitions;
+    }
+    assert(acquisitions > 3 * 20 * keys.size());
+}
+
+static void testSlabAllocation() {
+    EPStats st;
+    st.maxDataSize = 64*1024*1024;
+    assert(HashTable::getSlabAllocation());
+    {
+        HashTable h(st, 5, 1);
+        const int nkeys = 5000;
+        std::vector<std::string> keys = generateKeys(nkeys);
+        storeMany(h, keys);
+        assert(count(h) == nkeys);
+
+        assert(st.slabBytes.get() > 0);
+        assert(st.slabUsedBytes.get() <= st.slabBytes.get());
+        assert(st.slabUsedBytes.get() >= nkeys * StoredValue::sizeOf(false));
+
+        std::vector<std::string>::iterator it;
+        for (it = keys.begin(); it != keys.end(); it++) {
+            std::string key = *it;
+            assert(h.del(key));
+        }
+        // Deleted items are freed once no reader can see them.
+        Epoch::synchronize();
+        assert(st.slabUsedBytes.get() == 0);
+        // Only the spare slabs are kept, one per size class in use.
+        assert(st.slabFreeSlabs.get() > 0);
+        assert(st.slabBytes.get() == st.slabFreeSlabs.get() * SLAB_SIZE);
+
+        // And they get reused.
+        storeMany(h, keys);
+        assert(count(h) == nkeys);
+    }
+    assert(st.slabBytes.get() == 0);
+    assert(st.slabUsedBytes.get() == 0);
+    assert(st.slabFreeSlabs.get() == 0);
+
+    HashTable::setSlabAllocation(false);
+    {
+        HashTable h(st, 5, 1);
+        std::vector<std::string> keys = generateKeys(100);
+        storeMany(h, keys);
+        assert(count(h) == 100);
+        assert(st.slabBytes.get() == 0);
+    }
+    HashTable::setSlabAllocation(true);
+}
+
+static void checkValue(HashTable &h, std::string &k, const std::string &expected,
+                       bool inlined) {
+    StoredValue *v = h.find(k);
+    assert(v);
+    assert(v->isInline() == inlined);
+    assert(v->valLength() == expected.length());
+    assert(v->getValue()->to_s() == expected);
+}
+
+static void testInlineValues() {
+    EPStats st;
+    st.maxDataSize = 64*1024*1024;
+    HashTable h(st, 5, 1);
+    std::string k("key");
+    std::string small(10, 'a'), larger(200, 'b'), tiny("x");
+
+    Item i(k, 0, 0, small.data(), small.length());
+    assert(h.set(i) == NOT_FOUND);
+    checkValue(h, k, small, true);
+    size_t inlineSize = st.currentSize.get();
+
+    // Too big for the space reserved at creation.
+    Item i2(k, 0, 0, larger.data(), larger.length());
+    assert(h.set(i2) == WAS_DIRTY);
+    checkValue(h, k, larger, false);
+    assert(st.currentSize.get() > inlineSize + larger.length());
+
+    // Back into the inline space.
+    Item i3(k, 0, 0, tiny.data(), tiny.length());
+    assert(h.set(i3) == WAS_DIRTY);
+    checkValue(h, k, tiny, true);
+
+    // Eject and restore.  The inline space stays, so the item doesn't
+    // change size.
+    StoredValue *v = h.find(k);
+    rel_time_t age;
+    v->markClean(&age);
+    size_t residentSize = st.currentSize.get();
+    size_t ejectedBytes = st.valueEjectBytes.get();
+    assert(v->ejectValue(st));
+    assert(!v->isResident());
+    assert(v->isInline());
+    assert(v->valLength() == tiny.length());
+    assert(st.currentSize.get() == residentSize);
+    assert(st.valueEjectBytes.get() == ejectedBytes);
+    value_t restored(Blob::New(tiny));
+    assert(v->restoreValue(restored, st));
+    checkValue(h, k, tiny, true);
+    assert(st.currentSize.get() == residentSize);
+
+    // A value ejected out of line does shrink the item.
+    Item i5(k, 0, 0, larger.data(), larger.length());
+    assert(h.set(i5) == WAS_CLEAN);
+    v = h.find(k);
+    v->markClean(&age);
+    residentSize = st.currentSize.get();
+    assert(v->ejectValue(st));
+    assert(st.currentSize.get() < residentSize);
+    assert(st.valueEjectBytes.get() == ejectedBytes + larger.length());
+    assert(v->restoreValue(value_t(Blob::New(larger)), st));
+    checkValue(h, k, larger, false);
+    Item i6(k, 0, 0, tiny.data(), tiny.length());
+    assert(h.set(i6) == WAS_CLEAN);
+    h.find(k)->markClean(&age);
+
+    assert(h.softDelete(k) == WAS_CLEAN);
+    assert(h.find(k) == NULL);
+    assert(h.add(i) == ADD_UNDEL);
+    checkValue(h, k, small, true);
+
+    assert(h.del(k));
+    assert(st.currentSize.get() == 0);
+
+    HashTable::setMaxInlineValue(0);
+    {
+        HashTable h2(st, 5, 1);
+        Item i4(k, 0, 0, small.data(), small.length());
+        assert(h2.set(i4) == NOT_FOUND);
+        checkValue(h2, k, small, false);
+    }
+    HashTable::setMaxInlineValue(64);
+
+    // Loading just the key doesn't reserve any inline space, nor
+    // does it count as ejecting anything.
+    {
+        HashTable h3(st, 5, 1);
+        size_t ejectedBytes = st.valueEjectBytes.get();
+        size_t before = st.currentSize.get();
+        Item i7(k.data(), k.length(), tiny.length(), 0, 0, 0, -1, 0, false);
+        assert(i7.getNBytes() == tiny.length());
+        assert(h3.add(i7, false, false) == ADD_SUCCESS);
+        StoredValue *v3 = h3.find(k);
+        assert(v3);
+        assert(!v3->isResident());
+        assert(!v3->isInline());
+        assert(v3->valLength() == tiny.length());
+        assert(st.currentSize.get() == before + v3->size());
+        assert(st.valueEjectBytes.get() == ejectedBytes);
+        assert(v3->restoreValue(value_t(Blob::New(tiny)), st));
+        checkValue(h3, k, tiny, false);
+        assert(h3.del(k));
+        assert(st.currentSize.get() == before);
+    }
+}
+
+static int legacyHash(const char *str, size_t len) {
+    int h = 5381;
+    for (size_t i = 0; i < len; i++) {
+        h = ((h << 5) + h) ^ str[i];
+    }
+    return h;
+}
+
+static void testHashFunctions() {
+    const char *keys[] = { "", "a", "key0", "some\xff\x80key", "a rather longer key than that" };
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+        size_t len = strlen(keys[i]);
+        assert(static_cast<int>(djb_hash(keys[i], len)) == legacyHash(keys[i], len));
+        assert(murmur_hash(keys[i], len) == murmur_hash(keys[i], len));
+    }
+    assert(getHashFunction("djb") == djb_hash);
+    assert(getHashFunction("murmur") == murmur_hash);
+    assert(getHashFunction("md5") == NULL);
+    assert(!HashTable::setDefaultHashFunction("md5"));
+
+    const char *names[] = { "djb", "murmur" };
+    std::vector<std::string> keyList = generateKeys(20000);
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        assert(HashTable::setDefaultHashFunction(names[i]));
+        HashTable h(global_stats, 4096, 1);
+        storeMany(h, keyList);
+        assert(count(h) == 20000);
+        std::vector<std::string>::iterator it;
+        for (it = keyList.begin(); it != keyList.end(); ++it) {
+            assert(h.find(*it));
+        }
+
+        HashTableDepthStatVisitor depthCounter;
+        h.visitDepth(depthCounter);
+        std::cout << "Sequential keys with " << names[i] << ": depths "
+                  << depthCounter.min << " - " << depthCounter.max << std::endl;
+    }
+    assert(HashTable::setDefaultHashFunction("murmur"));
+}
+
+static hrtime_t timeChainWalks(HashTable &h, std::vector<std::string> &keys,
+                               std::vector<std::string> &missing) {
+    hrtime_t start = gethrtime();
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        assert(h.find(*it));
+    }
+    for (it = missing.begin(); it != missing.end(); ++it) {
+        assert(h.find(*it) == NULL);
+    }
+    return gethrtime() - start;
+}
+
+static void benchChainWalks() {
+    EPStats st;
+    st.maxDataSize = 256*1024*1024;
+    const size_t nkeys = 16384;
+    size_t chains[] = { 16, 64, 256 };
+
+    // Same length keys with a long common prefix are the worst case
+    // for comparing keys in a chain.
+    std::vector<std::string> keys, missing;
+    for (size_t i = 0; i < nkeys * 2; ++i) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "a_fairly_long_common_key_prefix_%08d",
+                 static_cast<int>(i));
+        (i < nkeys ? keys : missing).push_back(std::string(buf));
+    }
+
+    for (size_t i = 0; i < sizeof(chains) / sizeof(chains[0]); ++i) {
+        HashTable h(st, nkeys / chains[i], 1);
+        storeMany(h, keys);
+
+        HashTable::setFingerprinting(false);
+        hrtime_t without = timeChainWalks(h, keys, missing);
+        HashTable::setFingerprinting(true);
+        hrtime_t with = timeChainWalks(h, keys, missing);
+
+        std::cout << "Chain walks, " << chains[i] << " items per bucket: "
+                  << (without / 1000) << "us without fingerprints, "
+                  << (with / 1000) << "us with" << std::endl;
+    }
+}
+
 int main() {
     global_stats.maxDataSize = 64*1024*1024;
     alarm(60);
@@ -250,7 +895,20 @@ int main() {
     testFind();
     testFindSmall();
     testAdd();
+    testExpiryUpdates();
+    testRestore();
+    testTemperature();
+    testSlicedVisit();
+    testMemoryPressure();
     testDepthCounting();
     testPoisonKey();
+    testResize();
+    testConcurrentResize();
+    testOptimisticFind();
+    testLockStripes();
+    testSlabAllocation();
+    testInlineValues();
+    testHashFunctions();
+    benchChainWalks();
     exit(0);
 }
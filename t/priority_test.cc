@@ -13,7 +13,8 @@ int main(int argc, char **argv) {
    assert(Priority::VKeyStatBgFetcherPriority > Priority::NotifyVBStateChangePriority);
    assert(Priority::NotifyVBStateChangePriority > Priority::FlusherPriority);
    assert(Priority::FlusherPriority > Priority::ItemPagerPriority);
-   assert(Priority::ItemPagerPriority > Priority::VBucketDeletionPriority);
+   assert(Priority::ItemPagerPriority > Priority::HTResizePriority);
+   assert(Priority::HTResizePriority > Priority::VBucketDeletionPriority);
 
    return 0;
 }
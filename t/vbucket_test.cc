@@ -12,6 +12,14 @@
 #include "stats.hh"
 #include "threadtests.hh"
 
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
 static const size_t numThreads = 10;
 static const size_t vbucketsEach = 100;
 
@@ -141,6 +149,160 @@ static void testVBucketFilter() {
     assert(!hasThree(3));
 }
 
+static void testBloomFilter() {
+    VBucket plain(0, active, global_stats);
+    assert(!plain.bloomFilter.enabled());
+    assert(plain.bloomFilter.memorySize() == 0);
+    assert(plain.bloomFilter.maybeContains("anything"));
+
+    const int nkeys = 1000;
+    VBucket vb(1, active, global_stats, nkeys);
+    assert(vb.bloomFilter.enabled());
+    assert(vb.bloomFilter.getNumHashes() > 1);
+
+    for (int i = 0; i < nkeys; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        vb.bloomFilter.add(ss.str());
+    }
+    assert(vb.bloomFilter.getNumKeys() == static_cast<size_t>(nkeys));
+
+    int falsePositives(0);
+    for (int i = 0; i < nkeys; ++i) {
+        std::stringstream ss;
+        ss << "key" << i;
+        assert(vb.bloomFilter.maybeContains(ss.str()));
+        std::stringstream other;
+        other << "other" << i;
+        if (vb.bloomFilter.maybeContains(other.str())) {
+            ++falsePositives;
+        }
+    }
+    // Sized for 1%, leave some room for bad luck.
+    assert(falsePositives < nkeys / 25);
+
+    vb.bloomFilter.clear();
+    assert(vb.bloomFilter.getNumKeys() == 0);
+    assert(!vb.bloomFilter.maybeContains("key0"));
+}
+
+static void testBloomFilterRebuild() {
+    BloomFilter bf(1000);
+    bf.add("gone");
+    bf.add("kept");
+    bf.add("other");
+    assert(!bf.wantsRebuild());
+    bf.forget();
+    assert(bf.getNumStale() == 1);
+    assert(bf.wantsRebuild());
+
+    assert(bf.beginRebuild());
+    assert(!bf.beginRebuild());
+    bf.addRebuilt("kept");
+    // Keys added during the rebuild make it into the rebuilt filter.
+    bf.add("new");
+    assert(bf.maybeContains("gone"));
+    bf.endRebuild();
+
+    assert(bf.getNumKeys() == 2);
+    assert(bf.getNumStale() == 0);
+    assert(!bf.wantsRebuild());
+    assert(!bf.maybeContains("gone"));
+    assert(!bf.maybeContains("other"));
+    assert(bf.maybeContains("kept"));
+    assert(bf.maybeContains("new"));
+
+    // A clear drops the rebuild going on.
+    assert(bf.beginRebuild());
+    bf.clear();
+    bf.addRebuilt("kept");
+    bf.endRebuild();
+    assert(bf.getNumKeys() == 0);
+    assert(!bf.maybeContains("kept"));
+}
+
+static void testExpiryIndex() {
+    size_t overhead = global_stats.memOverhead.get();
+    {
+        VBucket vb(0, active, global_stats);
+        size_t vbOverhead = global_stats.memOverhead.get();
+        assert(vb.expiryIndex.size() == 0);
+        assert(vb.expiryIndex.nextExpiry() == 0);
+
+        // Items that never expire aren't indexed.
+        vb.expiryIndex.update(1, 0, 0);
+        assert(vb.expiryIndex.size() == 0);
+        assert(global_stats.memOverhead.get() == vbOverhead);
+
+        vb.expiryIndex.update(2, 0, 300);
+        vb.expiryIndex.update(3, 0, 100);
+        vb.expiryIndex.update(4, 0, 100);
+        vb.expiryIndex.update(5, 0, 200);
+        // Two items sharing a bucket number.
+        vb.expiryIndex.update(6, 0, 200);
+        vb.expiryIndex.update(6, 0, 200);
+        assert(vb.expiryIndex.size() == 6);
+        assert(global_stats.expiryIndexSize.get() == 6);
+        assert(vb.expiryIndex.nextExpiry() == 100);
+        assert(global_stats.memOverhead.get() > vbOverhead);
+
+        // An item stored again is only indexed at its latest time.
+        size_t indexed = global_stats.memOverhead.get();
+        vb.expiryIndex.update(3, 100, 100);
+        vb.expiryIndex.update(5, 200, 250);
+        vb.expiryIndex.update(5, 250, 200);
+        vb.expiryIndex.update(1, 0, 50);
+        vb.expiryIndex.update(1, 50, 0);
+        vb.expiryIndex.update(6, 200, 0);
+        assert(vb.expiryIndex.size() == 5);
+        assert(global_stats.expiryIndexSize.get() == 5);
+        assert(global_stats.memOverhead.get() < indexed);
+        assert(vb.expiryIndex.nextExpiry() == 100);
+
+        // Expired is before, not at, the given time.
+        std::vector<int> buckets;
+        std::vector<std::string> keys;
+        assert(vb.expiryIndex.takeExpired(100, buckets, keys) == 0);
+        assert(vb.expiryIndex.takeExpired(201, buckets, keys) == 4);
+        assert(keys.empty());
+        assert(buckets.size() == 4);
+        assert(buckets[0] == 3 && buckets[1] == 4);
+        assert(buckets[2] == 5 && buckets[3] == 6);
+        assert(vb.expiryIndex.size() == 1);
+        assert(vb.expiryIndex.nextExpiry() == 300);
+
+        // Entries already taken are just not there to move.
+        vb.expiryIndex.update(3, 100, 0);
+        assert(vb.expiryIndex.size() == 1);
+
+        // Evicted items are kept by key.
+        indexed = global_stats.memOverhead.get();
+        vb.expiryIndex.addEvicted("never", 0);
+        assert(vb.expiryIndex.size() == 1);
+        vb.expiryIndex.addEvicted("evicted", 150);
+        vb.expiryIndex.addEvicted("evicted late", 400);
+        assert(vb.expiryIndex.size() == 3);
+        assert(global_stats.expiryIndexSize.get() == 3);
+        assert(global_stats.memOverhead.get() > indexed);
+        assert(vb.expiryIndex.nextExpiry() == 150);
+        buckets.clear();
+        assert(vb.expiryIndex.takeExpired(301, buckets, keys) == 2);
+        assert(buckets.size() == 1 && buckets[0] == 2);
+        assert(keys.size() == 1 && keys[0] == "evicted");
+        assert(global_stats.memOverhead.get() > indexed);
+        assert(vb.expiryIndex.nextExpiry() == 400);
+
+        vb.expiryIndex.clear();
+        assert(vb.expiryIndex.size() == 0);
+        assert(global_stats.expiryIndexSize.get() == 0);
+        assert(global_stats.memOverhead.get() == vbOverhead);
+        vb.expiryIndex.update(7, 0, 400);
+        vb.expiryIndex.addEvicted("gone", 400);
+    }
+    assert(global_stats.expiryIndexSize.get() == 0);
+    assert(global_stats.memOverhead.get() == overhead);
+}
+
 int main(int argc, char **argv) {
     (void)argc; (void)argv;
 
@@ -152,4 +314,7 @@ int main(int argc, char **argv) {
     testVBucketLookup();
     testConcurrentUpdate();
     testVBucketFilter();
+    testBloomFilter();
+    testBloomFilterRebuild();
+    testExpiryIndex();
 }
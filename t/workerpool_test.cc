@@ -0,0 +1,76 @@
+#include "config.h"
+#include <cassert>
+#include <unistd.h>
+#include <vector>
+
+#include "workerpool.hh"
+#include "atomic.hh"
+#include "threadtests.hh"
+
+/**
+ * A job counting the times each of its parts got done.
+ */
+class CountingJob : public WorkerJob {
+public:
+    CountingJob(size_t n) : done(n) {
+        for (size_t i = 0; i < n; ++i) {
+            done[i] = 0;
+        }
+    }
+
+    void work(size_t part) {
+        usleep(100);
+        ++done[part];
+    }
+
+    void check(size_t times) {
+        for (size_t i = 0; i < done.size(); ++i) {
+            assert(done[i] == static_cast<int>(times));
+        }
+    }
+
+    std::vector<int> done;
+};
+
+static void testRun(WorkerPool &pool) {
+    CountingJob job(16);
+    pool.run(job, job.done.size());
+    job.check(1);
+    pool.run(job, job.done.size());
+    job.check(2);
+}
+
+class ConcurrentRuns : public Generator<bool> {
+public:
+    ConcurrentRuns(WorkerPool &p) : pool(p) {}
+
+    bool operator()() {
+        for (int i = 0; i < 20; ++i) {
+            CountingJob job(7);
+            pool.run(job, job.done.size());
+            job.check(1);
+        }
+        return true;
+    }
+
+private:
+    WorkerPool &pool;
+};
+
+int main() {
+    alarm(60);
+
+    // Without threads, the caller does all the work.
+    WorkerPool inline_pool(0);
+    assert(inline_pool.getNumThreads() == 0);
+    testRun(inline_pool);
+
+    WorkerPool pool(4);
+    assert(pool.getNumThreads() == 4);
+    testRun(pool);
+
+    // Parts of jobs run by different threads don't mix up.
+    ConcurrentRuns cr(pool);
+    getCompletedThreads<bool>(8, &cr);
+    return 0;
+}
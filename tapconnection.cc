@@ -311,9 +311,9 @@ bool TapConnection::waitForBackfill() {
 class TapBGFetchCallback : public DispatcherCallback {
 public:
     TapBGFetchCallback(EventuallyPersistentEngine *e, const std::string &n,
-                       const std::string &k,
-                       uint64_t r, const void *c) :
-        epe(e), name(n), key(k), rowid(r), cookie(c),
+                       const std::string &k, uint64_t r, uint16_t vb,
+                       const void *c) :
+        epe(e), name(n), key(k), rowid(r), vbucket(vb), cookie(c),
         init(gethrtime()), start(0), counter(e->getEpStore()->bgFetchQueue) {
         assert(epe);
         assert(cookie);
@@ -328,7 +328,13 @@ public:
         EventuallyPersistentStore *epstore = epe->getEpStore();
         assert(epstore);
 
-        epstore->getUnderlying()->get(key, rowid, gcb);
+        if (rowid == 0) {
+            epstore->getUnderlying()->getByKey(key, vbucket,
+                                               epstore->vbuckets.getBucketVersion(vbucket),
+                                               gcb);
+        } else {
+            epstore->getUnderlying()->get(key, rowid, gcb);
+        }
         gcb.waitForValue();
         assert(gcb.fired);
 
@@ -377,6 +383,7 @@ private:
     const std::string           name;
     std::string                 key;
     uint64_t                    rowid;
+    uint16_t                    vbucket;
     const void                 *cookie;
 
     hrtime_t init;
@@ -385,9 +392,10 @@ private:
     BGFetchCounter counter;
 };
 
-void TapConnection::queueBGFetch(const std::string &key, uint64_t id) {
+void TapConnection::queueBGFetch(const std::string &key, uint64_t id,
+                                 uint16_t vbucket) {
     LockHolder lh(backfillLock);
-    backfillQueue.push(TapBGFetchQueueItem(key, id));
+    backfillQueue.push(TapBGFetchQueueItem(key, id, vbucket));
     ++bgQueued;
     ++bgQueueSize;
     assert(!empty());
@@ -404,7 +412,7 @@ void TapConnection::runBGFetch(Dispatcher *dispatcher, const void *cookie) {
 
     shared_ptr<TapBGFetchCallback> dcb(new TapBGFetchCallback(&engine, client,
                                                               qi.key, qi.id,
-                                                              cookie));
+                                                              qi.vbucket, cookie));
     ++bgJobIssued;
     dispatcher->schedule(dcb, NULL, Priority::TapBgFetcherPriority);
 }
@@ -14,7 +14,7 @@
 class EventuallyPersistentEngine;
 class TapConnMap;
 class BackFillVisitor;
-class StrategicSqlite3;
+class KVStore;
 class TapBGFetchCallback;
 class CompleteBackfillOperation;
 class Dispatcher;
@@ -79,11 +79,12 @@ public:
 
 class TapBGFetchQueueItem {
 public:
-    TapBGFetchQueueItem(const std::string &k, uint64_t i) :
-        key(k), id(i) {}
+    TapBGFetchQueueItem(const std::string &k, uint64_t i, uint16_t vb) :
+        key(k), id(i), vbucket(vb) {}
 
     const std::string key;
     const uint64_t id;
+    const uint16_t vbucket;
 };
 
 /**
@@ -318,9 +319,10 @@ private:
      * Queue an item to be background fetched.
      *
      * @param key the item's key
-     * @param id the disk id of the item to fetch
+     * @param id the disk id of the item to fetch, or 0 to fetch it by key
+     * @param vbucket the vbucket of the item
      */
-    void queueBGFetch(const std::string &key, uint64_t id);
+    void queueBGFetch(const std::string &key, uint64_t id, uint16_t vbucket);
 
     /**
      * Run some background fetch jobs.
@@ -4,6 +4,7 @@
 #define VBUCKET_HH 1
 
 #include <cassert>
+#include <cstdlib>
 
 #include <map>
 #include <vector>
@@ -14,6 +15,8 @@
 
 #include "common.hh"
 #include "atomic.hh"
+#include "bloom.hh"
+#include "expiry.hh"
 #include "stored-value.hh"
 
 const size_t BASE_VBUCKET_SIZE=1024;
@@ -86,11 +89,19 @@ private:
 class VBucket : public RCValue {
 public:
 
-    VBucket(int i, vbucket_state_t initialState, EPStats &st) :
-        ht(st), id(i), state(initialState), stats(st) {
+    /**
+     * Create a vbucket.
+     *
+     * @param bloomKeys the number of keys to size the vbucket's Bloom
+     *        filter for (0 if it doesn't need one)
+     */
+    VBucket(int i, vbucket_state_t initialState, EPStats &st,
+            size_t bloomKeys = 0) :
+        ht(st), bloomFilter(bloomKeys), expiryIndex(st), id(i),
+        state(initialState), stats(st) {
         pendingOpsStart = 0;
         stats.memOverhead.incr(sizeof(VBucket)
-                               + ht.memorySize());
+                               + ht.memorySize() + bloomFilter.memorySize());
         assert(stats.memOverhead.get() < GIGANTOR);
     }
 
@@ -100,7 +111,8 @@ public:
                              "Have %d pending ops while destroying vbucket\n",
                              pendingOps.size());
         }
-        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize());
+        stats.memOverhead.decr(sizeof(VBucket) + ht.memorySize()
+                               + bloomFilter.memorySize());
         assert(stats.memOverhead.get() < GIGANTOR);
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
                          "Destroying vbucket %d\n", id);
@@ -140,6 +152,18 @@ public:
 
     HashTable ht;
 
+    /**
+     * Keys that were evicted from ht entirely (or never loaded into
+     * it) and may only be found on disk.
+     */
+    BloomFilter bloomFilter;
+
+    /**
+     * Keys of ht due to expire, so expiring them doesn't take a visit
+     * of the whole table.
+     */
+    ExpiryIndex expiryIndex;
+
     static const char* toString(vbucket_state_t s) {
         switch(s) {
         case active: return "active"; break;
@@ -171,6 +195,65 @@ private:
 
 class NeedMoreBuckets : std::exception {};
 
+/**
+ * vbucket-aware hashtable visitor.
+ */
+class VBucketVisitor : public HashTableVisitor {
+public:
+
+    VBucketVisitor() : HashTableVisitor() { }
+
+    /**
+     * Begin visiting a bucket.
+     *
+     * @param vbid the vbucket we are beginning to visit
+     *
+     * @return true iff we want to walk the hashtable in this vbucket
+     */
+    virtual bool visitBucket(RCPtr<VBucket> vb) {
+        currentBucket = vb;
+        return true;
+    }
+
+    // This is unused in all implementations so far.
+    void visit(StoredValue* v) {
+        (void)v;
+        abort();
+    }
+
+protected:
+    RCPtr<VBucket> currentBucket;
+};
+
+/**
+ * A VBucketVisitor whose visit may be split up among threads.
+ *
+ * Each thread visits its share of the vbuckets with a visitor of its
+ * own, made with fork(); what they found is collected with join().
+ */
+class ParallelVBucketVisitor : public VBucketVisitor {
+public:
+
+    /**
+     * Create a visitor for one share of the visit.
+     *
+     * @param parts the number of shares the visit is split into
+     */
+    virtual ParallelVBucketVisitor *fork(size_t parts) = 0;
+
+    /**
+     * Take over what the visitor of a share found so far.
+     */
+    virtual void join(ParallelVBucketVisitor &part) = 0;
+
+    /**
+     * Called when a share was visited completely.
+     *
+     * @return true to go over the share once more
+     */
+    virtual bool visitAgain() { return false; }
+};
+
 class VBucketHolder : public RCValue {
 public:
     VBucketHolder(size_t sz) :
@@ -456,4 +539,50 @@ private:
     DISALLOW_COPY_AND_ASSIGN(VBucketMap);
 };
 
+/**
+ * Where a visit over all vbuckets done in several goes stands.
+ */
+class VBucketMapCursor {
+public:
+
+    /**
+     * Create a cursor.
+     *
+     * @param f the first vbucket to visit
+     * @param s visit every s-th vbucket from there
+     */
+    VBucketMapCursor(size_t f = 0, size_t s = 1) :
+        first(f), step(s), vbid(f) {
+        assert(step > 0);
+    }
+
+    /**
+     * Go back to the first vbucket.
+     */
+    void reset() {
+        vbid = first;
+        current.reset();
+        htCursor.reset();
+    }
+
+    /**
+     * True if the visit hasn't gotten anywhere yet.
+     */
+    bool atStart() const {
+        return vbid == first && !current;
+    }
+
+private:
+    size_t         first;
+    size_t         step;
+    //! The vbucket being visited (or the next one to look at).
+    size_t         vbid;
+    //! The vbucket being visited, if it was started.
+    RCPtr<VBucket> current;
+    //! Where the visit of that vbucket's hash table stands.
+    HashTableCursor htCursor;
+
+    friend class EventuallyPersistentStore;
+};
+
 #endif /* VBUCKET_HH */
@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <stdexcept>
+
+#include "workerpool.hh"
+
+WorkerPool::WorkerPool(size_t n) : stopping(false) {
+    threads.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, launch, this) != 0) {
+            throw std::runtime_error("Error creating worker pool thread");
+        }
+        threads.push_back(tid);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    LockHolder lh(mutex);
+    stopping = true;
+    mutex.notify();
+    lh.unlock();
+    std::vector<pthread_t>::iterator it;
+    for (it = threads.begin(); it != threads.end(); ++it) {
+        pthread_join(*it, NULL);
+    }
+}
+
+void *WorkerPool::launch(void *arg) {
+    static_cast<WorkerPool*>(arg)->loop();
+    return NULL;
+}
+
+void WorkerPool::loop() {
+    LockHolder lh(mutex);
+    while (!stopping) {
+        if (tasks.empty()) {
+            mutex.wait();
+        } else {
+            doNext(lh);
+        }
+    }
+}
+
+void WorkerPool::doNext(LockHolder &lh) {
+    worker_task t = tasks.front();
+    tasks.pop_front();
+    lh.unlock();
+    t.job->work(t.part);
+    lh.lock();
+    if (--*t.pending == 0) {
+        mutex.notify();
+    }
+}
+
+void WorkerPool::run(WorkerJob &job, size_t parts) {
+    size_t pending = parts;
+    LockHolder lh(mutex);
+    for (size_t i = 0; i < parts; ++i) {
+        worker_task t;
+        t.job = &job;
+        t.part = i;
+        t.pending = &pending;
+        tasks.push_back(t);
+    }
+    mutex.notify();
+    while (pending > 0) {
+        if (tasks.empty()) {
+            mutex.wait();
+        } else {
+            doNext(lh);
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef WORKERPOOL_HH
+#define WORKERPOOL_HH 1
+
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+#include "common.hh"
+#include "locks.hh"
+#include "syncobject.hh"
+
+/**
+ * A job split up into parts that may be done in parallel.
+ */
+class WorkerJob {
+public:
+    virtual ~WorkerJob() {}
+
+    /**
+     * Do one part of the job.
+     *
+     * @param part the number of the part, from 0 up
+     */
+    virtual void work(size_t part) = 0;
+};
+
+/**
+ * A fixed set of threads doing the parts of jobs.
+ *
+ * Any number of threads may run jobs at the same time; the parts of
+ * all of them are done in the order they came in.
+ */
+class WorkerPool {
+public:
+
+    /**
+     * Start a pool.
+     *
+     * @param n the number of threads; with none, jobs are done by
+     *          the threads running them
+     */
+    WorkerPool(size_t n);
+
+    /**
+     * Stop the pool, waiting for its threads to exit.
+     */
+    ~WorkerPool();
+
+    /**
+     * Do all parts of a job, returning once they're all done.
+     *
+     * The calling thread helps with the parts waiting to be done
+     * rather than just wait.
+     *
+     * @param job the job
+     * @param parts the number of parts it's split up into
+     */
+    void run(WorkerJob &job, size_t parts);
+
+    /**
+     * Get the number of threads in this pool.
+     */
+    size_t getNumThreads() const {
+        return threads.size();
+    }
+
+private:
+
+    /**
+     * A part of a job waiting to be done.
+     */
+    struct worker_task {
+        WorkerJob *job;         //!< The job.
+        size_t     part;        //!< The part of it to do.
+        size_t    *pending;     //!< Parts of the job not done yet.
+    };
+
+    static void *launch(void *arg);
+    void loop();
+
+    //! Take the next task and do it; called and returns with the lock held.
+    void doNext(LockHolder &lh);
+
+    SyncObject               mutex;
+    std::deque<worker_task>  tasks;
+    std::vector<pthread_t>   threads;
+    bool                     stopping;
+
+    DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+#endif /* WORKERPOOL_HH */